@@ -0,0 +1,2021 @@
+// Benchmark.cpp
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Benchmarks of the record pipeline driven by synthetic frames (no sensor needed)
+
+
+#include "stdafx.h"
+#include <mmsystem.h>
+#include <strsafe.h>
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include "Benchmark.h"
+#include "ColorEncoder.h"
+#include "Crc32c.h"
+#include "DepthDelta.h"
+#include "FrameDedup.h"
+#include "FramePublisher.h"
+#include "FrameSlab.h"
+#include "FrameStream.h"
+#include "FrameWriter.h"
+#include "GrayPacking.h"
+#include "PointCloud.h"
+#include "Stripe.h"
+#include "RecordFile.h"
+#include "Registration.h"
+#include "ReplayReader.h"
+#include "ThreadPlacement.h"
+
+#pragma comment (lib, "winmm.lib")
+
+namespace
+{
+    const int cInfraredWidth = 512;
+    const int cInfraredHeight = 424;
+    const int cDepthWidth = 512;
+    const int cDepthHeight = 424;
+    const int cColorWidth = 1920;
+    const int cColorHeight = 1080;
+    const int cBufferSize = 32;
+
+    /// One stream of synthetic record frames (header followed by pixel data)
+    struct SyntheticStream
+    {
+        const WCHAR*        szName;
+        const WCHAR*        szExtension;
+        BYTE*               pSlot;
+        DWORD               cbHeader;
+        DWORD               cbFrame;
+    };
+
+    /// <summary>
+    /// Get the current time
+    /// </summary>
+    /// <returns>time in seconds</returns>
+    double Now()
+    {
+        static LARGE_INTEGER qpf = { 0 };
+        if (!qpf.QuadPart)
+        {
+            QueryPerformanceFrequency(&qpf);
+        }
+
+        LARGE_INTEGER qpc = { 0 };
+        QueryPerformanceCounter(&qpc);
+        return double(qpc.QuadPart) / double(qpf.QuadPart);
+    }
+
+    /// <summary>
+    /// Create the synthetic infrared, depth and color streams in record format
+    /// </summary>
+    /// <param name="streams">streams to fill in</param>
+    void CreateSyntheticStreams(SyntheticStream streams[3])
+    {
+        const DWORD cbPixels[3] =
+        {
+            cInfraredWidth * cInfraredHeight * sizeof(UINT16),
+            cDepthWidth * cDepthHeight * sizeof(UINT16),
+            cColorWidth * cColorHeight * sizeof(RGBTRIPLE)
+        };
+
+        streams[0].szName = L"ir";
+        streams[1].szName = L"depth";
+        streams[2].szName = L"color";
+        streams[0].szExtension = L"pgm";
+        streams[1].szExtension = L"pgm";
+        streams[2].szExtension = L"ppm";
+
+        for (int s = 0; s < 3; ++s)
+        {
+            streams[s].pSlot = AllocateFrameSlot(GetFrameSlotSize(256 + cbPixels[s]));
+        }
+
+        DWORD cbHeader[3];
+        cbHeader[0] = FormatPGMHeader(streams[0].pSlot, cInfraredWidth, cInfraredHeight, 65535);
+        cbHeader[1] = FormatPGMHeader(streams[1].pSlot, cDepthWidth, cDepthHeight, 65535);
+        cbHeader[2] = FormatPPMHeader(streams[2].pSlot, cColorWidth, cColorHeight, 255);
+
+        for (int s = 0; s < 3; ++s)
+        {
+            // fill the pixels with a pattern which does not compress trivially
+            UINT32 nSeed = 0x9E3779B9u * (s + 1);
+            BYTE* pPixel = streams[s].pSlot + cbHeader[s];
+            for (DWORD i = 0; i < cbPixels[s]; ++i)
+            {
+                nSeed = nSeed * 1664525u + 1013904223u;
+                pPixel[i] = static_cast<BYTE>(nSeed >> 24);
+            }
+            streams[s].cbHeader = cbHeader[s];
+            streams[s].cbFrame = cbHeader[s] + cbPixels[s];
+        }
+    }
+
+    /// <summary>
+    /// Free the synthetic streams
+    /// </summary>
+    /// <param name="streams">streams to free</param>
+    void FreeSyntheticStreams(SyntheticStream streams[3])
+    {
+        for (int s = 0; s < 3; ++s)
+        {
+            FreeFrameSlot(streams[s].pSlot);
+            streams[s].pSlot = NULL;
+        }
+    }
+
+    /// <summary>
+    /// Write frame sets with each writer backend and report throughput and stalls
+    /// </summary>
+    /// <param name="argc">number of arguments</param>
+    /// <param name="argv">output folder and (optional) number of frame sets</param>
+    /// <returns>0 on success, otherwise failure</returns>
+    int RunWriterBenchmark(int argc, LPWSTR* argv)
+    {
+        if (argc < 1)
+        {
+            wprintf(L"Usage: KinectV2Recorder /benchmark writer <folder> [frames]\n");
+            return 1;
+        }
+
+        LPCWSTR szFolder = argv[0];
+        int nFrames = (argc >= 2) ? max(1, _wtoi(argv[1])) : 300;
+
+        SyntheticStream streams[3];
+        CreateSyntheticStreams(streams);
+        double fSetMB = (streams[0].cbFrame + streams[1].cbFrame + streams[2].cbFrame) / (1024. * 1024.);
+
+        const WriterMode modes[] = { WriterMode_Buffered, WriterMode_Unbuffered };
+        const WCHAR* szModes[] = { L"buffered", L"unbuffered" };
+
+        CreateDirectoryW(szFolder, NULL);
+        wprintf(L"%d frame sets of %.2f MB to %s\n", nFrames, fSetMB, szFolder);
+        wprintf(L"%-12s %10s %10s %10s %10s %10s\n", L"writer", L"MB/s", L"realtime", L"mean ms", L"p99 ms", L"max ms");
+
+        int nResult = 0;
+        for (int m = 0; m < _countof(modes); ++m)
+        {
+            FrameWriter* pWriter = FrameWriter::Create(modes[m]);
+
+            WCHAR szModeFolder[MAX_PATH];
+            WCHAR szPath[MAX_PATH];
+            StringCchPrintfW(szModeFolder, _countof(szModeFolder), L"%s\\writer_%s", szFolder, szModes[m]);
+            CreateDirectoryW(szModeFolder, NULL);
+            for (int s = 0; s < 3; ++s)
+            {
+                StringCchPrintfW(szPath, _countof(szPath), L"%s\\%s", szModeFolder, streams[s].szName);
+                CreateDirectoryW(szPath, NULL);
+            }
+
+            std::vector<double> vSetTime(nFrames);
+            double fStart = Now();
+            for (int f = 0; f < nFrames && 0 == nResult; ++f)
+            {
+                double fSetStart = Now();
+                for (int s = 0; s < 3; ++s)
+                {
+                    StringCchPrintfW(szPath, _countof(szPath), L"%s\\%s\\%06d.%s", szModeFolder, streams[s].szName, f, streams[s].szExtension);
+                    if (FAILED(pWriter->Write(szPath, streams[s].pSlot, streams[s].cbFrame)))
+                    {
+                        wprintf(L"Failed to write %s\n", szPath);
+                        nResult = 1;
+                        break;
+                    }
+                }
+                vSetTime[f] = Now() - fSetStart;
+            }
+            double fElapsed = Now() - fStart;
+
+            // clean up the written frames
+            for (int s = 0; s < 3; ++s)
+            {
+                for (int f = 0; f < nFrames; ++f)
+                {
+                    StringCchPrintfW(szPath, _countof(szPath), L"%s\\%s\\%06d.%s", szModeFolder, streams[s].szName, f, streams[s].szExtension);
+                    DeleteFileW(szPath);
+                }
+                StringCchPrintfW(szPath, _countof(szPath), L"%s\\%s", szModeFolder, streams[s].szName);
+                RemoveDirectoryW(szPath);
+            }
+            RemoveDirectoryW(szModeFolder);
+            delete pWriter;
+
+            if (nResult)
+            {
+                break;
+            }
+
+            double fMean = 0.0;
+            for (int f = 0; f < nFrames; ++f)
+            {
+                fMean += vSetTime[f];
+            }
+            fMean /= nFrames;
+            std::sort(vSetTime.begin(), vSetTime.end());
+            double fP99 = vSetTime[min(nFrames - 1, nFrames * 99 / 100)];
+
+            wprintf(L"%-12s %10.1f %9.2fx %10.2f %10.2f %10.2f\n", szModes[m],
+                fSetMB * nFrames / fElapsed, nFrames / 30. / fElapsed,
+                fMean * 1000., fP99 * 1000., vSetTime[nFrames - 1] * 1000.);
+        }
+
+        FreeSyntheticStreams(streams);
+        return nResult;
+    }
+
+    /// Result of feeding a writer backend at a given load
+    struct LoadResult
+    {
+        int                 nFrames;
+        int                 nWritten;
+        int                 nDropped;
+        int                 nFailed;
+        UINT64              cbWritten;
+        double              fElapsed;
+        double              fMeanLatency;
+        double              fP99Latency;
+        double              fMaxLatency;
+    };
+
+    /// <summary>
+    /// Feed synthetic frame sets paced at a multiple of real time through a writer backend the way
+    /// the recorder does: a ring of slots per stream, which are released when their write completes
+    /// and dropped while they are still busy
+    /// </summary>
+    /// <param name="mode">writer backend</param>
+    /// <param name="szFolder">output folder, relative to the receiver folder when streaming</param>
+    /// <param name="fRate">frame sets per second</param>
+    /// <param name="fSeconds">duration of the load</param>
+    /// <param name="nQueueDepth">max number of writes in flight</param>
+    /// <param name="streams">synthetic streams</param>
+    /// <param name="szStreamTo">receiver to stream the frames to, NULL to write them locally</param>
+    /// <param name="szReceiveFolder">folder the receiver writes to, for the clean up</param>
+    /// <returns>result of the load</returns>
+    LoadResult RunLoad(WriterMode mode, LPCWSTR szFolder, double fRate, double fSeconds, int nQueueDepth, SyntheticStream streams[3],
+        LPCWSTR szStreamTo = NULL, LPCWSTR szReceiveFolder = NULL)
+    {
+        LoadResult result = { 0 };
+        WCHAR szPath[MAX_PATH];
+
+        // the receiver creates the folders of the frames it is sent
+        if (!szStreamTo)
+        {
+            CreateDirectoryW(szFolder, NULL);
+            for (int s = 0; s < 3; ++s)
+            {
+                StringCchPrintfW(szPath, _countof(szPath), L"%s\\%s", szFolder, streams[s].szName);
+                CreateDirectoryW(szPath, NULL);
+            }
+        }
+
+        std::atomic<bool> bSlotBusy[3][cBufferSize];
+        for (int s = 0; s < 3; ++s)
+        {
+            for (int i = 0; i < cBufferSize; ++i)
+            {
+                bSlotBusy[s][i] = false;
+            }
+        }
+
+        std::mutex mQueueMutex;
+        std::queue<int> qFrameQueue[3];
+        std::queue<double> qTimeQueue[3];
+        std::atomic<int> nPending;
+        std::atomic<bool> bProducing;
+        nPending = 0;
+        bProducing = true;
+
+        std::vector<double> vLatency;
+        vLatency.reserve(static_cast<size_t>(3 * fRate * fSeconds) + 3);
+        std::vector<double> vSubmitTime(3 * cBufferSize);
+        int nSequence[3] = { 0 };
+
+        // writer thread, shaped like CKinectV2Recorder::SaveRecordImages
+        std::thread tWriter([&]()
+        {
+            FrameWriter* pWriter = szStreamTo ? new NetworkFrameWriter(szStreamTo, 64ull << 20) : FrameWriter::Create(mode);
+            ULONG_PTR nContexts[3 * cBufferSize];
+            HRESULT hrResults[3 * cBufferSize];
+            DWORD dwWait = 0;
+
+            while (bProducing || nPending > 0)
+            {
+                int nCompleted = pWriter->Poll(nContexts, hrResults, _countof(nContexts), dwWait);
+                for (int i = 0; i < nCompleted; ++i)
+                {
+                    int nStream = static_cast<int>(nContexts[i] >> 16);
+                    int nSlot = static_cast<int>(nContexts[i] & 0xFFFF);
+                    vLatency.push_back(Now() - vSubmitTime[nStream * cBufferSize + nSlot]);
+                    result.nFailed += FAILED(hrResults[i]) ? 1 : 0;
+                    result.cbWritten += SUCCEEDED(hrResults[i]) ? streams[nStream].cbFrame : 0;
+                    bSlotBusy[nStream][nSlot] = false;
+                    --nPending;
+                }
+
+                bool bSubmitted = false;
+                for (int s = 0; s < 3 && pWriter->GetPendingCount() < nQueueDepth; ++s)
+                {
+                    int nSlot = 0;
+                    double fTime = 0.0;
+                    {
+                        std::lock_guard<std::mutex> lock(mQueueMutex);
+                        if (qFrameQueue[s].empty())
+                        {
+                            continue;
+                        }
+                        nSlot = qFrameQueue[s].front();
+                        fTime = qTimeQueue[s].front();
+                        qFrameQueue[s].pop();
+                        qTimeQueue[s].pop();
+                    }
+
+                    vSubmitTime[s * cBufferSize + nSlot] = fTime;
+                    StringCchPrintfW(szPath, _countof(szPath), L"%s\\%s\\%06d.%s", szFolder, streams[s].szName, nSequence[s]++, streams[s].szExtension);
+                    ULONG_PTR nContext = (static_cast<ULONG_PTR>(s) << 16) | nSlot;
+                    if (FAILED(pWriter->Submit(szPath, streams[s].pSlot, streams[s].cbFrame, nContext)))
+                    {
+                        ++result.nFailed;
+                        bSlotBusy[s][nSlot] = false;
+                        --nPending;
+                    }
+                    bSubmitted = true;
+                }
+
+                dwWait = 0;
+                if (!bSubmitted && !nCompleted)
+                {
+                    if (pWriter->GetPendingCount() > 0)
+                    {
+                        dwWait = 1;
+                    }
+                    else
+                    {
+                        std::this_thread::sleep_for(std::chrono::microseconds(100));
+                    }
+                }
+            }
+
+            delete pWriter;
+        });
+
+        // producer, paced like the sensor
+        int nSets = static_cast<int>(fRate * fSeconds);
+        int nIndex[3] = { 0 };
+        double fStart = Now();
+        for (int f = 0; f < nSets; ++f)
+        {
+            double fDue = fStart + f / fRate;
+            while (Now() < fDue)
+            {
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }
+
+            for (int s = 0; s < 3; ++s)
+            {
+                int nSlot = nIndex[s] % cBufferSize;
+                if (bSlotBusy[s][nSlot])
+                {
+                    ++result.nDropped;
+                    continue;
+                }
+
+                bSlotBusy[s][nSlot] = true;
+                ++nPending;
+                std::lock_guard<std::mutex> lock(mQueueMutex);
+                qFrameQueue[s].push(nSlot);
+                qTimeQueue[s].push(Now());
+                ++nIndex[s];
+            }
+        }
+        bProducing = false;
+        tWriter.join();
+        result.fElapsed = Now() - fStart;
+
+        result.nFrames = 3 * nSets;
+        result.nWritten = static_cast<int>(vLatency.size()) - result.nFailed;
+        for (size_t i = 0; i < vLatency.size(); ++i)
+        {
+            result.fMeanLatency += vLatency[i];
+            result.fMaxLatency = max(result.fMaxLatency, vLatency[i]);
+        }
+        result.fMeanLatency /= max(1, static_cast<int>(vLatency.size()));
+        if (!vLatency.empty())
+        {
+            std::sort(vLatency.begin(), vLatency.end());
+            size_t nP99 = vLatency.size() * 99 / 100;
+            result.fP99Latency = vLatency[min(vLatency.size() - 1, nP99)];
+        }
+
+        // clean up the written frames
+        WCHAR szWrittenFolder[MAX_PATH];
+        if (szStreamTo)
+        {
+            StringCchPrintfW(szWrittenFolder, _countof(szWrittenFolder), L"%s\\%s", szReceiveFolder, szFolder);
+        }
+        else
+        {
+            StringCchCopyW(szWrittenFolder, _countof(szWrittenFolder), szFolder);
+        }
+        for (int s = 0; s < 3; ++s)
+        {
+            for (int f = 0; f < nSequence[s]; ++f)
+            {
+                StringCchPrintfW(szPath, _countof(szPath), L"%s\\%s\\%06d.%s", szWrittenFolder, streams[s].szName, f, streams[s].szExtension);
+                DeleteFileW(szPath);
+            }
+            StringCchPrintfW(szPath, _countof(szPath), L"%s\\%s", szWrittenFolder, streams[s].szName);
+            RemoveDirectoryW(szPath);
+        }
+        RemoveDirectoryW(szWrittenFolder);
+
+        return result;
+    }
+
+    /// <summary>
+    /// Compare the writer backends at 1x, 2x and 4x real-time load
+    /// </summary>
+    /// <param name="argc">number of arguments</param>
+    /// <param name="argv">output folder, (optional) seconds per run and (optional) queue depth</param>
+    /// <returns>0 on success, otherwise failure</returns>
+    int RunLoadBenchmark(int argc, LPWSTR* argv)
+    {
+        if (argc < 1)
+        {
+            wprintf(L"Usage: KinectV2Recorder /benchmark load <folder> [seconds] [queue depth]\n");
+            return 1;
+        }
+
+        LPCWSTR szFolder = argv[0];
+        double fSeconds = (argc >= 2) ? max(1.0, _wtof(argv[1])) : 10.0;
+        int nQueueDepth = (argc >= 3) ? max(1, min(3 * cBufferSize, _wtoi(argv[2]))) : 16;
+
+        SyntheticStream streams[3];
+        CreateSyntheticStreams(streams);
+
+        const WriterMode modes[] = { WriterMode_Buffered, WriterMode_Unbuffered, WriterMode_Overlapped };
+        const WCHAR* szModes[] = { L"buffered", L"unbuffered", L"overlapped" };
+        const int nLoads[] = { 1, 2, 4 };
+
+        CreateDirectoryW(szFolder, NULL);
+        wprintf(L"%.0f s per run, queue depth %d, %d slots per stream\n", fSeconds, nQueueDepth, cBufferSize);
+        wprintf(L"%-12s %6s %10s %10s %10s %10s %10s\n", L"writer", L"load", L"frames/s", L"dropped", L"failed", L"mean ms", L"max ms");
+
+        int nResult = 0;
+        for (int m = 0; m < _countof(modes); ++m)
+        {
+            for (int l = 0; l < _countof(nLoads); ++l)
+            {
+                WCHAR szRunFolder[MAX_PATH];
+                StringCchPrintfW(szRunFolder, _countof(szRunFolder), L"%s\\load_%s_%dx", szFolder, szModes[m], nLoads[l]);
+
+                LoadResult result = RunLoad(modes[m], szRunFolder, 30.0 * nLoads[l], fSeconds, nQueueDepth, streams);
+                wprintf(L"%-12s %5dx %10.1f %10d %10d %10.2f %10.2f\n", szModes[m], nLoads[l],
+                    result.nWritten / result.fElapsed, result.nDropped, result.nFailed,
+                    result.fMeanLatency * 1000., result.fMaxLatency * 1000.);
+
+                nResult |= result.nFailed ? 1 : 0;
+            }
+        }
+
+        FreeSyntheticStreams(streams);
+        return nResult;
+    }
+
+    /// <summary>
+    /// Write frame sets striped by frame over the first 1..N roots with overlapped writes and
+    /// report how the throughput scales with the number of roots
+    /// </summary>
+    /// <param name="argc">number of arguments</param>
+    /// <param name="argv">roots separated by ';', (optional) number of frame sets and (optional) queue depth</param>
+    /// <returns>0 on success, otherwise failure</returns>
+    int RunStripeBenchmark(int argc, LPWSTR* argv)
+    {
+        if (argc < 1)
+        {
+            wprintf(L"Usage: KinectV2Recorder /benchmark stripe <folder;folder;...> [frames] [queue depth]\n");
+            return 1;
+        }
+
+        StripeLayout layout;
+        layout.SetRoots(argv[0], StripeMode_Frame);
+        int nRoots = layout.GetRootCount();
+        int nFrames = (argc >= 2) ? max(1, _wtoi(argv[1])) : 300;
+        int nQueueDepth = (argc >= 3) ? max(1, min(3 * cBufferSize, _wtoi(argv[2]))) : 16;
+
+        SyntheticStream streams[3];
+        CreateSyntheticStreams(streams);
+        double fSetMB = (streams[0].cbFrame + streams[1].cbFrame + streams[2].cbFrame) / (1024. * 1024.);
+
+        wprintf(L"%d frame sets of %.2f MB over up to %d roots, queue depth %d\n", nFrames, fSetMB, nRoots, nQueueDepth);
+        wprintf(L"%-8s %10s %10s %10s\n", L"roots", L"MB/s", L"realtime", L"speedup");
+
+        int nResult = 0;
+        double fBaseRate = 0.0;
+        for (int k = 1; k <= nRoots && 0 == nResult; ++k)
+        {
+            WCHAR szPath[MAX_PATH];
+            std::vector<std::wstring> vFolders(k);
+            for (int r = 0; r < k; ++r)
+            {
+                layout.GetSessionFolder(r, L"stripe_benchmark", szPath, _countof(szPath));
+                vFolders[r] = szPath;
+                for (int s = 0; s < 3; ++s)
+                {
+                    StringCchPrintfW(szPath, _countof(szPath), L"%s\\%s", vFolders[r].c_str(), streams[s].szName);
+                    CreateFolderTree(szPath);
+                }
+            }
+
+            FrameWriter* pWriter = FrameWriter::Create(WriterMode_Overlapped);
+            ULONG_PTR nContexts[64];
+            HRESULT hrResults[64];
+            int nFailed = 0;
+
+            double fStart = Now();
+            for (int f = 0; f < nFrames; ++f)
+            {
+                for (int s = 0; s < 3; ++s)
+                {
+                    while (pWriter->GetPendingCount() >= nQueueDepth)
+                    {
+                        int nCompleted = pWriter->Poll(nContexts, hrResults, _countof(nContexts), INFINITE);
+                        for (int i = 0; i < nCompleted; ++i)
+                        {
+                            nFailed += FAILED(hrResults[i]) ? 1 : 0;
+                        }
+                    }
+
+                    // Frame f of every stream goes to root f % k, like the recorder in frame mode
+                    StringCchPrintfW(szPath, _countof(szPath), L"%s\\%s\\%06d.%s", vFolders[f % k].c_str(), streams[s].szName, f, streams[s].szExtension);
+                    if (FAILED(pWriter->Submit(szPath, streams[s].pSlot, streams[s].cbFrame, 0)))
+                    {
+                        ++nFailed;
+                    }
+                }
+            }
+            while (pWriter->GetPendingCount() > 0)
+            {
+                int nCompleted = pWriter->Poll(nContexts, hrResults, _countof(nContexts), INFINITE);
+                for (int i = 0; i < nCompleted; ++i)
+                {
+                    nFailed += FAILED(hrResults[i]) ? 1 : 0;
+                }
+            }
+            double fElapsed = Now() - fStart;
+            delete pWriter;
+
+            // clean up the written frames
+            for (int s = 0; s < 3; ++s)
+            {
+                for (int f = 0; f < nFrames; ++f)
+                {
+                    StringCchPrintfW(szPath, _countof(szPath), L"%s\\%s\\%06d.%s", vFolders[f % k].c_str(), streams[s].szName, f, streams[s].szExtension);
+                    DeleteFileW(szPath);
+                }
+                for (int r = 0; r < k; ++r)
+                {
+                    StringCchPrintfW(szPath, _countof(szPath), L"%s\\%s", vFolders[r].c_str(), streams[s].szName);
+                    RemoveDirectoryW(szPath);
+                }
+            }
+            for (int r = 0; r < k; ++r)
+            {
+                RemoveDirectoryW(vFolders[r].c_str());
+            }
+
+            if (nFailed)
+            {
+                wprintf(L"%d frames failed to write over %d roots\n", nFailed, k);
+                nResult = 1;
+                break;
+            }
+
+            double fRate = fSetMB * nFrames / fElapsed;
+            if (1 == k)
+            {
+                fBaseRate = fRate;
+            }
+            wprintf(L"%-8d %10.1f %9.2fx %9.2fx\n", k, fRate, nFrames / 30. / fElapsed, fRate / fBaseRate);
+        }
+
+        FreeSyntheticStreams(streams);
+        return nResult;
+    }
+
+    /// <summary>
+    /// Consume the pixel data of a frame set the way a reader would, one byte per cache line
+    /// </summary>
+    /// <param name="frameSet">frame set to consume</param>
+    /// <returns>checksum of the touched bytes</returns>
+    BYTE ConsumeFrameSet(const ReplayFrameSet& frameSet)
+    {
+        BYTE nChecksum = 0;
+        for (int s = 0; s < 3; ++s)
+        {
+            for (UINT32 cb = 0; cb < frameSet.frames[s].cbData; cb += 64)
+            {
+                nChecksum ^= frameSet.frames[s].pData[cb];
+            }
+        }
+        return nChecksum;
+    }
+
+    /// <summary>
+    /// Record synthetic frame sets as image files and as record files, then read them back with
+    /// the replay reader and (as the baseline) one open/read/close per image without read-ahead
+    /// </summary>
+    /// <param name="argc">number of arguments</param>
+    /// <param name="argv">output folder, (optional) number of frame sets and (optional) prefetch depth</param>
+    /// <returns>0 on success, otherwise failure</returns>
+    int RunReplayBenchmark(int argc, LPWSTR* argv)
+    {
+        if (argc < 1)
+        {
+            wprintf(L"Usage: KinectV2Recorder /benchmark replay <folder> [frames] [prefetch depth]\n");
+            return 1;
+        }
+
+        LPCWSTR szFolder = argv[0];
+        int nFrames = (argc >= 2) ? max(1, _wtoi(argv[1])) : 300;
+        UINT32 nPrefetchDepth = (argc >= 3) ? max(1, _wtoi(argv[2])) : ReplayPrefetchDepth;
+
+        SyntheticStream streams[3];
+        CreateSyntheticStreams(streams);
+        double fSetMB = (streams[0].cbFrame + streams[1].cbFrame + streams[2].cbFrame) / (1024. * 1024.);
+
+        const UINT32 nWidths[3] = { cInfraredWidth, cDepthWidth, cColorWidth };
+        const UINT32 nHeights[3] = { cInfraredHeight, cDepthHeight, cColorHeight };
+        const RecordPixelFormat nPixelFormats[3] = { RecordPixelFormat_Gray16BE, RecordPixelFormat_Gray16BE, RecordPixelFormat_RGB24 };
+        const WCHAR* szRecordFiles[3] = { L"ir.kvr", L"depth.kvr", L"color.kvr" };
+        UINT32 cbPixels[3];
+        for (int s = 0; s < 3; ++s)
+        {
+            cbPixels[s] = nWidths[s] * nHeights[s] * (RecordPixelFormat_Gray16BE == nPixelFormats[s] ? sizeof(UINT16) : sizeof(RGBTRIPLE));
+        }
+
+        // Record the same frame sets in both layouts, named by time like the recorder does
+        WCHAR szImageFolder[MAX_PATH];
+        WCHAR szRecordFolder[MAX_PATH];
+        WCHAR szPath[MAX_PATH];
+        StringCchPrintfW(szImageFolder, _countof(szImageFolder), L"%s\\replay_images", szFolder);
+        StringCchPrintfW(szRecordFolder, _countof(szRecordFolder), L"%s\\replay_records", szFolder);
+        CreateFolderTree(szRecordFolder);
+
+        int nResult = 0;
+        FrameWriter* pWriter = FrameWriter::Create(WriterMode_Buffered);
+        MappedRecordFile recordFiles[3];
+        for (int s = 0; s < 3 && 0 == nResult; ++s)
+        {
+            StringCchPrintfW(szPath, _countof(szPath), L"%s\\%s", szImageFolder, streams[s].szName);
+            CreateFolderTree(szPath);
+
+            StringCchPrintfW(szPath, _countof(szPath), L"%s\\%s", szRecordFolder, szRecordFiles[s]);
+            if (FAILED(recordFiles[s].Create(szPath, s, nWidths[s], nHeights[s], nPixelFormats[s], cbPixels[s], nFrames)))
+            {
+                wprintf(L"Failed to create %s\n", szPath);
+                nResult = 1;
+            }
+        }
+
+        for (int f = 0; f < nFrames && 0 == nResult; ++f)
+        {
+            INT64 nTime = INT64(f) * 333333;
+            for (int s = 0; s < 3; ++s)
+            {
+                StringCchPrintfW(szPath, _countof(szPath), L"%s\\%s\\%011.6f.%s", szImageFolder, streams[s].szName, nTime / 10000000., streams[s].szExtension);
+                BYTE* pRecord = recordFiles[s].AcquireFrame();
+                if (FAILED(pWriter->Write(szPath, streams[s].pSlot, streams[s].cbFrame)) || !pRecord)
+                {
+                    wprintf(L"Failed to record frame set %d\n", f);
+                    nResult = 1;
+                    break;
+                }
+                memcpy(pRecord, streams[s].pSlot + streams[s].cbFrame - cbPixels[s], cbPixels[s]);
+                recordFiles[s].CommitFrame(nTime);
+            }
+        }
+        for (int s = 0; s < 3; ++s)
+        {
+            recordFiles[s].Close();
+        }
+        delete pWriter;
+
+        if (0 == nResult)
+        {
+            wprintf(L"%d frame sets of %.2f MB, prefetch depth %u (files are likely in the system cache)\n", nFrames, fSetMB, nPrefetchDepth);
+            wprintf(L"%-16s %12s %10s %10s\n", L"layout", L"frame sets/s", L"MB/s", L"realtime");
+
+            // Baseline: one open/read/close per image on the consumer thread
+            std::vector<std::wstring> vFiles[3];
+            std::vector<BYTE> vBuffer;
+            BYTE nChecksum = 0;
+            for (int s = 0; s < 3; ++s)
+            {
+                StripeLayout::ListFrames(szImageFolder, streams[s].szName, &vFiles[s]);
+            }
+
+            double fStart = Now();
+            for (int f = 0; f < nFrames && 0 == nResult; ++f)
+            {
+                for (int s = 0; s < 3; ++s)
+                {
+                    HANDLE hFile = CreateFileW(vFiles[s][f].c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+                    DWORD dwBytesRead = 0;
+                    vBuffer.resize(streams[s].cbFrame);
+                    if (INVALID_HANDLE_VALUE == hFile || !ReadFile(hFile, vBuffer.data(), streams[s].cbFrame, &dwBytesRead, NULL))
+                    {
+                        nResult = 1;
+                    }
+                    if (INVALID_HANDLE_VALUE != hFile)
+                    {
+                        CloseHandle(hFile);
+                    }
+                    for (DWORD cb = 0; cb < dwBytesRead; cb += 64)
+                    {
+                        nChecksum ^= vBuffer[cb];
+                    }
+                }
+            }
+            double fElapsed = Now() - fStart;
+            wprintf(L"%-16s %12.1f %10.1f %9.2fx\n", L"images (plain)", nFrames / fElapsed, fSetMB * nFrames / fElapsed, nFrames / 30. / fElapsed);
+
+            // The replay reader over both layouts
+            LPCWSTR szFolders[2] = { szImageFolder, szRecordFolder };
+            LPCWSTR szLayouts[2] = { L"images", L"record files" };
+            for (int l = 0; l < 2 && 0 == nResult; ++l)
+            {
+                ReplayReader reader;
+                ReplayFrameSet frameSet;
+                int nFrameSets = 0;
+
+                fStart = Now();
+                HRESULT hr = reader.Open(szFolders[l], nPrefetchDepth);
+                while (S_OK == hr && S_OK == (hr = reader.Next(&frameSet)))
+                {
+                    nChecksum ^= ConsumeFrameSet(frameSet);
+                    ++nFrameSets;
+                }
+                fElapsed = Now() - fStart;
+                reader.Close();
+
+                if (FAILED(hr) || nFrameSets != nFrames)
+                {
+                    wprintf(L"Failed to replay the %s (%d of %d frame sets)\n", szLayouts[l], nFrameSets, nFrames);
+                    nResult = 1;
+                    break;
+                }
+                wprintf(L"%-16s %12.1f %10.1f %9.2fx\n", szLayouts[l], nFrames / fElapsed, fSetMB * nFrames / fElapsed, nFrames / 30. / fElapsed);
+            }
+            wprintf(L"(checksum %02x)\n", nChecksum);
+        }
+
+        // clean up the recorded frame sets
+        for (int s = 0; s < 3; ++s)
+        {
+            for (int f = 0; f < nFrames; ++f)
+            {
+                StringCchPrintfW(szPath, _countof(szPath), L"%s\\%s\\%011.6f.%s", szImageFolder, streams[s].szName, INT64(f) * 333333 / 10000000., streams[s].szExtension);
+                DeleteFileW(szPath);
+            }
+            StringCchPrintfW(szPath, _countof(szPath), L"%s\\%s", szImageFolder, streams[s].szName);
+            RemoveDirectoryW(szPath);
+            StringCchPrintfW(szPath, _countof(szPath), L"%s\\%s", szRecordFolder, szRecordFiles[s]);
+            DeleteFileW(szPath);
+        }
+        RemoveDirectoryW(szImageFolder);
+        RemoveDirectoryW(szRecordFolder);
+
+        FreeSyntheticStreams(streams);
+        return nResult;
+    }
+
+    /// <summary>
+    /// Write frame sets with the buffered writer and checksum their pixel data on the same
+    /// thread as the recorder does, and report the cost of the checksums relative to the writes
+    /// </summary>
+    /// <param name="argc">number of arguments</param>
+    /// <param name="argv">output folder and (optional) number of frame sets</param>
+    /// <returns>0 on success, otherwise failure</returns>
+    int RunChecksumBenchmark(int argc, LPWSTR* argv)
+    {
+        if (argc < 1)
+        {
+            wprintf(L"Usage: KinectV2Recorder /benchmark checksum <folder> [frames]\n");
+            return 1;
+        }
+
+        LPCWSTR szFolder = argv[0];
+        int nFrames = (argc >= 2) ? max(1, _wtoi(argv[1])) : 300;
+
+        SyntheticStream streams[3];
+        CreateSyntheticStreams(streams);
+        double fSetMB = (streams[0].cbFrame + streams[1].cbFrame + streams[2].cbFrame) / (1024. * 1024.);
+
+        WCHAR szPath[MAX_PATH];
+        StringCchPrintfW(szPath, _countof(szPath), L"%s\\checksum", szFolder);
+        CreateFolderTree(szPath);
+
+        FrameWriter* pWriter = FrameWriter::Create(WriterMode_Buffered);
+        double fWrite = 0.;
+        double fHardware = 0.;
+        double fSoftware = 0.;
+        UINT32 nChecksum = 0;
+        int nResult = 0;
+
+        for (int f = 0; f < nFrames && 0 == nResult; ++f)
+        {
+            for (int s = 0; s < 3; ++s)
+            {
+                const BYTE* pPixels = streams[s].pSlot + streams[s].cbHeader;
+                DWORD cbPixels = streams[s].cbFrame - streams[s].cbHeader;
+
+                double fStart = Now();
+                nChecksum ^= ComputeCrc32c(pPixels, cbPixels);
+                double fChecksummed = Now();
+                fHardware += fChecksummed - fStart;
+
+                StringCchPrintfW(szPath, _countof(szPath), L"%s\\checksum\\%s_%06d.%s", szFolder, streams[s].szName, f, streams[s].szExtension);
+                if (FAILED(pWriter->Write(szPath, streams[s].pSlot, streams[s].cbFrame)))
+                {
+                    wprintf(L"Failed to write %s\n", szPath);
+                    nResult = 1;
+                    break;
+                }
+                fWrite += Now() - fChecksummed;
+            }
+        }
+
+        // The table lookup only serves as the comparison, it runs on the cached frames
+        for (int f = 0; f < nFrames && 0 == nResult; ++f)
+        {
+            double fStart = Now();
+            for (int s = 0; s < 3; ++s)
+            {
+                nChecksum ^= ComputeCrc32cSoftware(streams[s].pSlot + streams[s].cbHeader, streams[s].cbFrame - streams[s].cbHeader);
+            }
+            fSoftware += Now() - fStart;
+        }
+
+        if (0 == nResult)
+        {
+            double fBudget = nFrames / 30.;
+            wprintf(L"%d frame sets of %.2f MB, crc32 instruction %s (checksum %08x)\n", nFrames, fSetMB, IsCrc32cAccelerated() ? L"available" : L"not available", nChecksum);
+            wprintf(L"%-16s %12s %10s %12s %12s\n", L"", L"ms/set", L"MB/s", L"% of write", L"% of 33 ms");
+            wprintf(L"%-16s %12.3f %10.1f %12s %11.2f%%\n", L"write", 1000. * fWrite / nFrames, fSetMB * nFrames / fWrite, L"", 100. * fWrite / fBudget);
+            wprintf(L"%-16s %12.3f %10.1f %11.2f%% %11.2f%%\n", L"crc32c", 1000. * fHardware / nFrames, fSetMB * nFrames / fHardware, 100. * fHardware / fWrite, 100. * fHardware / fBudget);
+            wprintf(L"%-16s %12.3f %10.1f %11.2f%% %11.2f%%\n", L"crc32c (table)", 1000. * fSoftware / nFrames, fSetMB * nFrames / fSoftware, 100. * fSoftware / fWrite, 100. * fSoftware / fBudget);
+        }
+        delete pWriter;
+
+        // clean up the written frames
+        for (int f = 0; f < nFrames; ++f)
+        {
+            for (int s = 0; s < 3; ++s)
+            {
+                StringCchPrintfW(szPath, _countof(szPath), L"%s\\checksum\\%s_%06d.%s", szFolder, streams[s].szName, f, streams[s].szExtension);
+                DeleteFileW(szPath);
+            }
+        }
+        StringCchPrintfW(szPath, _countof(szPath), L"%s\\checksum", szFolder);
+        RemoveDirectoryW(szPath);
+
+        FreeSyntheticStreams(streams);
+        return nResult;
+    }
+
+    /// <summary>
+    /// Convert synthetic depth frames to point clouds on one thread, without and with the
+    /// infrared intensity, and report the frames per second against the 30 fps of the sensor
+    /// </summary>
+    /// <param name="argc">number of arguments</param>
+    /// <param name="argv">(optional) number of frames</param>
+    /// <returns>0 on success, otherwise failure</returns>
+    int RunPointCloudBenchmark(int argc, LPWSTR* argv)
+    {
+        int nFrames = (argc >= 1) ? max(1, _wtoi(argv[0])) : 300;
+
+        // Typical intrinsics of a Kinect V2 depth camera
+        DepthIntrinsics intrinsics = { 365.5f, 365.5f, 257.3f, 210.6f, 0.09f, -0.27f, 0.09f };
+        DepthRayTable rayTable;
+        double fStart = Now();
+        if (FAILED(rayTable.Build(intrinsics)))
+        {
+            wprintf(L"Failed to build the ray table\n");
+            return 1;
+        }
+        double fBuild = Now() - fStart;
+
+        // Depth between 0.5 and 4.5 m big-endian as recorded, with about 1 of 8 pixels invalid
+        std::vector<UINT16> vDepth(PointCloudWidth * PointCloudHeight);
+        std::vector<UINT16> vInfrared(PointCloudWidth * PointCloudHeight);
+        for (size_t i = 0; i < vDepth.size(); ++i)
+        {
+            UINT16 nDepth = (0 == rand() % 8) ? 0 : static_cast<UINT16>(500 + rand() % 4000);
+            vDepth[i] = _byteswap_ushort(nDepth);
+            vInfrared[i] = _byteswap_ushort(static_cast<UINT16>(rand()));
+        }
+        std::vector<BYTE> vPoints(PointCloudWidth * PointCloudHeight * DepthRayTable::GetPointSize(true));
+
+        wprintf(L"%d depth frames of %dx%d, ray table built in %.2f ms\n", nFrames, PointCloudWidth, PointCloudHeight, 1000. * fBuild);
+        wprintf(L"%-16s %10s %12s %10s %10s\n", L"", L"points", L"ms/frame", L"fps", L"x 30 fps");
+        for (int n = 0; n < 2; ++n)
+        {
+            bool bInfrared = (1 == n);
+            UINT32 nPoints = 0;
+            fStart = Now();
+            for (int f = 0; f < nFrames; ++f)
+            {
+                nPoints = rayTable.Convert(vDepth.data(), bInfrared ? vInfrared.data() : NULL, true, vPoints.data());
+            }
+            double fElapsed = Now() - fStart;
+            wprintf(L"%-16s %10u %12.3f %10.1f %10.1f\n", bInfrared ? L"xyz + intensity" : L"xyz", nPoints, 1000. * fElapsed / nFrames, nFrames / fElapsed, nFrames / fElapsed / 30.);
+        }
+
+        return 0;
+    }
+
+    /// <summary>
+    /// Register synthetic depth frames to the color grid on one thread, color for depth and
+    /// depth for color, and report the frames per second against the 30 fps of the sensor
+    /// </summary>
+    /// <param name="argc">number of arguments</param>
+    /// <param name="argv">(optional) number of frames</param>
+    /// <returns>0 on success, otherwise failure</returns>
+    int RunRegistrationBenchmark(int argc, LPWSTR* argv)
+    {
+        int nFrames = (argc >= 1) ? max(1, _wtoi(argv[0])) : 300;
+
+        // Typical calibration of a Kinect V2: the color camera is about 5 cm beside the depth camera
+        DepthIntrinsics depth = { 365.5f, 365.5f, 257.3f, 210.6f, 0.09f, -0.27f, 0.09f };
+        ColorIntrinsics color = { 1060.f, 1060.f, 960.f, 540.f };
+        DepthToColorExtrinsics extrinsics = { { 1.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f, 0.f, 1.f }, { 0.052f, 0.f, 0.f } };
+        DepthColorRegistration registration;
+        double fStart = Now();
+        if (FAILED(registration.Build(depth, color, extrinsics)))
+        {
+            wprintf(L"Failed to build the registration\n");
+            return 1;
+        }
+        double fBuild = Now() - fStart;
+
+        std::vector<UINT16> vDepth(PointCloudWidth * PointCloudHeight);
+        for (size_t i = 0; i < vDepth.size(); ++i)
+        {
+            UINT16 nDepth = (0 == rand() % 8) ? 0 : static_cast<UINT16>(500 + rand() % 4000);
+            vDepth[i] = _byteswap_ushort(nDepth);
+        }
+        std::vector<BYTE> vColor(RegistrationColorWidth * RegistrationColorHeight * sizeof(RGBTRIPLE), 128);
+        std::vector<INT32> vColorIndex(PointCloudWidth * PointCloudHeight);
+        std::vector<BYTE> vRegistered(RegistrationColorWidth * RegistrationColorHeight * sizeof(UINT16));
+
+        wprintf(L"%d frame sets, tables built in %.2f ms\n", nFrames, 1000. * fBuild);
+        wprintf(L"%-16s %12s %10s %10s\n", L"", L"ms/frame", L"fps", L"x 30 fps");
+        for (int n = 0; n < 2; ++n)
+        {
+            bool bColor = (0 == n);
+            fStart = Now();
+            for (int f = 0; f < nFrames; ++f)
+            {
+                registration.Map(vDepth.data(), true, vColorIndex.data());
+                if (bColor)
+                {
+                    DepthColorRegistration::RegisterColor(vColorIndex.data(), vColor.data(), vRegistered.data());
+                }
+                else
+                {
+                    DepthColorRegistration::RegisterDepth(vColorIndex.data(), vDepth.data(), true, reinterpret_cast<UINT16*>(vRegistered.data()));
+                }
+            }
+            double fElapsed = Now() - fStart;
+            wprintf(L"%-16s %12.3f %10.1f %10.1f\n", bColor ? L"color for depth" : L"depth for color", 1000. * fElapsed / nFrames, nFrames / fElapsed, nFrames / fElapsed / 30.);
+        }
+
+        return 0;
+    }
+
+    /// <summary>
+    /// Pack and unpack synthetic depth and infrared frames on one thread with each packing, and
+    /// report the size and the time per frame against the 33 ms of a frame
+    /// </summary>
+    /// <param name="argc">number of arguments</param>
+    /// <param name="argv">(optional) number of frames</param>
+    /// <returns>0 on success, otherwise failure</returns>
+    int RunPackingBenchmark(int argc, LPWSTR* argv)
+    {
+        int nFrames = (argc >= 1) ? max(1, _wtoi(argv[0])) : 300;
+        const UINT32 nPixels = cDepthWidth * cDepthHeight;
+
+        // Depth between 0.5 and 4.5 m with about 1 of 8 pixels invalid, and full range infrared,
+        // both big-endian as recorded
+        std::vector<UINT16> vFrames[2];
+        vFrames[0].resize(nPixels);
+        vFrames[1].resize(nPixels);
+        for (UINT32 i = 0; i < nPixels; ++i)
+        {
+            UINT16 nDepth = (0 == rand() % 8) ? 0 : static_cast<UINT16>(500 + rand() % 4000);
+            vFrames[0][i] = _byteswap_ushort(nDepth);
+            vFrames[1][i] = _byteswap_ushort(static_cast<UINT16>(rand()));
+        }
+        std::vector<UINT16> vQuantized(nPixels);
+        std::vector<UINT16> vUnpacked(nPixels);
+        std::vector<BYTE> vPacked(GetPackedSize(nPixels, 13));
+
+        const WCHAR* szNames[] = { L"depth 13 bits", L"depth 12 bits", L"ir 13 bits >> 3", L"ir 12 bits >> 4" };
+        const GrayPacking packings[] = { { 13, 0 }, { 12, 0 }, { 13, 3 }, { 12, 4 } };
+
+        wprintf(L"%d frames of %dx%d\n", nFrames, cDepthWidth, cDepthHeight);
+        wprintf(L"%-16s %10s %10s %12s %12s %12s\n", L"", L"KB", L"% of PGM", L"ms quantize", L"ms pack", L"ms unpack");
+        for (int p = 0; p < _countof(packings); ++p)
+        {
+            const std::vector<UINT16>& vFrame = vFrames[(packings[p].nShift) ? 1 : 0];
+            double fQuantize = 0.;
+            double fPack = 0.;
+            double fUnpack = 0.;
+            for (int f = 0; f < nFrames; ++f)
+            {
+                memcpy(vQuantized.data(), vFrame.data(), nPixels * sizeof(UINT16));
+                double fStart = Now();
+                QuantizeGray(vQuantized.data(), nPixels, packings[p]);
+                double fQuantized = Now();
+                PackGray(vFrame.data(), nPixels, packings[p], vPacked.data());
+                double fPacked = Now();
+                UnpackGray(vPacked.data(), nPixels, packings[p], vUnpacked.data());
+                double fUnpacked = Now();
+
+                fQuantize += fQuantized - fStart;
+                fPack += fPacked - fQuantized;
+                fUnpack += fUnpacked - fPacked;
+            }
+
+            // Unpacking has to give the frame the recorder checksums
+            if (0 != memcmp(vQuantized.data(), vUnpacked.data(), nPixels * sizeof(UINT16)))
+            {
+                wprintf(L"Unpacked frame differs for %s\n", szNames[p]);
+                return 1;
+            }
+
+            UINT32 cbPacked = GetPackedSize(nPixels, packings[p].nBits);
+            wprintf(L"%-16s %10.1f %9.1f%% %12.3f %12.3f %12.3f\n", szNames[p], cbPacked / 1024., 100. * cbPacked / (nPixels * sizeof(UINT16)),
+                1000. * fQuantize / nFrames, 1000. * fPack / nFrames, 1000. * fUnpack / nFrames);
+        }
+
+        return 0;
+    }
+
+    /// <summary>
+    /// Delta code the depth frames of a recorded session on one thread, with keyframes only and
+    /// with a keyframe interval, and report the size, the time per frame against the 33 ms of a
+    /// frame, and the mean time to seek to a frame (decoding from its keyframe on)
+    /// </summary>
+    /// <param name="argc">number of arguments</param>
+    /// <param name="argv">session folder, (optional) keyframe interval and number of frames</param>
+    /// <returns>0 on success, otherwise failure</returns>
+    int RunDeltaBenchmark(int argc, LPWSTR* argv)
+    {
+        if (argc < 1)
+        {
+            wprintf(L"Usage: KinectV2Recorder /benchmark delta <session> [keyframe interval] [frames]\n");
+            return 1;
+        }
+
+        LPCWSTR szSessionFolder = argv[0];
+        UINT32 nKeyframeInterval = (argc >= 2) ? max(1, _wtoi(argv[1])) : 30;
+        size_t nMaxFrames = (argc >= 3) ? max(1, _wtoi(argv[2])) : 300;
+
+        // The frames are read (and decoded if they are coded already) before any timing
+        std::vector<std::vector<UINT16> > vFrames;
+        UINT32 nWidth = 0;
+        UINT32 nHeight = 0;
+        ReplayReader reader;
+        ReplayFrameSet frameSet;
+        HRESULT hr = reader.Open(szSessionFolder, ReplayPrefetchDepth, ReplayStream_Depth);
+        while (S_OK == hr && vFrames.size() < nMaxFrames && S_OK == (hr = reader.Next(&frameSet)))
+        {
+            const ReplayFrame& depth = frameSet.frames[1];
+            if (RecordPixelFormat_Gray16BE != depth.nPixelFormat)
+            {
+                hr = E_FAIL;
+                break;
+            }
+            nWidth = depth.nWidth;
+            nHeight = depth.nHeight;
+            const UINT16* pPixels = reinterpret_cast<const UINT16*>(depth.pData);
+            vFrames.push_back(std::vector<UINT16>(pPixels, pPixels + nWidth * nHeight));
+        }
+        reader.Close();
+        if (FAILED(hr) || vFrames.empty())
+        {
+            wprintf(L"Failed to read the depth frames of %s\n", szSessionFolder);
+            return 1;
+        }
+
+        size_t nFrames = vFrames.size();
+        UINT32 nPixels = nWidth * nHeight;
+        std::vector<std::vector<BYTE> > vImages(nFrames);
+        std::vector<UINT16> vDecoded(nPixels);
+
+        wprintf(L"%u depth frames of %ux%u\n", static_cast<UINT32>(nFrames), nWidth, nHeight);
+        wprintf(L"%-16s %10s %10s %12s %12s %12s\n", L"", L"KB", L"% of PGM", L"ms encode", L"ms decode", L"ms seek");
+        const UINT32 nIntervals[] = { 1, nKeyframeInterval };
+        for (int k = 0; k < ((1 == nKeyframeInterval) ? 1 : 2); ++k)
+        {
+            DepthDeltaEncoder encoder;
+            DepthDeltaDecoder decoder;
+            encoder.Reset(nIntervals[k]);
+
+            ULONGLONG cbCoded = 0;
+            double fStart = Now();
+            for (size_t f = 0; f < nFrames; ++f)
+            {
+                vImages[f].resize(GetDepthDeltaBound(nPixels));
+                vImages[f].resize(encoder.Encode(vFrames[f].data(), nWidth, nHeight, vImages[f].data()));
+                cbCoded += vImages[f].size();
+            }
+            double fEncode = Now() - fStart;
+
+            // Decoding has to give the frames as they were read
+            double fDecode = 0.;
+            ULONGLONG nKeyDistances = 0;
+            for (size_t f = 0; f < nFrames; ++f)
+            {
+                ReplayFrame frame;
+                fStart = Now();
+                hr = ParseImageHeader(vImages[f].data(), vImages[f].size(), &frame);
+                if (SUCCEEDED(hr))
+                {
+                    hr = decoder.Decode(frame.pData, frame.cbData, frame.nWidth, frame.nHeight, frame.delta, vDecoded.data());
+                }
+                fDecode += Now() - fStart;
+
+                if (FAILED(hr) || 0 != memcmp(vDecoded.data(), vFrames[f].data(), nPixels * sizeof(UINT16)))
+                {
+                    wprintf(L"Decoded frame %u differs with a keyframe interval of %u\n", static_cast<UINT32>(f), nIntervals[k]);
+                    return 1;
+                }
+                nKeyDistances += frame.delta.nKeyDistance;
+            }
+
+            // A seek decodes the frame and the ones back to its keyframe
+            WCHAR szName[32];
+            StringCchPrintfW(szName, _countof(szName), L"keyframe / %u", nIntervals[k]);
+            double fSeek = fDecode / nFrames * (1. + double(nKeyDistances) / nFrames);
+            wprintf(L"%-16s %10.1f %9.1f%% %12.3f %12.3f %12.3f\n", szName, cbCoded / 1024. / nFrames, 100. * cbCoded / (ULONGLONG(nFrames) * nPixels * sizeof(UINT16)),
+                1000. * fEncode / nFrames, 1000. * fDecode / nFrames, 1000. * fSeek);
+        }
+
+        return 0;
+    }
+    /// <summary>
+    /// Encode the color frames of a recorded session with each codec, on one thread and on a
+    /// pool of encoder threads, and report the size, the frames per second per core against the
+    /// 30 fps of the sensor, and the quality of the lossy codec
+    /// </summary>
+    /// <param name="argc">number of arguments</param>
+    /// <param name="argv">session folder, (optional) number of encoder threads, number of frames and JPEG quality</param>
+    /// <returns>0 on success, otherwise failure</returns>
+    int RunColorBenchmark(int argc, LPWSTR* argv)
+    {
+        if (argc < 1)
+        {
+            wprintf(L"Usage: KinectV2Recorder /benchmark color <session> [threads] [frames] [quality]\n");
+            return 1;
+        }
+
+        LPCWSTR szSessionFolder = argv[0];
+        UINT nThreads = (argc >= 2) ? max(1, min(ColorEncoderMaxThreads, _wtoi(argv[1]))) : 4;
+        size_t nMaxFrames = (argc >= 3) ? max(1, _wtoi(argv[2])) : 60;
+        UINT32 nQuality = (argc >= 4) ? max(1, min(100, _wtoi(argv[3]))) : 90;
+
+        // The frames are read (and decoded if they are encoded already) before any timing
+        std::vector<std::vector<RGBTRIPLE> > vFrames;
+        UINT32 nWidth = 0;
+        UINT32 nHeight = 0;
+        bool bRedFirst = true;
+        ReplayReader reader;
+        ReplayFrameSet frameSet;
+        HRESULT hr = reader.Open(szSessionFolder, ReplayPrefetchDepth, ReplayStream_Color);
+        while (S_OK == hr && vFrames.size() < nMaxFrames && S_OK == (hr = reader.Next(&frameSet)))
+        {
+            const ReplayFrame& color = frameSet.frames[2];
+            nWidth = color.nWidth;
+            nHeight = color.nHeight;
+            bRedFirst = (RecordPixelFormat_RGB24 == color.nPixelFormat);
+            const RGBTRIPLE* pPixels = reinterpret_cast<const RGBTRIPLE*>(color.pData);
+            vFrames.push_back(std::vector<RGBTRIPLE>(pPixels, pPixels + nWidth * nHeight));
+        }
+        reader.Close();
+        if (FAILED(hr) || vFrames.empty())
+        {
+            wprintf(L"Failed to read the color frames of %s\n", szSessionFolder);
+            return 1;
+        }
+
+        size_t nFrames = vFrames.size();
+        UINT32 nPixels = nWidth * nHeight;
+        DWORD cbBound = GetColorEncodedBound(nPixels);
+        std::vector<BYTE> vImage(cbBound);
+        std::vector<RGBTRIPLE> vDecoded(nPixels);
+        ColorCoder coder;
+
+        wprintf(L"%u color frames of %ux%u, %u encoder threads\n", static_cast<UINT32>(nFrames), nWidth, nHeight, nThreads);
+        wprintf(L"%-10s %10s %10s %12s %12s %12s %12s %10s\n", L"", L"KB", L"% of PPM", L"ms encode", L"fps/core", L"fps pool", L"ms decode", L"PSNR dB");
+        const ColorCodec nCodecs[] = { ColorCodec_Qoi, ColorCodec_Png, ColorCodec_Jpeg };
+        for (int c = 0; c < _countof(nCodecs); ++c)
+        {
+            ColorEncoding encoding = { nCodecs[c], (ColorCodec_Jpeg == nCodecs[c]) ? nQuality : 0 };
+
+            // One thread: encode, then decode and compare with the frame
+            ULONGLONG cbEncoded = 0;
+            double fEncode = 0.;
+            double fDecode = 0.;
+            double fSquaredError = 0.;
+            for (size_t f = 0; f < nFrames && SUCCEEDED(hr); ++f)
+            {
+                DWORD cbImage = 0;
+                double fStart = Now();
+                hr = coder.Encode(encoding, vFrames[f].data(), nWidth, nHeight, bRedFirst, vImage.data(), cbBound, &cbImage);
+                fEncode += Now() - fStart;
+                cbEncoded += cbImage;
+
+                fStart = Now();
+                if (SUCCEEDED(hr))
+                {
+                    hr = coder.Decode(nCodecs[c], vImage.data(), cbImage, nWidth, nHeight, bRedFirst, vDecoded.data());
+                }
+                fDecode += Now() - fStart;
+
+                const BYTE* pFrame = reinterpret_cast<const BYTE*>(vFrames[f].data());
+                const BYTE* pDecoded = reinterpret_cast<const BYTE*>(vDecoded.data());
+                for (UINT32 i = 0; SUCCEEDED(hr) && i < nPixels * sizeof(RGBTRIPLE); ++i)
+                {
+                    int nError = int(pFrame[i]) - int(pDecoded[i]);
+                    fSquaredError += nError * nError;
+                }
+            }
+            if (FAILED(hr) || (ColorCodec_Jpeg != nCodecs[c] && fSquaredError > 0.))
+            {
+                wprintf(L"Failed to encode the frames with %s\n", GetColorCodecName(nCodecs[c]));
+                return 1;
+            }
+
+            // The pool: frames in flight as the recorder keeps them, collected in order
+            ColorEncoderPool pool(nThreads);
+            size_t nSubmitted = 0;
+            size_t nCollected = 0;
+            double fStart = Now();
+            while (nCollected < nFrames && SUCCEEDED(hr))
+            {
+                while (nSubmitted < nFrames && pool.GetPendingCount() < 2 * static_cast<int>(nThreads) && SUCCEEDED(hr))
+                {
+                    hr = pool.Submit(L"", encoding, vFrames[nSubmitted].data(), nWidth, nHeight, bRedFirst, nSubmitted);
+                    ++nSubmitted;
+                }
+
+                ColorEncodedFrame encodedFrames[cBufferSize];
+                int nEncoded = pool.Collect(encodedFrames, _countof(encodedFrames));
+                for (int i = 0; i < nEncoded; ++i)
+                {
+                    if (FAILED(encodedFrames[i].hr) || encodedFrames[i].nContext != nCollected)
+                    {
+                        hr = E_FAIL;
+                    }
+                    pool.Release(encodedFrames[i].nContext);
+                    ++nCollected;
+                }
+                if (!nEncoded)
+                {
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+                }
+            }
+            double fPool = Now() - fStart;
+            if (FAILED(hr))
+            {
+                wprintf(L"Failed to encode the frames with %s on the pool\n", GetColorCodecName(nCodecs[c]));
+                return 1;
+            }
+
+            WCHAR szPsnr[32] = L"lossless";
+            if (fSquaredError > 0.)
+            {
+                double fMeanSquaredError = fSquaredError / (double(nFrames) * nPixels * sizeof(RGBTRIPLE));
+                StringCchPrintfW(szPsnr, _countof(szPsnr), L"%.2f", 10. * log10(255. * 255. / fMeanSquaredError));
+            }
+            wprintf(L"%-10s %10.1f %9.1f%% %12.3f %12.1f %12.1f %12.3f %10s\n", GetColorCodecName(nCodecs[c]), cbEncoded / 1024. / nFrames,
+                100. * cbEncoded / (ULONGLONG(nFrames) * nPixels * sizeof(RGBTRIPLE)), 1000. * fEncode / nFrames, nFrames / fEncode,
+                nFrames / fPool, 1000. * fDecode / nFrames, szPsnr);
+        }
+
+        return 0;
+    }
+
+    /// <summary>
+    /// Deduplicate synthetic depth and color frames on one thread, comparing identical frames
+    /// and frames within a noise tolerance, and report the time per frame of a static scene and
+    /// of a changing one against the 33 ms of a frame, next to the checksum every frame costs
+    /// </summary>
+    /// <param name="argc">number of arguments</param>
+    /// <param name="argv">(optional) number of frames</param>
+    /// <returns>0 on success, otherwise failure</returns>
+    int RunDedupBenchmark(int argc, LPWSTR* argv)
+    {
+        int nFrames = (argc >= 1) ? max(2, _wtoi(argv[0])) : 300;
+
+        // A frame, the same frame with noise of up to 2 (depth in mm, color in levels) and
+        // another frame, as big-endian depth and as color
+        const UINT32 cbFrames[] = { cDepthWidth * cDepthHeight * sizeof(UINT16), cColorWidth * cColorHeight * sizeof(RGBTRIPLE) };
+        std::vector<BYTE> vFrames[2][3];
+        for (int s = 0; s < 2; ++s)
+        {
+            for (int k = 0; k < 3; ++k)
+            {
+                vFrames[s][k].resize(cbFrames[s]);
+            }
+        }
+        UINT16* pFrames[] = { reinterpret_cast<UINT16*>(vFrames[0][0].data()), reinterpret_cast<UINT16*>(vFrames[0][1].data()), reinterpret_cast<UINT16*>(vFrames[0][2].data()) };
+        for (UINT32 i = 0; i < cDepthWidth * cDepthHeight; ++i)
+        {
+            UINT16 nDepth = (0 == rand() % 8) ? 0 : static_cast<UINT16>(500 + rand() % 4000);
+            UINT16 nNoisy = nDepth ? static_cast<UINT16>(nDepth + rand() % 5 - 2) : 0;
+            pFrames[0][i] = _byteswap_ushort(nDepth);
+            pFrames[1][i] = _byteswap_ushort(nNoisy);
+            pFrames[2][i] = _byteswap_ushort(static_cast<UINT16>(500 + rand() % 4000));
+        }
+        for (UINT32 i = 0; i < cbFrames[1]; ++i)
+        {
+            int nLevel = rand() % 256;
+            int nNoisy = nLevel + rand() % 5 - 2;
+            vFrames[1][0][i] = static_cast<BYTE>(nLevel);
+            vFrames[1][1][i] = static_cast<BYTE>(max(0, min(255, nNoisy)));
+            vFrames[1][2][i] = static_cast<BYTE>(rand());
+        }
+
+        const WCHAR* szNames[] = { L"depth exact", L"depth within 2", L"color exact", L"color within 2" };
+        const FrameDedupThreshold thresholds[] = { { 0, 0 }, { 2, 10 }, { 0, 0 }, { 2, 10 } };
+
+        wprintf(L"%d frames of %dx%d depth and %dx%d color\n", nFrames, cDepthWidth, cDepthHeight, cColorWidth, cColorHeight);
+        wprintf(L"%-16s %12s %12s %12s %12s\n", L"", L"ms checksum", L"ms static", L"ms changed", L"duplicates");
+        for (int t = 0; t < _countof(thresholds); ++t)
+        {
+            int s = t / 2;
+            bool bExact = !thresholds[t].nTolerance;
+            const std::vector<BYTE>& vReference = vFrames[s][0];
+            const std::vector<BYTE>& vStatic = vFrames[s][bExact ? 0 : 1];
+            UINT32 nChecksums[3];
+            double fStart = Now();
+            for (int k = 0; k < 3; ++k)
+            {
+                nChecksums[k] = ComputeCrc32c(vFrames[s][k].data(), cbFrames[s]);
+            }
+            double fChecksum = (Now() - fStart) / 3;
+
+            // A static scene repeats the reference, a changing one takes every frame as the
+            // next reference
+            FrameDeduplicator dedup;
+            dedup.Reset(thresholds[t], true);
+            dedup.Deduplicate(vReference.data(), cbFrames[s], 0 == s, nChecksums[0], 0);
+            fStart = Now();
+            for (int f = 0; f < nFrames; ++f)
+            {
+                dedup.Deduplicate(vStatic.data(), cbFrames[s], 0 == s, nChecksums[bExact ? 0 : 1], f);
+            }
+            double fStatic = Now() - fStart;
+            UINT32 nDuplicates = dedup.GetDuplicateCount();
+
+            fStart = Now();
+            for (int f = 0; f < nFrames; ++f)
+            {
+                int k = (f & 1) ? 0 : 2;
+                dedup.Deduplicate(vFrames[s][k].data(), cbFrames[s], 0 == s, nChecksums[k], f);
+            }
+            double fChanged = Now() - fStart;
+
+            // Every static frame has to repeat the reference, no changed one
+            if (nDuplicates != static_cast<UINT32>(nFrames) || dedup.GetDuplicateCount() != nDuplicates)
+            {
+                wprintf(L"Deduplication failed for %s\n", szNames[t]);
+                return 1;
+            }
+
+            wprintf(L"%-16s %12.3f %12.3f %12.3f %12u\n", szNames[t], 1000. * fChecksum, 1000. * fStatic / nFrames, 1000. * fChanged / nFrames, nDuplicates);
+        }
+
+        return 0;
+    }
+
+    /// Counters of a reader of the live frames
+    struct LiveReader
+    {
+        DWORD               dwHoldMs;           // time a frame is used in place
+        UINT32              nRead;
+        UINT32              nSkipped;           // frames published while the reader was busy
+        UINT32              nOverwritten;       // frames overwritten while they were used
+        double              fLatency;           // sum of the times from publishing to reading
+        double              fMaxLatency;
+    };
+
+    /// <summary>
+    /// Publish synthetic frame sets at 30 fps to shared memory, read by readers which use each
+    /// frame in place for a while (the last ones longer than the ring of slots lasts), and report
+    /// the time the publisher takes per frame set next to what the readers saw
+    /// </summary>
+    /// <param name="argc">number of arguments</param>
+    /// <param name="argv">(optional) number of frame sets and number of readers</param>
+    /// <returns>0 on success, otherwise failure</returns>
+    int RunPublishBenchmark(int argc, LPWSTR* argv)
+    {
+        int nFrames = (argc >= 1) ? max(1, _wtoi(argv[0])) : 300;
+        int nReaders = (argc >= 2) ? max(1, min(16, _wtoi(argv[1]))) : 4;
+
+        const FramePublisherFormat formats[FramePublisherStreams] =
+        {
+            { cInfraredWidth, cInfraredHeight, RecordPixelFormat_Gray16BE, cInfraredWidth * cInfraredHeight * sizeof(UINT16) },
+            { cDepthWidth, cDepthHeight, RecordPixelFormat_Gray16BE, cDepthWidth * cDepthHeight * sizeof(UINT16) },
+            { cColorWidth, cColorHeight, RecordPixelFormat_RGB24, cColorWidth * cColorHeight * sizeof(RGBTRIPLE) }
+        };
+        const WCHAR* szName = FramePublisherName L".Benchmark";
+        FramePublisher publisher;
+        HRESULT hr = publisher.Create(szName, formats, FramePublisherDefaultSlots);
+        if (FAILED(hr))
+        {
+            wprintf(L"Failed to create the shared memory %s (0x%08x)\n", szName, hr);
+            return 1;
+        }
+
+        SyntheticStream streams[3];
+        CreateSyntheticStreams(streams);
+
+        // Every other reader holds a frame for a few ms, the last one for longer than the
+        // slots of a stream last at 30 fps
+        std::vector<LiveReader> vReaders(nReaders);
+        for (int r = 0; r < nReaders; ++r)
+        {
+            ZeroMemory(&vReaders[r], sizeof(LiveReader));
+            vReaders[r].dwHoldMs = (r == nReaders - 1 && nReaders > 1) ? 200 : (r & 1) ? 5 : 0;
+        }
+
+        // The readers take the color stream, whose frames take longest to use
+        const UINT32 nStream = 2;
+        std::atomic<bool> bStop(false);
+        std::vector<std::thread> vThreads;
+        for (int r = 0; r < nReaders; ++r)
+        {
+            vThreads.push_back(std::thread([&, r]()
+            {
+                LiveReader& reader = vReaders[r];
+                FrameSubscriber subscriber;
+                if (FAILED(subscriber.Open(szName)))
+                {
+                    return;
+                }
+
+                LONG64 nLast = 0;
+                while (!bStop)
+                {
+                    FrameView view;
+                    if (S_OK != subscriber.Acquire(nStream, &view, nLast))
+                    {
+                        Sleep(1);
+                        continue;
+                    }
+
+                    double fLatency = Now() - view.nTime / 10000000.;
+                    volatile UINT32 nSum = 0;
+                    for (UINT32 i = 0; i < view.cbData; i += 4096)
+                    {
+                        nSum += view.pData[i];
+                    }
+                    if (reader.dwHoldMs)
+                    {
+                        Sleep(reader.dwHoldMs);
+                    }
+
+                    if (!subscriber.IsValid(nStream, view))
+                    {
+                        ++reader.nOverwritten;
+                    }
+                    else
+                    {
+                        ++reader.nRead;
+                        reader.fLatency += fLatency;
+                        reader.fMaxLatency = max(reader.fMaxLatency, fLatency);
+                    }
+                    reader.nSkipped += static_cast<UINT32>(view.nFrame - nLast - 1);
+                    nLast = view.nFrame;
+                }
+            }));
+        }
+
+        // The publisher keeps the frame rate of the sensor, whatever the readers do
+        double fPublish = 0.0;
+        double fMaxPublish = 0.0;
+        double fStart = Now();
+        for (int f = 0; f < nFrames; ++f)
+        {
+            double fFrameStart = Now();
+            INT64 nTime = static_cast<INT64>(fFrameStart * 10000000.);
+            for (int s = 0; s < 3; ++s)
+            {
+                publisher.Publish(s, streams[s].pSlot + streams[s].cbHeader, nTime);
+            }
+            double fElapsed = Now() - fFrameStart;
+            fPublish += fElapsed;
+            fMaxPublish = max(fMaxPublish, fElapsed);
+
+            double fNext = fStart + (f + 1) / 30.;
+            double fWait = fNext - Now();
+            if (fWait > 0)
+            {
+                Sleep(static_cast<DWORD>(fWait * 1000));
+            }
+        }
+
+        bStop = true;
+        for (size_t i = 0; i < vThreads.size(); ++i)
+        {
+            vThreads[i].join();
+        }
+        FreeSyntheticStreams(streams);
+
+        wprintf(L"%d frame sets published at 30 fps in %u slots, %.3f ms per frame set (max %.3f ms)\n", nFrames, FramePublisherDefaultSlots, 1000. * fPublish / nFrames, 1000. * fMaxPublish);
+        wprintf(L"%-8s %10s %10s %10s %12s %12s %12s\n", L"reader", L"hold ms", L"read", L"skipped", L"overwritten", L"ms latency", L"ms max");
+        for (int r = 0; r < nReaders; ++r)
+        {
+            const LiveReader& reader = vReaders[r];
+            wprintf(L"%-8d %10u %10u %10u %12u %12.3f %12.3f\n", r, reader.dwHoldMs, reader.nRead, reader.nSkipped, reader.nOverwritten,
+                reader.nRead ? 1000. * reader.fLatency / reader.nRead : 0.0, 1000. * reader.fMaxLatency);
+        }
+
+        return 0;
+    }
+
+    /// <summary>
+    /// Stream synthetic frame sets at 1x, 2x and 4x real-time load over the loopback interface to
+    /// a receiver in this process, which writes them with overlapped I/O, and report what reaches
+    /// its disk and how long a frame takes from the slot to the acknowledgment of its write
+    /// </summary>
+    /// <param name="argc">number of arguments</param>
+    /// <param name="argv">receiver folder, (optional) seconds per run, (optional) queue depth and (optional) port</param>
+    /// <returns>0 on success, otherwise failure</returns>
+    int RunStreamBenchmark(int argc, LPWSTR* argv)
+    {
+        if (argc < 1)
+        {
+            wprintf(L"Usage: KinectV2Recorder /benchmark stream <folder> [seconds] [queue depth] [port]\n");
+            return 1;
+        }
+
+        LPCWSTR szFolder = argv[0];
+        double fSeconds = (argc >= 2) ? max(1.0, _wtof(argv[1])) : 10.0;
+        int nQueueDepth = (argc >= 3) ? max(1, min(3 * cBufferSize, _wtoi(argv[2]))) : 16;
+        USHORT nPort = (argc >= 4) ? static_cast<USHORT>(_wtoi(argv[3])) : FrameStreamDefaultPort;
+
+        CreateDirectoryW(szFolder, NULL);
+        FrameReceiver receiver(szFolder, WriterMode_Overlapped, 32, 256ull << 20);
+        HRESULT hr = receiver.Listen(L"127.0.0.1", nPort);
+        if (FAILED(hr))
+        {
+            wprintf(L"Cannot listen on port %u (0x%08x)\n", nPort, hr);
+            return 1;
+        }
+        std::thread tReceiver(&FrameReceiver::Run, &receiver);
+
+        WCHAR szStreamTo[64];
+        StringCchPrintfW(szStreamTo, _countof(szStreamTo), L"127.0.0.1:%u", nPort);
+
+        SyntheticStream streams[3];
+        CreateSyntheticStreams(streams);
+
+        const int nLoads[] = { 1, 2, 4 };
+
+        wprintf(L"%.0f s per run to %s, queue depth %d, %d slots per stream\n", fSeconds, szStreamTo, nQueueDepth, cBufferSize);
+        wprintf(L"%6s %10s %10s %10s %10s %10s %10s %10s\n", L"load", L"sets/s", L"MB/s", L"dropped", L"failed", L"mean ms", L"p99 ms", L"max ms");
+
+        int nResult = 0;
+        for (int l = 0; l < _countof(nLoads); ++l)
+        {
+            WCHAR szRunFolder[MAX_PATH];
+            StringCchPrintfW(szRunFolder, _countof(szRunFolder), L"stream_%dx", nLoads[l]);
+
+            LoadResult result = RunLoad(WriterMode_Network, szRunFolder, 30.0 * nLoads[l], fSeconds, nQueueDepth, streams, szStreamTo, szFolder);
+            wprintf(L"%5dx %10.1f %10.1f %10d %10d %10.2f %10.2f %10.2f\n", nLoads[l],
+                result.nWritten / 3. / result.fElapsed, result.cbWritten / 1048576. / result.fElapsed,
+                result.nDropped, result.nFailed,
+                result.fMeanLatency * 1000., result.fP99Latency * 1000., result.fMaxLatency * 1000.);
+
+            nResult |= result.nFailed ? 1 : 0;
+        }
+
+        receiver.Stop();
+        tReceiver.join();
+
+        FreeSyntheticStreams(streams);
+        return nResult;
+    }
+
+    /// Placement of the pipeline thread and its surroundings in a run of the thread benchmark
+    struct ThreadScenario
+    {
+        const WCHAR*        szName;
+        bool                bLoad;              // background load on the other threads
+        bool                bPinned;            // pipeline thread on the chosen core
+        bool                bIsolated;          // background load kept off the chosen core
+        int                 nPriority;          // priority of the pipeline thread
+    };
+
+    /// <summary>
+    /// Keep a core busy with arithmetic over a buffer larger than the caches until stopped
+    /// </summary>
+    /// <param name="nAffinity">cores to run on, 0 for any</param>
+    /// <param name="pbStop">set to stop</param>
+    void RunBackgroundLoad(DWORD_PTR nAffinity, const std::atomic<bool>* pbStop)
+    {
+        ThreadPlacement placement = { nAffinity, THREAD_PRIORITY_NORMAL };
+        DWORD_PTR nEffective = 0;
+        ApplyThreadPlacement(GetCurrentThread(), placement, &nEffective);
+
+        std::vector<UINT32> vBuffer(2 << 20);
+        for (UINT32 n = 1; !*pbStop; ++n)
+        {
+            for (size_t i = 0; i < vBuffer.size(); ++i)
+            {
+                vBuffer[i] = vBuffer[i] * 1664525u + 1013904223u + n;
+            }
+        }
+    }
+
+    /// <summary>
+    /// Run a pipeline thread which waits for frames signalled at 30 fps, like the sensor does, and
+    /// checksums each of them
+    /// </summary>
+    /// <param name="placement">placement of the pipeline thread</param>
+    /// <param name="pFrame">frame to process</param>
+    /// <param name="cbFrame">size (in bytes) of the frame</param>
+    /// <param name="nFrames">number of frames</param>
+    /// <param name="pvLatency">receives the times from each frame being due to being processed</param>
+    /// <param name="pnAffinity">receives the cores the pipeline thread ran on</param>
+    /// <returns>checksum of the frames</returns>
+    UINT32 RunPacedThread(const ThreadPlacement& placement, const BYTE* pFrame, DWORD cbFrame, int nFrames, std::vector<double>* pvLatency, DWORD_PTR* pnAffinity)
+    {
+        // Frames which come in while one is processed are counted, so none is lost
+        HANDLE hFrameSemaphore = CreateSemaphoreW(NULL, 0, nFrames, NULL);
+        std::vector<double> vDue(nFrames);
+
+        pvLatency->clear();
+        pvLatency->reserve(nFrames);
+        UINT32 nCrc = 0;
+        std::thread tPipeline([&]()
+        {
+            ApplyThreadPlacement(GetCurrentThread(), placement, pnAffinity);
+            for (int f = 0; f < nFrames; ++f)
+            {
+                WaitForSingleObject(hFrameSemaphore, INFINITE);
+                nCrc = ComputeCrc32c(pFrame, cbFrame, nCrc);
+                pvLatency->push_back(Now() - vDue[f]);
+            }
+        });
+
+        // The sensor sleeps until shortly before a frame is due and signals it on time
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+        double fStart = Now() + 0.1;
+        for (int f = 0; f < nFrames; ++f)
+        {
+            vDue[f] = fStart + f / 30.0;
+            while (Now() < vDue[f] - 0.002)
+            {
+                Sleep(1);
+            }
+            while (Now() < vDue[f])
+            {
+            }
+            ReleaseSemaphore(hFrameSemaphore, 1, NULL);
+        }
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_NORMAL);
+
+        tPipeline.join();
+        CloseHandle(hFrameSemaphore);
+        return nCrc;
+    }
+
+    /// <summary>
+    /// Process frames at 30 fps on a pipeline thread with and without background load on every
+    /// core, placed by default, at a higher priority, pinned to a core and isolated on it, and
+    /// report the time from a frame being due to being processed and its jitter
+    /// </summary>
+    /// <param name="argc">number of arguments</param>
+    /// <param name="argv">(optional) seconds per run, (optional) number of load threads and (optional) core of the pipeline thread</param>
+    /// <returns>0 on success, otherwise failure</returns>
+    int RunThreadBenchmark(int argc, LPWSTR* argv)
+    {
+        DWORD_PTR nProcessAffinity = 0;
+        DWORD_PTR nSystemAffinity = 0;
+        GetProcessAffinityMask(GetCurrentProcess(), &nProcessAffinity, &nSystemAffinity);
+        int nLastCore = 0;
+        for (int i = 0; i < static_cast<int>(sizeof(DWORD_PTR) * 8); ++i)
+        {
+            nLastCore = ((nProcessAffinity >> i) & 1) ? i : nLastCore;
+        }
+
+        double fSeconds = (argc >= 1) ? max(1.0, _wtof(argv[0])) : 10.0;
+        int nLoadThreads = (argc >= 2) ? max(1, _wtoi(argv[1])) : max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        int nCore = (argc >= 3) ? _wtoi(argv[2]) : nLastCore;
+        DWORD_PTR nCoreAffinity = (nCore >= 0 && nCore < static_cast<int>(sizeof(DWORD_PTR) * 8)) ? (static_cast<DWORD_PTR>(1) << nCore) & nProcessAffinity : 0;
+        if (!nCoreAffinity || nCoreAffinity == nProcessAffinity)
+        {
+            wprintf(L"Core %d is not one of several cores of the process\n", nCore);
+            return 1;
+        }
+
+        SyntheticStream streams[3];
+        CreateSyntheticStreams(streams);
+        int nFrames = static_cast<int>(30 * fSeconds);
+
+        const ThreadScenario scenarios[] =
+        {
+            { L"idle", false, false, false, THREAD_PRIORITY_NORMAL },
+            { L"loaded", true, false, false, THREAD_PRIORITY_NORMAL },
+            { L"priority", true, false, false, THREAD_PRIORITY_HIGHEST },
+            { L"pinned", true, true, false, THREAD_PRIORITY_NORMAL },
+            { L"isolated", true, true, true, THREAD_PRIORITY_NORMAL },
+            { L"isolated+prio", true, true, true, THREAD_PRIORITY_HIGHEST }
+        };
+
+        // Sleep(1) of the sensor needs the 1 ms timer resolution
+        timeBeginPeriod(1);
+        wprintf(L"%.0f s per run, %d load threads, color frame checksummed at 30 fps, pinned to core %d\n", fSeconds, nLoadThreads, nCore);
+        UINT32 nChecksum = 0;
+        wprintf(L"%-14s %10s %10s %10s %10s %10s %10s %10s\n", L"scenario", L"cores", L"priority", L"mean ms", L"jitter ms", L"p99 ms", L"max ms", L"late");
+
+        for (int c = 0; c < _countof(scenarios); ++c)
+        {
+            const ThreadScenario& scenario = scenarios[c];
+            std::atomic<bool> bStop;
+            bStop = false;
+            std::vector<std::thread> vLoad;
+            for (int i = 0; scenario.bLoad && i < nLoadThreads; ++i)
+            {
+                vLoad.push_back(std::thread(RunBackgroundLoad, scenario.bIsolated ? (nProcessAffinity & ~nCoreAffinity) : 0, &bStop));
+            }
+
+            ThreadPlacement placement = { scenario.bPinned ? nCoreAffinity : 0, scenario.nPriority };
+            std::vector<double> vLatency;
+            DWORD_PTR nAffinity = 0;
+            nChecksum ^= RunPacedThread(placement, streams[2].pSlot + streams[2].cbHeader, streams[2].cbFrame - streams[2].cbHeader, nFrames, &vLatency, &nAffinity);
+
+            bStop = true;
+            for (size_t i = 0; i < vLoad.size(); ++i)
+            {
+                vLoad[i].join();
+            }
+
+            // Jitter is the standard deviation of the latency, late frames are not done before the next one is due
+            double fMean = 0.0;
+            double fVariance = 0.0;
+            int nLate = 0;
+            for (size_t i = 0; i < vLatency.size(); ++i)
+            {
+                fMean += vLatency[i];
+                nLate += (vLatency[i] > 1.0 / 30.0) ? 1 : 0;
+            }
+            fMean /= max(1, static_cast<int>(vLatency.size()));
+            for (size_t i = 0; i < vLatency.size(); ++i)
+            {
+                fVariance += (vLatency[i] - fMean) * (vLatency[i] - fMean);
+            }
+            fVariance /= max(1, static_cast<int>(vLatency.size()));
+            std::sort(vLatency.begin(), vLatency.end());
+            size_t nP99 = vLatency.size() * 99 / 100;
+
+            WCHAR szCores[128];
+            FormatCoreList(nAffinity, szCores, _countof(szCores));
+            wprintf(L"%-14s %10s %10s %10.2f %10.2f %10.2f %10.2f %10d\n", scenario.szName, szCores, GetThreadPriorityName(scenario.nPriority),
+                fMean * 1000., sqrt(fVariance) * 1000., vLatency[min(vLatency.size() - 1, nP99)] * 1000., vLatency.back() * 1000., nLate);
+        }
+        timeEndPeriod(1);
+        wprintf(L"(checksum %08x)\n", nChecksum);
+
+        FreeSyntheticStreams(streams);
+        return 0;
+    }
+
+    /// <summary>
+    /// Placement and timing of the color slots of one slab
+    /// </summary>
+    struct SlabRun
+    {
+        FrameSlabStats      stats;
+        double              fFill;
+        double              fChecksum;
+        UINT32              nChecksum;
+        HRESULT             hr;
+    };
+
+    /// <summary>
+    /// Allocate a slab of color slots and fill and checksum its slots round robin, as the
+    /// capture and save threads do
+    /// </summary>
+    /// <param name="stream">synthetic color frame</param>
+    /// <param name="nNode">preferred node of the slab, FrameSlabAnyNode for none</param>
+    /// <param name="bLargePages">back the slab by large pages</param>
+    /// <param name="nFrames">number of frames</param>
+    /// <param name="pRun">receives the placement and the time</param>
+    void RunSlab(const SyntheticStream& stream, DWORD nNode, bool bLargePages, int nFrames, SlabRun* pRun)
+    {
+        FrameSlab slab;
+        pRun->hr = slab.Create(cBufferSize, GetFrameSlotSize(stream.cbFrame), nNode, bLargePages);
+        pRun->fFill = 0.;
+        pRun->fChecksum = 0.;
+        pRun->nChecksum = 0;
+        slab.GetStats(&pRun->stats);
+        if (FAILED(pRun->hr))
+        {
+            return;
+        }
+
+        for (int f = 0; f < nFrames; ++f)
+        {
+            BYTE* pSlot = slab.GetSlot(f % cBufferSize);
+            double fStart = Now();
+            memcpy(pSlot, stream.pSlot, stream.cbFrame);
+            double fFilled = Now();
+            pRun->nChecksum ^= ComputeCrc32c(pSlot + stream.cbHeader, stream.cbFrame - stream.cbHeader);
+            pRun->fFill += fFilled - fStart;
+            pRun->fChecksum += Now() - fFilled;
+        }
+    }
+
+    /// <summary>
+    /// Fill and checksum color frames in slabs on each NUMA node, with small and large pages, on
+    /// a thread pinned to node 0, and report where the pages landed and the time per frame
+    /// </summary>
+    /// <param name="argc">number of arguments</param>
+    /// <param name="argv">(optional) number of frames</param>
+    /// <returns>0 on success, otherwise failure</returns>
+    int RunSlabBenchmark(int argc, LPWSTR* argv)
+    {
+        int nFrames = (argc >= 1) ? max(1, _wtoi(argv[0])) : 300;
+        DWORD nNodes = GetNodeCount();
+
+        // The slabs are filled from node 0 (the cores of the process on it), so slabs on the other
+        // nodes are remote and those without a node go wherever the thread first touches them
+        DWORD_PTR nProcessAffinity = 0;
+        DWORD_PTR nSystemAffinity = 0;
+        ULONGLONG nNodeAffinity = 0;
+        GetProcessAffinityMask(GetCurrentProcess(), &nProcessAffinity, &nSystemAffinity);
+        GetNumaNodeProcessorMask(0, &nNodeAffinity);
+        ThreadPlacement placement = { static_cast<DWORD_PTR>(nNodeAffinity) & nProcessAffinity, THREAD_PRIORITY_NORMAL };
+
+        SyntheticStream streams[3];
+        CreateSyntheticStreams(streams);
+        double fFrameMB = streams[2].cbFrame / (1024. * 1024.);
+
+        std::vector<DWORD> vNodes(1, FrameSlabAnyNode);
+        for (DWORD i = 0; i < nNodes; ++i)
+        {
+            vNodes.push_back(i);
+        }
+        std::vector<SlabRun> vRuns(vNodes.size() * 2);
+        DWORD_PTR nAffinity = 0;
+        std::thread tSlabs([&]()
+        {
+            ApplyThreadPlacement(GetCurrentThread(), placement, &nAffinity);
+            for (size_t i = 0; i < vRuns.size(); ++i)
+            {
+                RunSlab(streams[2], vNodes[i / 2], 1 == i % 2, nFrames, &vRuns[i]);
+            }
+        });
+        tSlabs.join();
+
+        WCHAR szCores[128];
+        FormatCoreList(nAffinity, szCores, _countof(szCores));
+        wprintf(L"%d color frames of %.2f MB in %d slots, %u nodes, large pages of %u KB, filled on cores %s\n",
+            nFrames, fFrameMB, cBufferSize, nNodes, static_cast<UINT>(GetLargePageMinimum() / 1024), szCores);
+        wprintf(L"%-8s %8s %8s %16s %10s %10s %10s %10s\n", L"node", L"pages", L"large", L"pages per node", L"fill ms", L"fill MB/s", L"crc ms", L"crc MB/s");
+
+        UINT32 nChecksum = 0;
+        int nResult = 0;
+        for (size_t i = 0; i < vRuns.size(); ++i)
+        {
+            const SlabRun& run = vRuns[i];
+            WCHAR szNode[16];
+            if (FrameSlabAnyNode == vNodes[i / 2])
+            {
+                StringCchCopyW(szNode, _countof(szNode), L"any");
+            }
+            else
+            {
+                StringCchPrintfW(szNode, _countof(szNode), L"%u", vNodes[i / 2]);
+            }
+            if (FAILED(run.hr))
+            {
+                wprintf(L"%-8s %8s Failed to allocate the slab (0x%08x)\n", szNode, 1 == i % 2 ? L"large" : L"small", run.hr);
+                nResult = 1;
+                continue;
+            }
+
+            // Large pages which could not be locked fall back to small ones, as in the recorder
+            WCHAR szPages[128];
+            FormatSlabPages(run.stats, szPages, _countof(szPages));
+            nChecksum ^= run.nChecksum;
+            wprintf(L"%-8s %8s %8s %16s %10.3f %10.1f %10.3f %10.1f\n", szNode, 1 == i % 2 ? L"large" : L"small", run.stats.bLargePages ? L"yes" : L"no", szPages,
+                1000. * run.fFill / nFrames, fFrameMB * nFrames / run.fFill, 1000. * run.fChecksum / nFrames, fFrameMB * nFrames / run.fChecksum);
+        }
+        wprintf(L"(checksum %08x)\n", nChecksum);
+
+        FreeSyntheticStreams(streams);
+        return nResult;
+    }
+}
+
+/// <summary>
+/// Run the benchmark named by the first argument
+/// </summary>
+/// <param name="argc">number of arguments</param>
+/// <param name="argv">benchmark name followed by its arguments</param>
+/// <returns>0 on success, otherwise failure</returns>
+int RunBenchmark(int argc, LPWSTR* argv)
+{
+    if (argc >= 1 && 0 == _wcsicmp(argv[0], L"writer"))
+    {
+        return RunWriterBenchmark(argc - 1, argv + 1);
+    }
+
+    if (argc >= 1 && 0 == _wcsicmp(argv[0], L"load"))
+    {
+        return RunLoadBenchmark(argc - 1, argv + 1);
+    }
+
+    if (argc >= 1 && 0 == _wcsicmp(argv[0], L"stripe"))
+    {
+        return RunStripeBenchmark(argc - 1, argv + 1);
+    }
+
+    if (argc >= 1 && 0 == _wcsicmp(argv[0], L"replay"))
+    {
+        return RunReplayBenchmark(argc - 1, argv + 1);
+    }
+
+    if (argc >= 1 && 0 == _wcsicmp(argv[0], L"checksum"))
+    {
+        return RunChecksumBenchmark(argc - 1, argv + 1);
+    }
+
+    if (argc >= 1 && 0 == _wcsicmp(argv[0], L"pointcloud"))
+    {
+        return RunPointCloudBenchmark(argc - 1, argv + 1);
+    }
+
+    if (argc >= 1 && 0 == _wcsicmp(argv[0], L"registration"))
+    {
+        return RunRegistrationBenchmark(argc - 1, argv + 1);
+    }
+
+    if (argc >= 1 && 0 == _wcsicmp(argv[0], L"pack"))
+    {
+        return RunPackingBenchmark(argc - 1, argv + 1);
+    }
+
+    if (argc >= 1 && 0 == _wcsicmp(argv[0], L"delta"))
+    {
+        return RunDeltaBenchmark(argc - 1, argv + 1);
+    }
+
+    if (argc >= 1 && 0 == _wcsicmp(argv[0], L"color"))
+    {
+        return RunColorBenchmark(argc - 1, argv + 1);
+    }
+
+    if (argc >= 1 && 0 == _wcsicmp(argv[0], L"dedup"))
+    {
+        return RunDedupBenchmark(argc - 1, argv + 1);
+    }
+
+    if (argc >= 1 && 0 == _wcsicmp(argv[0], L"publish"))
+    {
+        return RunPublishBenchmark(argc - 1, argv + 1);
+    }
+
+    if (argc >= 1 && 0 == _wcsicmp(argv[0], L"stream"))
+    {
+        return RunStreamBenchmark(argc - 1, argv + 1);
+    }
+
+    if (argc >= 1 && 0 == _wcsicmp(argv[0], L"threads"))
+    {
+        return RunThreadBenchmark(argc - 1, argv + 1);
+    }
+
+    if (argc >= 1 && 0 == _wcsicmp(argv[0], L"slab"))
+    {
+        return RunSlabBenchmark(argc - 1, argv + 1);
+    }
+
+    wprintf(L"Unknown benchmark: %s\n", argc >= 1 ? argv[0] : L"");
+    return 1;
+}
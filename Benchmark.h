@@ -0,0 +1,18 @@
+// Benchmark.h
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Benchmarks of the record pipeline driven by synthetic frames (no sensor needed)
+
+
+#pragma once
+
+#include <windows.h>
+
+/// <summary>
+/// Run the benchmark named by the first argument
+/// </summary>
+/// <param name="argc">number of arguments</param>
+/// <param name="argv">benchmark name followed by its arguments</param>
+/// <returns>0 on success, otherwise failure</returns>
+int RunBenchmark(int argc, LPWSTR* argv);
@@ -0,0 +1,877 @@
+// ColorEncoder.cpp
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Encoding of color frames to QOI, PNG or JPEG images, on a pool of worker threads
+
+
+#include "stdafx.h"
+#include <wincodec.h>
+#include "ColorEncoder.h"
+#include "FrameWriter.h"
+#include "ThreadPlacement.h"
+
+#pragma comment (lib, "windowscodecs.lib")
+
+// QOI chunks (see qoiformat.org), of which the recorder writes all but QOI_OP_RGBA
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xC0
+#define QOI_OP_RGB 0xFE
+#define QOI_OP_RGBA 0xFF
+#define QOI_MASK_2 0xC0
+#define QOI_HEADER_SIZE 14
+#define QOI_PADDING_SIZE 8
+
+/// <summary>
+/// Find a codec by its name
+/// </summary>
+/// <param name="szName">"none", "qoi", "png" or "jpeg"</param>
+/// <returns>codec, ColorCodec_None if the name is unknown</returns>
+ColorCodec ParseColorCodec(LPCWSTR szName)
+{
+    if (0 == _wcsicmp(szName, L"qoi"))
+    {
+        return ColorCodec_Qoi;
+    }
+    if (0 == _wcsicmp(szName, L"png"))
+    {
+        return ColorCodec_Png;
+    }
+    if (0 == _wcsicmp(szName, L"jpeg") || 0 == _wcsicmp(szName, L"jpg"))
+    {
+        return ColorCodec_Jpeg;
+    }
+    return ColorCodec_None;
+}
+
+/// <summary>
+/// Get the name of a codec
+/// </summary>
+/// <param name="nCodec">codec</param>
+/// <returns>name, as taken by ParseColorCodec</returns>
+LPCWSTR GetColorCodecName(ColorCodec nCodec)
+{
+    switch (nCodec)
+    {
+    case ColorCodec_Qoi:    return L"qoi";
+    case ColorCodec_Png:    return L"png";
+    case ColorCodec_Jpeg:   return L"jpeg";
+    default:                return L"none";
+    }
+}
+
+/// <summary>
+/// Get the file extension of the images of a codec
+/// </summary>
+/// <param name="nCodec">codec other than ColorCodec_None</param>
+/// <returns>extension without the dot</returns>
+LPCWSTR GetColorCodecExtension(ColorCodec nCodec)
+{
+    switch (nCodec)
+    {
+    case ColorCodec_Qoi:    return L"qoi";
+    case ColorCodec_Png:    return L"png";
+    default:                return L"jpg";
+    }
+}
+
+/// <summary>
+/// Read a big-endian number
+/// </summary>
+/// <param name="p">first byte</param>
+/// <param name="cbNumber">size (in bytes) of the number, up to 4</param>
+/// <returns>number</returns>
+static inline UINT32 ReadBigEndian(const BYTE* p, int cbNumber)
+{
+    UINT32 nValue = 0;
+    for (int i = 0; i < cbNumber; ++i)
+    {
+        nValue = (nValue << 8) | p[i];
+    }
+    return nValue;
+}
+
+/// <summary>
+/// Find the codec and the size of an encoded image from its header
+/// </summary>
+/// <param name="pFile">start of the file</param>
+/// <param name="cbFile">size (in bytes) of pFile</param>
+/// <param name="pnCodec">receives the codec</param>
+/// <param name="pnWidth">receives the width (in pixels) of the image</param>
+/// <param name="pnHeight">receives the height (in pixels) of the image</param>
+/// <returns>S_OK, S_FALSE if the file is no encoded image, otherwise failure</returns>
+HRESULT ParseColorImageHeader(const BYTE* pFile, size_t cbFile, ColorCodec* pnCodec, UINT32* pnWidth, UINT32* pnHeight)
+{
+    static const BYTE cPngSignature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+    if (cbFile >= 4 && 0 == memcmp(pFile, "qoif", 4))
+    {
+        // QOI: magic, width, height, channels and color space
+        if (cbFile < QOI_HEADER_SIZE)
+        {
+            return E_FAIL;
+        }
+        *pnCodec = ColorCodec_Qoi;
+        *pnWidth = ReadBigEndian(pFile + 4, 4);
+        *pnHeight = ReadBigEndian(pFile + 8, 4);
+        return S_OK;
+    }
+
+    if (cbFile >= sizeof(cPngSignature) && 0 == memcmp(pFile, cPngSignature, sizeof(cPngSignature)))
+    {
+        // PNG: signature, then the IHDR chunk with width and height first
+        if (cbFile < 24 || 0 != memcmp(pFile + 12, "IHDR", 4))
+        {
+            return E_FAIL;
+        }
+        *pnCodec = ColorCodec_Png;
+        *pnWidth = ReadBigEndian(pFile + 16, 4);
+        *pnHeight = ReadBigEndian(pFile + 20, 4);
+        return S_OK;
+    }
+
+    if (cbFile >= 2 && 0xFF == pFile[0] && 0xD8 == pFile[1])
+    {
+        // JPEG: the segments in front of the image data, up to the frame header (SOFn, which
+        // are the markers 0xC0 to 0xCF other than DHT, JPG and DAC)
+        size_t nPosition = 2;
+        while (nPosition + 4 <= cbFile && 0xFF == pFile[nPosition])
+        {
+            BYTE nMarker = pFile[nPosition + 1];
+            if (0xFF == nMarker)
+            {
+                ++nPosition;
+                continue;
+            }
+            if (nMarker >= 0xC0 && nMarker <= 0xCF && 0xC4 != nMarker && 0xC8 != nMarker && 0xCC != nMarker)
+            {
+                if (nPosition + 9 > cbFile)
+                {
+                    break;
+                }
+                *pnCodec = ColorCodec_Jpeg;
+                *pnHeight = ReadBigEndian(pFile + nPosition + 5, 2);
+                *pnWidth = ReadBigEndian(pFile + nPosition + 7, 2);
+                return S_OK;
+            }
+            nPosition += 2 + ReadBigEndian(pFile + nPosition + 2, 2);
+        }
+        return E_FAIL;
+    }
+
+    return S_FALSE;
+}
+
+/// <summary>
+/// Hash of a pixel into the QOI index of recently seen pixels, all of them opaque
+/// </summary>
+/// <param name="nRed">red</param>
+/// <param name="nGreen">green</param>
+/// <param name="nBlue">blue</param>
+/// <returns>position in the index</returns>
+static inline UINT32 QoiHash(BYTE nRed, BYTE nGreen, BYTE nBlue)
+{
+    return (nRed * 3 + nGreen * 5 + nBlue * 7 + 255 * 11) % 64;
+}
+
+/// <summary>
+/// Encode a frame as QOI with 3 channels
+/// </summary>
+/// <param name="pFrame">frame, top-down</param>
+/// <param name="nWidth">width (in pixels) of the frame</param>
+/// <param name="nHeight">height (in pixels) of the frame</param>
+/// <param name="bRedFirst">whether the pixels are red first</param>
+/// <param name="pDest">receives the image, at most GetColorEncodedBound(nWidth * nHeight) bytes</param>
+/// <returns>size (in bytes) of the image</returns>
+static DWORD EncodeQoi(const RGBTRIPLE* pFrame, UINT32 nWidth, UINT32 nHeight, bool bRedFirst, BYTE* pDest)
+{
+    static const BYTE cPadding[QOI_PADDING_SIZE] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+    BYTE* p = pDest;
+    memcpy(p, "qoif", 4);
+    for (int i = 0; i < 4; ++i)
+    {
+        p[4 + i] = static_cast<BYTE>(nWidth >> (24 - 8 * i));
+        p[8 + i] = static_cast<BYTE>(nHeight >> (24 - 8 * i));
+    }
+    p[12] = 3;
+    p[13] = 0;
+    p += QOI_HEADER_SIZE;
+
+    // Pixels are compared as red, green and blue in one value, the index starts out transparent
+    UINT32 nIndex[64] = { 0 };
+    const BYTE* pPixel = reinterpret_cast<const BYTE*>(pFrame);
+    const BYTE* pEnd = pPixel + nWidth * nHeight * sizeof(RGBTRIPLE);
+    const int nRedOffset = bRedFirst ? 0 : 2;
+    const int nBlueOffset = 2 - nRedOffset;
+    BYTE nPreviousRed = 0;
+    BYTE nPreviousGreen = 0;
+    BYTE nPreviousBlue = 0;
+    UINT32 nPrevious = 0xFF000000;
+    UINT32 nRun = 0;
+
+    for (; pPixel < pEnd; pPixel += sizeof(RGBTRIPLE))
+    {
+        BYTE nRed = pPixel[nRedOffset];
+        BYTE nGreen = pPixel[1];
+        BYTE nBlue = pPixel[nBlueOffset];
+        UINT32 nValue = nRed | (nGreen << 8) | (nBlue << 16) | 0xFF000000;
+
+        if (nValue == nPrevious)
+        {
+            if (62 == ++nRun)
+            {
+                *p++ = QOI_OP_RUN | 61;
+                nRun = 0;
+            }
+            continue;
+        }
+        if (nRun)
+        {
+            *p++ = static_cast<BYTE>(QOI_OP_RUN | (nRun - 1));
+            nRun = 0;
+        }
+
+        UINT32 nHash = QoiHash(nRed, nGreen, nBlue);
+        if (nIndex[nHash] == nValue)
+        {
+            *p++ = static_cast<BYTE>(QOI_OP_INDEX | nHash);
+        }
+        else
+        {
+            nIndex[nHash] = nValue;
+
+            // Differences wrap around, as the decoder adds them modulo 256
+            signed char nDiffRed = static_cast<signed char>(nRed - nPreviousRed);
+            signed char nDiffGreen = static_cast<signed char>(nGreen - nPreviousGreen);
+            signed char nDiffBlue = static_cast<signed char>(nBlue - nPreviousBlue);
+            signed char nRedToGreen = static_cast<signed char>(nDiffRed - nDiffGreen);
+            signed char nBlueToGreen = static_cast<signed char>(nDiffBlue - nDiffGreen);
+
+            if (nDiffRed >= -2 && nDiffRed <= 1 && nDiffGreen >= -2 && nDiffGreen <= 1 && nDiffBlue >= -2 && nDiffBlue <= 1)
+            {
+                *p++ = static_cast<BYTE>(QOI_OP_DIFF | ((nDiffRed + 2) << 4) | ((nDiffGreen + 2) << 2) | (nDiffBlue + 2));
+            }
+            else if (nRedToGreen >= -8 && nRedToGreen <= 7 && nDiffGreen >= -32 && nDiffGreen <= 31 && nBlueToGreen >= -8 && nBlueToGreen <= 7)
+            {
+                *p++ = static_cast<BYTE>(QOI_OP_LUMA | (nDiffGreen + 32));
+                *p++ = static_cast<BYTE>(((nRedToGreen + 8) << 4) | (nBlueToGreen + 8));
+            }
+            else
+            {
+                p[0] = QOI_OP_RGB;
+                p[1] = nRed;
+                p[2] = nGreen;
+                p[3] = nBlue;
+                p += 4;
+            }
+        }
+
+        nPreviousRed = nRed;
+        nPreviousGreen = nGreen;
+        nPreviousBlue = nBlue;
+        nPrevious = nValue;
+    }
+    if (nRun)
+    {
+        *p++ = static_cast<BYTE>(QOI_OP_RUN | (nRun - 1));
+    }
+
+    memcpy(p, cPadding, sizeof(cPadding));
+    p += sizeof(cPadding);
+    return static_cast<DWORD>(p - pDest);
+}
+
+/// <summary>
+/// Decode a QOI image
+/// </summary>
+/// <param name="pImage">the image file</param>
+/// <param name="cbImage">size (in bytes) of the image file</param>
+/// <param name="nWidth">width (in pixels) of the image</param>
+/// <param name="nHeight">height (in pixels) of the image</param>
+/// <param name="bRedFirst">whether the pixels are wanted red first</param>
+/// <param name="pDest">receives the frame, top-down</param>
+/// <returns>indicates success or failure</returns>
+static HRESULT DecodeQoi(const BYTE* pImage, DWORD cbImage, UINT32 nWidth, UINT32 nHeight, bool bRedFirst, RGBTRIPLE* pDest)
+{
+    if (cbImage < QOI_HEADER_SIZE + QOI_PADDING_SIZE || 0 != memcmp(pImage, "qoif", 4) ||
+        ReadBigEndian(pImage + 4, 4) != nWidth || ReadBigEndian(pImage + 8, 4) != nHeight)
+    {
+        return E_FAIL;
+    }
+
+    BYTE nIndex[64][4] = { { 0 } };
+    BYTE nPixel[4] = { 0, 0, 0, 255 };
+    const BYTE* p = pImage + QOI_HEADER_SIZE;
+    const BYTE* pChunksEnd = pImage + cbImage - QOI_PADDING_SIZE;
+    BYTE* pOut = reinterpret_cast<BYTE*>(pDest);
+    BYTE* pOutEnd = pOut + nWidth * nHeight * sizeof(RGBTRIPLE);
+    const int nRedOffset = bRedFirst ? 0 : 2;
+    const int nBlueOffset = 2 - nRedOffset;
+    UINT32 nRun = 0;
+
+    for (; pOut < pOutEnd; pOut += sizeof(RGBTRIPLE))
+    {
+        if (nRun)
+        {
+            --nRun;
+        }
+        else
+        {
+            if (p >= pChunksEnd)
+            {
+                return E_FAIL;
+            }
+
+            BYTE nChunk = *p++;
+            if (QOI_OP_RGB == nChunk || QOI_OP_RGBA == nChunk)
+            {
+                int cbValues = (QOI_OP_RGB == nChunk) ? 3 : 4;
+                if (pChunksEnd - p < cbValues)
+                {
+                    return E_FAIL;
+                }
+                memcpy(nPixel, p, cbValues);
+                p += cbValues;
+            }
+            else if (QOI_OP_INDEX == (nChunk & QOI_MASK_2))
+            {
+                memcpy(nPixel, nIndex[nChunk], 4);
+            }
+            else if (QOI_OP_DIFF == (nChunk & QOI_MASK_2))
+            {
+                nPixel[0] += ((nChunk >> 4) & 0x03) - 2;
+                nPixel[1] += ((nChunk >> 2) & 0x03) - 2;
+                nPixel[2] += (nChunk & 0x03) - 2;
+            }
+            else if (QOI_OP_LUMA == (nChunk & QOI_MASK_2))
+            {
+                if (p >= pChunksEnd)
+                {
+                    return E_FAIL;
+                }
+                BYTE nDiffs = *p++;
+                int nDiffGreen = (nChunk & 0x3F) - 32;
+                nPixel[0] += nDiffGreen - 8 + ((nDiffs >> 4) & 0x0F);
+                nPixel[1] += nDiffGreen;
+                nPixel[2] += nDiffGreen - 8 + (nDiffs & 0x0F);
+            }
+            else
+            {
+                nRun = nChunk & 0x3F;
+            }
+
+            memcpy(nIndex[(nPixel[0] * 3 + nPixel[1] * 5 + nPixel[2] * 7 + nPixel[3] * 11) % 64], nPixel, 4);
+        }
+
+        pOut[nRedOffset] = nPixel[0];
+        pOut[1] = nPixel[1];
+        pOut[nBlueOffset] = nPixel[2];
+    }
+
+    return S_OK;
+}
+
+/// <summary>
+/// Swap the red and the blue channel of a frame
+/// </summary>
+/// <param name="pSource">frame</param>
+/// <param name="nPixels">number of pixels</param>
+/// <param name="pDest">receives the frame, may be pSource</param>
+static void SwapRedBlue(const RGBTRIPLE* pSource, UINT32 nPixels, RGBTRIPLE* pDest)
+{
+    for (UINT32 i = 0; i < nPixels; ++i)
+    {
+        RGBTRIPLE pixel = pSource[i];
+        pDest[i].rgbtBlue = pixel.rgbtRed;
+        pDest[i].rgbtGreen = pixel.rgbtGreen;
+        pDest[i].rgbtRed = pixel.rgbtBlue;
+    }
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+ColorCoder::ColorCoder() :
+    m_pFactory(NULL),
+    m_bComInitialized(false)
+{
+}
+
+/// <summary>
+/// Destructor
+/// </summary>
+ColorCoder::~ColorCoder()
+{
+    SafeRelease(m_pFactory);
+    if (m_bComInitialized)
+    {
+        CoUninitialize();
+    }
+}
+
+/// <summary>
+/// Encode a frame
+/// </summary>
+/// <param name="encoding">codec and its parameters, other than ColorCodec_None</param>
+/// <param name="pFrame">frame, top-down</param>
+/// <param name="nWidth">width (in pixels) of the frame</param>
+/// <param name="nHeight">height (in pixels) of the frame</param>
+/// <param name="bRedFirst">whether the pixels are red first (as in PPM) or blue first (as in BMP)</param>
+/// <param name="pDest">receives the image</param>
+/// <param name="cbDest">size (in bytes) of pDest, at least GetColorEncodedBound(nWidth * nHeight)</param>
+/// <param name="pcbImage">receives the size (in bytes) of the image</param>
+/// <returns>indicates success or failure</returns>
+HRESULT ColorCoder::Encode(const ColorEncoding& encoding, const RGBTRIPLE* pFrame, UINT32 nWidth, UINT32 nHeight, bool bRedFirst, BYTE* pDest, DWORD cbDest, DWORD* pcbImage)
+{
+    if (cbDest < GetColorEncodedBound(nWidth * nHeight))
+    {
+        return E_INVALIDARG;
+    }
+
+    switch (encoding.nCodec)
+    {
+    case ColorCodec_Qoi:
+        *pcbImage = EncodeQoi(pFrame, nWidth, nHeight, bRedFirst, pDest);
+        return S_OK;
+
+    case ColorCodec_Png:
+    case ColorCodec_Jpeg:
+        return EncodeWic(encoding, pFrame, nWidth, nHeight, bRedFirst, pDest, cbDest, pcbImage);
+
+    default:
+        return E_INVALIDARG;
+    }
+}
+
+/// <summary>
+/// Decode an image
+/// </summary>
+/// <param name="nCodec">codec of the image</param>
+/// <param name="pImage">the image file</param>
+/// <param name="cbImage">size (in bytes) of the image file</param>
+/// <param name="nWidth">width (in pixels) of the image</param>
+/// <param name="nHeight">height (in pixels) of the image</param>
+/// <param name="bRedFirst">whether the pixels are wanted red first (as in PPM) or blue first (as in BMP)</param>
+/// <param name="pDest">receives the frame, top-down</param>
+/// <returns>indicates success or failure</returns>
+HRESULT ColorCoder::Decode(ColorCodec nCodec, const BYTE* pImage, DWORD cbImage, UINT32 nWidth, UINT32 nHeight, bool bRedFirst, RGBTRIPLE* pDest)
+{
+    switch (nCodec)
+    {
+    case ColorCodec_Qoi:
+        return DecodeQoi(pImage, cbImage, nWidth, nHeight, bRedFirst, pDest);
+
+    case ColorCodec_Png:
+    case ColorCodec_Jpeg:
+        return DecodeWic(pImage, cbImage, nWidth, nHeight, bRedFirst, pDest);
+
+    default:
+        return E_INVALIDARG;
+    }
+}
+
+/// <summary>
+/// Create the imaging factory on first use
+/// </summary>
+/// <returns>indicates success or failure</returns>
+HRESULT ColorCoder::CreateFactory()
+{
+    if (m_pFactory)
+    {
+        return S_OK;
+    }
+
+    // A thread which has entered a single-threaded apartment before stays in it
+    HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    m_bComInitialized = SUCCEEDED(hr);
+    if (RPC_E_CHANGED_MODE == hr)
+    {
+        hr = S_OK;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = CoCreateInstance(CLSID_WICImagingFactory, NULL, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&m_pFactory));
+    }
+
+    return hr;
+}
+
+/// <summary>
+/// Encode a frame with the Windows Imaging Component
+/// </summary>
+/// <param name="encoding">ColorCodec_Png or ColorCodec_Jpeg and its parameters</param>
+/// <param name="pFrame">frame, top-down</param>
+/// <param name="nWidth">width (in pixels) of the frame</param>
+/// <param name="nHeight">height (in pixels) of the frame</param>
+/// <param name="bRedFirst">whether the pixels are red first</param>
+/// <param name="pDest">receives the image</param>
+/// <param name="cbDest">size (in bytes) of pDest</param>
+/// <param name="pcbImage">receives the size (in bytes) of the image</param>
+/// <returns>indicates success or failure</returns>
+HRESULT ColorCoder::EncodeWic(const ColorEncoding& encoding, const RGBTRIPLE* pFrame, UINT32 nWidth, UINT32 nHeight, bool bRedFirst, BYTE* pDest, DWORD cbDest, DWORD* pcbImage)
+{
+    IWICStream* pStream = NULL;
+    IWICBitmapEncoder* pEncoder = NULL;
+    IWICBitmapFrameEncode* pFrameEncode = NULL;
+    IPropertyBag2* pOptions = NULL;
+    UINT32 nPixels = nWidth * nHeight;
+
+    // The encoders take the pixels blue first
+    const RGBTRIPLE* pPixels = pFrame;
+    if (bRedFirst)
+    {
+        m_vSwapped.resize(nPixels);
+        SwapRedBlue(pFrame, nPixels, m_vSwapped.data());
+        pPixels = m_vSwapped.data();
+    }
+
+    // The image is written straight into the destination, which is large enough for any frame
+    HRESULT hr = CreateFactory();
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pFactory->CreateStream(&pStream);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = pStream->InitializeFromMemory(pDest, cbDest);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pFactory->CreateEncoder((ColorCodec_Png == encoding.nCodec) ? GUID_ContainerFormatPng : GUID_ContainerFormatJpeg, NULL, &pEncoder);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = pEncoder->Initialize(pStream, WICBitmapEncoderNoCache);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = pEncoder->CreateNewFrame(&pFrameEncode, &pOptions);
+    }
+    if (SUCCEEDED(hr))
+    {
+        // JPEG at the quality of the stream. PNG with the sub filter only, which is several
+        // times faster than the adaptive filter and close to it on camera frames.
+        PROPBAG2 option = { 0 };
+        VARIANT value;
+        VariantInit(&value);
+        if (ColorCodec_Jpeg == encoding.nCodec)
+        {
+            option.pstrName = const_cast<LPOLESTR>(L"ImageQuality");
+            value.vt = VT_R4;
+            value.fltVal = encoding.nQuality / 100.f;
+        }
+        else
+        {
+            option.pstrName = const_cast<LPOLESTR>(L"FilterOption");
+            value.vt = VT_UI1;
+            value.bVal = WICPngFilterSub;
+        }
+        hr = pOptions->Write(1, &option, &value);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = pFrameEncode->Initialize(pOptions);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = pFrameEncode->SetSize(nWidth, nHeight);
+    }
+    WICPixelFormatGUID format = GUID_WICPixelFormat24bppBGR;
+    if (SUCCEEDED(hr))
+    {
+        hr = pFrameEncode->SetPixelFormat(&format);
+    }
+    if (SUCCEEDED(hr) && !IsEqualGUID(format, GUID_WICPixelFormat24bppBGR))
+    {
+        hr = E_FAIL;
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = pFrameEncode->WritePixels(nHeight, nWidth * sizeof(RGBTRIPLE), nPixels * sizeof(RGBTRIPLE), reinterpret_cast<BYTE*>(const_cast<RGBTRIPLE*>(pPixels)));
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = pFrameEncode->Commit();
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = pEncoder->Commit();
+    }
+    if (SUCCEEDED(hr))
+    {
+        LARGE_INTEGER nZero = { 0 };
+        ULARGE_INTEGER nPosition = { 0 };
+        hr = pStream->Seek(nZero, STREAM_SEEK_CUR, &nPosition);
+        *pcbImage = nPosition.LowPart;
+    }
+
+    SafeRelease(pOptions);
+    SafeRelease(pFrameEncode);
+    SafeRelease(pEncoder);
+    SafeRelease(pStream);
+    return hr;
+}
+
+/// <summary>
+/// Decode an image with the Windows Imaging Component
+/// </summary>
+/// <param name="pImage">the image file</param>
+/// <param name="cbImage">size (in bytes) of the image file</param>
+/// <param name="nWidth">width (in pixels) of the image</param>
+/// <param name="nHeight">height (in pixels) of the image</param>
+/// <param name="bRedFirst">whether the pixels are wanted red first</param>
+/// <param name="pDest">receives the frame, top-down</param>
+/// <returns>indicates success or failure</returns>
+HRESULT ColorCoder::DecodeWic(const BYTE* pImage, DWORD cbImage, UINT32 nWidth, UINT32 nHeight, bool bRedFirst, RGBTRIPLE* pDest)
+{
+    IWICStream* pStream = NULL;
+    IWICBitmapDecoder* pDecoder = NULL;
+    IWICBitmapFrameDecode* pFrameDecode = NULL;
+    IWICFormatConverter* pConverter = NULL;
+    UINT nImageWidth = 0;
+    UINT nImageHeight = 0;
+    UINT32 nPixels = nWidth * nHeight;
+
+    HRESULT hr = CreateFactory();
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pFactory->CreateStream(&pStream);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = pStream->InitializeFromMemory(const_cast<BYTE*>(pImage), cbImage);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pFactory->CreateDecoderFromStream(pStream, NULL, WICDecodeMetadataCacheOnDemand, &pDecoder);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = pDecoder->GetFrame(0, &pFrameDecode);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = pFrameDecode->GetSize(&nImageWidth, &nImageHeight);
+    }
+    if (SUCCEEDED(hr) && (nImageWidth != nWidth || nImageHeight != nHeight))
+    {
+        hr = E_FAIL;
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pFactory->CreateFormatConverter(&pConverter);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = pConverter->Initialize(pFrameDecode, GUID_WICPixelFormat24bppBGR, WICBitmapDitherTypeNone, NULL, 0., WICBitmapPaletteTypeCustom);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = pConverter->CopyPixels(NULL, nWidth * sizeof(RGBTRIPLE), nPixels * sizeof(RGBTRIPLE), reinterpret_cast<BYTE*>(pDest));
+    }
+    if (SUCCEEDED(hr) && bRedFirst)
+    {
+        SwapRedBlue(pDest, nPixels, pDest);
+    }
+
+    SafeRelease(pConverter);
+    SafeRelease(pFrameDecode);
+    SafeRelease(pDecoder);
+    SafeRelease(pStream);
+    return hr;
+}
+
+/// <summary>
+/// Constructor, starts the workers
+/// </summary>
+/// <param name="nThreads">number of encoder threads</param>
+ColorEncoderPool::ColorEncoderPool(UINT nThreads) :
+    m_bStop(false)
+{
+    nThreads = max(1u, min(static_cast<UINT>(ColorEncoderMaxThreads), nThreads));
+    for (UINT i = 0; i < nThreads; ++i)
+    {
+        m_vThreads.push_back(std::thread(&ColorEncoderPool::EncodeFrames, this));
+    }
+}
+
+/// <summary>
+/// Destructor, encodes the frames submitted and stops the workers
+/// </summary>
+ColorEncoderPool::~ColorEncoderPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mMutex);
+        m_bStop = true;
+    }
+    m_cvQueued.notify_all();
+    for (size_t i = 0; i < m_vThreads.size(); ++i)
+    {
+        m_vThreads[i].join();
+    }
+
+    for (size_t i = 0; i < m_vJobs.size(); ++i)
+    {
+        FreeFrameSlot(m_vJobs[i]->pImage);
+        delete m_vJobs[i];
+    }
+}
+
+/// <summary>
+/// Queue a frame to encode. The frame has to stay unchanged until it comes back from Collect.
+/// </summary>
+/// <param name="szFilePath">file path of the image, handed back with it</param>
+/// <param name="encoding">codec and its parameters</param>
+/// <param name="pFrame">frame, top-down</param>
+/// <param name="nWidth">width (in pixels) of the frame</param>
+/// <param name="nHeight">height (in pixels) of the frame</param>
+/// <param name="bRedFirst">whether the pixels are red first (as in PPM) or blue first (as in BMP)</param>
+/// <param name="nContext">context handed back with the image</param>
+/// <returns>indicates success or failure</returns>
+HRESULT ColorEncoderPool::Submit(LPCWSTR szFilePath, const ColorEncoding& encoding, const RGBTRIPLE* pFrame, UINT32 nWidth, UINT32 nHeight, bool bRedFirst, ULONG_PTR nContext)
+{
+    EncodeJob* pJob = NULL;
+    {
+        std::lock_guard<std::mutex> lock(m_mMutex);
+        for (size_t i = 0; i < m_vJobs.size() && !pJob; ++i)
+        {
+            if (JobState_Free == m_vJobs[i]->nState)
+            {
+                pJob = m_vJobs[i];
+            }
+        }
+        if (!pJob)
+        {
+            pJob = new EncodeJob();
+            pJob->nState = JobState_Free;
+            pJob->pImage = NULL;
+            pJob->cbCapacity = 0;
+            m_vJobs.push_back(pJob);
+        }
+    }
+
+    // A free job is only touched by the thread driving the pool. Its buffer grows to the
+    // largest frame, so that the image is written in one piece.
+    DWORD cbSlot = GetFrameSlotSize(GetColorEncodedBound(nWidth * nHeight));
+    if (pJob->cbCapacity < cbSlot)
+    {
+        FreeFrameSlot(pJob->pImage);
+        pJob->pImage = AllocateFrameSlot(cbSlot);
+        pJob->cbCapacity = pJob->pImage ? cbSlot : 0;
+        if (!pJob->pImage)
+        {
+            return E_OUTOFMEMORY;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mMutex);
+    pJob->sFilePath = szFilePath;
+    pJob->encoding = encoding;
+    pJob->pFrame = pFrame;
+    pJob->nWidth = nWidth;
+    pJob->nHeight = nHeight;
+    pJob->bRedFirst = bRedFirst;
+    pJob->nContext = nContext;
+    pJob->cbImage = 0;
+    pJob->hr = S_OK;
+    pJob->nState = JobState_Queued;
+    m_dQueued.push_back(pJob);
+    m_dOrder.push_back(pJob);
+    m_cvQueued.notify_one();
+    return S_OK;
+}
+
+/// <summary>
+/// Take the encoded frames which are next in order
+/// </summary>
+/// <param name="pFrames">receives the frames, valid until each is released</param>
+/// <param name="nMaxFrames">number of entries in pFrames</param>
+/// <returns>number of frames</returns>
+int ColorEncoderPool::Collect(ColorEncodedFrame* pFrames, int nMaxFrames)
+{
+    std::lock_guard<std::mutex> lock(m_mMutex);
+    int nFrames = 0;
+    while (nFrames < nMaxFrames && !m_dOrder.empty() && JobState_Done == m_dOrder.front()->nState)
+    {
+        EncodeJob* pJob = m_dOrder.front();
+        m_dOrder.pop_front();
+        pJob->nState = JobState_Collected;
+
+        pFrames[nFrames].szFilePath = pJob->sFilePath.c_str();
+        pFrames[nFrames].pImage = pJob->pImage;
+        pFrames[nFrames].cbImage = pJob->cbImage;
+        pFrames[nFrames].nContext = pJob->nContext;
+        pFrames[nFrames].hr = pJob->hr;
+        ++nFrames;
+    }
+    return nFrames;
+}
+
+/// <summary>
+/// Give the buffer of a collected frame back to the pool
+/// </summary>
+/// <param name="nContext">context of the frame</param>
+/// <returns>true if the context belongs to a collected frame</returns>
+bool ColorEncoderPool::Release(ULONG_PTR nContext)
+{
+    std::lock_guard<std::mutex> lock(m_mMutex);
+    for (size_t i = 0; i < m_vJobs.size(); ++i)
+    {
+        if (JobState_Collected == m_vJobs[i]->nState && nContext == m_vJobs[i]->nContext)
+        {
+            m_vJobs[i]->nState = JobState_Free;
+            return true;
+        }
+    }
+    return false;
+}
+
+/// <summary>
+/// Get the number of frames submitted but not collected yet
+/// </summary>
+/// <returns>number of frames</returns>
+int ColorEncoderPool::GetPendingCount()
+{
+    std::lock_guard<std::mutex> lock(m_mMutex);
+    return static_cast<int>(m_dOrder.size());
+}
+
+/// <summary>
+/// Encode queued frames until the pool is destroyed
+/// </summary>
+void ColorEncoderPool::EncodeFrames()
+{
+    HRESULT hrPlaced = PlaceThread(PipelineThread_Encoder);
+
+    // The coder is destroyed after the lock, on this thread
+    ColorCoder coder;
+    std::unique_lock<std::mutex> lock(m_mMutex);
+    for (;;)
+    {
+        while (m_dQueued.empty() && !m_bStop)
+        {
+            m_cvQueued.wait(lock);
+        }
+        if (m_dQueued.empty())
+        {
+            break;
+        }
+
+        EncodeJob* pJob = m_dQueued.front();
+        m_dQueued.pop_front();
+        pJob->nState = JobState_Encoding;
+
+        lock.unlock();
+        HRESULT hr = coder.Encode(pJob->encoding, pJob->pFrame, pJob->nWidth, pJob->nHeight, pJob->bRedFirst, pJob->pImage, pJob->cbCapacity, &pJob->cbImage);
+        lock.lock();
+
+        pJob->hr = hr;
+        pJob->nState = JobState_Done;
+    }
+
+    UnplaceThread(PipelineThread_Encoder, hrPlaced);
+}
@@ -0,0 +1,270 @@
+// ColorEncoder.h
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Encoding of color frames to QOI, PNG or JPEG images, on a pool of worker threads
+
+
+#pragma once
+
+#include <windows.h>
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+struct IWICImagingFactory;
+
+/// The ColorEncoderMaxThreads value specifies the largest number of encoder threads of a pool
+#define ColorEncoderMaxThreads 16
+
+/// Codecs of the color images. QOI is coded in-tree, PNG and JPEG by the Windows Imaging
+/// Component. The images are plain files of their format, red first as usual.
+enum ColorCodec
+{
+    ColorCodec_None = 0,                // PPM (or BMP with COLOR_BMP), not encoded
+    ColorCodec_Qoi,                     // lossless, fast
+    ColorCodec_Png,                     // lossless, smaller and slower
+    ColorCodec_Jpeg                     // lossy, at a quality of 1 to 100
+};
+
+/// Codec of a color stream and its parameters
+struct ColorEncoding
+{
+    ColorCodec              nCodec;
+    UINT32                  nQuality;           // JPEG quality (1 to 100)
+};
+
+/// <summary>
+/// Find a codec by its name
+/// </summary>
+/// <param name="szName">"none", "qoi", "png" or "jpeg"</param>
+/// <returns>codec, ColorCodec_None if the name is unknown</returns>
+ColorCodec ParseColorCodec(LPCWSTR szName);
+
+/// <summary>
+/// Get the name of a codec
+/// </summary>
+/// <param name="nCodec">codec</param>
+/// <returns>name, as taken by ParseColorCodec</returns>
+LPCWSTR GetColorCodecName(ColorCodec nCodec);
+
+/// <summary>
+/// Get the file extension of the images of a codec
+/// </summary>
+/// <param name="nCodec">codec other than ColorCodec_None</param>
+/// <returns>extension without the dot</returns>
+LPCWSTR GetColorCodecExtension(ColorCodec nCodec);
+
+/// <summary>
+/// Get the size of a buffer which holds any encoded image
+/// </summary>
+/// <param name="nPixels">number of pixels</param>
+/// <returns>size (in bytes) of the buffer</returns>
+inline DWORD GetColorEncodedBound(UINT32 nPixels)
+{
+    // QOI needs up to 4 bytes for a pixel, PNG and JPEG less for a camera frame
+    return nPixels * 4 + 4096;
+}
+
+/// <summary>
+/// Find the codec and the size of an encoded image from its header
+/// </summary>
+/// <param name="pFile">start of the file</param>
+/// <param name="cbFile">size (in bytes) of pFile</param>
+/// <param name="pnCodec">receives the codec</param>
+/// <param name="pnWidth">receives the width (in pixels) of the image</param>
+/// <param name="pnHeight">receives the height (in pixels) of the image</param>
+/// <returns>S_OK, S_FALSE if the file is no encoded image, otherwise failure</returns>
+HRESULT ParseColorImageHeader(const BYTE* pFile, size_t cbFile, ColorCodec* pnCodec, UINT32* pnWidth, UINT32* pnHeight);
+
+/// Encodes and decodes color frames on one thread. The Windows Imaging Component is set up on
+/// first use, with COM for the thread, so a coder has to be destroyed by the thread using it.
+class ColorCoder
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    ColorCoder();
+
+    /// <summary>
+    /// Destructor
+    /// </summary>
+    ~ColorCoder();
+
+    /// <summary>
+    /// Encode a frame
+    /// </summary>
+    /// <param name="encoding">codec and its parameters, other than ColorCodec_None</param>
+    /// <param name="pFrame">frame, top-down</param>
+    /// <param name="nWidth">width (in pixels) of the frame</param>
+    /// <param name="nHeight">height (in pixels) of the frame</param>
+    /// <param name="bRedFirst">whether the pixels are red first (as in PPM) or blue first (as in BMP)</param>
+    /// <param name="pDest">receives the image</param>
+    /// <param name="cbDest">size (in bytes) of pDest, at least GetColorEncodedBound(nWidth * nHeight)</param>
+    /// <param name="pcbImage">receives the size (in bytes) of the image</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 Encode(const ColorEncoding& encoding, const RGBTRIPLE* pFrame, UINT32 nWidth, UINT32 nHeight, bool bRedFirst, BYTE* pDest, DWORD cbDest, DWORD* pcbImage);
+
+    /// <summary>
+    /// Decode an image
+    /// </summary>
+    /// <param name="nCodec">codec of the image</param>
+    /// <param name="pImage">the image file</param>
+    /// <param name="cbImage">size (in bytes) of the image file</param>
+    /// <param name="nWidth">width (in pixels) of the image</param>
+    /// <param name="nHeight">height (in pixels) of the image</param>
+    /// <param name="bRedFirst">whether the pixels are wanted red first (as in PPM) or blue first (as in BMP)</param>
+    /// <param name="pDest">receives the frame, top-down</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 Decode(ColorCodec nCodec, const BYTE* pImage, DWORD cbImage, UINT32 nWidth, UINT32 nHeight, bool bRedFirst, RGBTRIPLE* pDest);
+
+private:
+    IWICImagingFactory*     m_pFactory;
+    bool                    m_bComInitialized;
+    std::vector<RGBTRIPLE>  m_vSwapped;         // blue first copy of a red first frame for WIC
+
+    /// <summary>
+    /// Create the imaging factory on first use
+    /// </summary>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 CreateFactory();
+
+    /// <summary>
+    /// Encode a frame with the Windows Imaging Component
+    /// </summary>
+    /// <param name="encoding">ColorCodec_Png or ColorCodec_Jpeg and its parameters</param>
+    /// <param name="pFrame">frame, top-down</param>
+    /// <param name="nWidth">width (in pixels) of the frame</param>
+    /// <param name="nHeight">height (in pixels) of the frame</param>
+    /// <param name="bRedFirst">whether the pixels are red first</param>
+    /// <param name="pDest">receives the image</param>
+    /// <param name="cbDest">size (in bytes) of pDest</param>
+    /// <param name="pcbImage">receives the size (in bytes) of the image</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 EncodeWic(const ColorEncoding& encoding, const RGBTRIPLE* pFrame, UINT32 nWidth, UINT32 nHeight, bool bRedFirst, BYTE* pDest, DWORD cbDest, DWORD* pcbImage);
+
+    /// <summary>
+    /// Decode an image with the Windows Imaging Component
+    /// </summary>
+    /// <param name="pImage">the image file</param>
+    /// <param name="cbImage">size (in bytes) of the image file</param>
+    /// <param name="nWidth">width (in pixels) of the image</param>
+    /// <param name="nHeight">height (in pixels) of the image</param>
+    /// <param name="bRedFirst">whether the pixels are wanted red first</param>
+    /// <param name="pDest">receives the frame, top-down</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 DecodeWic(const BYTE* pImage, DWORD cbImage, UINT32 nWidth, UINT32 nHeight, bool bRedFirst, RGBTRIPLE* pDest);
+};
+
+/// A frame encoded by the pool, handed back in the order the frames were submitted
+struct ColorEncodedFrame
+{
+    LPCWSTR                 szFilePath;
+    const BYTE*             pImage;             // sector aligned, held until the frame is released
+    DWORD                   cbImage;
+    ULONG_PTR               nContext;
+    HRESULT                 hr;                 // result of the encoding
+};
+
+/// Encodes color frames on a pool of worker threads, several frames at a time. The frames come
+/// back in the order they were submitted, in sector aligned buffers which the pool holds until
+/// they are written. The pool is driven by a single thread (the save thread of the recorder).
+class ColorEncoderPool
+{
+public:
+    /// <summary>
+    /// Constructor, starts the workers
+    /// </summary>
+    /// <param name="nThreads">number of encoder threads</param>
+    ColorEncoderPool(UINT nThreads);
+
+    /// <summary>
+    /// Destructor, encodes the frames submitted and stops the workers
+    /// </summary>
+    ~ColorEncoderPool();
+
+    /// <summary>
+    /// Queue a frame to encode. The frame has to stay unchanged until it comes back from Collect.
+    /// </summary>
+    /// <param name="szFilePath">file path of the image, handed back with it</param>
+    /// <param name="encoding">codec and its parameters</param>
+    /// <param name="pFrame">frame, top-down</param>
+    /// <param name="nWidth">width (in pixels) of the frame</param>
+    /// <param name="nHeight">height (in pixels) of the frame</param>
+    /// <param name="bRedFirst">whether the pixels are red first (as in PPM) or blue first (as in BMP)</param>
+    /// <param name="nContext">context handed back with the image</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 Submit(LPCWSTR szFilePath, const ColorEncoding& encoding, const RGBTRIPLE* pFrame, UINT32 nWidth, UINT32 nHeight, bool bRedFirst, ULONG_PTR nContext);
+
+    /// <summary>
+    /// Take the encoded frames which are next in order
+    /// </summary>
+    /// <param name="pFrames">receives the frames, valid until each is released</param>
+    /// <param name="nMaxFrames">number of entries in pFrames</param>
+    /// <returns>number of frames</returns>
+    int                     Collect(ColorEncodedFrame* pFrames, int nMaxFrames);
+
+    /// <summary>
+    /// Give the buffer of a collected frame back to the pool
+    /// </summary>
+    /// <param name="nContext">context of the frame</param>
+    /// <returns>true if the context belongs to a collected frame</returns>
+    bool                    Release(ULONG_PTR nContext);
+
+    /// <summary>
+    /// Get the number of frames submitted but not collected yet
+    /// </summary>
+    /// <returns>number of frames</returns>
+    int                     GetPendingCount();
+
+    /// <summary>
+    /// Get the number of encoder threads
+    /// </summary>
+    /// <returns>number of threads</returns>
+    UINT                    GetThreadCount() const { return static_cast<UINT>(m_vThreads.size()); }
+
+private:
+    /// States of a job
+    enum JobState
+    {
+        JobState_Free = 0,
+        JobState_Queued,
+        JobState_Encoding,
+        JobState_Done,
+        JobState_Collected                  // the image is being written
+    };
+
+    /// A frame and its image
+    struct EncodeJob
+    {
+        JobState            nState;
+        std::wstring        sFilePath;
+        ColorEncoding       encoding;
+        const RGBTRIPLE*    pFrame;
+        UINT32              nWidth;
+        UINT32              nHeight;
+        bool                bRedFirst;
+        ULONG_PTR           nContext;
+        BYTE*               pImage;             // frame slot
+        DWORD               cbCapacity;
+        DWORD               cbImage;
+        HRESULT             hr;
+    };
+
+    std::vector<EncodeJob*> m_vJobs;
+    std::deque<EncodeJob*>  m_dQueued;          // jobs to encode, in order of submission
+    std::deque<EncodeJob*>  m_dOrder;           // jobs not collected yet, in order of submission
+    std::vector<std::thread> m_vThreads;
+    bool                    m_bStop;
+    std::mutex              m_mMutex;
+    std::condition_variable m_cvQueued;
+
+    /// <summary>
+    /// Encode queued frames until the pool is destroyed
+    /// </summary>
+    void                    EncodeFrames();
+};
@@ -0,0 +1,482 @@
+// Converter.cpp
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Offline batch conversion of recorded sessions between the image and record file layouts
+
+
+#include "stdafx.h"
+#include <strsafe.h>
+#include <stdio.h>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <winioctl.h>
+#include "Converter.h"
+#include "FrameWriter.h"
+#include "RecordFile.h"
+#include "ReplayReader.h"
+#include "Stripe.h"
+
+namespace
+{
+    /// Layouts a session can be converted to
+    enum ConvertTarget
+    {
+        ConvertTarget_Images = 0,   // one PGM/PPM/BMP file per frame
+        ConvertTarget_RecordFiles   // one .kvr record file per stream
+    };
+
+    const WCHAR* cStreamNames[3] = { L"ir", L"depth", L"color" };
+    const WCHAR* cRecordFileNames[3] = { L"ir.kvr", L"depth.kvr", L"color.kvr" };
+
+    // Reports which the recorder writes to the session folder on its first root
+    const WCHAR* cReportNames[] = { L"index.csv", L"gaps.csv", L"session.ini" };
+
+    /// Settings and progress of a batch, shared by the workers
+    struct ConvertBatch
+    {
+        std::vector<std::wstring> vSessions;        // session folder names relative to the source folder
+        std::wstring        sSourceFolder;
+        std::wstring        sDestinationFolder;
+        ConvertTarget       nTarget;
+        bool                bCompress;
+        std::atomic<size_t> nNextSession;
+        std::atomic<int>    nConverted;
+        std::atomic<int>    nSkipped;
+        std::atomic<int>    nFailed;
+        std::atomic<ULONGLONG> cbConverted;
+        std::mutex          mPrintMutex;
+    };
+
+    /// <summary>
+    /// Check whether a folder holds a recorded session
+    /// </summary>
+    /// <param name="szFolder">folder to check</param>
+    /// <returns>true if the folder holds frames, record files or a stripe manifest</returns>
+    bool IsSessionFolder(LPCWSTR szFolder)
+    {
+        const WCHAR* szEntries[] = { L"ir", L"ir.kvr", StripeManifestName };
+        for (int i = 0; i < _countof(szEntries); ++i)
+        {
+            WCHAR szPath[MAX_PATH];
+            StringCchPrintfW(szPath, _countof(szPath), L"%s\\%s", szFolder, szEntries[i]);
+            if (INVALID_FILE_ATTRIBUTES != GetFileAttributesW(szPath))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// <summary>
+    /// Find the recorded sessions below a folder (e.g. 2D\\wi_tr_1 below a record root)
+    /// </summary>
+    /// <param name="szFolder">folder to search</param>
+    /// <param name="szRelativeFolder">szFolder relative to the source folder, empty for the source folder</param>
+    /// <param name="pvSessions">receives the session folders relative to the source folder</param>
+    void FindSessions(LPCWSTR szFolder, LPCWSTR szRelativeFolder, std::vector<std::wstring>* pvSessions)
+    {
+        WCHAR szPattern[MAX_PATH];
+        StringCchPrintfW(szPattern, _countof(szPattern), L"%s\\*", szFolder);
+
+        WIN32_FIND_DATAW findData;
+        HANDLE hFind = FindFirstFileW(szPattern, &findData);
+        if (INVALID_HANDLE_VALUE == hFind)
+        {
+            return;
+        }
+
+        do
+        {
+            if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) || L'.' == findData.cFileName[0])
+            {
+                continue;
+            }
+
+            WCHAR szSubfolder[MAX_PATH];
+            WCHAR szRelativeSubfolder[MAX_PATH];
+            StringCchPrintfW(szSubfolder, _countof(szSubfolder), L"%s\\%s", szFolder, findData.cFileName);
+            StringCchPrintfW(szRelativeSubfolder, _countof(szRelativeSubfolder), szRelativeFolder[0] ? L"%s\\%s" : L"%s%s", szRelativeFolder, findData.cFileName);
+
+            // The stream folders of a session are not searched any further
+            if (IsSessionFolder(szSubfolder))
+            {
+                pvSessions->push_back(szRelativeSubfolder);
+            }
+            else
+            {
+                FindSessions(szSubfolder, szRelativeSubfolder, pvSessions);
+            }
+        } while (FindNextFileW(hFind, &findData));
+        FindClose(hFind);
+    }
+
+    /// <summary>
+    /// Set the NTFS compression of a folder, which new files in it inherit
+    /// </summary>
+    /// <param name="szFolder">folder to compress</param>
+    void CompressFolder(LPCWSTR szFolder)
+    {
+        HANDLE hFolder = CreateFileW(szFolder, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+        if (INVALID_HANDLE_VALUE == hFolder)
+        {
+            return;
+        }
+
+        // Volumes without compression support (e.g. FAT or ReFS) keep the frames uncompressed
+        USHORT nFormat = COMPRESSION_FORMAT_DEFAULT;
+        DWORD dwBytesReturned = 0;
+        DeviceIoControl(hFolder, FSCTL_SET_COMPRESSION, &nFormat, sizeof(nFormat), NULL, 0, &dwBytesReturned, NULL);
+        CloseHandle(hFolder);
+    }
+
+    /// <summary>
+    /// Check whether a frame file was already written completely by an interrupted conversion
+    /// </summary>
+    /// <param name="szFilePath">full file path of the frame</param>
+    /// <param name="cbFrame">size (in bytes) of header and pixel data</param>
+    /// <returns>true if the file exists with the expected size</returns>
+    bool IsFrameWritten(LPCWSTR szFilePath, DWORD cbFrame)
+    {
+        WIN32_FILE_ATTRIBUTE_DATA fileData;
+        return GetFileAttributesExW(szFilePath, GetFileExInfoStandard, &fileData) && 0 == fileData.nFileSizeHigh && cbFrame == fileData.nFileSizeLow;
+    }
+
+    /// <summary>
+    /// Convert the frames of a session to one image file per frame
+    /// </summary>
+    /// <param name="pReader">reader of the opened source session</param>
+    /// <param name="szSessionFolder">destination session folder</param>
+    /// <param name="bCompress">whether the frames are stored NTFS compressed</param>
+    /// <param name="pcbConverted">receives the size (in bytes) of the converted pixel data</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT ConvertToImages(ReplayReader* pReader, LPCWSTR szSessionFolder, bool bCompress, ULONGLONG* pcbConverted)
+    {
+        // Streams which were off get no folder
+        WCHAR szStreamFolders[3][MAX_PATH];
+        for (int i = 0; i < 3; ++i)
+        {
+            if (!(pReader->GetStreams() & (1 << i)))
+            {
+                continue;
+            }
+            StringCchPrintfW(szStreamFolders[i], _countof(szStreamFolders[i]), L"%s\\%s", szSessionFolder, cStreamNames[i]);
+            if (FAILED(CreateFolderTree(szStreamFolders[i])))
+            {
+                return E_FAIL;
+            }
+            if (bCompress)
+            {
+                CompressFolder(szStreamFolders[i]);
+            }
+        }
+
+        FrameWriter* pWriter = FrameWriter::Create(WriterMode_Buffered);
+        std::vector<BYTE> vFrame[3];
+        ReplayFrameSet frameSet;
+        HRESULT hr = S_OK;
+
+        while (S_OK == (hr = pReader->Next(&frameSet)))
+        {
+            for (int i = 0; i < 3 && SUCCEEDED(hr); ++i)
+            {
+                // Serialize the frame with the same headers the recorder writes
+                const ReplayFrame& frame = frameSet.frames[i];
+                if (!frame.pData)
+                {
+                    continue;
+                }
+                const WCHAR* szExtension = L"pgm";
+                vFrame[i].resize(1024 + frame.cbData);
+                DWORD cbHeader = 0;
+                switch (frame.nPixelFormat)
+                {
+                case RecordPixelFormat_Gray16BE:
+                    cbHeader = FormatPGMHeader(vFrame[i].data(), frame.nWidth, frame.nHeight, 65535);
+                    break;
+
+                case RecordPixelFormat_RGB24:
+                    cbHeader = FormatPPMHeader(vFrame[i].data(), frame.nWidth, frame.nHeight, 255);
+                    szExtension = L"ppm";
+                    break;
+
+                default:
+                    cbHeader = FormatBMPHeader(vFrame[i].data(), frame.nWidth, frame.nHeight, sizeof(RGBTRIPLE) * 8);
+                    szExtension = L"bmp";
+                    break;
+                }
+
+                WCHAR szFilePath[MAX_PATH];
+                StringCchPrintfW(szFilePath, _countof(szFilePath), L"%s\\%011.6f.%s", szStreamFolders[i], frame.nTime / 10000000., szExtension);
+                if (!IsFrameWritten(szFilePath, cbHeader + frame.cbData))
+                {
+                    memcpy(vFrame[i].data() + cbHeader, frame.pData, frame.cbData);
+                    hr = pWriter->Write(szFilePath, vFrame[i].data(), cbHeader + frame.cbData);
+                }
+                *pcbConverted += frame.cbData;
+            }
+
+            if (FAILED(hr))
+            {
+                break;
+            }
+        }
+
+        delete pWriter;
+        return hr;
+    }
+
+    /// <summary>
+    /// Convert the frame sets of a session to one record file per stream
+    /// </summary>
+    /// <param name="pReader">reader of the opened source session</param>
+    /// <param name="szSessionFolder">destination session folder</param>
+    /// <param name="bCompress">whether the record files are stored NTFS compressed</param>
+    /// <param name="pcbConverted">receives the size (in bytes) of the converted pixel data</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT ConvertToRecordFiles(ReplayReader* pReader, LPCWSTR szSessionFolder, bool bCompress, ULONGLONG* pcbConverted)
+    {
+        if (FAILED(CreateFolderTree(szSessionFolder)))
+        {
+            return E_FAIL;
+        }
+        if (bCompress)
+        {
+            CompressFolder(szSessionFolder);
+        }
+
+        // The record file of a stream is created with the format of its first frame and
+        // preallocated for all of its frames, streams which were off get none
+        MappedRecordFile recordFiles[3];
+        UINT32 cbFrames[3] = { 0 };
+        bool bCreated[3] = { false, false, false };
+        ReplayFrameSet frameSet;
+        HRESULT hr = S_OK;
+        while (S_OK == (hr = pReader->Next(&frameSet)))
+        {
+            for (int i = 0; i < 3 && S_OK == hr; ++i)
+            {
+                const ReplayFrame& frame = frameSet.frames[i];
+                if (!frame.pData)
+                {
+                    continue;
+                }
+
+                if (!bCreated[i])
+                {
+                    cbFrames[i] = frame.cbData;
+                    WCHAR szFilePath[MAX_PATH];
+                    StringCchPrintfW(szFilePath, _countof(szFilePath), L"%s\\%s", szSessionFolder, cRecordFileNames[i]);
+                    hr = recordFiles[i].Create(szFilePath, i, frame.nWidth, frame.nHeight, frame.nPixelFormat, frame.cbData, pReader->GetStreamFrameCount(i));
+                    if (FAILED(hr))
+                    {
+                        break;
+                    }
+                    bCreated[i] = true;
+                }
+
+                BYTE* pRecord = recordFiles[i].AcquireFrame();
+                if (!pRecord || frame.cbData != cbFrames[i])
+                {
+                    hr = E_FAIL;
+                    break;
+                }
+                memcpy(pRecord, frame.pData, frame.cbData);
+                recordFiles[i].CommitFrame(frame.nTime);
+                *pcbConverted += frame.cbData;
+            }
+
+            if (S_OK != hr)
+            {
+                break;
+            }
+        }
+
+        for (int i = 0; i < 3; ++i)
+        {
+            if (FAILED(recordFiles[i].Close()) && SUCCEEDED(hr))
+            {
+                hr = E_FAIL;
+            }
+        }
+        return hr;
+    }
+
+    /// <summary>
+    /// Convert a session of the batch unless it was converted before
+    /// </summary>
+    /// <param name="pBatch">batch of the session</param>
+    /// <param name="szSession">session folder name relative to the source folder</param>
+    void ConvertSession(ConvertBatch* pBatch, LPCWSTR szSession)
+    {
+        WCHAR szSourceFolder[MAX_PATH];
+        WCHAR szDestinationFolder[MAX_PATH];
+        WCHAR szMarkerPath[MAX_PATH];
+        WCHAR szMarker[MAX_PATH];
+        StringCchPrintfW(szSourceFolder, _countof(szSourceFolder), L"%s\\%s", pBatch->sSourceFolder.c_str(), szSession);
+        StringCchPrintfW(szDestinationFolder, _countof(szDestinationFolder), L"%s\\%s", pBatch->sDestinationFolder.c_str(), szSession);
+
+        // The profile functions need a full path, otherwise the Windows folder is used
+        StringCchPrintfW(szMarkerPath, _countof(szMarkerPath), L"%s\\%s", szDestinationFolder, ConvertMarkerName);
+        GetFullPathNameW(szMarkerPath, _countof(szMarker), szMarker, NULL);
+        if (GetPrivateProfileIntW(L"Convert", L"Frames", 0, szMarker) > 0)
+        {
+            std::lock_guard<std::mutex> lock(pBatch->mPrintMutex);
+            wprintf(L"%-32s already converted\n", szSession);
+            ++pBatch->nSkipped;
+            return;
+        }
+
+        ULONGLONG nStart = GetTickCount64();
+        ULONGLONG cbConverted = 0;
+        ReplayReader reader;
+        HRESULT hr = reader.Open(szSourceFolder, ConvertPrefetchDepth);
+        UINT32 nFrames = reader.GetFrameCount();
+        if (SUCCEEDED(hr))
+        {
+            if (ConvertTarget_Images == pBatch->nTarget)
+            {
+                hr = ConvertToImages(&reader, szDestinationFolder, pBatch->bCompress, &cbConverted);
+            }
+            else
+            {
+                hr = ConvertToRecordFiles(&reader, szDestinationFolder, pBatch->bCompress, &cbConverted);
+            }
+        }
+        reader.Close();
+
+        if (SUCCEEDED(hr))
+        {
+            for (int i = 0; i < _countof(cReportNames); ++i)
+            {
+                WCHAR szSourcePath[MAX_PATH];
+                WCHAR szDestinationPath[MAX_PATH];
+                StringCchPrintfW(szSourcePath, _countof(szSourcePath), L"%s\\%s", szSourceFolder, cReportNames[i]);
+                StringCchPrintfW(szDestinationPath, _countof(szDestinationPath), L"%s\\%s", szDestinationFolder, cReportNames[i]);
+                CopyFileW(szSourcePath, szDestinationPath, FALSE);
+            }
+
+            // The marker is written last, so a session interrupted before is converted again
+            WCHAR szValue[32];
+            WritePrivateProfileStringW(L"Convert", L"Source", szSourceFolder, szMarker);
+            WritePrivateProfileStringW(L"Convert", L"Layout", (ConvertTarget_Images == pBatch->nTarget) ? L"images" : L"kvr", szMarker);
+            StringCchPrintfW(szValue, _countof(szValue), L"%u", nFrames);
+            WritePrivateProfileStringW(L"Convert", L"Frames", szValue, szMarker);
+            if (!WritePrivateProfileStringW(NULL, NULL, NULL, szMarker))
+            {
+                hr = E_FAIL;
+            }
+        }
+
+        double fElapsed = max(1ull, GetTickCount64() - nStart) / 1000.;
+        double fMB = cbConverted / (1024. * 1024.);
+
+        std::lock_guard<std::mutex> lock(pBatch->mPrintMutex);
+        if (SUCCEEDED(hr))
+        {
+            wprintf(L"%-32s %7u %10.1f %8.1f %8.1f %8.1f\n", szSession, nFrames, fMB, fElapsed, fMB / fElapsed, nFrames / fElapsed);
+            ++pBatch->nConverted;
+            pBatch->cbConverted += cbConverted;
+        }
+        else
+        {
+            wprintf(L"%-32s failed (0x%08x)\n", szSession, hr);
+            ++pBatch->nFailed;
+        }
+    }
+
+    /// <summary>
+    /// Convert the sessions of a batch until none is left
+    /// </summary>
+    /// <param name="pBatch">batch to work on</param>
+    void ConvertSessions(ConvertBatch* pBatch)
+    {
+        for (size_t i = pBatch->nNextSession++; i < pBatch->vSessions.size(); i = pBatch->nNextSession++)
+        {
+            ConvertSession(pBatch, pBatch->vSessions[i].c_str());
+        }
+    }
+}
+
+/// <summary>
+/// Convert the recorded sessions in a folder
+/// </summary>
+/// <param name="argc">number of arguments</param>
+/// <param name="argv">source folder, destination folder, target layout, (optional) number of workers and /compress</param>
+/// <returns>0 on success, otherwise failure</returns>
+int RunConvert(int argc, LPWSTR* argv)
+{
+    if (argc < 3 || (0 != _wcsicmp(argv[2], L"images") && 0 != _wcsicmp(argv[2], L"kvr")))
+    {
+        wprintf(L"Usage: KinectV2Recorder /convert <source> <destination> <images|kvr> [workers] [/compress]\n");
+        return 1;
+    }
+
+    ConvertBatch batch;
+    batch.sSourceFolder = argv[0];
+    batch.sDestinationFolder = argv[1];
+    batch.nTarget = (0 == _wcsicmp(argv[2], L"images")) ? ConvertTarget_Images : ConvertTarget_RecordFiles;
+    batch.bCompress = false;
+    batch.nNextSession = 0;
+    batch.nConverted = 0;
+    batch.nSkipped = 0;
+    batch.nFailed = 0;
+    batch.cbConverted = 0;
+
+    int nWorkers = max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    for (int i = 3; i < argc; ++i)
+    {
+        if (0 == _wcsicmp(argv[i], L"/compress"))
+        {
+            batch.bCompress = true;
+        }
+        else
+        {
+            nWorkers = max(1, _wtoi(argv[i]));
+        }
+    }
+
+    // The source is either a single session or a folder of sessions
+    if (IsSessionFolder(argv[0]))
+    {
+        std::wstring sSource(argv[0]);
+        size_t nName = sSource.find_last_of(L"\\/");
+        batch.sSourceFolder = (std::wstring::npos == nName) ? L"." : sSource.substr(0, nName);
+        batch.vSessions.push_back((std::wstring::npos == nName) ? sSource : sSource.substr(nName + 1));
+    }
+    else
+    {
+        FindSessions(argv[0], L"", &batch.vSessions);
+    }
+
+    if (batch.vSessions.empty())
+    {
+        wprintf(L"No recorded sessions in %s\n", argv[0]);
+        return 1;
+    }
+
+    // Each worker converts whole sessions, so large batches scale with the cores while
+    // the memory stays bounded by the read ahead of one session per worker
+    nWorkers = min(nWorkers, static_cast<int>(batch.vSessions.size()));
+    wprintf(L"%u sessions to %s with %d workers\n", static_cast<UINT>(batch.vSessions.size()), (ConvertTarget_Images == batch.nTarget) ? L"images" : L"record files", nWorkers);
+    wprintf(L"%-32s %7s %10s %8s %8s %8s\n", L"session", L"frames", L"MB", L"s", L"MB/s", L"fps");
+
+    ULONGLONG nStart = GetTickCount64();
+    std::vector<std::thread> vWorkers;
+    for (int i = 0; i < nWorkers; ++i)
+    {
+        vWorkers.push_back(std::thread(ConvertSessions, &batch));
+    }
+    for (size_t i = 0; i < vWorkers.size(); ++i)
+    {
+        vWorkers[i].join();
+    }
+
+    double fElapsed = max(1ull, GetTickCount64() - nStart) / 1000.;
+    double fMB = batch.cbConverted / (1024. * 1024.);
+    wprintf(L"%d converted, %d already converted, %d failed: %.1f MB in %.1f s (%.1f MB/s)\n", batch.nConverted.load(), batch.nSkipped.load(), batch.nFailed.load(), fMB, fElapsed, fMB / fElapsed);
+    return batch.nFailed ? 1 : 0;
+}
@@ -0,0 +1,26 @@
+// Converter.h
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Offline batch conversion of recorded sessions between the image and record file layouts
+
+
+#pragma once
+
+#include <windows.h>
+
+/// The ConvertMarkerName value specifies the marker written to a session folder once it is
+/// converted completely, so an interrupted batch resumes with the remaining sessions
+#define ConvertMarkerName L"convert.ini"
+
+/// The ConvertPrefetchDepth value specifies the number of frame sets read ahead per session,
+/// which bounds the memory of a conversion to a few frame sets per worker
+#define ConvertPrefetchDepth 2
+
+/// <summary>
+/// Convert the recorded sessions in a folder
+/// </summary>
+/// <param name="argc">number of arguments</param>
+/// <param name="argv">source folder, destination folder, target layout, (optional) number of workers and /compress</param>
+/// <returns>0 on success, otherwise failure</returns>
+int RunConvert(int argc, LPWSTR* argv);
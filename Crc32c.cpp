@@ -0,0 +1,154 @@
+// Crc32c.cpp
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// CRC32C (Castagnoli) checksums of the recorded frames
+
+
+#include "stdafx.h"
+#include <string.h>
+#include <intrin.h>
+#include <nmmintrin.h>
+#include "Crc32c.h"
+
+namespace
+{
+    /// Lookup tables of the software CRC32C, which processes 8 bytes per step (slicing-by-8)
+    struct Crc32cTables
+    {
+        UINT32              nTable[8][256];
+
+        Crc32cTables()
+        {
+            // Reflected Castagnoli polynomial
+            for (UINT32 i = 0; i < 256; ++i)
+            {
+                UINT32 nCrc = i;
+                for (int b = 0; b < 8; ++b)
+                {
+                    nCrc = (nCrc & 1) ? (nCrc >> 1) ^ 0x82F63B78 : (nCrc >> 1);
+                }
+                nTable[0][i] = nCrc;
+            }
+            for (UINT32 i = 0; i < 256; ++i)
+            {
+                for (int t = 1; t < 8; ++t)
+                {
+                    nTable[t][i] = (nTable[t - 1][i] >> 8) ^ nTable[0][nTable[t - 1][i] & 0xFF];
+                }
+            }
+        }
+    };
+
+    /// <summary>
+    /// Check whether the processor supports SSE4.2, which includes the crc32 instruction
+    /// </summary>
+    /// <returns>true if SSE4.2 is supported</returns>
+    bool DetectSse42()
+    {
+        int nInfo[4] = { 0 };
+        __cpuid(nInfo, 1);
+        return 0 != (nInfo[2] & (1 << 20));
+    }
+
+    // Both are set up before main, since local statics are not initialized thread-safely
+    // by this compiler and the writer threads checksum concurrently
+    const Crc32cTables s_tables;
+    const bool s_bAccelerated = DetectSse42();
+
+    /// <summary>
+    /// Compute the CRC32C of a buffer with the crc32 instruction
+    /// </summary>
+    /// <param name="pData">data to checksum</param>
+    /// <param name="cbData">size (in bytes) of the data</param>
+    /// <param name="nCrc">inverted CRC32C of the preceding data</param>
+    /// <returns>inverted CRC32C</returns>
+    UINT32 UpdateCrc32cHardware(const BYTE* pData, size_t cbData, UINT32 nCrc)
+    {
+        // Align to 8 bytes, then 8 bytes (4 on 32-bit builds) per instruction
+        while (cbData && (reinterpret_cast<ULONG_PTR>(pData) & 7))
+        {
+            nCrc = _mm_crc32_u8(nCrc, *pData++);
+            --cbData;
+        }
+#ifdef _M_X64
+        UINT64 nCrc64 = nCrc;
+        for (; cbData >= 8; cbData -= 8, pData += 8)
+        {
+            nCrc64 = _mm_crc32_u64(nCrc64, *reinterpret_cast<const UINT64*>(pData));
+        }
+        nCrc = static_cast<UINT32>(nCrc64);
+#else
+        for (; cbData >= 4; cbData -= 4, pData += 4)
+        {
+            nCrc = _mm_crc32_u32(nCrc, *reinterpret_cast<const UINT32*>(pData));
+        }
+#endif
+        while (cbData--)
+        {
+            nCrc = _mm_crc32_u8(nCrc, *pData++);
+        }
+        return nCrc;
+    }
+
+    /// <summary>
+    /// Compute the CRC32C of a buffer with the lookup tables
+    /// </summary>
+    /// <param name="pData">data to checksum</param>
+    /// <param name="cbData">size (in bytes) of the data</param>
+    /// <param name="nCrc">inverted CRC32C of the preceding data</param>
+    /// <returns>inverted CRC32C</returns>
+    UINT32 UpdateCrc32cSoftware(const BYTE* pData, size_t cbData, UINT32 nCrc)
+    {
+        const UINT32 (*t)[256] = s_tables.nTable;
+        for (; cbData >= 8; cbData -= 8, pData += 8)
+        {
+            UINT32 nLow = 0;
+            UINT32 nHigh = 0;
+            memcpy(&nLow, pData, 4);
+            memcpy(&nHigh, pData + 4, 4);
+            nLow ^= nCrc;
+            nCrc = t[7][nLow & 0xFF] ^ t[6][(nLow >> 8) & 0xFF] ^ t[5][(nLow >> 16) & 0xFF] ^ t[4][nLow >> 24] ^
+                t[3][nHigh & 0xFF] ^ t[2][(nHigh >> 8) & 0xFF] ^ t[1][(nHigh >> 16) & 0xFF] ^ t[0][nHigh >> 24];
+        }
+        while (cbData--)
+        {
+            nCrc = (nCrc >> 8) ^ t[0][(nCrc ^ *pData++) & 0xFF];
+        }
+        return nCrc;
+    }
+}
+
+/// <summary>
+/// Compute the CRC32C of a buffer, with the SSE4.2 crc32 instruction if the processor has it
+/// </summary>
+/// <param name="pData">data to checksum</param>
+/// <param name="cbData">size (in bytes) of the data</param>
+/// <param name="nCrc">CRC32C of the preceding data, 0 to start</param>
+/// <returns>CRC32C of the preceding data and this buffer</returns>
+UINT32 ComputeCrc32c(const void* pData, size_t cbData, UINT32 nCrc)
+{
+    const BYTE* pBytes = static_cast<const BYTE*>(pData);
+    return ~(s_bAccelerated ? UpdateCrc32cHardware(pBytes, cbData, ~nCrc) : UpdateCrc32cSoftware(pBytes, cbData, ~nCrc));
+}
+
+/// <summary>
+/// Compute the CRC32C of a buffer with lookup tables only
+/// </summary>
+/// <param name="pData">data to checksum</param>
+/// <param name="cbData">size (in bytes) of the data</param>
+/// <param name="nCrc">CRC32C of the preceding data, 0 to start</param>
+/// <returns>CRC32C of the preceding data and this buffer</returns>
+UINT32 ComputeCrc32cSoftware(const void* pData, size_t cbData, UINT32 nCrc)
+{
+    return ~UpdateCrc32cSoftware(static_cast<const BYTE*>(pData), cbData, ~nCrc);
+}
+
+/// <summary>
+/// Check whether ComputeCrc32c uses the crc32 instruction
+/// </summary>
+/// <returns>true if the processor supports SSE4.2</returns>
+bool IsCrc32cAccelerated()
+{
+    return s_bAccelerated;
+}
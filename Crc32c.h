@@ -0,0 +1,34 @@
+// Crc32c.h
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// CRC32C (Castagnoli) checksums of the recorded frames
+
+
+#pragma once
+
+#include <windows.h>
+
+/// <summary>
+/// Compute the CRC32C of a buffer, with the SSE4.2 crc32 instruction if the processor has it
+/// </summary>
+/// <param name="pData">data to checksum</param>
+/// <param name="cbData">size (in bytes) of the data</param>
+/// <param name="nCrc">CRC32C of the preceding data, 0 to start</param>
+/// <returns>CRC32C of the preceding data and this buffer</returns>
+UINT32 ComputeCrc32c(const void* pData, size_t cbData, UINT32 nCrc = 0);
+
+/// <summary>
+/// Compute the CRC32C of a buffer with lookup tables only
+/// </summary>
+/// <param name="pData">data to checksum</param>
+/// <param name="cbData">size (in bytes) of the data</param>
+/// <param name="nCrc">CRC32C of the preceding data, 0 to start</param>
+/// <returns>CRC32C of the preceding data and this buffer</returns>
+UINT32 ComputeCrc32cSoftware(const void* pData, size_t cbData, UINT32 nCrc = 0);
+
+/// <summary>
+/// Check whether ComputeCrc32c uses the crc32 instruction
+/// </summary>
+/// <returns>true if the processor supports SSE4.2</returns>
+bool IsCrc32cAccelerated();
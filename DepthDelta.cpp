@@ -0,0 +1,532 @@
+// DepthDelta.cpp
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Temporal delta coding of depth sequences: periodic keyframes and residuals to the previous frame
+
+
+#include "stdafx.h"
+#include <stdio.h>
+#include <intrin.h>
+#include <emmintrin.h>
+#include <algorithm>
+#include "DepthDelta.h"
+
+/// Unary prefixes of this length escape to the residual in 32 plain bits
+static const UINT32 cRiceEscape = 24;
+
+/// Largest Rice parameter, enough for runs over a whole frame
+static const UINT32 cRiceMaxParameter = 20;
+
+/// Symbols after which the statistics of a Rice context are halved, so that it adapts
+static const UINT32 cRiceWindow = 64;
+
+/// Running statistics of the symbols of one kind, which select their Rice parameter
+struct RiceContext
+{
+    UINT32                  nSum;
+    UINT32                  nCount;
+};
+
+/// Writes bits least significant first, 32 at a time
+struct DeltaBitWriter
+{
+    BYTE*                   pDest;
+    UINT32                  cbWritten;
+    UINT32                  cbCapacity;
+    UINT64                  nBits;
+    UINT32                  nCount;
+    bool                    bOverflow;
+};
+
+/// Reads bits least significant first, 32 at a time, and zeros beyond the data
+struct DeltaBitReader
+{
+    const BYTE*             pSource;
+    UINT32                  cbRead;
+    UINT32                  cbData;
+    UINT64                  nBits;
+    UINT32                  nCount;
+};
+
+/// <summary>
+/// Format the header of a delta coded image
+/// </summary>
+/// <param name="pDest">destination of the header</param>
+/// <param name="lWidth">width (in pixels) of image data</param>
+/// <param name="lHeight">height (in pixels) of image data</param>
+/// <param name="delta">position of the frame in its sequence</param>
+/// <param name="cbData">size (in bytes) of the coded data</param>
+/// <returns>size (in bytes) of the header, the same for any cbData</returns>
+DWORD FormatDeltaHeader(BYTE* pDest, LONG lWidth, LONG lHeight, const DepthDeltaFrame& delta, UINT32 cbData)
+{
+    CHAR szHeader[DepthDeltaMaxHeaderSize];
+    int nLength = sprintf_s(szHeader, _countof(szHeader), "KD\n%d %d\n%u %u %010u\n", lWidth, lHeight, delta.nSequence, delta.nKeyDistance, cbData);
+    memcpy(pDest, szHeader, nLength);
+    return nLength;
+}
+
+/// <summary>
+/// Convert pixels between big-endian and native byte order with SSE2, 8 pixels at a time
+/// </summary>
+/// <param name="pSource">pixels</param>
+/// <param name="nPixels">number of pixels</param>
+/// <param name="pDest">receives the pixels in the other byte order</param>
+static void SwapPixelBytes(const UINT16* pSource, UINT32 nPixels, UINT16* pDest)
+{
+    UINT32 i = 0;
+    for (; i + 8 <= nPixels; i += 8)
+    {
+        __m128i nPixels8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSource + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pDest + i), _mm_or_si128(_mm_slli_epi16(nPixels8, 8), _mm_srli_epi16(nPixels8, 8)));
+    }
+    for (; i < nPixels; ++i)
+    {
+        pDest[i] = _byteswap_ushort(pSource[i]);
+    }
+}
+
+/// <summary>
+/// Find the first pixel which differs from its reference with SSE2, 8 pixels at a time
+/// </summary>
+/// <param name="pCurrent">pixels</param>
+/// <param name="pReference">reference of each pixel</param>
+/// <param name="nBegin">first pixel to compare</param>
+/// <param name="nPixels">number of pixels</param>
+/// <returns>index of the pixel, nPixels if all are equal</returns>
+static inline UINT32 FindResidual(const UINT16* pCurrent, const UINT16* pReference, UINT32 nBegin, UINT32 nPixels)
+{
+    UINT32 i = nBegin;
+    for (; i + 8 <= nPixels; i += 8)
+    {
+        __m128i nEqual = _mm_cmpeq_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pCurrent + i)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(pReference + i)));
+        int nMask = _mm_movemask_epi8(nEqual);
+        if (0xFFFF != nMask)
+        {
+            DWORD nBit = 0;
+            _BitScanForward(&nBit, ~nMask & 0xFFFF);
+            return i + nBit / 2;
+        }
+    }
+    while (i < nPixels && pCurrent[i] == pReference[i])
+    {
+        ++i;
+    }
+    return i;
+}
+
+/// <summary>
+/// Get the Rice parameter of a context, the smallest k for which 2^k reaches the mean symbol
+/// </summary>
+/// <param name="context">statistics of the symbols</param>
+/// <returns>number of plain low bits of the next symbol</returns>
+static inline UINT32 GetRiceParameter(const RiceContext& context)
+{
+    UINT32 k = 0;
+    while ((context.nCount << k) < context.nSum && k < cRiceMaxParameter)
+    {
+        ++k;
+    }
+    return k;
+}
+
+/// <summary>
+/// Add a symbol to the statistics of a context
+/// </summary>
+/// <param name="pContext">statistics of the symbols</param>
+/// <param name="nSymbol">symbol just coded</param>
+static inline void UpdateRiceContext(RiceContext* pContext, UINT32 nSymbol)
+{
+    pContext->nSum += nSymbol;
+    if (++pContext->nCount >= cRiceWindow)
+    {
+        pContext->nSum >>= 1;
+        pContext->nCount >>= 1;
+    }
+}
+
+/// <summary>
+/// Write bits
+/// </summary>
+/// <param name="pWriter">writer</param>
+/// <param name="nValue">value of less than nCount bits</param>
+/// <param name="nCount">number of bits, at most 32</param>
+static inline void WriteBits(DeltaBitWriter* pWriter, UINT32 nValue, UINT32 nCount)
+{
+    pWriter->nBits |= static_cast<UINT64>(nValue) << pWriter->nCount;
+    pWriter->nCount += nCount;
+    if (pWriter->nCount >= 32)
+    {
+        if (pWriter->cbWritten + 4 <= pWriter->cbCapacity)
+        {
+            UINT32 nWord = static_cast<UINT32>(pWriter->nBits);
+            memcpy(pWriter->pDest + pWriter->cbWritten, &nWord, 4);
+            pWriter->cbWritten += 4;
+        }
+        else
+        {
+            pWriter->bOverflow = true;
+        }
+        pWriter->nBits >>= 32;
+        pWriter->nCount -= 32;
+    }
+}
+
+/// <summary>
+/// Write a symbol as a Rice code, its high bits in unary and the low bits of the parameter plain
+/// </summary>
+/// <param name="pWriter">writer</param>
+/// <param name="pContext">statistics of the symbols of its kind</param>
+/// <param name="nSymbol">symbol</param>
+static inline void WriteRice(DeltaBitWriter* pWriter, RiceContext* pContext, UINT32 nSymbol)
+{
+    UINT32 k = GetRiceParameter(*pContext);
+    UINT32 nHigh = nSymbol >> k;
+    if (nHigh < cRiceEscape)
+    {
+        WriteBits(pWriter, 1u << nHigh, nHigh + 1);
+        WriteBits(pWriter, nSymbol & ((1u << k) - 1), k);
+    }
+    else
+    {
+        WriteBits(pWriter, 1u << cRiceEscape, cRiceEscape + 1);
+        WriteBits(pWriter, nSymbol & 0xFFFF, 16);
+        WriteBits(pWriter, nSymbol >> 16, 16);
+    }
+    UpdateRiceContext(pContext, nSymbol);
+}
+
+/// <summary>
+/// Fill the bits of a reader to more than 32
+/// </summary>
+/// <param name="pReader">reader</param>
+static inline void RefillBits(DeltaBitReader* pReader)
+{
+    while (pReader->nCount <= 32)
+    {
+        UINT32 nWord = 0;
+        if (pReader->cbRead + 4 <= pReader->cbData)
+        {
+            memcpy(&nWord, pReader->pSource + pReader->cbRead, 4);
+        }
+        else if (pReader->cbRead < pReader->cbData)
+        {
+            memcpy(&nWord, pReader->pSource + pReader->cbRead, pReader->cbData - pReader->cbRead);
+        }
+        pReader->cbRead += 4;
+        pReader->nBits |= static_cast<UINT64>(nWord) << pReader->nCount;
+        pReader->nCount += 32;
+    }
+}
+
+/// <summary>
+/// Read bits
+/// </summary>
+/// <param name="pReader">reader</param>
+/// <param name="nCount">number of bits, less than 32</param>
+/// <returns>value</returns>
+static inline UINT32 ReadBits(DeltaBitReader* pReader, UINT32 nCount)
+{
+    RefillBits(pReader);
+    UINT32 nValue = static_cast<UINT32>(pReader->nBits) & ((1u << nCount) - 1);
+    pReader->nBits >>= nCount;
+    pReader->nCount -= nCount;
+    return nValue;
+}
+
+/// <summary>
+/// Read a symbol written by WriteRice
+/// </summary>
+/// <param name="pReader">reader</param>
+/// <param name="pContext">statistics of the symbols of its kind</param>
+/// <param name="pnSymbol">receives the symbol</param>
+/// <returns>false if the data is corrupt</returns>
+static inline bool ReadRice(DeltaBitReader* pReader, RiceContext* pContext, UINT32* pnSymbol)
+{
+    UINT32 k = GetRiceParameter(*pContext);
+    RefillBits(pReader);
+
+    DWORD nHigh = 0;
+    if (!_BitScanForward(&nHigh, static_cast<DWORD>(pReader->nBits) & ((2u << cRiceEscape) - 1)))
+    {
+        return false;
+    }
+    pReader->nBits >>= nHigh + 1;
+    pReader->nCount -= nHigh + 1;
+
+    if (nHigh < cRiceEscape)
+    {
+        *pnSymbol = (nHigh << k) | ReadBits(pReader, k);
+    }
+    else
+    {
+        UINT32 nLow = ReadBits(pReader, 16);
+        *pnSymbol = nLow | (ReadBits(pReader, 16) << 16);
+    }
+    UpdateRiceContext(pContext, *pnSymbol);
+    return true;
+}
+
+/// <summary>
+/// Code the residuals of a frame to a reference as alternating runs of zero residuals and
+/// single residuals, both as adaptive Rice codes of their own statistics
+/// </summary>
+/// <param name="pCurrent">frame in native byte order</param>
+/// <param name="pReference">reference of each pixel, the previous pixel for a keyframe</param>
+/// <param name="nPixels">number of pixels</param>
+/// <param name="pDest">receives the codes</param>
+/// <param name="cbCapacity">size (in bytes) of pDest</param>
+/// <returns>size (in bytes) of the codes, 0 if they do not fit</returns>
+static UINT32 EncodeResiduals(const UINT16* pCurrent, const UINT16* pReference, UINT32 nPixels, BYTE* pDest, UINT32 cbCapacity)
+{
+    DeltaBitWriter writer = { pDest, 0, cbCapacity, 0, 0, false };
+    RiceContext runs = { 16, 1 };
+    RiceContext residuals = { 16, 1 };
+
+    UINT32 i = 0;
+    while (i < nPixels && !writer.bOverflow)
+    {
+        UINT32 nNext = FindResidual(pCurrent, pReference, i, nPixels);
+        WriteRice(&writer, &runs, nNext - i);
+        if (nNext == nPixels)
+        {
+            break;
+        }
+
+        // Residuals are zigzag mapped to 1, 2, 3, ... for -1, 1, -2, ..., which never is 0
+        INT32 nResidual = static_cast<INT32>(pCurrent[nNext]) - static_cast<INT32>(pReference[nNext]);
+        UINT32 nSymbol = (static_cast<UINT32>(nResidual) << 1) ^ static_cast<UINT32>(nResidual >> 31);
+        WriteRice(&writer, &residuals, nSymbol - 1);
+        i = nNext + 1;
+    }
+
+    // The last bits go out as whole bytes
+    while (writer.nCount && !writer.bOverflow)
+    {
+        if (writer.cbWritten < writer.cbCapacity)
+        {
+            writer.pDest[writer.cbWritten++] = static_cast<BYTE>(writer.nBits);
+        }
+        else
+        {
+            writer.bOverflow = true;
+        }
+        writer.nBits >>= 8;
+        writer.nCount = (writer.nCount > 8) ? writer.nCount - 8 : 0;
+    }
+
+    return writer.bOverflow ? 0 : writer.cbWritten;
+}
+
+/// <summary>
+/// Decode the residuals written by EncodeResiduals
+/// </summary>
+/// <param name="pSource">codes</param>
+/// <param name="cbSource">size (in bytes) of the codes</param>
+/// <param name="pReference">previous frame, NULL for a keyframe</param>
+/// <param name="nPixels">number of pixels</param>
+/// <param name="pCurrent">receives the frame in native byte order, behind a leading 0</param>
+/// <returns>false if the data is corrupt</returns>
+static bool DecodeResiduals(const BYTE* pSource, UINT32 cbSource, const UINT16* pReference, UINT32 nPixels, UINT16* pCurrent)
+{
+    DeltaBitReader reader = { pSource, 0, cbSource, 0, 0 };
+    RiceContext runs = { 16, 1 };
+    RiceContext residuals = { 16, 1 };
+
+    // A keyframe refers to its own previous pixel, so runs repeat it rather than copy
+    const UINT16* pPrevious = pReference ? pReference : pCurrent - 1;
+    UINT32 i = 0;
+    while (i < nPixels)
+    {
+        UINT32 nRun = 0;
+        if (!ReadRice(&reader, &runs, &nRun) || nRun > nPixels - i)
+        {
+            return false;
+        }
+        if (pReference)
+        {
+            memcpy(pCurrent + i, pReference + i, nRun * sizeof(UINT16));
+        }
+        else
+        {
+            std::fill(pCurrent + i, pCurrent + i + nRun, pCurrent[static_cast<INT32>(i) - 1]);
+        }
+        i += nRun;
+        if (i == nPixels)
+        {
+            break;
+        }
+
+        UINT32 nSymbol = 0;
+        if (!ReadRice(&reader, &residuals, &nSymbol))
+        {
+            return false;
+        }
+        ++nSymbol;
+        INT32 nResidual = static_cast<INT32>(nSymbol >> 1) ^ -static_cast<INT32>(nSymbol & 1);
+        pCurrent[i] = static_cast<UINT16>(pPrevious[i] + nResidual);
+        ++i;
+    }
+
+    // The codes must not have run past the data
+    return (ULONGLONG(reader.cbRead) * 8 - reader.nCount) <= ULONGLONG(cbSource) * 8;
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+DepthDeltaEncoder::DepthDeltaEncoder() :
+    m_nWidth(0),
+    m_nHeight(0),
+    m_nKeyframeInterval(1),
+    m_nSequence(0),
+    m_nKeySequence(0),
+    m_bReference(false)
+{
+}
+
+/// <summary>
+/// Start a new sequence, whose first frame is a keyframe
+/// </summary>
+/// <param name="nKeyframeInterval">frames from one keyframe to the next, 1 for keyframes only</param>
+void DepthDeltaEncoder::Reset(UINT32 nKeyframeInterval)
+{
+    m_nKeyframeInterval = max(1u, nKeyframeInterval);
+    m_nSequence = 0;
+    m_nKeySequence = 0;
+    m_bReference = false;
+}
+
+/// <summary>
+/// Code the next frame of the sequence
+/// </summary>
+/// <param name="pFrame">frame in big-endian (as in PGM)</param>
+/// <param name="nWidth">width (in pixels) of the frame</param>
+/// <param name="nHeight">height (in pixels) of the frame</param>
+/// <param name="pDest">receives the image, at most GetDepthDeltaBound(nWidth * nHeight) bytes, may overlap pFrame</param>
+/// <returns>size (in bytes) of the image</returns>
+DWORD DepthDeltaEncoder::Encode(const UINT16* pFrame, UINT32 nWidth, UINT32 nHeight, BYTE* pDest)
+{
+    UINT32 nPixels = nWidth * nHeight;
+    if (nWidth != m_nWidth || nHeight != m_nHeight)
+    {
+        m_nWidth = nWidth;
+        m_nHeight = nHeight;
+        m_vFrames[0].assign(nPixels + 1, 0);
+        m_vFrames[1].assign(nPixels + 1, 0);
+        m_bReference = false;
+    }
+
+    if (!m_bReference || m_nSequence - m_nKeySequence >= m_nKeyframeInterval)
+    {
+        m_nKeySequence = m_nSequence;
+    }
+    DepthDeltaFrame delta = { m_nSequence, m_nSequence - m_nKeySequence };
+
+    // The frame becomes the reference of the next one, so it is kept in native byte order. From
+    // here on only the copy is read, and the image may overwrite the frame.
+    m_vFrames[0].swap(m_vFrames[1]);
+    UINT16* pCurrent = m_vFrames[0].data() + 1;
+    SwapPixelBytes(pFrame, nPixels, pCurrent);
+
+    // Codes which are not shorter than the frame are dropped for the frame itself
+    DWORD cbHeader = FormatDeltaHeader(pDest, nWidth, nHeight, delta, 0);
+    BYTE* pData = pDest + cbHeader;
+    UINT32 cbStored = nPixels * sizeof(UINT16);
+    const UINT16* pReference = delta.nKeyDistance ? m_vFrames[1].data() + 1 : pCurrent - 1;
+    UINT32 cbCodes = EncodeResiduals(pCurrent, pReference, nPixels, pData + 1, cbStored - 1);
+    if (cbCodes)
+    {
+        pData[0] = DepthDeltaCoding_Rice;
+    }
+    else
+    {
+        pData[0] = DepthDeltaCoding_Stored;
+        SwapPixelBytes(pCurrent, nPixels, reinterpret_cast<UINT16*>(pData + 1));
+        cbCodes = cbStored;
+    }
+
+    FormatDeltaHeader(pDest, nWidth, nHeight, delta, 1 + cbCodes);
+    m_bReference = true;
+    ++m_nSequence;
+    return cbHeader + 1 + cbCodes;
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+DepthDeltaDecoder::DepthDeltaDecoder() :
+    m_nWidth(0),
+    m_nHeight(0),
+    m_nSequence(0),
+    m_bReference(false)
+{
+}
+
+/// <summary>
+/// Forget the previous frame
+/// </summary>
+void DepthDeltaDecoder::Reset()
+{
+    m_bReference = false;
+}
+
+/// <summary>
+/// Check whether a frame can be decoded next
+/// </summary>
+/// <param name="delta">position of the frame in its sequence</param>
+/// <param name="nWidth">width (in pixels) of the frame</param>
+/// <param name="nHeight">height (in pixels) of the frame</param>
+/// <returns>true for a keyframe or the frame following the previous one</returns>
+bool DepthDeltaDecoder::HasReference(const DepthDeltaFrame& delta, UINT32 nWidth, UINT32 nHeight) const
+{
+    return 0 == delta.nKeyDistance ||
+        (m_bReference && m_nSequence + 1 == delta.nSequence && nWidth == m_nWidth && nHeight == m_nHeight);
+}
+
+/// <summary>
+/// Decode a frame
+/// </summary>
+/// <param name="pData">coded data of the frame</param>
+/// <param name="cbData">size (in bytes) of the coded data</param>
+/// <param name="nWidth">width (in pixels) of the frame</param>
+/// <param name="nHeight">height (in pixels) of the frame</param>
+/// <param name="delta">position of the frame in its sequence</param>
+/// <param name="pDest">receives the frame in big-endian (as in PGM)</param>
+/// <returns>S_OK, E_NOT_VALID_STATE without the previous frame, otherwise failure</returns>
+HRESULT DepthDeltaDecoder::Decode(const BYTE* pData, UINT32 cbData, UINT32 nWidth, UINT32 nHeight, const DepthDeltaFrame& delta, UINT16* pDest)
+{
+    if (!HasReference(delta, nWidth, nHeight))
+    {
+        return E_NOT_VALID_STATE;
+    }
+
+    UINT32 nPixels = nWidth * nHeight;
+    if (nWidth != m_nWidth || nHeight != m_nHeight)
+    {
+        m_nWidth = nWidth;
+        m_nHeight = nHeight;
+        m_vFrames[0].assign(nPixels + 1, 0);
+        m_vFrames[1].assign(nPixels + 1, 0);
+    }
+
+    // Until the frame is decoded, the decoder has no reference for the next one
+    m_bReference = false;
+    m_vFrames[0].swap(m_vFrames[1]);
+    UINT16* pCurrent = m_vFrames[0].data() + 1;
+    const UINT16* pReference = delta.nKeyDistance ? m_vFrames[1].data() + 1 : NULL;
+
+    if (cbData == 1 + nPixels * sizeof(UINT16) && DepthDeltaCoding_Stored == pData[0])
+    {
+        SwapPixelBytes(reinterpret_cast<const UINT16*>(pData + 1), nPixels, pCurrent);
+    }
+    else if (!cbData || DepthDeltaCoding_Rice != pData[0] || !DecodeResiduals(pData + 1, cbData - 1, pReference, nPixels, pCurrent))
+    {
+        return E_FAIL;
+    }
+
+    SwapPixelBytes(pCurrent, nPixels, pDest);
+    m_nSequence = delta.nSequence;
+    m_bReference = true;
+    return S_OK;
+}
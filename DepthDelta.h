@@ -0,0 +1,142 @@
+// DepthDelta.h
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Temporal delta coding of depth sequences: periodic keyframes and residuals to the previous frame
+
+
+#pragma once
+
+#include <windows.h>
+#include <vector>
+
+/// The DepthDeltaExtension value specifies the file extension of delta coded images
+#define DepthDeltaExtension L"kvd"
+
+/// The DepthDeltaMaxHeaderSize value specifies the size (in bytes) which holds any delta header
+#define DepthDeltaMaxHeaderSize 64
+
+/// Codings of the pixel data of a delta coded image, the first byte of the data
+enum DepthDeltaCoding
+{
+    DepthDeltaCoding_Rice = 0,          // residuals as zero runs and adaptive Rice codes
+    DepthDeltaCoding_Stored             // the frame in big-endian, if coding does not pay off
+};
+
+/// Position of a delta coded frame in its sequence. A delta coded image has a PGM-like header
+/// "KD\n<width> <height>\n<sequence> <key distance> <size>\n" (the size of the data with
+/// 10 digits), and its data is the coding byte followed by the coded frame. A keyframe (key
+/// distance 0) is coded against its own previous pixel, any other frame against the frame
+/// before it in the sequence, which is key distance frames behind the keyframe.
+struct DepthDeltaFrame
+{
+    UINT32                  nSequence;          // index of the frame among the coded frames of the stream
+    UINT32                  nKeyDistance;       // frames since the last keyframe, 0 for a keyframe
+};
+
+/// <summary>
+/// Get the largest size of a delta coded image
+/// </summary>
+/// <param name="nPixels">number of pixels</param>
+/// <returns>size (in bytes) of the header and the data of a stored frame</returns>
+inline DWORD GetDepthDeltaBound(UINT32 nPixels)
+{
+    return DepthDeltaMaxHeaderSize + 1 + nPixels * sizeof(UINT16);
+}
+
+/// <summary>
+/// Format the header of a delta coded image
+/// </summary>
+/// <param name="pDest">destination of the header</param>
+/// <param name="lWidth">width (in pixels) of image data</param>
+/// <param name="lHeight">height (in pixels) of image data</param>
+/// <param name="delta">position of the frame in its sequence</param>
+/// <param name="cbData">size (in bytes) of the coded data</param>
+/// <returns>size (in bytes) of the header, the same for any cbData</returns>
+DWORD FormatDeltaHeader(BYTE* pDest, LONG lWidth, LONG lHeight, const DepthDeltaFrame& delta, UINT32 cbData);
+
+/// Codes the frames of a depth stream in order. Every nKeyframeInterval-th frame is a
+/// keyframe, so a reader seeking to a frame decodes at most nKeyframeInterval frames.
+class DepthDeltaEncoder
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    DepthDeltaEncoder();
+
+    /// <summary>
+    /// Start a new sequence, whose first frame is a keyframe
+    /// </summary>
+    /// <param name="nKeyframeInterval">frames from one keyframe to the next, 1 for keyframes only</param>
+    void                    Reset(UINT32 nKeyframeInterval);
+
+    /// <summary>
+    /// Drop the reference after the last frame was lost, so that the next frame is a keyframe.
+    /// The sequence goes on, so a decoder never takes another frame as the lost one.
+    /// </summary>
+    void                    DropReference() { m_bReference = false; }
+
+    /// <summary>
+    /// Code the next frame of the sequence
+    /// </summary>
+    /// <param name="pFrame">frame in big-endian (as in PGM)</param>
+    /// <param name="nWidth">width (in pixels) of the frame</param>
+    /// <param name="nHeight">height (in pixels) of the frame</param>
+    /// <param name="pDest">receives the image, at most GetDepthDeltaBound(nWidth * nHeight) bytes, may overlap pFrame</param>
+    /// <returns>size (in bytes) of the image</returns>
+    DWORD                   Encode(const UINT16* pFrame, UINT32 nWidth, UINT32 nHeight, BYTE* pDest);
+
+private:
+    std::vector<UINT16>     m_vFrames[2];       // current and previous frame, behind a leading 0
+    UINT32                  m_nWidth;
+    UINT32                  m_nHeight;
+    UINT32                  m_nKeyframeInterval;
+    UINT32                  m_nSequence;        // sequence of the next frame
+    UINT32                  m_nKeySequence;     // sequence of the last keyframe
+    bool                    m_bReference;       // the previous frame is valid
+};
+
+/// Decodes the frames of a delta coded depth stream. Each frame needs the frame before it
+/// decoded first, unless it is a keyframe.
+class DepthDeltaDecoder
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    DepthDeltaDecoder();
+
+    /// <summary>
+    /// Forget the previous frame
+    /// </summary>
+    void                    Reset();
+
+    /// <summary>
+    /// Check whether a frame can be decoded next
+    /// </summary>
+    /// <param name="delta">position of the frame in its sequence</param>
+    /// <param name="nWidth">width (in pixels) of the frame</param>
+    /// <param name="nHeight">height (in pixels) of the frame</param>
+    /// <returns>true for a keyframe or the frame following the previous one</returns>
+    bool                    HasReference(const DepthDeltaFrame& delta, UINT32 nWidth, UINT32 nHeight) const;
+
+    /// <summary>
+    /// Decode a frame
+    /// </summary>
+    /// <param name="pData">coded data of the frame</param>
+    /// <param name="cbData">size (in bytes) of the coded data</param>
+    /// <param name="nWidth">width (in pixels) of the frame</param>
+    /// <param name="nHeight">height (in pixels) of the frame</param>
+    /// <param name="delta">position of the frame in its sequence</param>
+    /// <param name="pDest">receives the frame in big-endian (as in PGM)</param>
+    /// <returns>S_OK, E_NOT_VALID_STATE without the previous frame, otherwise failure</returns>
+    HRESULT                 Decode(const BYTE* pData, UINT32 cbData, UINT32 nWidth, UINT32 nHeight, const DepthDeltaFrame& delta, UINT16* pDest);
+
+private:
+    std::vector<UINT16>     m_vFrames[2];       // current and previous frame, behind a leading 0
+    UINT32                  m_nWidth;
+    UINT32                  m_nHeight;
+    UINT32                  m_nSequence;        // sequence of the previous frame
+    bool                    m_bReference;       // the previous frame is valid
+};
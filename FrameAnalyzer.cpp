@@ -0,0 +1,95 @@
+// FrameAnalyzer.cpp
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Online analysis of the frame timing of a stream: gaps, missing frames and interval jitter
+
+
+#include "stdafx.h"
+#include <math.h>
+#include "FrameAnalyzer.h"
+
+/// <summary>
+/// Constructor
+/// </summary>
+/// <param name="nPeriod">expected interval between two frames (unit: 100 ns), a multiple of
+/// FramePeriod for a stream which keeps every Nth frame only</param>
+FrameAnalyzer::FrameAnalyzer(INT64 nPeriod) :
+    m_nPeriod(nPeriod)
+{
+    m_vMissingTimes.reserve(64);
+    Reset();
+}
+
+/// <summary>
+/// Forget all frames
+/// </summary>
+void FrameAnalyzer::Reset()
+{
+    m_nLastTime = 0;
+    m_nMaxInterval = 0;
+    m_nFrames = 0;
+    m_nGaps = 0;
+    m_nMissing = 0;
+    m_fSum = 0.0;
+    m_fSumSquares = 0.0;
+    ZeroMemory(m_nHistogram, sizeof(m_nHistogram));
+    m_vMissingTimes.clear();
+}
+
+/// <summary>
+/// Add the next frame of the stream
+/// </summary>
+/// <param name="nTime">relative time of the frame (unit: 100 ns)</param>
+/// <returns>number of frames missing right before this one</returns>
+UINT32 FrameAnalyzer::AddFrame(INT64 nTime)
+{
+    UINT32 nMissing = 0;
+    if (m_nFrames > 0)
+    {
+        INT64 nInterval = nTime - m_nLastTime;
+        m_nMaxInterval = max(m_nMaxInterval, nInterval);
+        m_fSum += nInterval;
+        m_fSumSquares += double(nInterval) * nInterval;
+        m_nHistogram[min(INT64(FrameHistogramBins - 1), max(INT64(0), nInterval / 10000))]++;
+
+        // An interval of 1.5 frame periods or more means frames are missing, they are expected
+        // evenly spread over the gap
+        if (2 * nInterval >= 3 * m_nPeriod)
+        {
+            nMissing = static_cast<UINT32>((nInterval + m_nPeriod / 2) / m_nPeriod - 1);
+            for (UINT32 i = 1; i <= nMissing; ++i)
+            {
+                m_vMissingTimes.push_back(m_nLastTime + nInterval * i / (nMissing + 1));
+            }
+            ++m_nGaps;
+            m_nMissing += nMissing;
+        }
+    }
+
+    m_nLastTime = nTime;
+    ++m_nFrames;
+    return nMissing;
+}
+
+/// <summary>
+/// Get the timing statistics
+/// </summary>
+/// <param name="pStats">receives the statistics</param>
+void FrameAnalyzer::GetStats(FrameTimingStats* pStats) const
+{
+    pStats->nFrames = m_nFrames;
+    pStats->nGaps = m_nGaps;
+    pStats->nMissing = m_nMissing;
+    pStats->fMeanInterval = 0.0;
+    pStats->fJitter = 0.0;
+    pStats->fMaxInterval = m_nMaxInterval / 10000.;
+
+    if (m_nFrames > 1)
+    {
+        double nIntervals = m_nFrames - 1;
+        double fMean = m_fSum / nIntervals;
+        pStats->fMeanInterval = fMean / 10000.;
+        pStats->fJitter = sqrt(max(0.0, m_fSumSquares / nIntervals - fMean * fMean)) / 10000.;
+    }
+}
@@ -0,0 +1,90 @@
+// FrameAnalyzer.h
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Online analysis of the frame timing of a stream: gaps, missing frames and interval jitter
+
+
+#pragma once
+
+#include <windows.h>
+#include <vector>
+
+/// The FramePeriod value specifies the nominal interval between two frames (unit: 100 ns, 30 fps)
+#define FramePeriod 333333
+
+/// The FrameHistogramBins value specifies the number of 1 ms bins of the interval histogram,
+/// the last bin also counts all longer intervals
+#define FrameHistogramBins 100
+
+/// Timing statistics of a stream
+struct FrameTimingStats
+{
+    UINT32                  nFrames;            // number of frames received
+    UINT32                  nGaps;              // number of intervals of more than one frame period
+    UINT32                  nMissing;           // number of frames missing in the gaps
+    double                  fMeanInterval;      // mean interval (unit: ms)
+    double                  fJitter;            // standard deviation of the interval (unit: ms)
+    double                  fMaxInterval;       // longest interval (unit: ms)
+};
+
+/// Tracks the intervals between the frames of a stream from their relative time. Each frame
+/// costs a few arithmetic operations, so it runs in the capture loop.
+class FrameAnalyzer
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    /// <param name="nPeriod">expected interval between two frames (unit: 100 ns), a multiple of
+    /// FramePeriod for a stream which keeps every Nth frame only</param>
+    FrameAnalyzer(INT64 nPeriod = FramePeriod);
+
+    /// <summary>
+    /// Forget all frames
+    /// </summary>
+    void                    Reset();
+
+    /// <summary>
+    /// Add the next frame of the stream
+    /// </summary>
+    /// <param name="nTime">relative time of the frame (unit: 100 ns)</param>
+    /// <returns>number of frames missing right before this one</returns>
+    UINT32                  AddFrame(INT64 nTime);
+
+    /// <summary>
+    /// Get the timing statistics
+    /// </summary>
+    /// <param name="pStats">receives the statistics</param>
+    void                    GetStats(FrameTimingStats* pStats) const;
+
+    /// <summary>
+    /// Get the interval histogram
+    /// </summary>
+    /// <returns>FrameHistogramBins counters, bin i counts the intervals of [i, i + 1) ms</returns>
+    const UINT32*           GetHistogram() const { return m_nHistogram; }
+
+    /// <summary>
+    /// Get the expected times of the missing frames
+    /// </summary>
+    /// <returns>relative times (unit: 100 ns) in ascending order</returns>
+    const std::vector<INT64>& GetMissingTimes() const { return m_vMissingTimes; }
+
+    /// <summary>
+    /// Get the number of missing frames
+    /// </summary>
+    /// <returns>number of frames</returns>
+    UINT32                  GetMissingCount() const { return m_nMissing; }
+
+private:
+    INT64                   m_nPeriod;
+    INT64                   m_nLastTime;
+    INT64                   m_nMaxInterval;
+    UINT32                  m_nFrames;
+    UINT32                  m_nGaps;
+    UINT32                  m_nMissing;
+    double                  m_fSum;
+    double                  m_fSumSquares;
+    UINT32                  m_nHistogram[FrameHistogramBins];
+    std::vector<INT64>      m_vMissingTimes;
+};
@@ -0,0 +1,202 @@
+// FrameDedup.cpp
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Deduplication of static frames: frames which repeat the previous recorded frame of their stream
+
+
+#include "stdafx.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <emmintrin.h>
+#include "FrameDedup.h"
+
+/// <summary>
+/// Format a duplicate image, which has a PGM-like header "KS\n<width> <height>\n<time>\n" (the
+/// time of the frame it repeats, in seconds as in the file names) and no data
+/// </summary>
+/// <param name="pDest">destination of the header</param>
+/// <param name="lWidth">width (in pixels) of the frame</param>
+/// <param name="lHeight">height (in pixels) of the frame</param>
+/// <param name="nReferenceTime">time of the repeated frame relative to the record start (unit: 100 ns)</param>
+/// <returns>size (in bytes) of the image</returns>
+DWORD FormatDuplicateHeader(BYTE* pDest, LONG lWidth, LONG lHeight, INT64 nReferenceTime)
+{
+    CHAR szHeader[FrameDedupMaxHeaderSize];
+    int nLength = sprintf_s(szHeader, _countof(szHeader), "KS\n%d %d\n%011.6f\n", lWidth, lHeight, nReferenceTime / 10000000.);
+    memcpy(pDest, szHeader, nLength);
+    return nLength;
+}
+
+/// <summary>
+/// Count the 16-bit samples which differ from their reference by more than a tolerance with
+/// SSE2, 8 samples at a time, until more than a limit are found
+/// </summary>
+/// <param name="pCurrent">samples in big-endian</param>
+/// <param name="pReference">reference of each sample in big-endian</param>
+/// <param name="nSamples">number of samples</param>
+/// <param name="nTolerance">largest unchanged difference</param>
+/// <param name="nMaxChanged">limit of changed samples</param>
+/// <returns>number of changed samples, counted up to somewhat more than nMaxChanged</returns>
+static UINT32 CountChangedGray16(const UINT16* pCurrent, const UINT16* pReference, UINT32 nSamples, UINT16 nTolerance, UINT32 nMaxChanged)
+{
+    const __m128i nTolerance8 = _mm_set1_epi16(static_cast<short>(nTolerance));
+    const __m128i nOnes = _mm_set1_epi16(1);
+    const __m128i nZero = _mm_setzero_si128();
+    const UINT32 nVectorSamples = nSamples & ~7u;
+
+    UINT32 nChanged = 0;
+    UINT32 i = 0;
+    while (i < nVectorSamples && nChanged <= nMaxChanged)
+    {
+        // A block of 2048 groups keeps the counts of the lanes in 16 bits
+        UINT32 nEnd = min(nVectorSamples, i + 8 * 2048);
+        __m128i nCounts = nZero;
+        for (; i < nEnd; i += 8)
+        {
+            __m128i nCurrent = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pCurrent + i));
+            __m128i nReference = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pReference + i));
+            nCurrent = _mm_or_si128(_mm_slli_epi16(nCurrent, 8), _mm_srli_epi16(nCurrent, 8));
+            nReference = _mm_or_si128(_mm_slli_epi16(nReference, 8), _mm_srli_epi16(nReference, 8));
+
+            // |a - b| for unsigned 16-bit lanes: max(a - b, 0) | max(b - a, 0)
+            __m128i nDifference = _mm_or_si128(_mm_subs_epu16(nCurrent, nReference), _mm_subs_epu16(nReference, nCurrent));
+            __m128i nUnchanged = _mm_cmpeq_epi16(_mm_subs_epu16(nDifference, nTolerance8), nZero);
+            nCounts = _mm_add_epi16(nCounts, _mm_andnot_si128(nUnchanged, nOnes));
+        }
+
+        __m128i nSums = _mm_madd_epi16(nCounts, nOnes);
+        nSums = _mm_add_epi32(nSums, _mm_srli_si128(nSums, 8));
+        nSums = _mm_add_epi32(nSums, _mm_srli_si128(nSums, 4));
+        nChanged += _mm_cvtsi128_si32(nSums);
+    }
+    for (i = max(i, nVectorSamples); i < nSamples && nChanged <= nMaxChanged; ++i)
+    {
+        int nDifference = abs(static_cast<int>(_byteswap_ushort(pCurrent[i])) - static_cast<int>(_byteswap_ushort(pReference[i])));
+        nChanged += (nDifference > nTolerance) ? 1 : 0;
+    }
+    return nChanged;
+}
+
+/// <summary>
+/// Count the 8-bit samples which differ from their reference by more than a tolerance with
+/// SSE2, 16 samples at a time, until more than a limit are found
+/// </summary>
+/// <param name="pCurrent">samples</param>
+/// <param name="pReference">reference of each sample</param>
+/// <param name="nSamples">number of samples</param>
+/// <param name="nTolerance">largest unchanged difference</param>
+/// <param name="nMaxChanged">limit of changed samples</param>
+/// <returns>number of changed samples, counted up to somewhat more than nMaxChanged</returns>
+static UINT32 CountChangedGray8(const BYTE* pCurrent, const BYTE* pReference, UINT32 nSamples, BYTE nTolerance, UINT32 nMaxChanged)
+{
+    const __m128i nTolerance16 = _mm_set1_epi8(static_cast<char>(nTolerance));
+    const __m128i nOnes = _mm_set1_epi8(1);
+    const __m128i nZero = _mm_setzero_si128();
+    const UINT32 nVectorSamples = nSamples & ~15u;
+
+    UINT32 nChanged = 0;
+    UINT32 i = 0;
+    while (i < nVectorSamples && nChanged <= nMaxChanged)
+    {
+        // A block of 255 groups keeps the counts of the lanes in 8 bits
+        UINT32 nEnd = min(nVectorSamples, i + 16 * 255);
+        __m128i nCounts = nZero;
+        for (; i < nEnd; i += 16)
+        {
+            __m128i nCurrent = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pCurrent + i));
+            __m128i nReference = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pReference + i));
+            __m128i nDifference = _mm_or_si128(_mm_subs_epu8(nCurrent, nReference), _mm_subs_epu8(nReference, nCurrent));
+            __m128i nUnchanged = _mm_cmpeq_epi8(_mm_subs_epu8(nDifference, nTolerance16), nZero);
+            nCounts = _mm_add_epi8(nCounts, _mm_andnot_si128(nUnchanged, nOnes));
+        }
+
+        __m128i nSums = _mm_sad_epu8(nCounts, nZero);
+        nChanged += _mm_cvtsi128_si32(nSums) + _mm_cvtsi128_si32(_mm_srli_si128(nSums, 8));
+    }
+    for (i = max(i, nVectorSamples); i < nSamples && nChanged <= nMaxChanged; ++i)
+    {
+        int nDifference = abs(static_cast<int>(pCurrent[i]) - static_cast<int>(pReference[i]));
+        nChanged += (nDifference > nTolerance) ? 1 : 0;
+    }
+    return nChanged;
+}
+
+/// <summary>
+/// Constructor, the deduplicator is off
+/// </summary>
+FrameDeduplicator::FrameDeduplicator() :
+    m_nReferenceTime(0),
+    m_nReferenceChecksum(0),
+    m_nDuplicates(0),
+    m_bReference(false),
+    m_bEnabled(false)
+{
+    m_threshold.nTolerance = 0;
+    m_threshold.nChangedSamples = 0;
+}
+
+/// <summary>
+/// Start a new stream, whose first frame is a reference
+/// </summary>
+/// <param name="threshold">which frames repeat their reference</param>
+/// <param name="bEnabled">whether frames are compared at all</param>
+void FrameDeduplicator::Reset(const FrameDedupThreshold& threshold, bool bEnabled)
+{
+    m_threshold = threshold;
+    m_nReferenceTime = 0;
+    m_nReferenceChecksum = 0;
+    m_nDuplicates = 0;
+    m_bReference = false;
+    m_bEnabled = bEnabled;
+}
+
+/// <summary>
+/// Compare a frame with the reference, and take it as the reference unless it repeats it
+/// </summary>
+/// <param name="pFrame">pixel data of the frame, big-endian for 16-bit frames</param>
+/// <param name="cbFrame">size (in bytes) of the pixel data</param>
+/// <param name="bGray16">whether the samples are 16-bit (depth, infrared) or 8-bit (color)</param>
+/// <param name="nChecksum">CRC32C of the pixel data</param>
+/// <param name="nTime">time of the frame</param>
+/// <returns>true if the frame repeats the reference</returns>
+bool FrameDeduplicator::Deduplicate(const BYTE* pFrame, UINT32 cbFrame, bool bGray16, UINT32 nChecksum, INT64 nTime)
+{
+    if (!m_bEnabled)
+    {
+        return false;
+    }
+
+    bool bDuplicate = false;
+    if (m_bReference && m_vReference.size() == cbFrame)
+    {
+        if (!m_threshold.nTolerance && !m_threshold.nChangedSamples)
+        {
+            // The checksum is computed for the index anyway, so a frame which changed costs
+            // nothing more, and only a match is confirmed against the reference
+            bDuplicate = (nChecksum == m_nReferenceChecksum) && 0 == memcmp(pFrame, m_vReference.data(), cbFrame);
+        }
+        else
+        {
+            UINT32 nSamples = bGray16 ? cbFrame / sizeof(UINT16) : cbFrame;
+            UINT32 nMaxChanged = static_cast<UINT32>(UINT64(nSamples) * m_threshold.nChangedSamples / 10000);
+            UINT32 nChanged = bGray16 ?
+                CountChangedGray16(reinterpret_cast<const UINT16*>(pFrame), reinterpret_cast<const UINT16*>(m_vReference.data()), nSamples, static_cast<UINT16>(min(65535u, m_threshold.nTolerance)), nMaxChanged) :
+                CountChangedGray8(pFrame, m_vReference.data(), nSamples, static_cast<BYTE>(min(255u, m_threshold.nTolerance)), nMaxChanged);
+            bDuplicate = (nChanged <= nMaxChanged);
+        }
+    }
+
+    if (bDuplicate)
+    {
+        ++m_nDuplicates;
+        return true;
+    }
+
+    // The reference keeps its capacity, so only the first frame of a stream allocates
+    m_vReference.assign(pFrame, pFrame + cbFrame);
+    m_nReferenceTime = nTime;
+    m_nReferenceChecksum = nChecksum;
+    m_bReference = true;
+    return false;
+}
@@ -0,0 +1,107 @@
+// FrameDedup.h
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Deduplication of static frames: frames which repeat the previous recorded frame of their stream
+
+
+#pragma once
+
+#include <windows.h>
+#include <vector>
+
+/// The FrameDedupExtension value specifies the file extension of duplicate images
+#define FrameDedupExtension L"kvs"
+
+/// The FrameDedupMaxHeaderSize value specifies the size (in bytes) which holds any duplicate header
+#define FrameDedupMaxHeaderSize 64
+
+/// Which frames repeat their reference. A sample (a pixel of a depth or infrared frame, a channel
+/// of a color frame) is unchanged within nTolerance of the reference, and a frame repeats it
+/// with at most nChangedSamples of 10000 samples changed. Zero for both takes identical frames
+/// only, which are found by their checksum.
+struct FrameDedupThreshold
+{
+    UINT32                  nTolerance;         // largest unchanged difference (depth: mm, infrared and color: levels)
+    UINT32                  nChangedSamples;    // changed samples per 10000 samples
+};
+
+/// <summary>
+/// Format a duplicate image, which has a PGM-like header "KS\n<width> <height>\n<time>\n" (the
+/// time of the frame it repeats, in seconds as in the file names) and no data
+/// </summary>
+/// <param name="pDest">destination of the header</param>
+/// <param name="lWidth">width (in pixels) of the frame</param>
+/// <param name="lHeight">height (in pixels) of the frame</param>
+/// <param name="nReferenceTime">time of the repeated frame relative to the record start (unit: 100 ns)</param>
+/// <returns>size (in bytes) of the image</returns>
+DWORD FormatDuplicateHeader(BYTE* pDest, LONG lWidth, LONG lHeight, INT64 nReferenceTime);
+
+/// Finds the frames of a stream which repeat the last frame that did not. That frame is the
+/// reference: it is recorded as usual, and the frames repeating it only refer to it, so a
+/// static scene is never compared against a drifting one.
+class FrameDeduplicator
+{
+public:
+    /// <summary>
+    /// Constructor, the deduplicator is off
+    /// </summary>
+    FrameDeduplicator();
+
+    /// <summary>
+    /// Start a new stream, whose first frame is a reference
+    /// </summary>
+    /// <param name="threshold">which frames repeat their reference</param>
+    /// <param name="bEnabled">whether frames are compared at all</param>
+    void                    Reset(const FrameDedupThreshold& threshold, bool bEnabled);
+
+    /// <summary>
+    /// Compare a frame with the reference, and take it as the reference unless it repeats it
+    /// </summary>
+    /// <param name="pFrame">pixel data of the frame, big-endian for 16-bit frames</param>
+    /// <param name="cbFrame">size (in bytes) of the pixel data</param>
+    /// <param name="bGray16">whether the samples are 16-bit (depth, infrared) or 8-bit (color)</param>
+    /// <param name="nChecksum">CRC32C of the pixel data</param>
+    /// <param name="nTime">time of the frame</param>
+    /// <returns>true if the frame repeats the reference</returns>
+    bool                    Deduplicate(const BYTE* pFrame, UINT32 cbFrame, bool bGray16, UINT32 nChecksum, INT64 nTime);
+
+    /// <summary>
+    /// Drop the reference after its frame was lost, so that no frame repeats it. The next frame
+    /// becomes the reference, the duplicates counted so far are kept.
+    /// </summary>
+    void                    DropReference() { m_bReference = false; }
+
+    /// <summary>
+    /// Check whether frames are compared
+    /// </summary>
+    /// <returns>true if the deduplicator is on</returns>
+    bool                    IsEnabled() const { return m_bEnabled; }
+
+    /// <summary>
+    /// Get the time of the reference
+    /// </summary>
+    /// <returns>time relative to the record start (unit: 100 ns)</returns>
+    INT64                   GetReferenceTime() const { return m_nReferenceTime; }
+
+    /// <summary>
+    /// Get the checksum of the reference, which is the one of any frame repeating it as read back
+    /// </summary>
+    /// <returns>CRC32C of the pixel data of the reference</returns>
+    UINT32                  GetReferenceChecksum() const { return m_nReferenceChecksum; }
+
+    /// <summary>
+    /// Get the number of frames which repeated their reference
+    /// </summary>
+    /// <returns>number of frames</returns>
+    UINT32                  GetDuplicateCount() const { return m_nDuplicates; }
+
+private:
+    std::vector<BYTE>       m_vReference;       // pixel data of the reference
+    FrameDedupThreshold     m_threshold;
+    INT64                   m_nReferenceTime;
+    UINT32                  m_nReferenceChecksum;
+    UINT32                  m_nDuplicates;
+    bool                    m_bReference;       // the reference is valid
+    bool                    m_bEnabled;
+};
@@ -0,0 +1,381 @@
+// FramePublisher.cpp
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Live frames in shared memory: a ring of frame slots per stream which the recorder publishes
+// to and local processes read from
+
+
+#include "stdafx.h"
+#include "FramePublisher.h"
+
+/// <summary>
+/// Get the slot of a frame
+/// </summary>
+/// <param name="pHeader">header of the shared memory</param>
+/// <param name="stream">stream of the frame</param>
+/// <param name="nFrame">number of the frame, from 1</param>
+/// <returns>header of the slot</returns>
+static FramePublisherFrame* GetFrameSlot(const FramePublisherHeader* pHeader, const FramePublisherStream& stream, LONG64 nFrame)
+{
+    BYTE* pBase = reinterpret_cast<BYTE*>(const_cast<FramePublisherHeader*>(pHeader));
+    return reinterpret_cast<FramePublisherFrame*>(pBase + stream.nOffset + UINT64((nFrame - 1) % stream.nSlots) * stream.cbSlot);
+}
+
+/// <summary>
+/// Check whether the process which published to a shared memory is still running
+/// </summary>
+/// <param name="nProcessId">process id, 0 if the publisher closed</param>
+/// <returns>true if the process runs</returns>
+static bool IsPublisherRunning(UINT32 nProcessId)
+{
+    if (!nProcessId)
+    {
+        return false;
+    }
+
+    HANDLE hProcess = OpenProcess(SYNCHRONIZE, FALSE, nProcessId);
+    if (!hProcess)
+    {
+        return false;
+    }
+    bool bRunning = (WAIT_TIMEOUT == WaitForSingleObject(hProcess, 0));
+    CloseHandle(hProcess);
+    return bRunning;
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+FramePublisher::FramePublisher() :
+    m_hMapping(NULL),
+    m_pHeader(NULL)
+{
+    for (int i = 0; i < FramePublisherStreams; ++i)
+    {
+        m_pAcquired[i] = NULL;
+    }
+}
+
+/// <summary>
+/// Destructor, closes the shared memory
+/// </summary>
+FramePublisher::~FramePublisher()
+{
+    Close();
+}
+
+/// <summary>
+/// Create the shared memory. A shared memory of the same layout which is left over from a
+/// recorder that exited (and is still mapped by readers) is taken over.
+/// </summary>
+/// <param name="szName">name of the shared memory</param>
+/// <param name="pFormats">layout of the frames of each stream</param>
+/// <param name="nSlots">number of frame slots per stream</param>
+/// <returns>indicates success or failure</returns>
+HRESULT FramePublisher::Create(LPCWSTR szName, const FramePublisherFormat pFormats[FramePublisherStreams], UINT32 nSlots)
+{
+    Close();
+
+    // The header takes a page of its own, so the slots stay page aligned
+    FramePublisherHeader header;
+    ZeroMemory(&header, sizeof(header));
+    memcpy(header.szMagic, "KV2LIVE", 8);
+    header.nVersion = FramePublisherVersion;
+    UINT64 cbMapping = (sizeof(FramePublisherHeader) + 4095) & ~4095ull;
+    for (int i = 0; i < FramePublisherStreams; ++i)
+    {
+        FramePublisherStream& stream = header.streams[i];
+        if (pFormats[i].cbFrame)
+        {
+            stream.format = pFormats[i];
+            stream.nSlots = max(2u, min(static_cast<UINT32>(FramePublisherMaxSlots), nSlots));
+            stream.cbSlot = (sizeof(FramePublisherFrame) + pFormats[i].cbFrame + 4095) & ~4095u;
+            stream.nOffset = cbMapping;
+            cbMapping += UINT64(stream.nSlots) * stream.cbSlot;
+        }
+    }
+
+    // Backed by the paging file, so the frames never go to disk unless memory runs short
+    m_hMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, DWORD(cbMapping >> 32), DWORD(cbMapping), szName);
+    if (!m_hMapping)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    bool bExisting = (ERROR_ALREADY_EXISTS == GetLastError());
+
+    // An existing shared memory smaller than ours fails to map
+    m_pHeader = reinterpret_cast<FramePublisherHeader*>(MapViewOfFile(m_hMapping, FILE_MAP_WRITE, 0, 0, SIZE_T(cbMapping)));
+    if (!m_pHeader)
+    {
+        HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+        Close();
+        return hr;
+    }
+
+    if (bExisting)
+    {
+        // Readers keep the frame numbers they have seen, so these go on where they stopped
+        bool bSameLayout = (0 == memcmp(m_pHeader->szMagic, header.szMagic, sizeof(header.szMagic))) && (m_pHeader->nVersion == header.nVersion);
+        for (int i = 0; i < FramePublisherStreams && bSameLayout; ++i)
+        {
+            const FramePublisherStream& stream = m_pHeader->streams[i];
+            bSameLayout = (0 == memcmp(&stream.format, &header.streams[i].format, sizeof(stream.format))) &&
+                stream.nSlots == header.streams[i].nSlots && stream.cbSlot == header.streams[i].cbSlot && stream.nOffset == header.streams[i].nOffset;
+        }
+
+        if (!bSameLayout || IsPublisherRunning(m_pHeader->nProcessId))
+        {
+            // The process id stays with the other publisher
+            UnmapViewOfFile(m_pHeader);
+            m_pHeader = NULL;
+            Close();
+            return HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS);
+        }
+    }
+    else
+    {
+        memcpy(m_pHeader, &header, sizeof(header));
+    }
+
+    // Readers take the shared memory as published once the process id is in
+    InterlockedExchange(reinterpret_cast<volatile LONG*>(&m_pHeader->nProcessId), static_cast<LONG>(GetCurrentProcessId()));
+    return S_OK;
+}
+
+/// <summary>
+/// Get the destination of the pixel data of the next frame of a stream, which readers see
+/// once it is committed
+/// </summary>
+/// <param name="nStream">stream of the frame</param>
+/// <returns>pointer into the shared memory, NULL if the stream is not published</returns>
+BYTE* FramePublisher::AcquireFrame(UINT32 nStream)
+{
+    if (!IsPublished(nStream))
+    {
+        return NULL;
+    }
+
+    // The odd sequence number tells readers of the slot that the frame they had is going away,
+    // before any of its pixel data is overwritten
+    LONG64 nFrame = m_pHeader->streams[nStream].nLatest + 1;
+    FramePublisherFrame* pSlot = GetFrameSlot(m_pHeader, m_pHeader->streams[nStream], nFrame);
+    InterlockedExchange64(&pSlot->nSequence, 2 * nFrame - 1);
+    m_pAcquired[nStream] = pSlot;
+    return reinterpret_cast<BYTE*>(pSlot) + sizeof(FramePublisherFrame);
+}
+
+/// <summary>
+/// Complete the frame returned by AcquireFrame
+/// </summary>
+/// <param name="nStream">stream of the frame</param>
+/// <param name="nTime">time stamp of the frame</param>
+void FramePublisher::CommitFrame(UINT32 nStream, INT64 nTime)
+{
+    FramePublisherFrame* pSlot = m_pAcquired[nStream];
+    if (!pSlot)
+    {
+        return;
+    }
+
+    FramePublisherStream& stream = m_pHeader->streams[nStream];
+    LONG64 nFrame = stream.nLatest + 1;
+    pSlot->nTime = nTime;
+    pSlot->cbData = stream.format.cbFrame;
+
+    // The interlocked exchanges are full barriers: the frame is complete before its sequence
+    // number is even, and that before it is the latest
+    InterlockedExchange64(&pSlot->nSequence, 2 * nFrame);
+    InterlockedExchange64(&stream.nLatest, nFrame);
+    m_pAcquired[nStream] = NULL;
+}
+
+/// <summary>
+/// Publish a frame of a stream
+/// </summary>
+/// <param name="nStream">stream of the frame</param>
+/// <param name="pFrame">pixel data, of the size of the stream format</param>
+/// <param name="nTime">time stamp of the frame</param>
+/// <returns>true if the stream is published</returns>
+bool FramePublisher::Publish(UINT32 nStream, const BYTE* pFrame, INT64 nTime)
+{
+    BYTE* pDest = AcquireFrame(nStream);
+    if (!pDest)
+    {
+        return false;
+    }
+
+    memcpy(pDest, pFrame, m_pHeader->streams[nStream].format.cbFrame);
+    CommitFrame(nStream, nTime);
+    return true;
+}
+
+/// <summary>
+/// Unmap and close the shared memory
+/// </summary>
+void FramePublisher::Close()
+{
+    if (m_pHeader)
+    {
+        // Readers which still map the shared memory see that no one publishes to it any more
+        InterlockedExchange(reinterpret_cast<volatile LONG*>(&m_pHeader->nProcessId), 0);
+        UnmapViewOfFile(m_pHeader);
+        m_pHeader = NULL;
+    }
+
+    if (m_hMapping)
+    {
+        CloseHandle(m_hMapping);
+        m_hMapping = NULL;
+    }
+
+    for (int i = 0; i < FramePublisherStreams; ++i)
+    {
+        m_pAcquired[i] = NULL;
+    }
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+FrameSubscriber::FrameSubscriber() :
+    m_hMapping(NULL),
+    m_pHeader(NULL),
+    m_nTorn(0)
+{
+}
+
+/// <summary>
+/// Destructor, closes the shared memory
+/// </summary>
+FrameSubscriber::~FrameSubscriber()
+{
+    if (m_pHeader)
+    {
+        UnmapViewOfFile(m_pHeader);
+    }
+
+    if (m_hMapping)
+    {
+        CloseHandle(m_hMapping);
+    }
+}
+
+/// <summary>
+/// Open the shared memory of a publisher
+/// </summary>
+/// <param name="szName">name of the shared memory</param>
+/// <returns>S_OK, HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND) if no publisher runs, otherwise failure</returns>
+HRESULT FrameSubscriber::Open(LPCWSTR szName)
+{
+    m_hMapping = OpenFileMappingW(FILE_MAP_READ, FALSE, szName);
+    if (!m_hMapping)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    // The whole shared memory is mapped, its size is the one of the view
+    m_pHeader = reinterpret_cast<const FramePublisherHeader*>(MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0));
+    if (!m_pHeader)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    // A publisher which has just created the shared memory may not have written the header yet
+    if (0 != memcmp(m_pHeader->szMagic, "KV2LIVE", 8) || FramePublisherVersion != m_pHeader->nVersion)
+    {
+        UnmapViewOfFile(m_pHeader);
+        m_pHeader = NULL;
+        return HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+    }
+
+    return S_OK;
+}
+
+/// <summary>
+/// Get the latest complete frame of a stream in place. The frame stays in its slot until
+/// the publisher comes round to it again, so it is used first and then checked by IsValid.
+/// </summary>
+/// <param name="nStream">stream</param>
+/// <param name="pView">receives the frame</param>
+/// <param name="nAfter">number of a frame which was read before, 0 for any frame</param>
+/// <returns>S_OK, S_FALSE if there is no new frame since nAfter, otherwise failure</returns>
+HRESULT FrameSubscriber::Acquire(UINT32 nStream, FrameView* pView, LONG64 nAfter)
+{
+    if (!m_pHeader || nStream >= FramePublisherStreams || !m_pHeader->streams[nStream].format.cbFrame)
+    {
+        return E_INVALIDARG;
+    }
+
+    const FramePublisherStream& stream = m_pHeader->streams[nStream];
+    for (int nTry = 0; nTry < 16; ++nTry)
+    {
+        LONG64 nFrame = stream.nLatest;
+        if (nFrame <= nAfter)
+        {
+            return S_FALSE;
+        }
+
+        // A sequence number other than the one of the frame means that the publisher has come
+        // round to the slot since the frame was the latest
+        const FramePublisherFrame* pSlot = GetFrameSlot(m_pHeader, stream, nFrame);
+        LONG64 nSequence = pSlot->nSequence;
+        MemoryBarrier();
+        pView->pData = reinterpret_cast<const BYTE*>(pSlot) + sizeof(FramePublisherFrame);
+        pView->cbData = pSlot->cbData;
+        pView->nTime = pSlot->nTime;
+        pView->nFrame = nFrame;
+        pView->pFormat = &stream.format;
+        if (nSequence == 2 * nFrame && IsValid(nStream, *pView))
+        {
+            return S_OK;
+        }
+    }
+
+    // The publisher laps this reader over and over
+    return HRESULT_FROM_WIN32(ERROR_BUSY);
+}
+
+/// <summary>
+/// Check whether a frame got by Acquire is still the one in its slot, so that whatever was
+/// read from it is consistent
+/// </summary>
+/// <param name="nStream">stream of the frame</param>
+/// <param name="view">the frame</param>
+/// <returns>true if the frame was not overwritten</returns>
+bool FrameSubscriber::IsValid(UINT32 nStream, const FrameView& view) const
+{
+    // Everything read from the frame is read before the sequence number is checked again
+    MemoryBarrier();
+    return GetFrameSlot(m_pHeader, m_pHeader->streams[nStream], view.nFrame)->nSequence == 2 * view.nFrame;
+}
+
+/// <summary>
+/// Copy the latest complete frame of a stream, retrying while the publisher overwrites it
+/// </summary>
+/// <param name="nStream">stream</param>
+/// <param name="pDest">receives the pixel data, of the size of the stream format</param>
+/// <param name="pView">receives the frame, whose pData is pDest</param>
+/// <param name="nAfter">number of a frame which was read before, 0 for any frame</param>
+/// <returns>S_OK, S_FALSE if there is no new frame since nAfter, otherwise failure</returns>
+HRESULT FrameSubscriber::Copy(UINT32 nStream, BYTE* pDest, FrameView* pView, LONG64 nAfter)
+{
+    for (int nTry = 0; nTry < 16; ++nTry)
+    {
+        HRESULT hr = Acquire(nStream, pView, nAfter);
+        if (S_OK != hr)
+        {
+            return hr;
+        }
+
+        memcpy(pDest, pView->pData, pView->cbData);
+        if (IsValid(nStream, *pView))
+        {
+            pView->pData = pDest;
+            return S_OK;
+        }
+        ++m_nTorn;
+    }
+
+    return HRESULT_FROM_WIN32(ERROR_BUSY);
+}
@@ -0,0 +1,235 @@
+// FramePublisher.h
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Live frames in shared memory: a ring of frame slots per stream which the recorder publishes
+// to and local processes read from
+
+
+#pragma once
+
+#include <windows.h>
+#include "RecordFile.h"
+
+/// The FramePublisherName value specifies the default name of the shared memory
+#define FramePublisherName L"Local\\KinectV2Recorder.Live"
+
+/// The FramePublisherVersion value specifies the version of the shared memory layout
+#define FramePublisherVersion 1
+
+/// The FramePublisherStreams value specifies the number of streams (infrared, depth, color)
+#define FramePublisherStreams 3
+
+/// The FramePublisherDefaultSlots value specifies the default number of frame slots per stream
+#define FramePublisherDefaultSlots 4
+
+/// The FramePublisherMaxSlots value specifies the largest number of frame slots per stream
+#define FramePublisherMaxSlots 16
+
+/// Layout of the frames of a stream, zero for a stream which is not published
+struct FramePublisherFormat
+{
+    UINT32                  nWidth;
+    UINT32                  nHeight;
+    UINT32                  nPixelFormat;       // RecordPixelFormat
+    UINT32                  cbFrame;            // size (in bytes) of the pixel data of a frame
+};
+
+/// A stream in the header of the shared memory
+struct FramePublisherStream
+{
+    FramePublisherFormat    format;
+    UINT32                  nSlots;
+    UINT32                  cbSlot;             // size (in bytes) of a frame slot, page aligned
+    UINT64                  nOffset;            // offset (in bytes) of the first slot from the start of the shared memory
+    volatile LONG64         nLatest;            // number of the latest complete frame, 0 before the first
+    UINT32                  nReserved[6];
+};
+
+/// Header at the start of the shared memory, which is followed by the slots of each stream
+struct FramePublisherHeader
+{
+    CHAR                    szMagic[8];         // "KV2LIVE"
+    UINT32                  nVersion;
+    UINT32                  nProcessId;         // process publishing the frames
+    FramePublisherStream    streams[FramePublisherStreams];
+};
+
+/// Header at the start of each frame slot, followed by the pixel data. Frame n of a stream
+/// goes to slot (n - 1) % nSlots, whose sequence number is 2n - 1 while it is written and 2n
+/// once it is complete: a frame read between two equal even sequence numbers is consistent.
+struct FramePublisherFrame
+{
+    volatile LONG64         nSequence;
+    INT64                   nTime;              // time stamp of the sensor (unit: 100 ns)
+    UINT32                  cbData;             // size (in bytes) of the pixel data
+    UINT32                  nReserved[11];
+};
+
+/// A frame in the shared memory as seen by a reader
+struct FrameView
+{
+    const BYTE*             pData;              // pixel data, in the shared memory
+    UINT32                  cbData;
+    INT64                   nTime;
+    LONG64                  nFrame;             // number of the frame in its stream
+    const FramePublisherFormat* pFormat;
+};
+
+/// Publishes the frames of the recorder to shared memory. The writer never waits on readers:
+/// it overwrites the oldest slot of a stream, and a reader which falls behind finds a sequence
+/// number which changed and retries with the latest frame.
+class FramePublisher
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    FramePublisher();
+
+    /// <summary>
+    /// Destructor, closes the shared memory
+    /// </summary>
+    ~FramePublisher();
+
+    /// <summary>
+    /// Create the shared memory. A shared memory of the same layout which is left over from a
+    /// recorder that exited (and is still mapped by readers) is taken over.
+    /// </summary>
+    /// <param name="szName">name of the shared memory</param>
+    /// <param name="pFormats">layout of the frames of each stream</param>
+    /// <param name="nSlots">number of frame slots per stream</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 Create(LPCWSTR szName, const FramePublisherFormat pFormats[FramePublisherStreams], UINT32 nSlots);
+
+    /// <summary>
+    /// Get the destination of the pixel data of the next frame of a stream, which readers see
+    /// once it is committed
+    /// </summary>
+    /// <param name="nStream">stream of the frame</param>
+    /// <returns>pointer into the shared memory, NULL if the stream is not published</returns>
+    BYTE*                   AcquireFrame(UINT32 nStream);
+
+    /// <summary>
+    /// Complete the frame returned by AcquireFrame
+    /// </summary>
+    /// <param name="nStream">stream of the frame</param>
+    /// <param name="nTime">time stamp of the frame</param>
+    void                    CommitFrame(UINT32 nStream, INT64 nTime);
+
+    /// <summary>
+    /// Publish a frame of a stream
+    /// </summary>
+    /// <param name="nStream">stream of the frame</param>
+    /// <param name="pFrame">pixel data, of the size of the stream format</param>
+    /// <param name="nTime">time stamp of the frame</param>
+    /// <returns>true if the stream is published</returns>
+    bool                    Publish(UINT32 nStream, const BYTE* pFrame, INT64 nTime);
+
+    /// <summary>
+    /// Check whether a stream is published
+    /// </summary>
+    /// <param name="nStream">stream</param>
+    /// <returns>true if the stream is published</returns>
+    bool                    IsPublished(UINT32 nStream) const { return m_pHeader && nStream < FramePublisherStreams && m_pHeader->streams[nStream].format.cbFrame; }
+
+    /// <summary>
+    /// Get the number of frames published to a stream
+    /// </summary>
+    /// <param name="nStream">stream</param>
+    /// <returns>number of frames</returns>
+    LONG64                  GetFrameCount(UINT32 nStream) const { return m_pHeader ? m_pHeader->streams[nStream].nLatest : 0; }
+
+private:
+    HANDLE                  m_hMapping;
+    FramePublisherHeader*   m_pHeader;
+    FramePublisherFrame*    m_pAcquired[FramePublisherStreams];   // slot of the frame being written
+
+    /// <summary>
+    /// Unmap and close the shared memory
+    /// </summary>
+    void                    Close();
+};
+
+/// Reads the frames of a publisher in place. A reader only maps the shared memory for reading,
+/// so it cannot hold up or disturb the recorder.
+class FrameSubscriber
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    FrameSubscriber();
+
+    /// <summary>
+    /// Destructor, closes the shared memory
+    /// </summary>
+    ~FrameSubscriber();
+
+    /// <summary>
+    /// Open the shared memory of a publisher
+    /// </summary>
+    /// <param name="szName">name of the shared memory</param>
+    /// <returns>S_OK, HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND) if no publisher runs, otherwise failure</returns>
+    HRESULT                 Open(LPCWSTR szName);
+
+    /// <summary>
+    /// Get the layout of the frames of a stream
+    /// </summary>
+    /// <param name="nStream">stream</param>
+    /// <returns>layout, zero if the stream is not published</returns>
+    const FramePublisherFormat& GetFormat(UINT32 nStream) const { return m_pHeader->streams[nStream].format; }
+
+    /// <summary>
+    /// Get the process which publishes to the shared memory
+    /// </summary>
+    /// <returns>process id, 0 if the publisher has closed</returns>
+    UINT32                  GetPublisherProcessId() const { return m_pHeader->nProcessId; }
+
+    /// <summary>
+    /// Get the number of the latest complete frame of a stream
+    /// </summary>
+    /// <param name="nStream">stream</param>
+    /// <returns>number of the frame, 0 before the first</returns>
+    LONG64                  GetLatestFrame(UINT32 nStream) const { return m_pHeader->streams[nStream].nLatest; }
+
+    /// <summary>
+    /// Get the latest complete frame of a stream in place. The frame stays in its slot until
+    /// the publisher comes round to it again, so it is used first and then checked by IsValid.
+    /// </summary>
+    /// <param name="nStream">stream</param>
+    /// <param name="pView">receives the frame</param>
+    /// <param name="nAfter">number of a frame which was read before, 0 for any frame</param>
+    /// <returns>S_OK, S_FALSE if there is no new frame since nAfter, otherwise failure</returns>
+    HRESULT                 Acquire(UINT32 nStream, FrameView* pView, LONG64 nAfter = 0);
+
+    /// <summary>
+    /// Check whether a frame got by Acquire is still the one in its slot, so that whatever was
+    /// read from it is consistent
+    /// </summary>
+    /// <param name="nStream">stream of the frame</param>
+    /// <param name="view">the frame</param>
+    /// <returns>true if the frame was not overwritten</returns>
+    bool                    IsValid(UINT32 nStream, const FrameView& view) const;
+
+    /// <summary>
+    /// Copy the latest complete frame of a stream, retrying while the publisher overwrites it
+    /// </summary>
+    /// <param name="nStream">stream</param>
+    /// <param name="pDest">receives the pixel data, of the size of the stream format</param>
+    /// <param name="pView">receives the frame, whose pData is pDest</param>
+    /// <param name="nAfter">number of a frame which was read before, 0 for any frame</param>
+    /// <returns>S_OK, S_FALSE if there is no new frame since nAfter, otherwise failure</returns>
+    HRESULT                 Copy(UINT32 nStream, BYTE* pDest, FrameView* pView, LONG64 nAfter = 0);
+
+    /// <summary>
+    /// Get the number of frames which were overwritten while they were read
+    /// </summary>
+    /// <returns>number of frames</returns>
+    UINT32                  GetTornCount() const { return m_nTorn; }
+
+private:
+    HANDLE                  m_hMapping;
+    const FramePublisherHeader* m_pHeader;
+    UINT32                  m_nTorn;
+};
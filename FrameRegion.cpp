@@ -0,0 +1,202 @@
+// FrameRegion.cpp
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Region of interest cropping and 2x2 binning of the recorded frames
+
+
+#include "stdafx.h"
+#include "FrameRegion.h"
+
+/// <summary>
+/// Set a geometry which records the whole frame
+/// </summary>
+/// <param name="nFullWidth">width (in pixels) of the sensor frame</param>
+/// <param name="nFullHeight">height (in pixels) of the sensor frame</param>
+/// <param name="pGeometry">receives the geometry</param>
+void SetFullGeometry(UINT32 nFullWidth, UINT32 nFullHeight, RecordGeometry* pGeometry)
+{
+    pGeometry->nX = 0;
+    pGeometry->nY = 0;
+    pGeometry->nWidth = nFullWidth;
+    pGeometry->nHeight = nFullHeight;
+    pGeometry->nBinning = 1;
+}
+
+/// <summary>
+/// Parse a region of interest "x,y,width,height" and fit it to the frame: it is clipped to the
+/// frame, and shrunk so that its width is a multiple of 4 * nBinning (rows of bitmaps stay
+/// 4-byte aligned) and its height a multiple of nBinning. An empty or invalid region selects
+/// the whole frame.
+/// </summary>
+/// <param name="szRegion">region of interest in pixels of the mirrored frame, may be empty</param>
+/// <param name="nBinning">binning, 1 or 2</param>
+/// <param name="nFullWidth">width (in pixels) of the sensor frame</param>
+/// <param name="nFullHeight">height (in pixels) of the sensor frame</param>
+/// <param name="pGeometry">receives the geometry</param>
+void ParseRecordGeometry(LPCWSTR szRegion, UINT nBinning, UINT32 nFullWidth, UINT32 nFullHeight, RecordGeometry* pGeometry)
+{
+    SetFullGeometry(nFullWidth, nFullHeight, pGeometry);
+    pGeometry->nBinning = (2 == nBinning) ? 2 : 1;
+
+    int nX = 0;
+    int nY = 0;
+    int nWidth = 0;
+    int nHeight = 0;
+    if (!szRegion || 4 != swscanf_s(szRegion, L"%d,%d,%d,%d", &nX, &nY, &nWidth, &nHeight) ||
+        nX < 0 || nY < 0 || nWidth <= 0 || nHeight <= 0 || nX >= static_cast<int>(nFullWidth) || nY >= static_cast<int>(nFullHeight))
+    {
+        return;
+    }
+
+    UINT32 nStepX = 4 * pGeometry->nBinning;
+    UINT32 nStepY = pGeometry->nBinning;
+    UINT32 nFitWidth = min(static_cast<UINT32>(nWidth), nFullWidth - nX) / nStepX * nStepX;
+    UINT32 nFitHeight = min(static_cast<UINT32>(nHeight), nFullHeight - nY) / nStepY * nStepY;
+    if (nFitWidth && nFitHeight)
+    {
+        pGeometry->nX = nX;
+        pGeometry->nY = nY;
+        pGeometry->nWidth = nFitWidth;
+        pGeometry->nHeight = nFitHeight;
+    }
+}
+
+/// <summary>
+/// Crop and bin an infrared frame as it comes from the sensor: mirrored, binned by averaging
+/// and converted to big-endian in a single pass
+/// </summary>
+/// <param name="pSensor">sensor frame (not mirrored)</param>
+/// <param name="nFullWidth">width (in pixels) of the sensor frame</param>
+/// <param name="geometry">recorded region</param>
+/// <param name="pDest">receives the recorded frame</param>
+void CropInfrared(const UINT16* pSensor, UINT32 nFullWidth, const RecordGeometry& geometry, UINT16* pDest)
+{
+    UINT32 nWidth = GetGeometryWidth(geometry);
+    UINT32 nHeight = GetGeometryHeight(geometry);
+
+    // Column x of the mirrored frame is column nFullWidth - 1 - x of the sensor frame, so the
+    // rows are read backwards from the right edge of the region
+    for (UINT32 i = 0; i < nHeight; ++i)
+    {
+        const UINT16* pRow = pSensor + (geometry.nY + i * geometry.nBinning) * nFullWidth + (nFullWidth - 1 - geometry.nX);
+        if (1 == geometry.nBinning)
+        {
+            for (UINT32 j = 0; j < nWidth; ++j)
+            {
+                UINT16 value = *pRow--;
+                *pDest++ = (value >> 8) | (value << 8);
+            }
+        }
+        else
+        {
+            const UINT16* pNextRow = pRow + nFullWidth;
+            for (UINT32 j = 0; j < nWidth; ++j)
+            {
+                UINT32 nSum = pRow[0] + pRow[-1] + pNextRow[0] + pNextRow[-1];
+                UINT16 value = static_cast<UINT16>((nSum + 2) >> 2);
+                *pDest++ = (value >> 8) | (value << 8);
+                pRow -= 2;
+                pNextRow -= 2;
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Crop and bin a depth frame as it comes from the sensor: mirrored, clamped to the reliable
+/// range, binned by averaging the valid pixels and converted to big-endian in a single pass
+/// </summary>
+/// <param name="pSensor">sensor frame (not mirrored)</param>
+/// <param name="nFullWidth">width (in pixels) of the sensor frame</param>
+/// <param name="geometry">recorded region</param>
+/// <param name="nMinDepth">minimum reliable depth</param>
+/// <param name="nMaxDepth">maximum reliable depth</param>
+/// <param name="pDest">receives the recorded frame, 0 where no pixel is valid</param>
+void CropDepth(const UINT16* pSensor, UINT32 nFullWidth, const RecordGeometry& geometry, USHORT nMinDepth, USHORT nMaxDepth, UINT16* pDest)
+{
+    UINT32 nWidth = GetGeometryWidth(geometry);
+    UINT32 nHeight = GetGeometryHeight(geometry);
+
+    for (UINT32 i = 0; i < nHeight; ++i)
+    {
+        const UINT16* pRow = pSensor + (geometry.nY + i * geometry.nBinning) * nFullWidth + (nFullWidth - 1 - geometry.nX);
+        if (1 == geometry.nBinning)
+        {
+            for (UINT32 j = 0; j < nWidth; ++j)
+            {
+                USHORT depth = *pRow--;
+                if ((depth < nMinDepth) || (depth > nMaxDepth))
+                {
+                    depth = 0;
+                }
+                *pDest++ = (depth >> 8) | (depth << 8);
+            }
+        }
+        else
+        {
+            // Averaging invalid pixels in would make up depths which were never measured, so
+            // only the valid ones count
+            const UINT16* pNextRow = pRow + nFullWidth;
+            for (UINT32 j = 0; j < nWidth; ++j)
+            {
+                USHORT samples[4] = { pRow[0], pRow[-1], pNextRow[0], pNextRow[-1] };
+                UINT32 nSum = 0;
+                UINT32 nValid = 0;
+                for (int k = 0; k < 4; ++k)
+                {
+                    if ((samples[k] >= nMinDepth) && (samples[k] <= nMaxDepth))
+                    {
+                        nSum += samples[k];
+                        ++nValid;
+                    }
+                }
+                USHORT depth = nValid ? static_cast<USHORT>((nSum + nValid / 2) / nValid) : 0;
+                *pDest++ = (depth >> 8) | (depth << 8);
+                pRow -= 2;
+                pNextRow -= 2;
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Crop and bin a color frame which is already mirrored for display
+/// </summary>
+/// <param name="pMirrored">mirrored BGRA frame</param>
+/// <param name="nFullWidth">width (in pixels) of the frame</param>
+/// <param name="geometry">recorded region</param>
+/// <param name="bRedFirst">true for red first (as in PPM), false for blue first (as in BMP)</param>
+/// <param name="pDest">receives the recorded frame</param>
+void CropColor(const RGBQUAD* pMirrored, UINT32 nFullWidth, const RecordGeometry& geometry, bool bRedFirst, RGBTRIPLE* pDest)
+{
+    UINT32 nWidth = GetGeometryWidth(geometry);
+    UINT32 nHeight = GetGeometryHeight(geometry);
+
+    for (UINT32 i = 0; i < nHeight; ++i)
+    {
+        const RGBQUAD* pRow = pMirrored + (geometry.nY + i * geometry.nBinning) * nFullWidth + geometry.nX;
+        const RGBQUAD* pNextRow = pRow + nFullWidth;
+        for (UINT32 j = 0; j < nWidth; ++j)
+        {
+            UINT32 nRed = pRow->rgbRed;
+            UINT32 nGreen = pRow->rgbGreen;
+            UINT32 nBlue = pRow->rgbBlue;
+            if (2 == geometry.nBinning)
+            {
+                nRed = (nRed + pRow[1].rgbRed + pNextRow[0].rgbRed + pNextRow[1].rgbRed + 2) >> 2;
+                nGreen = (nGreen + pRow[1].rgbGreen + pNextRow[0].rgbGreen + pNextRow[1].rgbGreen + 2) >> 2;
+                nBlue = (nBlue + pRow[1].rgbBlue + pNextRow[0].rgbBlue + pNextRow[1].rgbBlue + 2) >> 2;
+            }
+
+            // The channel order of PPM is the reverse of RGBTRIPLE
+            pDest->rgbtRed = static_cast<BYTE>(bRedFirst ? nBlue : nRed);
+            pDest->rgbtGreen = static_cast<BYTE>(nGreen);
+            pDest->rgbtBlue = static_cast<BYTE>(bRedFirst ? nRed : nBlue);
+            ++pDest;
+
+            pRow += geometry.nBinning;
+            pNextRow += geometry.nBinning;
+        }
+    }
+}
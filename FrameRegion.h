@@ -0,0 +1,96 @@
+// FrameRegion.h
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Region of interest cropping and 2x2 binning of the recorded frames
+
+
+#pragma once
+
+#include <windows.h>
+#include "RecordFile.h"
+
+/// <summary>
+/// Set a geometry which records the whole frame
+/// </summary>
+/// <param name="nFullWidth">width (in pixels) of the sensor frame</param>
+/// <param name="nFullHeight">height (in pixels) of the sensor frame</param>
+/// <param name="pGeometry">receives the geometry</param>
+void SetFullGeometry(UINT32 nFullWidth, UINT32 nFullHeight, RecordGeometry* pGeometry);
+
+/// <summary>
+/// Parse a region of interest "x,y,width,height" and fit it to the frame: it is clipped to the
+/// frame, and shrunk so that its width is a multiple of 4 * nBinning (rows of bitmaps stay
+/// 4-byte aligned) and its height a multiple of nBinning. An empty or invalid region selects
+/// the whole frame.
+/// </summary>
+/// <param name="szRegion">region of interest in pixels of the mirrored frame, may be empty</param>
+/// <param name="nBinning">binning, 1 or 2</param>
+/// <param name="nFullWidth">width (in pixels) of the sensor frame</param>
+/// <param name="nFullHeight">height (in pixels) of the sensor frame</param>
+/// <param name="pGeometry">receives the geometry</param>
+void ParseRecordGeometry(LPCWSTR szRegion, UINT nBinning, UINT32 nFullWidth, UINT32 nFullHeight, RecordGeometry* pGeometry);
+
+/// <summary>
+/// Check if a geometry records the whole frame as it is
+/// </summary>
+/// <param name="geometry">geometry to check</param>
+/// <param name="nFullWidth">width (in pixels) of the sensor frame</param>
+/// <param name="nFullHeight">height (in pixels) of the sensor frame</param>
+/// <returns>true for the whole frame without binning</returns>
+inline bool IsFullGeometry(const RecordGeometry& geometry, UINT32 nFullWidth, UINT32 nFullHeight)
+{
+    return 0 == geometry.nX && 0 == geometry.nY && nFullWidth == geometry.nWidth && nFullHeight == geometry.nHeight && 1 == geometry.nBinning;
+}
+
+/// <summary>
+/// Get the width of the recorded frames
+/// </summary>
+/// <param name="geometry">geometry of the stream</param>
+/// <returns>width (in pixels) after binning</returns>
+inline UINT32 GetGeometryWidth(const RecordGeometry& geometry)
+{
+    return geometry.nWidth / geometry.nBinning;
+}
+
+/// <summary>
+/// Get the height of the recorded frames
+/// </summary>
+/// <param name="geometry">geometry of the stream</param>
+/// <returns>height (in pixels) after binning</returns>
+inline UINT32 GetGeometryHeight(const RecordGeometry& geometry)
+{
+    return geometry.nHeight / geometry.nBinning;
+}
+
+/// <summary>
+/// Crop and bin an infrared frame as it comes from the sensor: mirrored, binned by averaging
+/// and converted to big-endian in a single pass
+/// </summary>
+/// <param name="pSensor">sensor frame (not mirrored)</param>
+/// <param name="nFullWidth">width (in pixels) of the sensor frame</param>
+/// <param name="geometry">recorded region</param>
+/// <param name="pDest">receives the recorded frame</param>
+void CropInfrared(const UINT16* pSensor, UINT32 nFullWidth, const RecordGeometry& geometry, UINT16* pDest);
+
+/// <summary>
+/// Crop and bin a depth frame as it comes from the sensor: mirrored, clamped to the reliable
+/// range, binned by averaging the valid pixels and converted to big-endian in a single pass
+/// </summary>
+/// <param name="pSensor">sensor frame (not mirrored)</param>
+/// <param name="nFullWidth">width (in pixels) of the sensor frame</param>
+/// <param name="geometry">recorded region</param>
+/// <param name="nMinDepth">minimum reliable depth</param>
+/// <param name="nMaxDepth">maximum reliable depth</param>
+/// <param name="pDest">receives the recorded frame, 0 where no pixel is valid</param>
+void CropDepth(const UINT16* pSensor, UINT32 nFullWidth, const RecordGeometry& geometry, USHORT nMinDepth, USHORT nMaxDepth, UINT16* pDest);
+
+/// <summary>
+/// Crop and bin a color frame which is already mirrored for display
+/// </summary>
+/// <param name="pMirrored">mirrored BGRA frame</param>
+/// <param name="nFullWidth">width (in pixels) of the frame</param>
+/// <param name="geometry">recorded region</param>
+/// <param name="bRedFirst">true for red first (as in PPM), false for blue first (as in BMP)</param>
+/// <param name="pDest">receives the recorded frame</param>
+void CropColor(const RGBQUAD* pMirrored, UINT32 nFullWidth, const RecordGeometry& geometry, bool bRedFirst, RGBTRIPLE* pDest);
@@ -0,0 +1,253 @@
+// FrameSlab.cpp
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Frame slots of a stream in one allocation, placed on a NUMA node and backed by large pages
+// where available
+
+
+#include "stdafx.h"
+#include <psapi.h>
+#include <strsafe.h>
+#include <vector>
+#include "FrameSlab.h"
+#include "FrameWriter.h"
+
+#pragma comment (lib, "psapi.lib")
+
+/// <summary>
+/// Enable the privilege to lock pages in memory, which large pages need
+/// </summary>
+/// <returns>true if the account of the process holds the privilege</returns>
+static bool EnableLockMemoryPrivilege()
+{
+    HANDLE hToken = NULL;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &hToken))
+    {
+        return false;
+    }
+
+    // AdjustTokenPrivileges succeeds with ERROR_NOT_ALL_ASSIGNED if the account lacks the privilege
+    TOKEN_PRIVILEGES privileges = { 0 };
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    bool bEnabled = LookupPrivilegeValueW(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+        AdjustTokenPrivileges(hToken, FALSE, &privileges, 0, NULL, NULL) &&
+        ERROR_SUCCESS == GetLastError();
+    CloseHandle(hToken);
+    return bEnabled;
+}
+
+/// <summary>
+/// Allocate committed memory, on a node if one is preferred
+/// </summary>
+/// <param name="cbSlab">size (in bytes) of the memory</param>
+/// <param name="flAllocationType">MEM_LARGE_PAGES or 0</param>
+/// <param name="nNode">preferred node, FrameSlabAnyNode for none</param>
+/// <returns>pointer to the memory, NULL on failure</returns>
+static BYTE* AllocateSlab(SIZE_T cbSlab, DWORD flAllocationType, DWORD nNode)
+{
+    DWORD flType = MEM_COMMIT | MEM_RESERVE | flAllocationType;
+    if (FrameSlabAnyNode == nNode)
+    {
+        return reinterpret_cast<BYTE*>(VirtualAlloc(NULL, cbSlab, flType, PAGE_READWRITE));
+    }
+    return reinterpret_cast<BYTE*>(VirtualAllocExNuma(GetCurrentProcess(), NULL, cbSlab, flType, PAGE_READWRITE, nNode));
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+FrameSlab::FrameSlab() :
+    m_pBase(NULL),
+    m_nSlots(0),
+    m_cbSlot(0),
+    m_cbSlab(0),
+    m_nNode(FrameSlabAnyNode),
+    m_bLargePages(false)
+{
+}
+
+/// <summary>
+/// Destructor, frees the slots
+/// </summary>
+FrameSlab::~FrameSlab()
+{
+    Destroy();
+}
+
+/// <summary>
+/// Allocate the slots, with large pages and on the node if possible and falling back to
+/// small pages and then to no preferred node. Every page is touched right away, so that the
+/// pages are in place before the first frame.
+/// </summary>
+/// <param name="nSlots">number of slots</param>
+/// <param name="cbSlot">size (in bytes) of a slot, as returned by GetFrameSlotSize</param>
+/// <param name="nNode">preferred node, FrameSlabAnyNode for none</param>
+/// <param name="bLargePages">back the slots by large pages if the process may lock them</param>
+/// <returns>indicates success or failure</returns>
+HRESULT FrameSlab::Create(UINT32 nSlots, DWORD cbSlot, DWORD nNode, bool bLargePages)
+{
+    Destroy();
+
+    SIZE_T cbSlab = static_cast<SIZE_T>(nSlots) * cbSlot;
+    if (!cbSlab)
+    {
+        return E_INVALIDARG;
+    }
+
+    // Large pages (2 MB on x64) are locked in memory and allocated right away, whole pages only
+    SIZE_T cbLargePage = GetLargePageMinimum();
+    if (bLargePages && cbLargePage && EnableLockMemoryPrivilege())
+    {
+        SIZE_T cbLargeSlab = (cbSlab + cbLargePage - 1) & ~(cbLargePage - 1);
+        m_pBase = AllocateSlab(cbLargeSlab, MEM_LARGE_PAGES, nNode);
+        m_cbSlab = cbLargeSlab;
+        m_bLargePages = (NULL != m_pBase);
+    }
+    if (!m_pBase)
+    {
+        m_pBase = AllocateSlab(cbSlab, 0, nNode);
+        m_cbSlab = cbSlab;
+    }
+    if (!m_pBase && FrameSlabAnyNode != nNode)
+    {
+        nNode = FrameSlabAnyNode;
+        m_pBase = AllocateSlab(cbSlab, 0, nNode);
+    }
+    if (!m_pBase)
+    {
+        m_cbSlab = 0;
+        return E_OUTOFMEMORY;
+    }
+
+    m_nSlots = nSlots;
+    m_cbSlot = cbSlot;
+    m_nNode = nNode;
+
+    // Small pages come from the preferred node (or the node of this thread) as they are touched
+    volatile BYTE* pPage = m_pBase;
+    for (SIZE_T i = 0; i < m_cbSlab; i += SectorAlignment)
+    {
+        pPage[i] = 0;
+    }
+
+    return S_OK;
+}
+
+/// <summary>
+/// Free the slots
+/// </summary>
+void FrameSlab::Destroy()
+{
+    if (m_pBase)
+    {
+        VirtualFree(m_pBase, 0, MEM_RELEASE);
+        m_pBase = NULL;
+    }
+    m_nSlots = 0;
+    m_cbSlot = 0;
+    m_cbSlab = 0;
+    m_nNode = FrameSlabAnyNode;
+    m_bLargePages = false;
+}
+
+/// <summary>
+/// Get the placement of the slab by querying the working set, page by page
+/// </summary>
+/// <param name="pStats">receives the placement</param>
+void FrameSlab::GetStats(FrameSlabStats* pStats) const
+{
+    ZeroMemory(pStats, sizeof(*pStats));
+    pStats->nSlots = m_nSlots;
+    pStats->cbSlot = m_cbSlot;
+    pStats->cbSlab = m_cbSlab;
+    pStats->nNode = m_nNode;
+    pStats->bLargePages = m_bLargePages;
+    if (!m_pBase)
+    {
+        return;
+    }
+
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+    SIZE_T cbPage = m_bLargePages ? GetLargePageMinimum() : systemInfo.dwPageSize;
+    std::vector<PSAPI_WORKING_SET_EX_INFORMATION> vPages(m_cbSlab / cbPage);
+    for (size_t i = 0; i < vPages.size(); ++i)
+    {
+        vPages[i].VirtualAddress = m_pBase + i * cbPage;
+    }
+
+    pStats->nPages = static_cast<UINT32>(vPages.size());
+    if (!QueryWorkingSetEx(GetCurrentProcess(), vPages.data(), static_cast<DWORD>(vPages.size() * sizeof(PSAPI_WORKING_SET_EX_INFORMATION))))
+    {
+        pStats->nPagesNotResident = pStats->nPages;
+        return;
+    }
+
+    for (size_t i = 0; i < vPages.size(); ++i)
+    {
+        if (!vPages[i].VirtualAttributes.Valid)
+        {
+            ++pStats->nPagesNotResident;
+        }
+        else
+        {
+            ++pStats->nNodePages[vPages[i].VirtualAttributes.Node % FrameSlabMaxNodes];
+        }
+    }
+}
+
+/// <summary>
+/// Format the resident pages of a slab per node, such as "0:96 1:4"
+/// </summary>
+/// <param name="stats">placement of the slab</param>
+/// <param name="szPages">receives the pages per node</param>
+/// <param name="cchPages">size (in characters) of szPages</param>
+void FormatSlabPages(const FrameSlabStats& stats, WCHAR* szPages, size_t cchPages)
+{
+    szPages[0] = L'\0';
+    for (int i = 0; i < FrameSlabMaxNodes; ++i)
+    {
+        if (stats.nNodePages[i])
+        {
+            WCHAR szNode[32];
+            StringCchPrintfW(szNode, _countof(szNode), szPages[0] ? L" %d:%u" : L"%d:%u", i, stats.nNodePages[i]);
+            StringCchCatW(szPages, cchPages, szNode);
+        }
+    }
+}
+
+/// <summary>
+/// Get the NUMA node of a set of cores
+/// </summary>
+/// <param name="nAffinity">cores (logical processors of the first processor group)</param>
+/// <returns>node of all the cores, FrameSlabAnyNode if they are on several nodes</returns>
+DWORD GetAffinityNode(DWORD_PTR nAffinity)
+{
+    DWORD nNode = FrameSlabAnyNode;
+    for (int i = 0; i < static_cast<int>(sizeof(DWORD_PTR) * 8); ++i)
+    {
+        UCHAR nProcessorNode = 0;
+        if (!((nAffinity >> i) & 1) || !GetNumaProcessorNode(static_cast<UCHAR>(i), &nProcessorNode))
+        {
+            continue;
+        }
+        if (FrameSlabAnyNode != nNode && nNode != nProcessorNode)
+        {
+            return FrameSlabAnyNode;
+        }
+        nNode = nProcessorNode;
+    }
+    return nNode;
+}
+
+/// <summary>
+/// Get the number of NUMA nodes
+/// </summary>
+/// <returns>number of nodes, 1 without NUMA</returns>
+DWORD GetNodeCount()
+{
+    ULONG nHighestNode = 0;
+    return GetNumaHighestNodeNumber(&nHighestNode) ? nHighestNode + 1 : 1;
+}
@@ -0,0 +1,107 @@
+// FrameSlab.h
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Frame slots of a stream in one allocation, placed on a NUMA node and backed by large pages
+// where available
+
+
+#pragma once
+
+#include <windows.h>
+
+/// The FrameSlabAnyNode value specifies a slab without a preferred node, whose pages go to the
+/// node which first touches them
+#define FrameSlabAnyNode 0xFFFFFFFF
+
+/// The FrameSlabMaxNodes value specifies the number of nodes the placement statistics tell apart
+#define FrameSlabMaxNodes 64
+
+/// Placement of a slab as found in the working set
+struct FrameSlabStats
+{
+    UINT32                  nSlots;
+    DWORD                   cbSlot;
+    UINT64                  cbSlab;             // size (in bytes) of the allocation
+    DWORD                   nNode;              // preferred node, FrameSlabAnyNode for none
+    bool                    bLargePages;        // backed by large pages
+    UINT32                  nPages;             // pages of the slab (of the size it is backed by)
+    UINT32                  nNodePages[FrameSlabMaxNodes];  // resident pages per node
+    UINT32                  nPagesNotResident;  // pages which were not touched yet or are paged out
+};
+
+/// The frame slots of a stream in a single allocation, allocated on a NUMA node so that the
+/// threads on that node which fill and write the frames do not reach across sockets. Slots
+/// are page aligned and zero filled like those of AllocateFrameSlot.
+class FrameSlab
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    FrameSlab();
+
+    /// <summary>
+    /// Destructor, frees the slots
+    /// </summary>
+    ~FrameSlab();
+
+    /// <summary>
+    /// Allocate the slots, with large pages and on the node if possible and falling back to
+    /// small pages and then to no preferred node. Every page is touched right away, so that the
+    /// pages are in place before the first frame.
+    /// </summary>
+    /// <param name="nSlots">number of slots</param>
+    /// <param name="cbSlot">size (in bytes) of a slot, as returned by GetFrameSlotSize</param>
+    /// <param name="nNode">preferred node, FrameSlabAnyNode for none</param>
+    /// <param name="bLargePages">back the slots by large pages if the process may lock them</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 Create(UINT32 nSlots, DWORD cbSlot, DWORD nNode, bool bLargePages);
+
+    /// <summary>
+    /// Free the slots
+    /// </summary>
+    void                    Destroy();
+
+    /// <summary>
+    /// Get a slot
+    /// </summary>
+    /// <param name="nSlot">index of the slot</param>
+    /// <returns>start of the slot, NULL if the slab is not created</returns>
+    BYTE*                   GetSlot(UINT32 nSlot) const { return m_pBase ? m_pBase + static_cast<SIZE_T>(nSlot) * m_cbSlot : NULL; }
+
+    /// <summary>
+    /// Get the placement of the slab by querying the working set, page by page
+    /// </summary>
+    /// <param name="pStats">receives the placement</param>
+    void                    GetStats(FrameSlabStats* pStats) const;
+
+private:
+    BYTE*                   m_pBase;
+    UINT32                  m_nSlots;
+    DWORD                   m_cbSlot;
+    SIZE_T                  m_cbSlab;
+    DWORD                   m_nNode;
+    bool                    m_bLargePages;
+};
+
+/// <summary>
+/// Format the resident pages of a slab per node, such as "0:96 1:4"
+/// </summary>
+/// <param name="stats">placement of the slab</param>
+/// <param name="szPages">receives the pages per node</param>
+/// <param name="cchPages">size (in characters) of szPages</param>
+void FormatSlabPages(const FrameSlabStats& stats, WCHAR* szPages, size_t cchPages);
+
+/// <summary>
+/// Get the NUMA node of a set of cores
+/// </summary>
+/// <param name="nAffinity">cores (logical processors of the first processor group)</param>
+/// <returns>node of all the cores, FrameSlabAnyNode if they are on several nodes</returns>
+DWORD GetAffinityNode(DWORD_PTR nAffinity);
+
+/// <summary>
+/// Get the number of NUMA nodes
+/// </summary>
+/// <returns>number of nodes, 1 without NUMA</returns>
+DWORD GetNodeCount();
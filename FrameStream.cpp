@@ -0,0 +1,1200 @@
+// FrameStream.cpp
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Streaming of recorded frames over TCP to a receiver which writes them to its disk
+
+
+#include "stdafx.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <strsafe.h>
+#include <stdio.h>
+#include "FrameStream.h"
+#include "Stripe.h"
+#include "ThreadPlacement.h"
+
+#pragma comment (lib, "ws2_32.lib")
+
+/// <summary>
+/// Get the current time
+/// </summary>
+/// <returns>time in seconds</returns>
+static double GetStreamTime()
+{
+    static LARGE_INTEGER qpf = { 0 };
+    if (!qpf.QuadPart)
+    {
+        QueryPerformanceFrequency(&qpf);
+    }
+
+    LARGE_INTEGER qpc = { 0 };
+    QueryPerformanceCounter(&qpc);
+    return double(qpc.QuadPart) / double(qpf.QuadPart);
+}
+
+/// <summary>
+/// Wait until a socket has data to read (or is closed)
+/// </summary>
+/// <param name="s">socket</param>
+/// <param name="dwMilliseconds">time to wait</param>
+/// <returns>true if a read does not block</returns>
+static bool WaitReadable(SOCKET s, DWORD dwMilliseconds)
+{
+    fd_set readSet;
+    FD_ZERO(&readSet);
+    FD_SET(s, &readSet);
+    timeval timeout = { static_cast<long>(dwMilliseconds / 1000), static_cast<long>(dwMilliseconds % 1000) * 1000 };
+    return select(0, &readSet, NULL, NULL, &timeout) != 0;
+}
+
+/// <summary>
+/// Send a gather list of buffers completely
+/// </summary>
+/// <param name="s">socket</param>
+/// <param name="pBuffers">buffers, which are advanced past what was sent</param>
+/// <param name="nBuffers">number of buffers</param>
+/// <returns>indicates success or failure</returns>
+static HRESULT SendBuffers(SOCKET s, WSABUF* pBuffers, DWORD nBuffers)
+{
+    while (nBuffers)
+    {
+        DWORD cbSent = 0;
+        if (SOCKET_ERROR == WSASend(s, pBuffers, nBuffers, &cbSent, 0, NULL, NULL))
+        {
+            return HRESULT_FROM_WIN32(WSAGetLastError());
+        }
+
+        // A blocking send returns once everything is sent, but a partial send is resumed
+        while (nBuffers && cbSent >= pBuffers->len)
+        {
+            cbSent -= pBuffers->len;
+            ++pBuffers;
+            --nBuffers;
+        }
+        if (nBuffers)
+        {
+            pBuffers->buf += cbSent;
+            pBuffers->len -= cbSent;
+        }
+    }
+
+    return S_OK;
+}
+
+/// <summary>
+/// Send a buffer completely
+/// </summary>
+/// <param name="s">socket</param>
+/// <param name="pData">data to send</param>
+/// <param name="cbData">size (in bytes) of the data</param>
+/// <returns>indicates success or failure</returns>
+static HRESULT SendAll(SOCKET s, const void* pData, DWORD cbData)
+{
+    WSABUF buffer = { cbData, reinterpret_cast<CHAR*>(const_cast<void*>(pData)) };
+    return SendBuffers(s, &buffer, 1);
+}
+
+/// <summary>
+/// Receive a buffer completely
+/// </summary>
+/// <param name="s">socket</param>
+/// <param name="pData">receives the data</param>
+/// <param name="cbData">size (in bytes) of the data</param>
+/// <returns>indicates success or failure, HRESULT_FROM_WIN32(ERROR_GRACEFUL_DISCONNECT) if the connection was closed</returns>
+static HRESULT ReceiveAll(SOCKET s, void* pData, DWORD cbData)
+{
+    CHAR* pDest = reinterpret_cast<CHAR*>(pData);
+    while (cbData)
+    {
+        int cbReceived = recv(s, pDest, static_cast<int>(min(cbData, 1u << 30)), 0);
+        if (0 == cbReceived)
+        {
+            return HRESULT_FROM_WIN32(ERROR_GRACEFUL_DISCONNECT);
+        }
+        if (SOCKET_ERROR == cbReceived)
+        {
+            return HRESULT_FROM_WIN32(WSAGetLastError());
+        }
+        pDest += cbReceived;
+        cbData -= cbReceived;
+    }
+
+    return S_OK;
+}
+
+/// <summary>
+/// Set the options of a connected socket
+/// </summary>
+/// <param name="s">socket</param>
+static void SetStreamOptions(SOCKET s)
+{
+    // Frames are sent in large gathers, so Nagle's algorithm would only hold back the last
+    // segment of each batch and each acknowledgement
+    BOOL bNoDelay = TRUE;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&bNoDelay), sizeof(bNoDelay));
+
+    // Socket buffers of a few frames keep a fast link busy between two sends
+    int cbBuffer = 4 << 20;
+    setsockopt(s, SOL_SOCKET, SO_SNDBUF, reinterpret_cast<const char*>(&cbBuffer), sizeof(cbBuffer));
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<const char*>(&cbBuffer), sizeof(cbBuffer));
+}
+
+/// <summary>
+/// Constructor, starts the sender thread which connects to the receiver
+/// </summary>
+/// <param name="szAddress">receiver as "host:port" (default port: FrameStreamDefaultPort)</param>
+/// <param name="cbWindow">max size (in bytes) of the frames sent but not acknowledged</param>
+NetworkFrameWriter::NetworkFrameWriter(LPCWSTR szAddress, UINT64 cbWindow) :
+    m_cbWindow(max(1ull, cbWindow)),
+    m_socket(INVALID_SOCKET),
+    m_nNextBatch(1),
+    m_nSendingBatch(0),
+    m_hrConnect(S_OK),
+    m_fRetryTime(0.0),
+    m_fAckTime(0.0),
+    m_bConnected(false),
+    m_bStop(false),
+    m_fLatencySum(0.0)
+{
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+    ZeroMemory(&m_status, sizeof(m_status));
+
+    // "host:port", "host" or "[IPv6 address]:port"
+    m_sHost = szAddress;
+    m_sPort = std::to_wstring(FrameStreamDefaultPort);
+    size_t nBracket = m_sHost.find(L']');
+    size_t nColon = m_sHost.rfind(L':');
+    if (L'[' == m_sHost[0] && std::wstring::npos != nBracket)
+    {
+        if (nBracket + 1 < m_sHost.size() && L':' == m_sHost[nBracket + 1])
+        {
+            m_sPort = m_sHost.substr(nBracket + 2);
+        }
+        m_sHost = m_sHost.substr(1, nBracket - 1);
+    }
+    else if (std::wstring::npos != nColon && m_sHost.find(L':') == nColon)
+    {
+        m_sPort = m_sHost.substr(nColon + 1);
+        m_sHost.resize(nColon);
+    }
+
+    m_tSender = std::thread(&NetworkFrameWriter::SendFrames, this);
+}
+
+/// <summary>
+/// Destructor, waits until all submitted frames are acknowledged or failed
+/// </summary>
+NetworkFrameWriter::~NetworkFrameWriter()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mMutex);
+        while (!m_qQueued.empty() || !m_mInFlight.empty())
+        {
+            m_cvCompleted.wait(lock);
+        }
+
+        m_bStop = true;
+        if (m_bConnected)
+        {
+            m_bConnected = false;
+            shutdown(m_socket, SD_BOTH);
+        }
+    }
+    m_cvQueued.notify_all();
+
+    if (m_tSender.joinable())
+    {
+        m_tSender.join();
+    }
+    CloseSocket();
+
+    WSACleanup();
+}
+
+/// <summary>
+/// Send a frame and wait until the receiver has written it
+/// </summary>
+/// <param name="lpszFilePath">file path relative to the receiver folder</param>
+/// <param name="pFrame">frame data</param>
+/// <param name="cbFrame">size (in bytes) of the frame</param>
+/// <returns>indicates success or failure</returns>
+HRESULT NetworkFrameWriter::Write(LPCWSTR lpszFilePath, const BYTE* pFrame, DWORD cbFrame)
+{
+    SyncResult result = { S_OK, false };
+    QueuedFrame frame;
+    frame.sFilePath = lpszFilePath;
+    frame.pFrame = pFrame;
+    frame.cbFrame = cbFrame;
+    frame.nContext = 0;
+    frame.pSync = &result;
+    frame.fSubmitTime = GetStreamTime();
+
+    HRESULT hr = Enqueue(frame);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mMutex);
+    while (!result.bDone)
+    {
+        m_cvCompleted.wait(lock);
+    }
+    return result.hr;
+}
+
+/// <summary>
+/// Queue a frame for the sender thread. The frame slot must stay untouched until Poll reports
+/// the completion, which comes once the receiver has written the frame.
+/// </summary>
+/// <param name="lpszFilePath">file path relative to the receiver folder</param>
+/// <param name="pFrame">start of the frame slot holding the frame</param>
+/// <param name="cbFrame">size (in bytes) of header and pixel data</param>
+/// <param name="nContext">value reported by Poll when the write completes</param>
+/// <returns>indicates success or failure, no completion is reported on failure</returns>
+HRESULT NetworkFrameWriter::Submit(LPCWSTR lpszFilePath, const BYTE* pFrame, DWORD cbFrame, ULONG_PTR nContext)
+{
+    QueuedFrame frame;
+    frame.sFilePath = lpszFilePath;
+    frame.pFrame = pFrame;
+    frame.cbFrame = cbFrame;
+    frame.nContext = nContext;
+    frame.pSync = NULL;
+    frame.fSubmitTime = GetStreamTime();
+
+    HRESULT hr = Enqueue(frame);
+    if (SUCCEEDED(hr))
+    {
+        ++m_nPending;
+    }
+    return hr;
+}
+
+/// <summary>
+/// Queue a copy of a file, such as a session report, to be sent along with the frames.
+/// No completion is reported for it, a failure only counts in the statistics.
+/// </summary>
+/// <param name="lpszFilePath">file path relative to the receiver folder</param>
+/// <param name="pData">file data, copied</param>
+/// <param name="cbData">size (in bytes) of the file</param>
+/// <returns>S_OK, or the connection failure while no connection is attempted</returns>
+HRESULT NetworkFrameWriter::Post(LPCWSTR lpszFilePath, const BYTE* pData, DWORD cbData)
+{
+    QueuedFrame frame;
+    frame.sFilePath = lpszFilePath;
+    frame.pCopy = std::make_shared<std::vector<BYTE>>(pData, pData + cbData);
+    frame.pFrame = frame.pCopy->data();
+    frame.cbFrame = cbData;
+    frame.nContext = 0;
+    frame.pSync = NULL;
+    frame.fSubmitTime = GetStreamTime();
+
+    return Enqueue(frame);
+}
+
+/// <summary>
+/// Collect the frames acknowledged by the receiver, or failed with the connection
+/// </summary>
+/// <param name="pContexts">receives the contexts of the completed writes</param>
+/// <param name="pResults">receives the results of the completed writes</param>
+/// <param name="nMaxCompletions">max number of completions to collect</param>
+/// <param name="dwMilliseconds">time to wait for a completion if none is available</param>
+/// <returns>number of collected completions</returns>
+int NetworkFrameWriter::Poll(ULONG_PTR* pContexts, HRESULT* pResults, int nMaxCompletions, DWORD dwMilliseconds)
+{
+    std::unique_lock<std::mutex> lock(m_mMutex);
+    if (m_qCompletedContexts.empty() && dwMilliseconds)
+    {
+        m_cvCompleted.wait_for(lock, std::chrono::milliseconds(dwMilliseconds));
+    }
+
+    int nCompleted = 0;
+    while (nCompleted < nMaxCompletions && !m_qCompletedContexts.empty())
+    {
+        pContexts[nCompleted] = m_qCompletedContexts.front();
+        pResults[nCompleted] = m_qCompletedResults.front();
+        m_qCompletedContexts.pop();
+        m_qCompletedResults.pop();
+        ++nCompleted;
+    }
+
+    m_nPending -= nCompleted;
+    return nCompleted;
+}
+
+/// <summary>
+/// Get the statistics of the stream
+/// </summary>
+/// <param name="pStatus">receives the statistics</param>
+void NetworkFrameWriter::GetStreamStatus(FrameStreamStatus* pStatus)
+{
+    std::lock_guard<std::mutex> lock(m_mMutex);
+    *pStatus = m_status;
+    pStatus->fMeanLatency = m_status.nAcknowledged ? m_fLatencySum / m_status.nAcknowledged : 0.0;
+    pStatus->bConnected = m_bConnected;
+}
+
+/// <summary>
+/// Queue a frame for the sender thread
+/// </summary>
+/// <param name="frame">frame to queue</param>
+/// <returns>S_OK, or the connection failure while no connection is attempted</returns>
+HRESULT NetworkFrameWriter::Enqueue(const QueuedFrame& frame)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mMutex);
+
+        // Until the next attempt, frames fail right away so that their slots go back to capture
+        if (!m_bConnected && FAILED(m_hrConnect) && GetStreamTime() < m_fRetryTime)
+        {
+            return m_hrConnect;
+        }
+        m_qQueued.push_back(frame);
+    }
+    m_cvQueued.notify_one();
+
+    return S_OK;
+}
+
+/// <summary>
+/// Send batches of queued frames until the writer is destroyed
+/// </summary>
+void NetworkFrameWriter::SendFrames()
+{
+    HRESULT hrPlaced = PlaceThread(PipelineThread_Network);
+
+    HRESULT hrConnect = Connect();
+    bool bConnected = SUCCEEDED(hrConnect);
+    if (!bConnected)
+    {
+        std::lock_guard<std::mutex> lock(m_mMutex);
+        m_hrConnect = hrConnect;
+        m_fRetryTime = GetStreamTime() + FrameStreamRetryInterval / 1000.;
+    }
+
+    std::vector<QueuedFrame> vBatch;
+    std::vector<BYTE> vDirectory;
+    std::vector<WSABUF> vBuffers;
+    for (;;)
+    {
+        {
+            // Wait for frames, and for the receiver to acknowledge a batch while the window is full
+            std::unique_lock<std::mutex> lock(m_mMutex);
+            while (!m_bStop && (m_qQueued.empty() || (m_bConnected && m_status.cbInFlight >= m_cbWindow)))
+            {
+                m_cvQueued.wait(lock);
+            }
+
+            if (m_qQueued.empty())
+            {
+                break;
+            }
+            bConnected = m_bConnected;
+        }
+
+        // A lost connection is attempted again with the next frame after the retry interval
+        if (!bConnected)
+        {
+            HRESULT hr = Connect();
+            if (FAILED(hr))
+            {
+                std::lock_guard<std::mutex> lock(m_mMutex);
+                m_hrConnect = hr;
+                m_fRetryTime = GetStreamTime() + FrameStreamRetryInterval / 1000.;
+                Disconnect(hr);
+                continue;
+            }
+        }
+
+        // The batch takes the frames queued meanwhile, so it grows while the link falls behind
+        UINT32 nBatch = 0;
+        UINT64 cbBatch = 0;
+        SOCKET s = INVALID_SOCKET;
+        vBatch.clear();
+        {
+            std::lock_guard<std::mutex> lock(m_mMutex);
+            if (!m_bConnected)
+            {
+                continue;
+            }
+
+            while (!m_qQueued.empty() && vBatch.size() < FrameStreamMaxBatchFrames &&
+                (vBatch.empty() || (cbBatch + m_qQueued.front().cbFrame <= FrameStreamMaxBatchSize && m_status.cbInFlight + cbBatch + m_qQueued.front().cbFrame <= m_cbWindow)))
+            {
+                cbBatch += m_qQueued.front().cbFrame;
+                vBatch.push_back(m_qQueued.front());
+                m_qQueued.pop_front();
+            }
+
+            if (m_mInFlight.empty())
+            {
+                m_fAckTime = GetStreamTime();
+            }
+            nBatch = m_nNextBatch++;
+            m_nSendingBatch = nBatch;
+            m_mInFlight[nBatch] = vBatch;
+            m_status.cbInFlight += cbBatch;
+            s = m_socket;
+        }
+
+        // The directory goes first, then the frames are sent straight from their slots
+        vDirectory.resize(sizeof(FrameStreamBatch));
+        for (size_t i = 0; i < vBatch.size(); ++i)
+        {
+            FrameStreamEntry entry;
+            entry.cbFrame = vBatch[i].cbFrame;
+            entry.cchPath = static_cast<UINT32>(vBatch[i].sFilePath.size());
+            const BYTE* pEntry = reinterpret_cast<const BYTE*>(&entry);
+            const BYTE* pPath = reinterpret_cast<const BYTE*>(vBatch[i].sFilePath.data());
+            vDirectory.insert(vDirectory.end(), pEntry, pEntry + sizeof(entry));
+            vDirectory.insert(vDirectory.end(), pPath, pPath + entry.cchPath * sizeof(WCHAR));
+        }
+
+        FrameStreamBatch* pHeader = reinterpret_cast<FrameStreamBatch*>(vDirectory.data());
+        pHeader->nMagic = FrameStreamMagic;
+        pHeader->nBatch = nBatch;
+        pHeader->nFrames = static_cast<UINT32>(vBatch.size());
+        pHeader->cbDirectory = static_cast<UINT32>(vDirectory.size() - sizeof(FrameStreamBatch));
+
+        vBuffers.resize(1 + vBatch.size());
+        vBuffers[0].buf = reinterpret_cast<CHAR*>(vDirectory.data());
+        vBuffers[0].len = static_cast<ULONG>(vDirectory.size());
+        for (size_t i = 0; i < vBatch.size(); ++i)
+        {
+            vBuffers[1 + i].buf = reinterpret_cast<CHAR*>(const_cast<BYTE*>(vBatch[i].pFrame));
+            vBuffers[1 + i].len = vBatch[i].cbFrame;
+        }
+
+        HRESULT hr = SendBuffers(s, vBuffers.data(), static_cast<DWORD>(vBuffers.size()));
+
+        std::lock_guard<std::mutex> lock(m_mMutex);
+        m_nSendingBatch = 0;
+        if (SUCCEEDED(hr))
+        {
+            m_status.cbSent += cbBatch;
+            m_status.nSent += static_cast<UINT>(vBatch.size());
+            ++m_status.nBatches;
+        }
+        else if (m_bConnected)
+        {
+            Disconnect(hr);
+        }
+
+        // A connection lost during the send fails the batch only now that its frames are no longer read
+        std::map<UINT32, std::vector<QueuedFrame>>::iterator it = m_mInFlight.find(nBatch);
+        if (!m_bConnected && it != m_mInFlight.end())
+        {
+            for (size_t i = 0; i < it->second.size(); ++i)
+            {
+                m_status.cbInFlight -= it->second[i].cbFrame;
+                Complete(it->second[i], m_hrConnect);
+            }
+            m_mInFlight.erase(it);
+        }
+    }
+
+    UnplaceThread(PipelineThread_Network, hrPlaced);
+}
+
+/// <summary>
+/// Receive the acknowledgements of a connection until it is closed
+/// </summary>
+/// <param name="s">socket of the connection</param>
+void NetworkFrameWriter::ReceiveAcks(SOCKET s)
+{
+    HRESULT hrPlaced = PlaceThread(PipelineThread_Network);
+
+    std::vector<HRESULT> vResults;
+    for (;;)
+    {
+        // A receiver which stops acknowledging the frames in flight is given up after the timeout
+        if (!WaitReadable(s, 1000))
+        {
+            std::lock_guard<std::mutex> lock(m_mMutex);
+            if (!m_mInFlight.empty() && GetStreamTime() - m_fAckTime > FrameStreamTimeout / 1000.)
+            {
+                if (m_bConnected)
+                {
+                    Disconnect(HRESULT_FROM_WIN32(ERROR_TIMEOUT));
+                }
+                break;
+            }
+            continue;
+        }
+
+        FrameStreamAck ack;
+        HRESULT hr = ReceiveAll(s, &ack, sizeof(ack));
+        if (SUCCEEDED(hr) && (FrameStreamMagic != ack.nMagic || !ack.nFrames || ack.nFrames > FrameStreamMaxBatchFrames))
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+        }
+        if (SUCCEEDED(hr))
+        {
+            vResults.resize(ack.nFrames);
+            hr = ReceiveAll(s, vResults.data(), static_cast<DWORD>(ack.nFrames * sizeof(HRESULT)));
+        }
+
+        std::lock_guard<std::mutex> lock(m_mMutex);
+        std::map<UINT32, std::vector<QueuedFrame>>::iterator it = m_mInFlight.end();
+        if (SUCCEEDED(hr))
+        {
+            it = m_mInFlight.find(ack.nBatch);
+            if (it == m_mInFlight.end() || it->second.size() != ack.nFrames)
+            {
+                hr = HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+            }
+        }
+        if (FAILED(hr))
+        {
+            if (m_bConnected)
+            {
+                Disconnect(hr);
+            }
+            break;
+        }
+
+        double fNow = GetStreamTime();
+        for (size_t i = 0; i < it->second.size(); ++i)
+        {
+            const QueuedFrame& frame = it->second[i];
+            if (SUCCEEDED(vResults[i]))
+            {
+                ++m_status.nAcknowledged;
+                m_fLatencySum += fNow - frame.fSubmitTime;
+                m_status.fMaxLatency = max(m_status.fMaxLatency, fNow - frame.fSubmitTime);
+            }
+            m_status.cbInFlight -= frame.cbFrame;
+            Complete(frame, vResults[i]);
+        }
+        m_mInFlight.erase(it);
+        m_status.cbBacklog = ack.cbBacklog;
+        m_fAckTime = fNow;
+        m_cvQueued.notify_one();
+    }
+
+    UnplaceThread(PipelineThread_Network, hrPlaced);
+}
+
+/// <summary>
+/// Connect to the receiver and start the acknowledgement thread
+/// </summary>
+/// <returns>indicates success or failure</returns>
+HRESULT NetworkFrameWriter::Connect()
+{
+    CloseSocket();
+
+    ADDRINFOW hints;
+    ZeroMemory(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    ADDRINFOW* pAddresses = NULL;
+    if (0 != GetAddrInfoW(m_sHost.c_str(), m_sPort.c_str(), &hints, &pAddresses))
+    {
+        return HRESULT_FROM_WIN32(WSAGetLastError());
+    }
+
+    SOCKET s = INVALID_SOCKET;
+    HRESULT hr = HRESULT_FROM_WIN32(WSAECONNREFUSED);
+    for (ADDRINFOW* pAddress = pAddresses; pAddress && INVALID_SOCKET == s; pAddress = pAddress->ai_next)
+    {
+        s = socket(pAddress->ai_family, pAddress->ai_socktype, pAddress->ai_protocol);
+        if (INVALID_SOCKET != s && SOCKET_ERROR == connect(s, pAddress->ai_addr, static_cast<int>(pAddress->ai_addrlen)))
+        {
+            hr = HRESULT_FROM_WIN32(WSAGetLastError());
+            closesocket(s);
+            s = INVALID_SOCKET;
+        }
+    }
+    FreeAddrInfoW(pAddresses);
+    if (INVALID_SOCKET == s)
+    {
+        return hr;
+    }
+
+    SetStreamOptions(s);
+
+    FrameStreamHello hello = { FrameStreamMagic, FrameStreamVersion };
+    hr = SendAll(s, &hello, sizeof(hello));
+    if (SUCCEEDED(hr))
+    {
+        hr = WaitReadable(s, FrameStreamTimeout) ? ReceiveAll(s, &hello, sizeof(hello)) : HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+    }
+    if (SUCCEEDED(hr) && (FrameStreamMagic != hello.nMagic || FrameStreamVersion != hello.nVersion))
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+    }
+    if (FAILED(hr))
+    {
+        closesocket(s);
+        return hr;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mMutex);
+    m_socket = s;
+    m_bConnected = true;
+    m_hrConnect = S_OK;
+    ++m_status.nConnections;
+    m_tAcknowledger = std::thread(&NetworkFrameWriter::ReceiveAcks, this, s);
+    return S_OK;
+}
+
+/// <summary>
+/// Close the socket of the previous connection once its acknowledgement thread has ended
+/// </summary>
+void NetworkFrameWriter::CloseSocket()
+{
+    if (m_tAcknowledger.joinable())
+    {
+        m_tAcknowledger.join();
+    }
+
+    if (INVALID_SOCKET != m_socket)
+    {
+        closesocket(m_socket);
+        m_socket = INVALID_SOCKET;
+    }
+}
+
+/// <summary>
+/// Fail the frames of a lost connection, called with the mutex held. The socket is only shut
+/// down, so that both threads see the failure, and closed by the sender thread.
+/// </summary>
+/// <param name="hr">reason of the failure</param>
+void NetworkFrameWriter::Disconnect(HRESULT hr)
+{
+    if (m_bConnected)
+    {
+        m_bConnected = false;
+        m_hrConnect = hr;
+        shutdown(m_socket, SD_BOTH);
+    }
+
+    // The batch being sent is failed by the sender thread once the send returns
+    std::map<UINT32, std::vector<QueuedFrame>>::iterator it = m_mInFlight.begin();
+    while (it != m_mInFlight.end())
+    {
+        if (it->first == m_nSendingBatch)
+        {
+            ++it;
+            continue;
+        }
+
+        for (size_t i = 0; i < it->second.size(); ++i)
+        {
+            m_status.cbInFlight -= it->second[i].cbFrame;
+            Complete(it->second[i], hr);
+        }
+        it = m_mInFlight.erase(it);
+    }
+
+    while (!m_qQueued.empty())
+    {
+        Complete(m_qQueued.front(), hr);
+        m_qQueued.pop_front();
+    }
+}
+
+/// <summary>
+/// Report the completion of a frame, called with the mutex held
+/// </summary>
+/// <param name="frame">frame</param>
+/// <param name="hr">result of the frame</param>
+void NetworkFrameWriter::Complete(const QueuedFrame& frame, HRESULT hr)
+{
+    if (frame.pSync)
+    {
+        frame.pSync->hr = hr;
+        frame.pSync->bDone = true;
+    }
+    else if (!frame.pCopy)
+    {
+        m_qCompletedContexts.push(frame.nContext);
+        m_qCompletedResults.push(hr);
+    }
+
+    if (FAILED(hr))
+    {
+        ++m_status.nFailed;
+    }
+    m_cvCompleted.notify_all();
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+/// <param name="szFolder">folder which receives the frames</param>
+/// <param name="mode">writer backend</param>
+/// <param name="nQueueDepth">max number of writes in flight</param>
+/// <param name="cbBacklog">size (in bytes) of the frames received but not written at which reading stops</param>
+FrameReceiver::FrameReceiver(LPCWSTR szFolder, WriterMode mode, int nQueueDepth, UINT64 cbBacklog) :
+    m_sFolder(szFolder),
+    m_nWriterMode(mode),
+    m_nQueueDepth(max(1, nQueueDepth)),
+    m_cbMaxBacklog(cbBacklog),
+    m_listener(INVALID_SOCKET)
+{
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+    m_bStop = false;
+    m_nWritten = 0;
+    m_nFailed = 0;
+    m_cbWritten = 0;
+    m_cbBacklog = 0;
+}
+
+/// <summary>
+/// Destructor, closes the listening socket
+/// </summary>
+FrameReceiver::~FrameReceiver()
+{
+    if (INVALID_SOCKET != m_listener)
+    {
+        closesocket(m_listener);
+    }
+
+    for (size_t i = 0; i < m_vFreeSlots.size(); ++i)
+    {
+        FreeFrameSlot(m_vFreeSlots[i].pSlot);
+    }
+
+    WSACleanup();
+}
+
+/// <summary>
+/// Start listening
+/// </summary>
+/// <param name="szAddress">local address to listen on, NULL for any</param>
+/// <param name="nPort">port to listen on</param>
+/// <returns>indicates success or failure</returns>
+HRESULT FrameReceiver::Listen(LPCWSTR szAddress, USHORT nPort)
+{
+    WCHAR szPort[16];
+    StringCchPrintfW(szPort, _countof(szPort), L"%u", nPort);
+
+    ADDRINFOW hints;
+    ZeroMemory(&hints, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = AI_PASSIVE;
+
+    ADDRINFOW* pAddress = NULL;
+    if (0 != GetAddrInfoW(szAddress, szPort, &hints, &pAddress))
+    {
+        return HRESULT_FROM_WIN32(WSAGetLastError());
+    }
+
+    HRESULT hr = S_OK;
+    m_listener = socket(pAddress->ai_family, pAddress->ai_socktype, pAddress->ai_protocol);
+    if (INVALID_SOCKET == m_listener ||
+        SOCKET_ERROR == bind(m_listener, pAddress->ai_addr, static_cast<int>(pAddress->ai_addrlen)) ||
+        SOCKET_ERROR == listen(m_listener, SOMAXCONN))
+    {
+        hr = HRESULT_FROM_WIN32(WSAGetLastError());
+    }
+    FreeAddrInfoW(pAddress);
+
+    return hr;
+}
+
+/// <summary>
+/// Serve senders one after another until Stop is called
+/// </summary>
+void FrameReceiver::Run()
+{
+    while (!m_bStop)
+    {
+        if (!WaitReadable(m_listener, 100))
+        {
+            continue;
+        }
+
+        SOCKET s = accept(m_listener, NULL, NULL);
+        if (INVALID_SOCKET != s)
+        {
+            Serve(s);
+            closesocket(s);
+        }
+    }
+}
+
+/// <summary>
+/// Receive and write the batches of a sender until it disconnects
+/// </summary>
+/// <param name="s">socket of the connection</param>
+void FrameReceiver::Serve(SOCKET s)
+{
+    SetStreamOptions(s);
+
+    FrameStreamHello hello;
+    HRESULT hr = WaitReadable(s, FrameStreamTimeout) ? ReceiveAll(s, &hello, sizeof(hello)) : HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+    if (SUCCEEDED(hr) && (FrameStreamMagic != hello.nMagic || FrameStreamVersion != hello.nVersion))
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = SendAll(s, &hello, sizeof(hello));
+    }
+    if (FAILED(hr))
+    {
+        return;
+    }
+
+    // Folders may have been removed since the previous sender
+    m_sCreatedFolders.clear();
+
+    FrameWriter* pWriter = FrameWriter::Create(m_nWriterMode);
+    std::map<UINT32, ReceivedBatch> mBatches;
+    std::deque<ReceivedFrame*> qFrames;
+    ULONG_PTR nContexts[FrameStreamMaxBatchFrames];
+    HRESULT hrResults[FrameStreamMaxBatchFrames];
+    bool bReading = true;
+    DWORD dwWait = 0;
+
+    while (bReading || !qFrames.empty() || pWriter->GetPendingCount() > 0)
+    {
+        // Release the written frames, which acknowledges the batches written completely
+        int nCompleted = pWriter->Poll(nContexts, hrResults, _countof(nContexts), dwWait);
+        for (int i = 0; i < nCompleted; ++i)
+        {
+            Complete(s, mBatches, reinterpret_cast<ReceivedFrame*>(nContexts[i]), hrResults[i]);
+        }
+
+        while (!qFrames.empty() && pWriter->GetPendingCount() < m_nQueueDepth)
+        {
+            ReceivedFrame* pFrame = qFrames.front();
+            qFrames.pop_front();
+            HRESULT hrSubmit = pWriter->Submit(pFrame->sFilePath.c_str(), pFrame->pSlot, pFrame->cbFrame, reinterpret_cast<ULONG_PTR>(pFrame));
+            if (FAILED(hrSubmit))
+            {
+                Complete(s, mBatches, pFrame, hrSubmit);
+            }
+        }
+
+        // The socket is left alone while the disk falls behind, so the sender is held by TCP.
+        // On Stop the frames received so far are still written and acknowledged.
+        bool bReceived = false;
+        bReading = bReading && !m_bStop;
+        bool bBusy = nCompleted || !qFrames.empty() || pWriter->GetPendingCount() > 0;
+        if (bReading && m_cbBacklog < m_cbMaxBacklog && WaitReadable(s, bBusy ? 0 : 100))
+        {
+            bReading = SUCCEEDED(ReceiveBatch(s, mBatches, qFrames));
+            bReceived = true;
+        }
+
+        dwWait = (!nCompleted && !bReceived && pWriter->GetPendingCount() > 0) ? 1 : 0;
+    }
+
+    delete pWriter;
+}
+
+/// <summary>
+/// Receive a batch and queue its frames for writing
+/// </summary>
+/// <param name="s">socket of the connection</param>
+/// <param name="mBatches">batches being written</param>
+/// <param name="qFrames">receives the frames to write</param>
+/// <returns>indicates success or failure, which ends the connection</returns>
+HRESULT FrameReceiver::ReceiveBatch(SOCKET s, std::map<UINT32, ReceivedBatch>& mBatches, std::deque<ReceivedFrame*>& qFrames)
+{
+    FrameStreamBatch header;
+    HRESULT hr = ReceiveAll(s, &header, sizeof(header));
+    if (SUCCEEDED(hr) && (FrameStreamMagic != header.nMagic || !header.nFrames || header.nFrames > FrameStreamMaxBatchFrames ||
+        header.cbDirectory > header.nFrames * (sizeof(FrameStreamEntry) + MAX_PATH * sizeof(WCHAR)) || mBatches.count(header.nBatch)))
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+    }
+
+    std::vector<BYTE> vDirectory;
+    if (SUCCEEDED(hr))
+    {
+        vDirectory.resize(header.cbDirectory);
+        hr = ReceiveAll(s, vDirectory.data(), header.cbDirectory);
+    }
+
+    // Parse the directory, then receive each frame into a slot
+    std::vector<ReceivedFrame*> vFrames;
+    size_t nOffset = 0;
+    for (UINT32 i = 0; i < header.nFrames && SUCCEEDED(hr); ++i)
+    {
+        FrameStreamEntry entry;
+        if (nOffset + sizeof(entry) > vDirectory.size())
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+            break;
+        }
+        memcpy(&entry, &vDirectory[nOffset], sizeof(entry));
+        nOffset += sizeof(entry);
+        if (!entry.cchPath || entry.cchPath >= MAX_PATH || nOffset + entry.cchPath * sizeof(WCHAR) > vDirectory.size() || entry.cbFrame > FrameStreamMaxFrameSize)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+            break;
+        }
+
+        ReceivedFrame* pFrame = new ReceivedFrame;
+        pFrame->sFilePath.resize(entry.cchPath);
+        memcpy(&pFrame->sFilePath[0], &vDirectory[nOffset], entry.cchPath * sizeof(WCHAR));
+        nOffset += entry.cchPath * sizeof(WCHAR);
+        pFrame->pSlot = NULL;
+        pFrame->cbSlot = 0;
+        pFrame->cbFrame = entry.cbFrame;
+        pFrame->nBatch = header.nBatch;
+        pFrame->nIndex = i;
+        vFrames.push_back(pFrame);
+    }
+
+    for (size_t i = 0; i < vFrames.size() && SUCCEEDED(hr); ++i)
+    {
+        // Take the smallest free slot which holds the frame
+        ReceivedFrame* pFrame = vFrames[i];
+        DWORD cbSlot = GetFrameSlotSize(max(1ul, pFrame->cbFrame));
+        size_t nBest = m_vFreeSlots.size();
+        for (size_t j = 0; j < m_vFreeSlots.size(); ++j)
+        {
+            if (m_vFreeSlots[j].cbSlot >= cbSlot && (nBest == m_vFreeSlots.size() || m_vFreeSlots[j].cbSlot < m_vFreeSlots[nBest].cbSlot))
+            {
+                nBest = j;
+            }
+        }
+        if (nBest < m_vFreeSlots.size())
+        {
+            pFrame->pSlot = m_vFreeSlots[nBest].pSlot;
+            pFrame->cbSlot = m_vFreeSlots[nBest].cbSlot;
+            m_vFreeSlots.erase(m_vFreeSlots.begin() + nBest);
+        }
+        else
+        {
+            pFrame->pSlot = AllocateFrameSlot(cbSlot);
+            pFrame->cbSlot = cbSlot;
+        }
+        if (!pFrame->pSlot)
+        {
+            hr = E_OUTOFMEMORY;
+            break;
+        }
+
+        // The sector padding of a reused slot is cleared, so that no other frame is written behind this one
+        hr = ReceiveAll(s, pFrame->pSlot, pFrame->cbFrame);
+        ZeroMemory(pFrame->pSlot + pFrame->cbFrame, GetFrameSlotSize(pFrame->cbFrame) - pFrame->cbFrame);
+    }
+
+    if (FAILED(hr))
+    {
+        for (size_t i = 0; i < vFrames.size(); ++i)
+        {
+            if (vFrames[i]->pSlot)
+            {
+                m_vFreeSlots.push_back(*vFrames[i]);
+            }
+            delete vFrames[i];
+        }
+        return hr;
+    }
+
+    ReceivedBatch& batch = mBatches[header.nBatch];
+    batch.nRemaining = header.nFrames;
+    batch.vResults.assign(header.nFrames, S_OK);
+    for (size_t i = 0; i < vFrames.size(); ++i)
+    {
+        m_cbBacklog += vFrames[i]->cbFrame;
+        HRESULT hrPath = PrepareFilePath(vFrames[i]->sFilePath);
+        if (SUCCEEDED(hrPath))
+        {
+            qFrames.push_back(vFrames[i]);
+        }
+        else
+        {
+            Complete(s, mBatches, vFrames[i], hrPath);
+        }
+    }
+
+    return S_OK;
+}
+
+/// <summary>
+/// Complete a frame, and acknowledge its batch once all of its frames are written
+/// </summary>
+/// <param name="s">socket of the connection</param>
+/// <param name="mBatches">batches being written</param>
+/// <param name="pFrame">frame, which is deleted</param>
+/// <param name="hr">result of the write</param>
+void FrameReceiver::Complete(SOCKET s, std::map<UINT32, ReceivedBatch>& mBatches, ReceivedFrame* pFrame, HRESULT hr)
+{
+    if (SUCCEEDED(hr))
+    {
+        ++m_nWritten;
+        m_cbWritten += pFrame->cbFrame;
+    }
+    else
+    {
+        ++m_nFailed;
+    }
+    m_cbBacklog -= pFrame->cbFrame;
+
+    // Slots are kept for the next batches, up to a batch worth of them
+    if (m_vFreeSlots.size() < FrameStreamMaxBatchFrames)
+    {
+        m_vFreeSlots.push_back(*pFrame);
+    }
+    else
+    {
+        FreeFrameSlot(pFrame->pSlot);
+    }
+
+    UINT32 nBatch = pFrame->nBatch;
+    ReceivedBatch& batch = mBatches[nBatch];
+    batch.vResults[pFrame->nIndex] = hr;
+    delete pFrame;
+    if (--batch.nRemaining)
+    {
+        return;
+    }
+
+    // A failed acknowledgement ends the connection with the next read
+    std::vector<BYTE> vAck(sizeof(FrameStreamAck) + batch.vResults.size() * sizeof(HRESULT));
+    FrameStreamAck* pAck = reinterpret_cast<FrameStreamAck*>(vAck.data());
+    pAck->nMagic = FrameStreamMagic;
+    pAck->nBatch = nBatch;
+    pAck->nFrames = static_cast<UINT32>(batch.vResults.size());
+    pAck->nReserved = 0;
+    pAck->cbBacklog = m_cbBacklog;
+    memcpy(pAck + 1, batch.vResults.data(), batch.vResults.size() * sizeof(HRESULT));
+    SendAll(s, vAck.data(), static_cast<DWORD>(vAck.size()));
+    mBatches.erase(nBatch);
+}
+
+/// <summary>
+/// Check a received path, and get the full path of its file with its folder created
+/// </summary>
+/// <param name="sPath">path relative to the receiver folder, replaced by the full path</param>
+/// <returns>indicates success or failure</returns>
+HRESULT FrameReceiver::PrepareFilePath(std::wstring& sPath)
+{
+    // Only paths below the folder are written: no drive, no root and no parent folder
+    if (std::wstring::npos != sPath.find(L':') || L'\\' == sPath[0] || L'/' == sPath[0])
+    {
+        return E_ACCESSDENIED;
+    }
+    size_t nStart = 0;
+    while (nStart <= sPath.size())
+    {
+        size_t nEnd = sPath.find_first_of(L"\\/", nStart);
+        if (std::wstring::npos == nEnd)
+        {
+            nEnd = sPath.size();
+        }
+        if (0 == sPath.compare(nStart, nEnd - nStart, L".."))
+        {
+            return E_ACCESSDENIED;
+        }
+        nStart = nEnd + 1;
+    }
+
+    std::wstring sFilePath = m_sFolder + L"\\" + sPath;
+    std::wstring sFolder = sFilePath.substr(0, sFilePath.find_last_of(L"\\/"));
+    if (!m_sCreatedFolders.count(sFolder))
+    {
+        HRESULT hr = CreateFolderTree(sFolder.c_str());
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+        m_sCreatedFolders.insert(sFolder);
+    }
+
+    sPath = sFilePath;
+    return S_OK;
+}
+
+/// The receiver stopped by Ctrl+C
+static FrameReceiver* s_pReceiver = NULL;
+
+/// <summary>
+/// Stop the receiver on Ctrl+C or when the console closes
+/// </summary>
+/// <param name="dwCtrlType">console event</param>
+/// <returns>TRUE, the event is handled</returns>
+static BOOL WINAPI StopReceiver(DWORD dwCtrlType)
+{
+    UNREFERENCED_PARAMETER(dwCtrlType);
+    if (s_pReceiver)
+    {
+        s_pReceiver->Stop();
+    }
+    return TRUE;
+}
+
+/// <summary>
+/// Receive frames streamed by recorders and write them under a folder until Ctrl+C is pressed
+/// </summary>
+/// <param name="argc">number of arguments</param>
+/// <param name="argv">output folder, (optional) port and (optional) writer backend</param>
+/// <returns>0 on success, otherwise failure</returns>
+int RunReceive(int argc, LPWSTR* argv)
+{
+    if (argc < 1)
+    {
+        wprintf(L"Usage: KinectV2Recorder /receive <folder> [port] [buffered|unbuffered|overlapped]\n");
+        return 1;
+    }
+
+    LPCWSTR szFolder = argv[0];
+    USHORT nPort = (argc >= 2) ? static_cast<USHORT>(_wtoi(argv[1])) : FrameStreamDefaultPort;
+    WriterMode nWriterMode = WriterMode_Overlapped;
+    if (argc >= 3 && 0 == _wcsicmp(argv[2], L"buffered"))
+    {
+        nWriterMode = WriterMode_Buffered;
+    }
+    else if (argc >= 3 && 0 == _wcsicmp(argv[2], L"unbuffered"))
+    {
+        nWriterMode = WriterMode_Unbuffered;
+    }
+
+    if (FAILED(CreateFolderTree(szFolder)))
+    {
+        wprintf(L"Cannot create %s\n", szFolder);
+        return 1;
+    }
+
+    // Up to 256 MB are received ahead of the disk
+    FrameReceiver receiver(szFolder, nWriterMode, 32, 256ull << 20);
+    HRESULT hr = receiver.Listen(NULL, nPort);
+    if (FAILED(hr))
+    {
+        wprintf(L"Cannot listen on port %u (0x%08x)\n", nPort, hr);
+        return 1;
+    }
+    wprintf(L"Receiving into %s on port %u, press Ctrl+C to stop\n", szFolder, nPort);
+
+    s_pReceiver = &receiver;
+    SetConsoleCtrlHandler(StopReceiver, TRUE);
+
+    std::atomic<bool> bDone;
+    bDone = false;
+    std::thread tReceiver([&]()
+    {
+        receiver.Run();
+        bDone = true;
+    });
+
+    UINT64 cbLastWritten = 0;
+    while (!bDone)
+    {
+        Sleep(1000);
+        UINT64 cbWritten = receiver.GetWrittenSize();
+        wprintf(L"\r%u frames written, %.1f MB/s, backlog %llu MB, %u failed   ", receiver.GetWrittenCount(),
+            (cbWritten - cbLastWritten) / 1048576., receiver.GetBacklog() >> 20, receiver.GetFailedCount());
+        cbLastWritten = cbWritten;
+    }
+    tReceiver.join();
+
+    SetConsoleCtrlHandler(StopReceiver, FALSE);
+    s_pReceiver = NULL;
+    wprintf(L"\n%u frames written, %u failed\n", receiver.GetWrittenCount(), receiver.GetFailedCount());
+    return receiver.GetFailedCount() ? 1 : 0;
+}
@@ -0,0 +1,359 @@
+// FrameStream.h
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Streaming of recorded frames over TCP to a receiver which writes them to its disk
+
+
+#pragma once
+
+#include <winsock2.h>
+#include <windows.h>
+#include <map>
+#include <set>
+#include <memory>
+#include "FrameWriter.h"
+
+/// The FrameStreamMagic value specifies the first field of every message ("KV2N")
+#define FrameStreamMagic 0x4E32564B
+
+/// The FrameStreamVersion value specifies the version of the protocol
+#define FrameStreamVersion 1
+
+/// The FrameStreamDefaultPort value specifies the port a receiver listens on by default
+#define FrameStreamDefaultPort 50710
+
+/// The FrameStreamMaxBatchFrames value specifies the largest number of frames sent in a batch
+#define FrameStreamMaxBatchFrames 64
+
+/// The FrameStreamMaxBatchSize value specifies the size (in bytes) up to which frames are batched
+#define FrameStreamMaxBatchSize (8 << 20)
+
+/// The FrameStreamMaxFrameSize value specifies the size (in bytes) of the largest frame a receiver accepts
+#define FrameStreamMaxFrameSize (64 << 20)
+
+/// The FrameStreamTimeout value specifies the time (in ms) a receiver has to acknowledge a batch
+#define FrameStreamTimeout 10000
+
+/// The FrameStreamRetryInterval value specifies the time (in ms) between two connection attempts
+#define FrameStreamRetryInterval 1000
+
+/// Sent by each side once connected
+struct FrameStreamHello
+{
+    UINT32                  nMagic;
+    UINT32                  nVersion;
+};
+
+/// A batch of frames: the header is followed by a FrameStreamEntry and the path of each frame,
+/// then by the data of each frame
+struct FrameStreamBatch
+{
+    UINT32                  nMagic;
+    UINT32                  nBatch;             // number of the batch, from 1
+    UINT32                  nFrames;
+    UINT32                  cbDirectory;        // size (in bytes) of the entries and paths
+};
+
+/// A frame in the directory of a batch, followed by its path
+struct FrameStreamEntry
+{
+    UINT32                  cbFrame;            // size (in bytes) of the frame (file header and pixel data)
+    UINT32                  cchPath;            // length (in characters, UTF-16) of the path relative to the receiver folder
+};
+
+/// Sent by the receiver once every frame of a batch is written, followed by the HRESULT of each frame
+struct FrameStreamAck
+{
+    UINT32                  nMagic;
+    UINT32                  nBatch;
+    UINT32                  nFrames;
+    UINT32                  nReserved;
+    UINT64                  cbBacklog;          // size (in bytes) of the frames received but not written yet
+};
+
+/// Statistics of a NetworkFrameWriter
+struct FrameStreamStatus
+{
+    UINT64                  cbSent;             // size (in bytes) of the frames sent
+    UINT64                  cbInFlight;         // size (in bytes) of the frames sent but not acknowledged
+    UINT64                  cbBacklog;          // receiver backlog as of the last acknowledgement
+    UINT                    nSent;              // number of frames sent
+    UINT                    nAcknowledged;      // number of frames written by the receiver
+    UINT                    nFailed;            // number of frames which failed to send or to write
+    UINT                    nBatches;           // number of batches sent
+    UINT                    nConnections;       // number of connections made
+    double                  fMeanLatency;       // time (in seconds) from Submit to the acknowledgement
+    double                  fMaxLatency;
+    bool                    bConnected;
+};
+
+/// Sends frames to a FrameReceiver instead of writing them. The file paths are sent relative to
+/// the receiver folder, which gets the same layout as a local session. A sender thread batches
+/// the frames submitted meanwhile and sends them straight from their slots, up to a window of
+/// bytes which the receiver has not acknowledged; a write completes once the receiver has it on
+/// disk. The receiver stops reading while its disk falls behind, so its backlog holds the
+/// frames in flight, which hold the writer queue of the recorder and in turn its frame slots:
+/// the recorder drops frames at capture instead of buffering without bound.
+class NetworkFrameWriter : public FrameWriter
+{
+public:
+    /// <summary>
+    /// Constructor, starts the sender thread which connects to the receiver
+    /// </summary>
+    /// <param name="szAddress">receiver as "host:port" (default port: FrameStreamDefaultPort)</param>
+    /// <param name="cbWindow">max size (in bytes) of the frames sent but not acknowledged</param>
+    NetworkFrameWriter(LPCWSTR szAddress, UINT64 cbWindow);
+
+    /// <summary>
+    /// Destructor, waits until all submitted frames are acknowledged or failed
+    /// </summary>
+    virtual ~NetworkFrameWriter();
+
+    /// <summary>
+    /// Send a frame and wait until the receiver has written it
+    /// </summary>
+    /// <param name="lpszFilePath">file path relative to the receiver folder</param>
+    /// <param name="pFrame">frame data</param>
+    /// <param name="cbFrame">size (in bytes) of the frame</param>
+    /// <returns>indicates success or failure</returns>
+    virtual HRESULT         Write(LPCWSTR lpszFilePath, const BYTE* pFrame, DWORD cbFrame);
+
+    virtual HRESULT         Submit(LPCWSTR lpszFilePath, const BYTE* pFrame, DWORD cbFrame, ULONG_PTR nContext);
+    virtual int             Poll(ULONG_PTR* pContexts, HRESULT* pResults, int nMaxCompletions, DWORD dwMilliseconds);
+
+    /// <summary>
+    /// Queue a copy of a file, such as a session report, to be sent along with the frames.
+    /// No completion is reported for it, a failure only counts in the statistics.
+    /// </summary>
+    /// <param name="lpszFilePath">file path relative to the receiver folder</param>
+    /// <param name="pData">file data, copied</param>
+    /// <param name="cbData">size (in bytes) of the file</param>
+    /// <returns>S_OK, or the connection failure while no connection is attempted</returns>
+    HRESULT                 Post(LPCWSTR lpszFilePath, const BYTE* pData, DWORD cbData);
+
+    /// <summary>
+    /// Get the statistics of the stream
+    /// </summary>
+    /// <param name="pStatus">receives the statistics</param>
+    void                    GetStreamStatus(FrameStreamStatus* pStatus);
+
+private:
+    /// Outcome of a frame sent by Write
+    struct SyncResult
+    {
+        HRESULT             hr;
+        bool                bDone;
+    };
+
+    /// A submitted frame, queued until it is sent and in flight until it is acknowledged
+    struct QueuedFrame
+    {
+        std::wstring        sFilePath;
+        const BYTE*         pFrame;
+        DWORD               cbFrame;
+        ULONG_PTR           nContext;
+        SyncResult*         pSync;              // set for frames sent by Write
+        std::shared_ptr<std::vector<BYTE>> pCopy; // set for files queued by Post, holds pFrame
+        double              fSubmitTime;
+    };
+
+    std::wstring            m_sHost;
+    std::wstring            m_sPort;
+    UINT64                  m_cbWindow;
+    SOCKET                  m_socket;
+    UINT32                  m_nNextBatch;
+    UINT32                  m_nSendingBatch;    // batch being sent, which stays in flight until the send returns
+    HRESULT                 m_hrConnect;        // result of the last connection attempt
+    double                  m_fRetryTime;       // time of the next connection attempt after a failure
+    double                  m_fAckTime;         // time of the last acknowledgement, or of the first batch in flight
+    bool                    m_bConnected;
+    bool                    m_bStop;
+    FrameStreamStatus       m_status;
+    double                  m_fLatencySum;
+    std::deque<QueuedFrame> m_qQueued;
+    std::map<UINT32, std::vector<QueuedFrame>> m_mInFlight;
+    std::queue<ULONG_PTR>   m_qCompletedContexts;
+    std::queue<HRESULT>     m_qCompletedResults;
+    std::mutex              m_mMutex;
+    std::condition_variable m_cvQueued;         // frames were queued or the window opened
+    std::condition_variable m_cvCompleted;      // frames were completed
+    std::thread             m_tSender;
+    std::thread             m_tAcknowledger;
+
+    /// <summary>
+    /// Queue a frame for the sender thread
+    /// </summary>
+    /// <param name="frame">frame to queue</param>
+    /// <returns>S_OK, or the connection failure while no connection is attempted</returns>
+    HRESULT                 Enqueue(const QueuedFrame& frame);
+
+    /// <summary>
+    /// Send batches of queued frames until the writer is destroyed
+    /// </summary>
+    void                    SendFrames();
+
+    /// <summary>
+    /// Receive the acknowledgements of a connection until it is closed
+    /// </summary>
+    /// <param name="s">socket of the connection</param>
+    void                    ReceiveAcks(SOCKET s);
+
+    /// <summary>
+    /// Connect to the receiver and start the acknowledgement thread
+    /// </summary>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 Connect();
+
+    /// <summary>
+    /// Close the socket of the previous connection once its acknowledgement thread has ended
+    /// </summary>
+    void                    CloseSocket();
+
+    /// <summary>
+    /// Fail the frames of a lost connection, called with the mutex held
+    /// </summary>
+    /// <param name="hr">reason of the failure</param>
+    void                    Disconnect(HRESULT hr);
+
+    /// <summary>
+    /// Report the completion of a frame, called with the mutex held
+    /// </summary>
+    /// <param name="frame">frame</param>
+    /// <param name="hr">result of the frame</param>
+    void                    Complete(const QueuedFrame& frame, HRESULT hr);
+};
+
+/// Accepts a NetworkFrameWriter at a time and writes its frames under a folder through a writer
+/// backend. A batch is acknowledged once all its frames are written; while the frames received
+/// but not written exceed the backlog limit, the socket is not read, so TCP holds the sender.
+class FrameReceiver
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    /// <param name="szFolder">folder which receives the frames</param>
+    /// <param name="mode">writer backend</param>
+    /// <param name="nQueueDepth">max number of writes in flight</param>
+    /// <param name="cbBacklog">size (in bytes) of the frames received but not written at which reading stops</param>
+    FrameReceiver(LPCWSTR szFolder, WriterMode mode, int nQueueDepth, UINT64 cbBacklog);
+
+    /// <summary>
+    /// Destructor, closes the listening socket
+    /// </summary>
+    ~FrameReceiver();
+
+    /// <summary>
+    /// Start listening
+    /// </summary>
+    /// <param name="szAddress">local address to listen on, NULL for any</param>
+    /// <param name="nPort">port to listen on</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 Listen(LPCWSTR szAddress, USHORT nPort);
+
+    /// <summary>
+    /// Serve senders one after another until Stop is called
+    /// </summary>
+    void                    Run();
+
+    /// <summary>
+    /// Make Run return once the current connection is served
+    /// </summary>
+    void                    Stop() { m_bStop = true; }
+
+    /// <summary>
+    /// Get the number of frames written
+    /// </summary>
+    /// <returns>number of frames</returns>
+    UINT                    GetWrittenCount() const { return m_nWritten; }
+
+    /// <summary>
+    /// Get the number of frames which failed to write
+    /// </summary>
+    /// <returns>number of frames</returns>
+    UINT                    GetFailedCount() const { return m_nFailed; }
+
+    /// <summary>
+    /// Get the size of the frames written
+    /// </summary>
+    /// <returns>size (in bytes)</returns>
+    UINT64                  GetWrittenSize() const { return m_cbWritten; }
+
+    /// <summary>
+    /// Get the size of the frames received but not written
+    /// </summary>
+    /// <returns>size (in bytes)</returns>
+    UINT64                  GetBacklog() const { return m_cbBacklog; }
+
+private:
+    /// A received frame, from its arrival until it is written
+    struct ReceivedFrame
+    {
+        std::wstring        sFilePath;
+        BYTE*               pSlot;
+        DWORD               cbSlot;
+        DWORD               cbFrame;
+        UINT32              nBatch;
+        UINT32              nIndex;
+    };
+
+    /// A batch whose frames are being written
+    struct ReceivedBatch
+    {
+        UINT32              nRemaining;
+        std::vector<HRESULT> vResults;
+    };
+
+    std::wstring            m_sFolder;
+    WriterMode              m_nWriterMode;
+    int                     m_nQueueDepth;
+    UINT64                  m_cbMaxBacklog;
+    SOCKET                  m_listener;
+    std::atomic<bool>       m_bStop;
+    std::atomic<UINT>       m_nWritten;
+    std::atomic<UINT>       m_nFailed;
+    std::atomic<UINT64>     m_cbWritten;
+    std::atomic<UINT64>     m_cbBacklog;
+    std::vector<ReceivedFrame> m_vFreeSlots;
+    std::set<std::wstring>  m_sCreatedFolders;
+
+    /// <summary>
+    /// Receive and write the batches of a sender until it disconnects
+    /// </summary>
+    /// <param name="s">socket of the connection</param>
+    void                    Serve(SOCKET s);
+
+    /// <summary>
+    /// Receive a batch and queue its frames for writing
+    /// </summary>
+    /// <param name="s">socket of the connection</param>
+    /// <param name="mBatches">batches being written</param>
+    /// <param name="qFrames">receives the frames to write</param>
+    /// <returns>indicates success or failure, which ends the connection</returns>
+    HRESULT                 ReceiveBatch(SOCKET s, std::map<UINT32, ReceivedBatch>& mBatches, std::deque<ReceivedFrame*>& qFrames);
+
+    /// <summary>
+    /// Complete a frame, and acknowledge its batch once all of its frames are written
+    /// </summary>
+    /// <param name="s">socket of the connection</param>
+    /// <param name="mBatches">batches being written</param>
+    /// <param name="pFrame">frame, which is deleted</param>
+    /// <param name="hr">result of the write</param>
+    void                    Complete(SOCKET s, std::map<UINT32, ReceivedBatch>& mBatches, ReceivedFrame* pFrame, HRESULT hr);
+
+    /// <summary>
+    /// Check a received path, and get the full path of its file with its folder created
+    /// </summary>
+    /// <param name="sPath">path relative to the receiver folder, replaced by the full path</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 PrepareFilePath(std::wstring& sPath);
+};
+
+/// <summary>
+/// Receive frames streamed by recorders and write them under a folder until Ctrl+C is pressed
+/// </summary>
+/// <param name="argc">number of arguments</param>
+/// <param name="argv">output folder, (optional) port and (optional) writer backend</param>
+/// <returns>0 on success, otherwise failure</returns>
+int RunReceive(int argc, LPWSTR* argv);
@@ -0,0 +1,929 @@
+// FrameWriter.cpp
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Writer backends used to store the recorded frames on disk
+
+
+#include "stdafx.h"
+#include <stdio.h>
+#include <string.h>
+#include <winioctl.h>
+#include <strsafe.h>
+#include "FrameWriter.h"
+#include "Stripe.h"
+#include "ThreadPlacement.h"
+
+/// <summary>
+/// Allocate a sector aligned and zero filled frame slot
+/// </summary>
+/// <param name="cbSlot">size (in bytes) of the slot, as returned by GetFrameSlotSize</param>
+/// <returns>pointer to the slot, NULL on failure</returns>
+BYTE* AllocateFrameSlot(DWORD cbSlot)
+{
+    // VirtualAlloc returns page aligned memory, which is zero filled so that the sector padding
+    // written behind each frame never carries stale data
+    return reinterpret_cast<BYTE*>(VirtualAlloc(NULL, cbSlot, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+}
+
+/// <summary>
+/// Free a frame slot allocated by AllocateFrameSlot
+/// </summary>
+/// <param name="pSlot">slot to free</param>
+void FreeFrameSlot(BYTE* pSlot)
+{
+    if (pSlot)
+    {
+        VirtualFree(pSlot, 0, MEM_RELEASE);
+    }
+}
+
+/// <summary>
+/// Enable the privilege needed by SetFileValidData for this process
+/// </summary>
+/// <returns>true if the privilege is held</returns>
+bool EnableManageVolumePrivilege()
+{
+    static int nEnabled = -1;
+    if (nEnabled >= 0)
+    {
+        return nEnabled > 0;
+    }
+
+    nEnabled = 0;
+    HANDLE hToken = NULL;
+    if (OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &hToken))
+    {
+        TOKEN_PRIVILEGES privileges = { 0 };
+        privileges.PrivilegeCount = 1;
+        privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+        if (LookupPrivilegeValueW(NULL, SE_MANAGE_VOLUME_NAME, &privileges.Privileges[0].Luid) &&
+            AdjustTokenPrivileges(hToken, FALSE, &privileges, 0, NULL, NULL) &&
+            GetLastError() == ERROR_SUCCESS)
+        {
+            nEnabled = 1;
+        }
+        CloseHandle(hToken);
+    }
+
+    return nEnabled > 0;
+}
+
+/// <summary>
+/// Format the header of a PGM file
+/// </summary>
+/// <param name="pDest">destination of the header</param>
+/// <param name="lWidth">width (in pixels) of image data</param>
+/// <param name="lHeight">height (in pixels) of image data</param>
+/// <param name="lMaxPixel">max value of a pixel</param>
+/// <returns>size (in bytes) of the header</returns>
+DWORD FormatPGMHeader(BYTE* pDest, LONG lWidth, LONG lHeight, LONG lMaxPixel)
+{
+    CHAR szHeader[256];
+    int nLength = sprintf_s(szHeader, _countof(szHeader), "P5\n%d %d\n%d\n", lWidth, lHeight, lMaxPixel);
+    memcpy(pDest, szHeader, nLength);
+    return nLength;
+}
+
+/// <summary>
+/// Format the header of a PPM file
+/// </summary>
+/// <param name="pDest">destination of the header</param>
+/// <param name="lWidth">width (in pixels) of image data</param>
+/// <param name="lHeight">height (in pixels) of image data</param>
+/// <param name="lMaxPixel">max value of a pixel</param>
+/// <returns>size (in bytes) of the header</returns>
+DWORD FormatPPMHeader(BYTE* pDest, LONG lWidth, LONG lHeight, LONG lMaxPixel)
+{
+    CHAR szHeader[256];
+    int nLength = sprintf_s(szHeader, _countof(szHeader), "P6\n%d %d\n%d\n", lWidth, lHeight, lMaxPixel);
+    memcpy(pDest, szHeader, nLength);
+    return nLength;
+}
+
+/// <summary>
+/// Format the file header and info header of a bitmap
+/// </summary>
+/// <param name="pDest">destination of the header</param>
+/// <param name="lWidth">width (in pixels) of image data</param>
+/// <param name="lHeight">height (in pixels) of image data</param>
+/// <param name="wBitsPerPixel">bits per pixel of image data</param>
+/// <returns>size (in bytes) of the header</returns>
+DWORD FormatBMPHeader(BYTE* pDest, LONG lWidth, LONG lHeight, WORD wBitsPerPixel)
+{
+    BITMAPINFOHEADER bmpInfoHeader = { 0 };
+
+    bmpInfoHeader.biSize = sizeof(BITMAPINFOHEADER);            // Size of the header
+    bmpInfoHeader.biBitCount = wBitsPerPixel;                   // Bit count
+    bmpInfoHeader.biCompression = BI_RGB;                       // Standard RGB, no compression
+    bmpInfoHeader.biWidth = lWidth;                             // Width in pixels
+    bmpInfoHeader.biHeight = -lHeight;                          // Height in pixels, negative indicates it's stored right-side-up
+    bmpInfoHeader.biPlanes = 1;                                 // Default
+    bmpInfoHeader.biSizeImage = lWidth * lHeight * (wBitsPerPixel / 8); // Image size in bytes
+
+    BITMAPFILEHEADER bfh = { 0 };
+
+    bfh.bfType = 0x4D42;                                                // 'M''B', indicates bitmap
+    bfh.bfOffBits = bmpInfoHeader.biSize + sizeof(BITMAPFILEHEADER);    // Offset to the start of pixel data
+    bfh.bfSize = bfh.bfOffBits + bmpInfoHeader.biSizeImage;             // Size of image + headers
+
+    memcpy(pDest, &bfh, sizeof(bfh));
+    memcpy(pDest + sizeof(bfh), &bmpInfoHeader, sizeof(bmpInfoHeader));
+    return sizeof(bfh) + sizeof(bmpInfoHeader);
+}
+
+/// <summary>
+/// Cut the sector padding off an unbuffered file
+/// </summary>
+/// <param name="hFile">file written with sector padding</param>
+/// <param name="cbFrame">size (in bytes) of header and pixel data</param>
+/// <param name="cbFile">size (in bytes) of the file as written</param>
+/// <returns>indicates success or failure</returns>
+static HRESULT TruncateFrameFile(HANDLE hFile, DWORD cbFrame, DWORD cbFile)
+{
+    if (cbFile == cbFrame)
+    {
+        return S_OK;
+    }
+
+    FILE_END_OF_FILE_INFO eofInfo;
+    eofInfo.EndOfFile.QuadPart = cbFrame;
+    if (!SetFileInformationByHandle(hFile, FileEndOfFileInfo, &eofInfo, sizeof(eofInfo)))
+    {
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+/// <summary>
+/// Create the writer backend of the given mode
+/// </summary>
+/// <param name="mode">writer mode</param>
+/// <returns>new writer, to be deleted by the caller</returns>
+FrameWriter* FrameWriter::Create(WriterMode mode)
+{
+    switch (mode)
+    {
+    case WriterMode_Unbuffered: return new UnbufferedFrameWriter();
+    case WriterMode_Overlapped: return new OverlappedFrameWriter();
+    default:                    return new BufferedFrameWriter();
+    }
+}
+
+/// <summary>
+/// Submit a frame write, which is done synchronously and reported on the next Poll
+/// </summary>
+/// <param name="lpszFilePath">full file path to output frame to</param>
+/// <param name="pFrame">start of the frame slot holding the frame</param>
+/// <param name="cbFrame">size (in bytes) of header and pixel data</param>
+/// <param name="nContext">value reported by Poll when the write completes</param>
+/// <returns>indicates success or failure, no completion is reported on failure</returns>
+HRESULT FrameWriter::Submit(LPCWSTR lpszFilePath, const BYTE* pFrame, DWORD cbFrame, ULONG_PTR nContext)
+{
+    HRESULT hr = Write(lpszFilePath, pFrame, cbFrame);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    m_qCompletedContexts.push(nContext);
+    m_qCompletedResults.push(hr);
+    ++m_nPending;
+    return hr;
+}
+
+/// <summary>
+/// Collect the writes completed by Submit
+/// </summary>
+/// <param name="pContexts">receives the contexts of the completed writes</param>
+/// <param name="pResults">receives the results of the completed writes</param>
+/// <param name="nMaxCompletions">max number of completions to collect</param>
+/// <param name="dwMilliseconds">ignored, synchronous writes are completed already</param>
+/// <returns>number of collected completions</returns>
+int FrameWriter::Poll(ULONG_PTR* pContexts, HRESULT* pResults, int nMaxCompletions, DWORD)
+{
+    int nCompleted = 0;
+    while (nCompleted < nMaxCompletions && !m_qCompletedContexts.empty())
+    {
+        pContexts[nCompleted] = m_qCompletedContexts.front();
+        pResults[nCompleted] = m_qCompletedResults.front();
+        m_qCompletedContexts.pop();
+        m_qCompletedResults.pop();
+        ++nCompleted;
+    }
+
+    m_nPending -= nCompleted;
+    return nCompleted;
+}
+
+/// <summary>
+/// Write a frame (file header followed by pixel data) to a new file through the file cache
+/// </summary>
+/// <param name="lpszFilePath">full file path to output frame to</param>
+/// <param name="pFrame">start of the frame slot holding the frame</param>
+/// <param name="cbFrame">size (in bytes) of header and pixel data</param>
+/// <returns>indicates success or failure</returns>
+HRESULT BufferedFrameWriter::Write(LPCWSTR lpszFilePath, const BYTE* pFrame, DWORD cbFrame)
+{
+    // Create the file on disk to write to, setting compression takes read access too
+    HANDLE hFile = CreateFileW(lpszFilePath, m_bCompress ? GENERIC_READ | GENERIC_WRITE : GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    // Return if error opening file
+    if (INVALID_HANDLE_VALUE == hFile)
+    {
+        return E_ACCESSDENIED;
+    }
+
+    // Compression is a file attribute, which is set before any data is written. Volumes
+    // without compression support (e.g. FAT or ReFS) keep the frame uncompressed.
+    if (m_bCompress)
+    {
+        USHORT nFormat = COMPRESSION_FORMAT_DEFAULT;
+        DWORD dwBytesReturned = 0;
+        DeviceIoControl(hFile, FSCTL_SET_COMPRESSION, &nFormat, sizeof(nFormat), NULL, 0, &dwBytesReturned, NULL);
+    }
+
+    DWORD dwBytesWritten = 0;
+
+    // Write header and pixel data at once
+    if (!WriteFile(hFile, pFrame, cbFrame, &dwBytesWritten, NULL) || dwBytesWritten != cbFrame)
+    {
+        CloseHandle(hFile);
+        return E_FAIL;
+    }
+
+    // Close the file
+    CloseHandle(hFile);
+    return S_OK;
+}
+
+/// <summary>
+/// Write a frame (file header followed by pixel data) to a new file bypassing the file cache
+/// </summary>
+/// <param name="lpszFilePath">full file path to output frame to</param>
+/// <param name="pFrame">start of the frame slot holding the frame</param>
+/// <param name="cbFrame">size (in bytes) of header and pixel data</param>
+/// <returns>indicates success or failure</returns>
+HRESULT UnbufferedFrameWriter::Write(LPCWSTR lpszFilePath, const BYTE* pFrame, DWORD cbFrame)
+{
+    // Unbuffered I/O needs a sector aligned buffer
+    if (reinterpret_cast<ULONG_PTR>(pFrame) & (SectorAlignment - 1))
+    {
+        return E_INVALIDARG;
+    }
+
+    // Create the file on disk to write to
+    HANDLE hFile = CreateFileW(lpszFilePath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, NULL);
+
+    // Return if error opening file
+    if (INVALID_HANDLE_VALUE == hFile)
+    {
+        return E_ACCESSDENIED;
+    }
+
+    // The write size has to be a multiple of the sector size, so the zero filled tail of the slot
+    // is written as well
+    DWORD cbPadded = GetFrameSlotSize(cbFrame);
+    DWORD dwBytesWritten = 0;
+
+    if (!WriteFile(hFile, pFrame, cbPadded, &dwBytesWritten, NULL) || dwBytesWritten != cbPadded)
+    {
+        CloseHandle(hFile);
+        return E_FAIL;
+    }
+
+    // Cut the padding off again
+    HRESULT hr = TruncateFrameFile(hFile, cbFrame, cbPadded);
+
+    // Close the file
+    CloseHandle(hFile);
+    return hr;
+}
+
+/// <summary>
+/// Delete an open file as it is closed
+/// </summary>
+/// <param name="hFile">file opened with DELETE access</param>
+static void DeleteOpenFile(HANDLE hFile)
+{
+    FILE_DISPOSITION_INFO dispositionInfo;
+    dispositionInfo.DeleteFile = TRUE;
+    SetFileInformationByHandle(hFile, FileDispositionInfo, &dispositionInfo, sizeof(dispositionInfo));
+    CloseHandle(hFile);
+}
+
+/// <summary>
+/// Give an open file a new name in the same volume, replacing a file of that name
+/// </summary>
+/// <param name="hFile">file opened with DELETE access</param>
+/// <param name="lpszFilePath">full path of the new name</param>
+/// <returns>indicates success or failure</returns>
+static HRESULT RenameOpenFile(HANDLE hFile, LPCWSTR lpszFilePath)
+{
+    union
+    {
+        FILE_RENAME_INFO    info;
+        BYTE                buffer[sizeof(FILE_RENAME_INFO) + MAX_PATH * sizeof(WCHAR)];
+    } renameInfo;
+    ZeroMemory(&renameInfo, sizeof(renameInfo));
+    size_t cchFilePath = wcslen(lpszFilePath);
+    if (cchFilePath >= MAX_PATH)
+    {
+        return E_INVALIDARG;
+    }
+
+    renameInfo.info.ReplaceIfExists = TRUE;
+    renameInfo.info.RootDirectory = NULL;
+    renameInfo.info.FileNameLength = static_cast<DWORD>(cchFilePath * sizeof(WCHAR));
+    memcpy(renameInfo.info.FileName, lpszFilePath, cchFilePath * sizeof(WCHAR));
+    if (!SetFileInformationByHandle(hFile, FileRenameInfo, &renameInfo, sizeof(renameInfo)))
+    {
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+/// <summary>
+/// Constructor, starts the opener thread
+/// </summary>
+OverlappedFrameWriter::OverlappedFrameWriter() :
+    m_hCompletionPort(NULL),
+    m_bValidData(false),
+    m_bStop(false),
+    m_nCreatedFiles(0)
+{
+    m_hCompletionPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    m_bValidData = EnableManageVolumePrivilege();
+    m_tOpener = std::thread(&OverlappedFrameWriter::CreateFiles, this);
+}
+
+/// <summary>
+/// Destructor, waits for all pending writes and deletes the files created ahead
+/// </summary>
+OverlappedFrameWriter::~OverlappedFrameWriter()
+{
+    ULONG_PTR nContext = 0;
+    HRESULT hr = S_OK;
+    while (m_nPending > 0 && Poll(&nContext, &hr, 1, INFINITE) > 0)
+    {
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mPoolMutex);
+        m_bStop = true;
+    }
+    m_cvPool.notify_one();
+    m_tOpener.join();
+
+    for (size_t i = 0; i < m_vPools.size(); ++i)
+    {
+        for (size_t j = 0; j < m_vPools[i].qFiles.size(); ++j)
+        {
+            DeleteOpenFile(m_vPools[i].qFiles[j].hFile);
+        }
+    }
+    m_vPools.clear();
+
+    if (m_hCompletionPort)
+    {
+        CloseHandle(m_hCompletionPort);
+        m_hCompletionPort = NULL;
+    }
+}
+
+/// <summary>
+/// Start an overlapped, unbuffered frame write
+/// </summary>
+/// <param name="lpszFilePath">full file path to output frame to</param>
+/// <param name="pFrame">start of the frame slot holding the frame</param>
+/// <param name="cbFrame">size (in bytes) of header and pixel data</param>
+/// <param name="nContext">value reported by Poll when the write completes</param>
+/// <returns>indicates success or failure, no completion is reported on failure</returns>
+HRESULT OverlappedFrameWriter::Submit(LPCWSTR lpszFilePath, const BYTE* pFrame, DWORD cbFrame, ULONG_PTR nContext)
+{
+    if (!m_hCompletionPort)
+    {
+        return E_FAIL;
+    }
+
+    // Unbuffered I/O needs a sector aligned buffer
+    if (reinterpret_cast<ULONG_PTR>(pFrame) & (SectorAlignment - 1))
+    {
+        return E_INVALIDARG;
+    }
+
+    WriteRequest* pRequest = new WriteRequest();
+    ZeroMemory(pRequest, sizeof(*pRequest));
+    if (FAILED(StringCchCopyW(pRequest->szFilePath, _countof(pRequest->szFilePath), lpszFilePath)))
+    {
+        delete pRequest;
+        return E_INVALIDARG;
+    }
+    pRequest->hFile = INVALID_HANDLE_VALUE;
+    pRequest->cbFrame = cbFrame;
+    pRequest->nContext = nContext;
+
+    // Take a file created ahead in the folder of the frame, and have the opener replace it
+    DWORD cbPadded = GetFrameSlotSize(cbFrame);
+    std::wstring sFolder(lpszFilePath);
+    size_t nSeparator = sFolder.find_last_of(L'\\');
+    sFolder.resize(std::wstring::npos == nSeparator ? 0 : nSeparator);
+    {
+        std::lock_guard<std::mutex> lock(m_mPoolMutex);
+        FilePool* pPool = UsePool(sFolder, cbPadded);
+        if (!pPool->qFiles.empty())
+        {
+            pRequest->hFile = pPool->qFiles.front().hFile;
+            pRequest->cbFile = pPool->qFiles.front().cbFile;
+            pRequest->bPooled = true;
+            pPool->qFiles.pop_front();
+        }
+    }
+    m_cvPool.notify_one();
+
+    // A frame larger than the ones before it grows the file, which still keeps the write from
+    // extending it. Only a folder which was not prepared has its first files created here.
+    if (pRequest->bPooled && pRequest->cbFile < cbPadded)
+    {
+        FILE_END_OF_FILE_INFO eofInfo;
+        eofInfo.EndOfFile.QuadPart = cbPadded;
+        if (!SetFileInformationByHandle(pRequest->hFile, FileEndOfFileInfo, &eofInfo, sizeof(eofInfo)))
+        {
+            DeleteOpenFile(pRequest->hFile);
+            delete pRequest;
+            return E_FAIL;
+        }
+        if (m_bValidData)
+        {
+            SetFileValidData(pRequest->hFile, cbPadded);
+        }
+        pRequest->cbFile = cbPadded;
+    }
+    else if (!pRequest->bPooled)
+    {
+        pRequest->hFile = CreateFrameFile(lpszFilePath, cbPadded);
+        pRequest->cbFile = cbPadded;
+    }
+
+    // Return if error opening file
+    if (INVALID_HANDLE_VALUE == pRequest->hFile)
+    {
+        delete pRequest;
+        return E_ACCESSDENIED;
+    }
+
+    // The completion packet is queued even if the write finishes synchronously
+    if (!WriteFile(pRequest->hFile, pFrame, cbPadded, NULL, &pRequest->overlapped) && GetLastError() != ERROR_IO_PENDING)
+    {
+        DeleteOpenFile(pRequest->hFile);
+        delete pRequest;
+        return E_FAIL;
+    }
+
+    ++m_nPending;
+    return S_OK;
+}
+
+/// <summary>
+/// Collect completed overlapped writes, truncate, name and close their files
+/// </summary>
+/// <param name="pContexts">receives the contexts of the completed writes</param>
+/// <param name="pResults">receives the results of the completed writes</param>
+/// <param name="nMaxCompletions">max number of completions to collect</param>
+/// <param name="dwMilliseconds">time to wait for a completion if none is available</param>
+/// <returns>number of collected completions</returns>
+int OverlappedFrameWriter::Poll(ULONG_PTR* pContexts, HRESULT* pResults, int nMaxCompletions, DWORD dwMilliseconds)
+{
+    if (m_nPending <= 0 || nMaxCompletions <= 0)
+    {
+        return 0;
+    }
+
+    OVERLAPPED_ENTRY entries[64];
+    ULONG nRemoved = 0;
+    if (!GetQueuedCompletionStatusEx(m_hCompletionPort, entries, min(nMaxCompletions, static_cast<int>(_countof(entries))), &nRemoved, dwMilliseconds, FALSE))
+    {
+        return 0;
+    }
+
+    for (ULONG i = 0; i < nRemoved; ++i)
+    {
+        WriteRequest* pRequest = reinterpret_cast<WriteRequest*>(entries[i].lpOverlapped);
+
+        DWORD dwBytesWritten = 0;
+        HRESULT hr = S_OK;
+        if (!GetOverlappedResult(pRequest->hFile, &pRequest->overlapped, &dwBytesWritten, FALSE) || dwBytesWritten != GetFrameSlotSize(pRequest->cbFrame))
+        {
+            hr = E_FAIL;
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            hr = TruncateFrameFile(pRequest->hFile, pRequest->cbFrame, pRequest->cbFile);
+        }
+
+        if (SUCCEEDED(hr) && pRequest->bPooled)
+        {
+            hr = RenameOpenFile(pRequest->hFile, pRequest->szFilePath);
+        }
+
+        // A failed write leaves no partial frame file behind
+        if (SUCCEEDED(hr))
+        {
+            CloseHandle(pRequest->hFile);
+        }
+        else
+        {
+            DeleteOpenFile(pRequest->hFile);
+        }
+
+        pContexts[i] = pRequest->nContext;
+        pResults[i] = hr;
+        delete pRequest;
+    }
+
+    m_nPending -= nRemoved;
+    return nRemoved;
+}
+
+/// <summary>
+/// Create a file for an overlapped, unbuffered write, sized so that the write does not
+/// extend it, and attach it to the completion port
+/// </summary>
+/// <param name="lpszFilePath">full path of the file</param>
+/// <param name="cbFile">size (in bytes) of the write, a multiple of the sector size</param>
+/// <returns>handle of the file, INVALID_HANDLE_VALUE on failure</returns>
+HANDLE OverlappedFrameWriter::CreateFrameFile(LPCWSTR lpszFilePath, DWORD cbFile)
+{
+    // DELETE access lets the file be renamed or deleted through its handle
+    HANDLE hFile = CreateFileW(lpszFilePath, GENERIC_WRITE | DELETE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED, NULL);
+    if (INVALID_HANDLE_VALUE == hFile)
+    {
+        return INVALID_HANDLE_VALUE;
+    }
+
+    // A write within the end of file and the valid data is queued to the device, one which
+    // extends either is completed synchronously. Without the privilege to set the valid data
+    // the write still zero fills the file first.
+    FILE_END_OF_FILE_INFO eofInfo;
+    eofInfo.EndOfFile.QuadPart = cbFile;
+    if (!SetFileInformationByHandle(hFile, FileEndOfFileInfo, &eofInfo, sizeof(eofInfo)))
+    {
+        DeleteOpenFile(hFile);
+        return INVALID_HANDLE_VALUE;
+    }
+    if (m_bValidData)
+    {
+        SetFileValidData(hFile, cbFile);
+    }
+
+    // Completions of every file are delivered to the same port
+    if (!CreateIoCompletionPort(hFile, m_hCompletionPort, 0, 0))
+    {
+        DeleteOpenFile(hFile);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    return hFile;
+}
+
+/// <summary>
+/// Have files created ahead in a folder, and the folder itself if needed
+/// </summary>
+/// <param name="lpszFolder">full path of the folder</param>
+/// <param name="cbFrame">size (in bytes) of the largest frame</param>
+void OverlappedFrameWriter::Prepare(LPCWSTR lpszFolder, DWORD cbFrame)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mPoolMutex);
+        UsePool(lpszFolder, GetFrameSlotSize(cbFrame));
+    }
+    m_cvPool.notify_one();
+}
+
+/// <summary>
+/// Find the pool of a folder, or add it, and note that the folder is written to
+/// </summary>
+/// <param name="sFolder">folder of the files</param>
+/// <param name="cbFile">size (in bytes) of the files needed</param>
+/// <returns>the pool</returns>
+OverlappedFrameWriter::FilePool* OverlappedFrameWriter::UsePool(const std::wstring& sFolder, DWORD cbFile)
+{
+    FilePool* pPool = NULL;
+    for (size_t i = 0; i < m_vPools.size() && !pPool; ++i)
+    {
+        pPool = (0 == _wcsicmp(m_vPools[i].sFolder.c_str(), sFolder.c_str())) ? &m_vPools[i] : NULL;
+    }
+    if (!pPool)
+    {
+        FilePool pool;
+        pool.sFolder = sFolder;
+        pool.cbFile = 0;
+        m_vPools.push_back(pool);
+        pPool = &m_vPools.back();
+    }
+
+    pPool->cbFile = max(pPool->cbFile, cbFile);
+    pPool->nLastUsed = GetTickCount64();
+    return pPool;
+}
+
+/// <summary>
+/// Keep the pools of the folders written to filled until the writer is destroyed, and
+/// delete the files of the others
+/// </summary>
+void OverlappedFrameWriter::CreateFiles()
+{
+    // The opener serves the save thread, which submits the writes
+    HRESULT hrPlaced = PlaceThread(PipelineThread_Save);
+
+    std::unique_lock<std::mutex> lock(m_mPoolMutex);
+    while (!m_bStop)
+    {
+        // Folders not written to any more (previous sessions) get their files deleted, so that
+        // no temporary files stay behind
+        ULONGLONG nNow = GetTickCount64();
+        for (size_t i = 0; i < m_vPools.size();)
+        {
+            if (nNow - m_vPools[i].nLastUsed > OverlappedPoolIdleMsec)
+            {
+                for (size_t j = 0; j < m_vPools[i].qFiles.size(); ++j)
+                {
+                    DeleteOpenFile(m_vPools[i].qFiles[j].hFile);
+                }
+                m_vPools.erase(m_vPools.begin() + i);
+            }
+            else
+            {
+                ++i;
+            }
+        }
+
+        // The emptiest pool is filled first, so that every folder has a file soon
+        size_t nPool = m_vPools.size();
+        for (size_t i = 0; i < m_vPools.size(); ++i)
+        {
+            if (m_vPools[i].qFiles.size() < OverlappedPoolFiles && (nPool == m_vPools.size() || m_vPools[i].qFiles.size() < m_vPools[nPool].qFiles.size()))
+            {
+                nPool = i;
+            }
+        }
+        if (nPool == m_vPools.size())
+        {
+            m_cvPool.wait_for(lock, std::chrono::milliseconds(OverlappedPoolIdleMsec / 4));
+            continue;
+        }
+
+        // The file is created outside the lock, so the pool is looked up again after
+        std::wstring sFolder = m_vPools[nPool].sFolder;
+        PooledFile file;
+        file.cbFile = m_vPools[nPool].cbFile;
+        WCHAR szFilePath[MAX_PATH];
+        StringCchPrintfW(szFilePath, _countof(szFilePath), L"%s\\~%08x_%u.tmp", sFolder.c_str(), GetCurrentProcessId(), m_nCreatedFiles++);
+        lock.unlock();
+        file.hFile = CreateFrameFile(szFilePath, file.cbFile);
+        if (INVALID_HANDLE_VALUE == file.hFile && SUCCEEDED(CreateFolderTree(sFolder.c_str())))
+        {
+            file.hFile = CreateFrameFile(szFilePath, file.cbFile);
+        }
+        lock.lock();
+
+        FilePool* pPool = NULL;
+        for (size_t i = 0; i < m_vPools.size() && !pPool; ++i)
+        {
+            pPool = (m_vPools[i].sFolder == sFolder) ? &m_vPools[i] : NULL;
+        }
+        if (INVALID_HANDLE_VALUE == file.hFile)
+        {
+            // The writes to the folder fail on their own, the opener only waits for it to change
+            m_cvPool.wait_for(lock, std::chrono::milliseconds(OverlappedPoolIdleMsec / 4));
+        }
+        else if (pPool && !m_bStop)
+        {
+            pPool->qFiles.push_back(file);
+        }
+        else
+        {
+            DeleteOpenFile(file.hFile);
+        }
+    }
+
+    UnplaceThread(PipelineThread_Save, hrPlaced);
+}
+
+/// <summary>
+/// Constructor, starts the migration thread
+/// </summary>
+/// <param name="pDestination">writer which stores the frames on disk, owned by the staging writer</param>
+/// <param name="cbCapacity">size (in bytes) of the staging area</param>
+StagingFrameWriter::StagingFrameWriter(FrameWriter* pDestination, UINT64 cbCapacity) :
+    m_pDestination(pDestination),
+    m_cbCapacity(cbCapacity),
+    m_cbStaged(0),
+    m_cbAllocated(0),
+    m_bStop(false),
+    m_pTally(NULL),
+    m_fMigrationRate(0.0)
+{
+    m_bBackground = true;
+    m_nFailed = 0;
+    m_tMigrator = std::thread(&StagingFrameWriter::MigrateFrames, this);
+}
+
+/// <summary>
+/// Destructor, waits until all staged frames are migrated
+/// </summary>
+StagingFrameWriter::~StagingFrameWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mMutex);
+        m_bStop = true;
+    }
+    m_bBackground = false;
+    m_cvStaged.notify_one();
+
+    if (m_tMigrator.joinable())
+    {
+        m_tMigrator.join();
+    }
+
+    for (size_t i = 0; i < m_vFreeSlots.size(); ++i)
+    {
+        FreeFrameSlot(m_vFreeSlots[i].pSlot);
+    }
+
+    delete m_pDestination;
+}
+
+/// <summary>
+/// Copy a frame into the staging area, or write it to the destination if the staging area is full
+/// </summary>
+/// <param name="lpszFilePath">full file path to output frame to</param>
+/// <param name="pFrame">start of the frame slot holding the frame</param>
+/// <param name="cbFrame">size (in bytes) of header and pixel data</param>
+/// <returns>indicates success or failure</returns>
+HRESULT StagingFrameWriter::Write(LPCWSTR lpszFilePath, const BYTE* pFrame, DWORD cbFrame)
+{
+    StagedFrame frame;
+    frame.sFilePath = lpszFilePath;
+    frame.pSlot = NULL;
+    frame.cbFrame = cbFrame;
+    frame.cbSlot = GetFrameSlotSize(cbFrame);
+    frame.pTally = m_pTally;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mMutex);
+
+        // Reuse a migrated slot of the same size
+        for (size_t i = 0; i < m_vFreeSlots.size(); ++i)
+        {
+            if (m_vFreeSlots[i].cbSlot == frame.cbSlot)
+            {
+                frame.pSlot = m_vFreeSlots[i].pSlot;
+                m_vFreeSlots.erase(m_vFreeSlots.begin() + i);
+                break;
+            }
+        }
+
+        // Otherwise give back slots of other sizes until a new one fits
+        while (!frame.pSlot && m_cbAllocated + frame.cbSlot > m_cbCapacity && !m_vFreeSlots.empty())
+        {
+            m_cbAllocated -= m_vFreeSlots.back().cbSlot;
+            FreeFrameSlot(m_vFreeSlots.back().pSlot);
+            m_vFreeSlots.pop_back();
+        }
+
+        if (!frame.pSlot && m_cbAllocated + frame.cbSlot <= m_cbCapacity)
+        {
+            frame.pSlot = AllocateFrameSlot(frame.cbSlot);
+            if (frame.pSlot)
+            {
+                m_cbAllocated += frame.cbSlot;
+            }
+        }
+
+        if (frame.pSlot)
+        {
+            m_cbStaged += frame.cbSlot;
+        }
+    }
+
+    // The staging area is full, so the frame goes straight to the destination
+    if (!frame.pSlot)
+    {
+        return m_pDestination->Write(lpszFilePath, pFrame, cbFrame);
+    }
+
+    memcpy(frame.pSlot, pFrame, cbFrame);
+
+    if (frame.pTally)
+    {
+        ++frame.pTally->nStaged;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mMutex);
+        m_qStagedFrames.push_back(frame);
+    }
+    m_cvStaged.notify_one();
+
+    return S_OK;
+}
+
+/// <summary>
+/// Get the occupancy of the staging area
+/// </summary>
+/// <param name="pStatus">receives the occupancy</param>
+void StagingFrameWriter::GetStagingStatus(StagingStatus* pStatus)
+{
+    std::lock_guard<std::mutex> lock(m_mMutex);
+    pStatus->cbStaged = m_cbStaged;
+    pStatus->cbCapacity = m_cbCapacity;
+    pStatus->nFrames = static_cast<UINT>(m_qStagedFrames.size());
+    pStatus->nFailed = m_nFailed;
+    pStatus->fMigrationRate = m_fMigrationRate;
+}
+
+/// <summary>
+/// Migrate staged frames until the writer is destroyed
+/// </summary>
+void StagingFrameWriter::MigrateFrames()
+{
+    HRESULT hrPlaced = PlaceThread(PipelineThread_Migrator);
+
+    LARGE_INTEGER qpf = { 0 };
+    QueryPerformanceFrequency(&qpf);
+
+    // Background mode lowers both the CPU and the I/O priority of the thread
+    bool bBackground = m_bBackground;
+    if (bBackground)
+    {
+        SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+    }
+
+    for (;;)
+    {
+        // The frame stays queued until it is written, so that it is counted as staged
+        StagedFrame frame;
+        {
+            std::unique_lock<std::mutex> lock(m_mMutex);
+            while (m_qStagedFrames.empty() && !m_bStop)
+            {
+                m_cvStaged.wait(lock);
+            }
+
+            if (m_qStagedFrames.empty())
+            {
+                break;
+            }
+            frame = m_qStagedFrames.front();
+        }
+
+        if (bBackground != m_bBackground)
+        {
+            bBackground = m_bBackground;
+            SetThreadPriority(GetCurrentThread(), bBackground ? THREAD_MODE_BACKGROUND_BEGIN : THREAD_MODE_BACKGROUND_END);
+        }
+
+        LARGE_INTEGER qpcStart = { 0 };
+        LARGE_INTEGER qpcEnd = { 0 };
+        QueryPerformanceCounter(&qpcStart);
+        bool bFailed = FAILED(m_pDestination->Write(frame.sFilePath.c_str(), frame.pSlot, frame.cbFrame));
+        QueryPerformanceCounter(&qpcEnd);
+
+        // The owner may be gone as soon as its last frame is counted as migrated
+        if (bFailed)
+        {
+            ++m_nFailed;
+        }
+        if (frame.pTally)
+        {
+            if (bFailed)
+            {
+                ++frame.pTally->nFailed;
+            }
+            --frame.pTally->nStaged;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mMutex);
+        m_qStagedFrames.pop_front();
+        m_cbStaged -= frame.cbSlot;
+        m_vFreeSlots.push_back(frame);
+
+        // Smooth the rate over the last frames for the ETA
+        if (qpcEnd.QuadPart > qpcStart.QuadPart)
+        {
+            double fRate = frame.cbFrame * double(qpf.QuadPart) / double(qpcEnd.QuadPart - qpcStart.QuadPart);
+            m_fMigrationRate = (m_fMigrationRate > 0.0) ? 0.9 * m_fMigrationRate + 0.1 * fRate : fRate;
+        }
+    }
+
+    if (bBackground)
+    {
+        SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+    }
+
+    UnplaceThread(PipelineThread_Migrator, hrPlaced);
+}
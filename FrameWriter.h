@@ -0,0 +1,383 @@
+// FrameWriter.h
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Writer backends used to store the recorded frames on disk
+
+
+#pragma once
+
+#include <windows.h>
+#include <queue>
+#include <deque>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+/// The SectorAlignment value specifies the alignment required by unbuffered (direct) I/O.
+/// Frame slots are page aligned and padded to a multiple of this value, which covers
+/// both 512-byte and 4K-native sector drives.
+#define SectorAlignment 4096
+
+/// Writer modes which can be selected for each record session
+enum WriterMode
+{
+    WriterMode_Buffered = 0,
+    WriterMode_Unbuffered,
+    WriterMode_Overlapped,
+    WriterMode_Mapped,      // frames are converted straight into mapped record files (see RecordFile.h)
+    WriterMode_Network      // frames are streamed to a receiver which writes them (see FrameStream.h)
+};
+
+/// <summary>
+/// Get the size of a frame slot which is able to hold a frame plus its sector padding
+/// </summary>
+/// <param name="cbFrame">size (in bytes) of header and pixel data</param>
+/// <returns>size (in bytes) of the slot</returns>
+inline DWORD GetFrameSlotSize(DWORD cbFrame)
+{
+    return (cbFrame + SectorAlignment - 1) & ~(SectorAlignment - 1);
+}
+
+/// <summary>
+/// Allocate a sector aligned and zero filled frame slot
+/// </summary>
+/// <param name="cbSlot">size (in bytes) of the slot, as returned by GetFrameSlotSize</param>
+/// <returns>pointer to the slot, NULL on failure</returns>
+BYTE* AllocateFrameSlot(DWORD cbSlot);
+
+/// <summary>
+/// Free a frame slot allocated by AllocateFrameSlot
+/// </summary>
+/// <param name="pSlot">slot to free</param>
+void FreeFrameSlot(BYTE* pSlot);
+
+/// <summary>
+/// Enable the privilege needed by SetFileValidData for this process
+/// </summary>
+/// <returns>true if the privilege is held</returns>
+bool EnableManageVolumePrivilege();
+
+/// <summary>
+/// Format the header of a PGM file
+/// </summary>
+/// <param name="pDest">destination of the header</param>
+/// <param name="lWidth">width (in pixels) of image data</param>
+/// <param name="lHeight">height (in pixels) of image data</param>
+/// <param name="lMaxPixel">max value of a pixel</param>
+/// <returns>size (in bytes) of the header</returns>
+DWORD FormatPGMHeader(BYTE* pDest, LONG lWidth, LONG lHeight, LONG lMaxPixel);
+
+/// <summary>
+/// Format the header of a PPM file
+/// </summary>
+/// <param name="pDest">destination of the header</param>
+/// <param name="lWidth">width (in pixels) of image data</param>
+/// <param name="lHeight">height (in pixels) of image data</param>
+/// <param name="lMaxPixel">max value of a pixel</param>
+/// <returns>size (in bytes) of the header</returns>
+DWORD FormatPPMHeader(BYTE* pDest, LONG lWidth, LONG lHeight, LONG lMaxPixel);
+
+/// <summary>
+/// Format the file header and info header of a bitmap
+/// </summary>
+/// <param name="pDest">destination of the header</param>
+/// <param name="lWidth">width (in pixels) of image data</param>
+/// <param name="lHeight">height (in pixels) of image data</param>
+/// <param name="wBitsPerPixel">bits per pixel of image data</param>
+/// <returns>size (in bytes) of the header</returns>
+DWORD FormatBMPHeader(BYTE* pDest, LONG lWidth, LONG lHeight, WORD wBitsPerPixel);
+
+/// Occupancy of the staging area of a StagingFrameWriter
+struct StagingStatus
+{
+    UINT64                  cbStaged;           // size (in bytes) of the frames waiting for migration
+    UINT64                  cbCapacity;         // size (in bytes) of the staging area
+    UINT                    nFrames;            // number of frames waiting for migration
+    UINT                    nFailed;            // number of frames which failed to migrate
+    double                  fMigrationRate;     // recent migration rate (in bytes per second)
+};
+
+/// Frames staged for one owner, e.g. a record session, which StagingFrameWriter counts
+/// until they are migrated
+struct StagingTally
+{
+    std::atomic<int>        nStaged;            // number of frames waiting for migration
+    std::atomic<int>        nFailed;            // number of frames which failed to migrate
+
+    StagingTally()
+    {
+        nStaged = 0;
+        nFailed = 0;
+    }
+};
+
+class FrameWriter
+{
+public:
+    /// <summary>
+    /// Create the writer backend of the given mode
+    /// </summary>
+    /// <param name="mode">writer mode</param>
+    /// <returns>new writer, to be deleted by the caller</returns>
+    static FrameWriter*     Create(WriterMode mode);
+
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    FrameWriter() : m_nPending(0) {}
+
+    /// <summary>
+    /// Destructor
+    /// </summary>
+    virtual ~FrameWriter() {}
+
+    /// <summary>
+    /// Write a frame (file header followed by pixel data) to a new file
+    /// </summary>
+    /// <param name="lpszFilePath">full file path to output frame to</param>
+    /// <param name="pFrame">start of the frame slot holding the frame</param>
+    /// <param name="cbFrame">size (in bytes) of header and pixel data</param>
+    /// <returns>indicates success or failure</returns>
+    virtual HRESULT         Write(LPCWSTR lpszFilePath, const BYTE* pFrame, DWORD cbFrame) = 0;
+
+    /// <summary>
+    /// Submit a frame write. The frame slot must stay untouched until Poll reports the completion.
+    /// Synchronous backends write the frame right away and report it on the next Poll.
+    /// </summary>
+    /// <param name="lpszFilePath">full file path to output frame to</param>
+    /// <param name="pFrame">start of the frame slot holding the frame</param>
+    /// <param name="cbFrame">size (in bytes) of header and pixel data</param>
+    /// <param name="nContext">value reported by Poll when the write completes</param>
+    /// <returns>indicates success or failure, no completion is reported on failure</returns>
+    virtual HRESULT         Submit(LPCWSTR lpszFilePath, const BYTE* pFrame, DWORD cbFrame, ULONG_PTR nContext);
+
+    /// <summary>
+    /// Collect completed writes
+    /// </summary>
+    /// <param name="pContexts">receives the contexts of the completed writes</param>
+    /// <param name="pResults">receives the results of the completed writes</param>
+    /// <param name="nMaxCompletions">max number of completions to collect</param>
+    /// <param name="dwMilliseconds">time to wait for a completion if none is available</param>
+    /// <returns>number of collected completions</returns>
+    virtual int             Poll(ULONG_PTR* pContexts, HRESULT* pResults, int nMaxCompletions, DWORD dwMilliseconds);
+
+    /// <summary>
+    /// Announce a folder which frames are about to be written to, so that the backend can get
+    /// ready for them. Backends which need no preparation ignore it.
+    /// </summary>
+    /// <param name="lpszFolder">full path of the folder, created by the backend if needed</param>
+    /// <param name="cbFrame">size (in bytes) of the largest frame</param>
+    virtual void            Prepare(LPCWSTR, DWORD) {}
+
+    /// <summary>
+    /// Get the number of submitted writes which have not been collected by Poll yet
+    /// </summary>
+    /// <returns>number of pending writes</returns>
+    int                     GetPendingCount() const { return m_nPending; }
+
+protected:
+    int                     m_nPending;
+
+private:
+    std::queue<ULONG_PTR>   m_qCompletedContexts;
+    std::queue<HRESULT>     m_qCompletedResults;
+};
+
+/// Writes frames through the system file cache
+class BufferedFrameWriter : public FrameWriter
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    /// <param name="bCompress">store the frames NTFS compressed</param>
+    BufferedFrameWriter(bool bCompress = false) : m_bCompress(bCompress) {}
+
+    virtual HRESULT         Write(LPCWSTR lpszFilePath, const BYTE* pFrame, DWORD cbFrame);
+
+private:
+    bool                    m_bCompress;
+};
+
+/// Writes frames with FILE_FLAG_NO_BUFFERING, bypassing the system file cache.
+/// The frame is written from its slot padded to the sector size and the file is
+/// truncated to the real frame size afterwards.
+class UnbufferedFrameWriter : public FrameWriter
+{
+public:
+    virtual HRESULT         Write(LPCWSTR lpszFilePath, const BYTE* pFrame, DWORD cbFrame);
+};
+
+/// The OverlappedPoolFiles value specifies the number of files the overlapped writer keeps
+/// created and sized ahead for each folder it writes to
+#define OverlappedPoolFiles 16
+
+/// The OverlappedPoolIdleMsec value specifies the time after which the files created ahead for
+/// a folder which is not written to any more are deleted again
+#define OverlappedPoolIdleMsec 2000
+
+/// Keeps many unbuffered frame writes in flight with overlapped I/O. Completions are
+/// collected from an I/O completion port, so the frame slots are released in the order
+/// the device finishes them. NTFS completes writes which extend a file synchronously, so the
+/// files are created and sized ahead on an opener thread, under temporary names in the folder
+/// written to, and get the name of their frame when their write completes.
+class OverlappedFrameWriter : public UnbufferedFrameWriter
+{
+public:
+    /// <summary>
+    /// Constructor, starts the opener thread
+    /// </summary>
+    OverlappedFrameWriter();
+
+    /// <summary>
+    /// Destructor, waits for all pending writes and deletes the files created ahead
+    /// </summary>
+    virtual ~OverlappedFrameWriter();
+
+    virtual HRESULT         Submit(LPCWSTR lpszFilePath, const BYTE* pFrame, DWORD cbFrame, ULONG_PTR nContext);
+    virtual int             Poll(ULONG_PTR* pContexts, HRESULT* pResults, int nMaxCompletions, DWORD dwMilliseconds);
+
+    /// <summary>
+    /// Have files created ahead in a folder, and the folder itself if needed
+    /// </summary>
+    /// <param name="lpszFolder">full path of the folder</param>
+    /// <param name="cbFrame">size (in bytes) of the largest frame</param>
+    virtual void            Prepare(LPCWSTR lpszFolder, DWORD cbFrame);
+
+private:
+    /// State of a write in flight, the OVERLAPPED has to be the first member
+    struct WriteRequest
+    {
+        OVERLAPPED          overlapped;
+        HANDLE              hFile;
+        DWORD               cbFrame;
+        DWORD               cbFile;                     // size (in bytes) of the file before it is truncated
+        ULONG_PTR           nContext;
+        bool                bPooled;                    // the file has a temporary name
+        WCHAR               szFilePath[MAX_PATH];       // name of the frame
+    };
+
+    /// A file created and sized ahead
+    struct PooledFile
+    {
+        HANDLE              hFile;
+        DWORD               cbFile;
+    };
+
+    /// Files created ahead in one folder, sized for the largest frame written there
+    struct FilePool
+    {
+        std::wstring        sFolder;
+        DWORD               cbFile;
+        ULONGLONG           nLastUsed;                  // GetTickCount64 of the last write to the folder
+        std::deque<PooledFile> qFiles;
+    };
+
+    HANDLE                  m_hCompletionPort;
+    bool                    m_bValidData;               // new files may skip zero filling
+    bool                    m_bStop;
+    UINT                    m_nCreatedFiles;
+    std::vector<FilePool>   m_vPools;
+    std::mutex              m_mPoolMutex;
+    std::condition_variable m_cvPool;
+    std::thread             m_tOpener;
+
+    /// <summary>
+    /// Create a file for an overlapped, unbuffered write, sized so that the write does not
+    /// extend it, and attach it to the completion port
+    /// </summary>
+    /// <param name="lpszFilePath">full path of the file</param>
+    /// <param name="cbFile">size (in bytes) of the write, a multiple of the sector size</param>
+    /// <returns>handle of the file, INVALID_HANDLE_VALUE on failure</returns>
+    HANDLE                  CreateFrameFile(LPCWSTR lpszFilePath, DWORD cbFile);
+
+    /// <summary>
+    /// Find the pool of a folder, or add it, and note that the folder is written to
+    /// </summary>
+    /// <param name="sFolder">folder of the files</param>
+    /// <param name="cbFile">size (in bytes) of the files needed</param>
+    /// <returns>the pool</returns>
+    FilePool*               UsePool(const std::wstring& sFolder, DWORD cbFile);
+
+    /// <summary>
+    /// Keep the pools of the folders written to filled until the writer is destroyed, and
+    /// delete the files of the others
+    /// </summary>
+    void                    CreateFiles();
+};
+
+/// Stages frames in memory at full rate and migrates them to a destination writer on a
+/// background thread with low CPU and I/O priority. Frames are written straight through
+/// to the destination while the staging area is full. Compressed frames are migrated by a
+/// compressing BufferedFrameWriter as destination.
+class StagingFrameWriter : public FrameWriter
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    /// <param name="pDestination">writer which stores the frames on disk, owned by the staging writer</param>
+    /// <param name="cbCapacity">size (in bytes) of the staging area</param>
+    StagingFrameWriter(FrameWriter* pDestination, UINT64 cbCapacity);
+
+    /// <summary>
+    /// Destructor, waits until all staged frames are migrated
+    /// </summary>
+    virtual ~StagingFrameWriter();
+
+    virtual HRESULT         Write(LPCWSTR lpszFilePath, const BYTE* pFrame, DWORD cbFrame);
+
+    /// <summary>
+    /// Get the occupancy of the staging area
+    /// </summary>
+    /// <param name="pStatus">receives the occupancy</param>
+    void                    GetStagingStatus(StagingStatus* pStatus);
+
+    /// <summary>
+    /// Select whether the migration runs in background mode (while recording) or at full speed
+    /// </summary>
+    /// <param name="bBackground">true to migrate with low CPU and I/O priority</param>
+    void                    SetBackground(bool bBackground) { m_bBackground = bBackground; }
+
+    /// <summary>
+    /// Select the tally which counts the frames staged from now on, until they are migrated.
+    /// The tally must stay valid until its nStaged count drops to 0.
+    /// </summary>
+    /// <param name="pTally">tally of the owner of the next frames, NULL for none</param>
+    void                    SetTally(StagingTally* pTally) { m_pTally = pTally; }
+
+private:
+    /// A frame copied into the staging area
+    struct StagedFrame
+    {
+        std::wstring        sFilePath;
+        BYTE*               pSlot;
+        DWORD               cbFrame;
+        DWORD               cbSlot;
+        StagingTally*       pTally;
+    };
+
+    FrameWriter*            m_pDestination;
+    UINT64                  m_cbCapacity;
+    UINT64                  m_cbStaged;
+    UINT64                  m_cbAllocated;
+    bool                    m_bStop;
+    std::atomic<bool>       m_bBackground;
+    std::atomic<UINT>       m_nFailed;
+    StagingTally*           m_pTally;
+    double                  m_fMigrationRate;
+    std::deque<StagedFrame> m_qStagedFrames;
+    std::vector<StagedFrame> m_vFreeSlots;
+    std::mutex              m_mMutex;
+    std::condition_variable m_cvStaged;
+    std::thread             m_tMigrator;
+
+    /// <summary>
+    /// Migrate staged frames until the writer is destroyed
+    /// </summary>
+    void                    MigrateFrames();
+};
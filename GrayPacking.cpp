@@ -0,0 +1,192 @@
+// GrayPacking.cpp
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Bit packing of 16-bit depth and infrared frames to 12 or 13 bits per pixel
+
+
+#include "stdafx.h"
+#include <stdio.h>
+#include <emmintrin.h>
+#include "GrayPacking.h"
+
+/// <summary>
+/// Format the header of a packed image
+/// </summary>
+/// <param name="pDest">destination of the header</param>
+/// <param name="lWidth">width (in pixels) of image data</param>
+/// <param name="lHeight">height (in pixels) of image data</param>
+/// <param name="packing">packing of the image data</param>
+/// <returns>size (in bytes) of the header</returns>
+DWORD FormatPackedHeader(BYTE* pDest, LONG lWidth, LONG lHeight, const GrayPacking& packing)
+{
+    CHAR szHeader[256];
+    int nLength = sprintf_s(szHeader, _countof(szHeader), "KP\n%d %d\n%u %u\n", lWidth, lHeight, packing.nBits, packing.nShift);
+    memcpy(pDest, szHeader, nLength);
+    return nLength;
+}
+
+/// <summary>
+/// Byte swap 8 pixels
+/// </summary>
+/// <param name="nPixels">pixels</param>
+/// <returns>pixels in the other byte order</returns>
+static inline __m128i ByteSwap16(__m128i nPixels)
+{
+    return _mm_or_si128(_mm_slli_epi16(nPixels, 8), _mm_srli_epi16(nPixels, 8));
+}
+
+/// <summary>
+/// Shift big-endian pixels right and saturate them to the bits of the packing
+/// </summary>
+/// <param name="nPixels">8 pixels in big-endian</param>
+/// <param name="nShift">right shift</param>
+/// <param name="nMax">largest value after the shift, in each 16-bit lane</param>
+/// <returns>8 values in native byte order</returns>
+static inline __m128i ReducePixels(__m128i nPixels, __m128i nShift, __m128i nMax)
+{
+    // min for unsigned 16-bit lanes: a - max(a - b, 0)
+    __m128i nValues = _mm_srl_epi16(ByteSwap16(nPixels), nShift);
+    return _mm_sub_epi16(nValues, _mm_subs_epu16(nValues, nMax));
+}
+
+/// <summary>
+/// Reduce a frame to the values its packing keeps, so that it equals the frame unpacked again
+/// </summary>
+/// <param name="pPixels">frame in big-endian, changed in place</param>
+/// <param name="nPixels">number of pixels</param>
+/// <param name="packing">packing of the frame</param>
+void QuantizeGray(UINT16* pPixels, UINT32 nPixels, const GrayPacking& packing)
+{
+    const __m128i nShift = _mm_cvtsi32_si128(packing.nShift);
+    const __m128i nMax = _mm_set1_epi16(static_cast<short>((1u << packing.nBits) - 1));
+    const UINT16 nMaxValue = static_cast<UINT16>((1u << packing.nBits) - 1);
+
+    UINT32 i = 0;
+    for (; i + 8 <= nPixels; i += 8)
+    {
+        __m128i* pGroup = reinterpret_cast<__m128i*>(pPixels + i);
+        __m128i nValues = ReducePixels(_mm_loadu_si128(pGroup), nShift, nMax);
+        _mm_storeu_si128(pGroup, ByteSwap16(_mm_sll_epi16(nValues, nShift)));
+    }
+    for (; i < nPixels; ++i)
+    {
+        UINT16 nValue = static_cast<UINT16>(min(_byteswap_ushort(pPixels[i]) >> packing.nShift, nMaxValue) << packing.nShift);
+        pPixels[i] = _byteswap_ushort(nValue);
+    }
+}
+
+/// <summary>
+/// Pack 8 values into the low nBits bytes of a register
+/// </summary>
+/// <param name="nValues">8 values of at most nBits bits</param>
+/// <param name="nBits">bits per value</param>
+/// <param name="n2Bits">shift count of 2 * nBits</param>
+/// <param name="n4Bits">shift count of 4 * nBits</param>
+/// <param name="n64Minus4Bits">shift count of 64 - 4 * nBits</param>
+/// <returns>packed group, zero above</returns>
+static inline __m128i PackGroup(__m128i nValues, __m128i nBits, __m128i n2Bits, __m128i n4Bits, __m128i n64Minus4Bits)
+{
+    // Pairs in 32-bit lanes, then quads in 64-bit lanes, then both quads across the register
+    __m128i nPairs = _mm_or_si128(_mm_and_si128(nValues, _mm_set1_epi32(0xFFFF)), _mm_sll_epi32(_mm_srli_epi32(nValues, 16), nBits));
+    __m128i nQuads = _mm_or_si128(_mm_and_si128(nPairs, _mm_set_epi32(0, -1, 0, -1)), _mm_sll_epi64(_mm_srli_epi64(nPairs, 32), n2Bits));
+    __m128i nHigh = _mm_srli_si128(nQuads, 8);
+    __m128i nLow = _mm_or_si128(_mm_move_epi64(nQuads), _mm_sll_epi64(nHigh, n4Bits));
+    return _mm_or_si128(nLow, _mm_slli_si128(_mm_srl_epi64(nHigh, n64Minus4Bits), 8));
+}
+
+/// <summary>
+/// Unpack 8 values from the low nBits bytes of a register
+/// </summary>
+/// <param name="nGroup">packed group, anything above</param>
+/// <param name="nBits">shift count of nBits</param>
+/// <param name="n2Bits">shift count of 2 * nBits</param>
+/// <param name="n4Bits">shift count of 4 * nBits</param>
+/// <param name="n64Minus4Bits">shift count of 64 - 4 * nBits</param>
+/// <param name="nMasks">masks of nBits, 2 * nBits and 4 * nBits bits in 16-bit, 32-bit and 64-bit lanes</param>
+/// <returns>8 values</returns>
+static inline __m128i UnpackGroup(__m128i nGroup, __m128i nBits, __m128i n2Bits, __m128i n4Bits, __m128i n64Minus4Bits, const __m128i nMasks[3])
+{
+    __m128i nQuad1 = _mm_or_si128(_mm_srl_epi64(nGroup, n4Bits), _mm_sll_epi64(_mm_srli_si128(nGroup, 8), n64Minus4Bits));
+    __m128i nQuads = _mm_and_si128(_mm_unpacklo_epi64(nGroup, nQuad1), nMasks[2]);
+    __m128i nPairs = _mm_or_si128(_mm_and_si128(nQuads, nMasks[1]), _mm_slli_epi64(_mm_srl_epi64(nQuads, n2Bits), 32));
+    return _mm_or_si128(_mm_and_si128(nPairs, nMasks[0]), _mm_slli_epi32(_mm_srl_epi32(nPairs, nBits), 16));
+}
+
+/// <summary>
+/// Pack a frame with SSE2, 8 pixels at a time. The packed data may overwrite the frame as long
+/// as it does not start behind it.
+/// </summary>
+/// <param name="pSource">frame in big-endian</param>
+/// <param name="nPixels">number of pixels</param>
+/// <param name="packing">packing of the frame</param>
+/// <param name="pDest">receives GetPackedSize(nPixels, packing.nBits) bytes</param>
+void PackGray(const UINT16* pSource, UINT32 nPixels, const GrayPacking& packing, BYTE* pDest)
+{
+    const __m128i nShift = _mm_cvtsi32_si128(packing.nShift);
+    const __m128i nMax = _mm_set1_epi16(static_cast<short>((1u << packing.nBits) - 1));
+    const __m128i nBits = _mm_cvtsi32_si128(packing.nBits);
+    const __m128i n2Bits = _mm_cvtsi32_si128(2 * packing.nBits);
+    const __m128i n4Bits = _mm_cvtsi32_si128(4 * packing.nBits);
+    const __m128i n64Minus4Bits = _mm_cvtsi32_si128(64 - 4 * packing.nBits);
+    UINT32 nGroups = (nPixels + 7) / 8;
+
+    // Each group is stored as 16 bytes, of which the next group overwrites all but nBits.
+    // Packing in place, the store stays behind the next group to load. The last group goes
+    // through a copy, so nothing is written past the packed data.
+    UINT32 g = 0;
+    for (; g + 1 < nGroups; ++g)
+    {
+        __m128i nValues = ReducePixels(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pSource + 8 * g)), nShift, nMax);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pDest + packing.nBits * g), PackGroup(nValues, nBits, n2Bits, n4Bits, n64Minus4Bits));
+    }
+    if (g < nGroups)
+    {
+        UINT16 last[8] = { 0 };
+        memcpy(last, pSource + 8 * g, (nPixels - 8 * g) * sizeof(UINT16));
+        __m128i nValues = ReducePixels(_mm_loadu_si128(reinterpret_cast<const __m128i*>(last)), nShift, nMax);
+        BYTE packed[16];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(packed), PackGroup(nValues, nBits, n2Bits, n4Bits, n64Minus4Bits));
+        memcpy(pDest + packing.nBits * g, packed, packing.nBits);
+    }
+}
+
+/// <summary>
+/// Unpack a frame with SSE2, 8 pixels at a time
+/// </summary>
+/// <param name="pSource">packed pixel data</param>
+/// <param name="nPixels">number of pixels</param>
+/// <param name="packing">packing of the frame</param>
+/// <param name="pDest">receives the frame in big-endian (as in PGM)</param>
+void UnpackGray(const BYTE* pSource, UINT32 nPixels, const GrayPacking& packing, UINT16* pDest)
+{
+    const __m128i nShift = _mm_cvtsi32_si128(packing.nShift);
+    const __m128i nBits = _mm_cvtsi32_si128(packing.nBits);
+    const __m128i n2Bits = _mm_cvtsi32_si128(2 * packing.nBits);
+    const __m128i n4Bits = _mm_cvtsi32_si128(4 * packing.nBits);
+    const __m128i n64Minus4Bits = _mm_cvtsi32_si128(64 - 4 * packing.nBits);
+    const __m128i nMasks[3] =
+    {
+        _mm_set1_epi32((1 << packing.nBits) - 1),
+        _mm_set_epi32(0, (1 << (2 * packing.nBits)) - 1, 0, (1 << (2 * packing.nBits)) - 1),
+        _mm_set_epi32((1 << (4 * packing.nBits - 32)) - 1, -1, (1 << (4 * packing.nBits - 32)) - 1, -1)
+    };
+    UINT32 nGroups = (nPixels + 7) / 8;
+
+    // Each group is loaded as 16 bytes, so the last one is copied first to stay inside the data
+    UINT32 g = 0;
+    for (; g + 1 < nGroups; ++g)
+    {
+        __m128i nValues = UnpackGroup(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pSource + packing.nBits * g)), nBits, n2Bits, n4Bits, n64Minus4Bits, nMasks);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pDest + 8 * g), ByteSwap16(_mm_sll_epi16(nValues, nShift)));
+    }
+    if (g < nGroups)
+    {
+        BYTE packed[16] = { 0 };
+        memcpy(packed, pSource + packing.nBits * g, packing.nBits);
+        __m128i nValues = UnpackGroup(_mm_loadu_si128(reinterpret_cast<const __m128i*>(packed)), nBits, n2Bits, n4Bits, n64Minus4Bits, nMasks);
+        UINT16 last[8];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(last), ByteSwap16(_mm_sll_epi16(nValues, nShift)));
+        memcpy(pDest + 8 * g, last, (nPixels - 8 * g) * sizeof(UINT16));
+    }
+}
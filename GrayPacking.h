@@ -0,0 +1,71 @@
+// GrayPacking.h
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Bit packing of 16-bit depth and infrared frames to 12 or 13 bits per pixel
+
+
+#pragma once
+
+#include <windows.h>
+
+/// The GrayPackedExtension value specifies the file extension of packed images
+#define GrayPackedExtension L"kvp"
+
+/// Packing of a gray stream: each pixel is shifted right by nShift, saturated to nBits and
+/// stored in groups of 8 pixels in nBits bytes, least significant bits first. A packed image
+/// has a PGM-like header "KP\n<width> <height>\n<bits> <shift>\n" (never longer than the PGM
+/// header of the same frame), and the last group of a frame is padded with zeros.
+struct GrayPacking
+{
+    UINT32                  nBits;              // 12 or 13, 0 if the stream is not packed
+    UINT32                  nShift;             // right shift before saturation (infrared)
+};
+
+/// <summary>
+/// Get the size of a packed frame
+/// </summary>
+/// <param name="nPixels">number of pixels</param>
+/// <param name="nBits">bits per pixel</param>
+/// <returns>size (in bytes) of the packed pixel data</returns>
+inline UINT32 GetPackedSize(UINT32 nPixels, UINT32 nBits)
+{
+    return (nPixels + 7) / 8 * nBits;
+}
+
+/// <summary>
+/// Format the header of a packed image
+/// </summary>
+/// <param name="pDest">destination of the header</param>
+/// <param name="lWidth">width (in pixels) of image data</param>
+/// <param name="lHeight">height (in pixels) of image data</param>
+/// <param name="packing">packing of the image data</param>
+/// <returns>size (in bytes) of the header</returns>
+DWORD FormatPackedHeader(BYTE* pDest, LONG lWidth, LONG lHeight, const GrayPacking& packing);
+
+/// <summary>
+/// Reduce a frame to the values its packing keeps, so that it equals the frame unpacked again
+/// </summary>
+/// <param name="pPixels">frame in big-endian, changed in place</param>
+/// <param name="nPixels">number of pixels</param>
+/// <param name="packing">packing of the frame</param>
+void QuantizeGray(UINT16* pPixels, UINT32 nPixels, const GrayPacking& packing);
+
+/// <summary>
+/// Pack a frame with SSE2, 8 pixels at a time. The packed data may overwrite the frame as long
+/// as it does not start behind it.
+/// </summary>
+/// <param name="pSource">frame in big-endian</param>
+/// <param name="nPixels">number of pixels</param>
+/// <param name="packing">packing of the frame</param>
+/// <param name="pDest">receives GetPackedSize(nPixels, packing.nBits) bytes</param>
+void PackGray(const UINT16* pSource, UINT32 nPixels, const GrayPacking& packing, BYTE* pDest);
+
+/// <summary>
+/// Unpack a frame with SSE2, 8 pixels at a time
+/// </summary>
+/// <param name="pSource">packed pixel data</param>
+/// <param name="nPixels">number of pixels</param>
+/// <param name="packing">packing of the frame</param>
+/// <param name="pDest">receives the frame in big-endian (as in PGM)</param>
+void UnpackGray(const BYTE* pSource, UINT32 nPixels, const GrayPacking& packing, UINT16* pDest);
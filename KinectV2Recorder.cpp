@@ -10,9 +10,13 @@
 #include <strsafe.h>
 #include "resource.h"
 #include "KinectV2Recorder.h"
+#include "Tools.h"
+#include "Crc32c.h"
+#include "ReplayReader.h"
 #include <algorithm>
 #include <vector>
 #include <queue>
+#include <string>
 
 #ifdef USE_IPP
 #include <ippi.h>
@@ -34,7 +38,13 @@ int APIENTRY wWinMain(
     )
 {
     UNREFERENCED_PARAMETER(hPrevInstance);
-    UNREFERENCED_PARAMETER(lpCmdLine);
+
+    // Run a command line tool (e.g. benchmark) instead of the recorder if requested
+    int nExitCode = 0;
+    if (RunTool(lpCmdLine, &nExitCode))
+    {
+        return nExitCode;
+    }
 
     CKinectV2Recorder application;
     application.Run(hInstance, nShowCmd);
@@ -72,13 +82,51 @@ m_pColorRGBX(NULL),
 m_nInfraredIndex(0),
 m_nDepthIndex(0),
 m_nColorIndex(0),
+m_pInfraredSpare(NULL),
+m_pDepthSpare(NULL),
+m_pColorSpare(NULL),
 m_nModel2DIndex(0),
 m_nModel3DIndex(0),
 m_nTypeIndex(0),
 m_nLevelIndex(0),
 m_nSideIndex(0),
+m_cbInfraredHeader(0),
+m_cbDepthHeader(0),
+m_cbColorHeader(0),
 m_tSaveThread(),
-m_bStopThread(false)
+m_tShotThread(),
+m_bStopThread(false),
+m_pShotSet(NULL),
+m_nShotSets(0),
+m_nShotSequence(0),
+m_nBurstCount(1),
+m_nBurstTaken(0),
+m_nBurstSkipped(0),
+m_nBurstInterval(0),
+m_nNextShotTime(0),
+m_fMinSharpness(0.0),
+m_fMaxMotion(0.0),
+m_nWriterMode(WriterMode_Buffered),
+m_pFrameWriter(NULL),
+m_nQueueDepth(16),
+m_nPreallocateFrames(1800),
+m_nKeyframeInterval(0),
+m_nColorEncoderThreads(0),
+m_pColorEncoders(NULL),
+m_nStagingMB(0),
+m_bStagingCompress(false),
+m_pStagingWriter(NULL),
+m_nStreamWindowMB(64),
+m_pNetworkWriter(NULL),
+m_nNextWriterMode(WriterMode_Buffered),
+m_nNextStagingMB(0),
+m_bNextStagingCompress(false),
+m_nNextStreamWindowMB(64),
+m_nNextColorEncoderThreads(0),
+m_bThreadsPlaced(false),
+m_bClosing(false),
+m_pPublisher(NULL),
+m_pRecordSession(NULL)
 {
     LARGE_INTEGER qpf = { 0 };
     if (QueryPerformanceFrequency(&qpf))
@@ -95,22 +143,62 @@ m_bStopThread(false)
     // create heap storage for color pixel data in RGBX format
     m_pColorRGBX = new RGBQUAD[cColorWidth * cColorHeight];
 
+    // Each frame slot holds the file header followed by the pixel data, so that a frame can be
+    // written with a single (unbuffered) write. The headers are the same for every slot.
+    BYTE header[256];
+    m_cbInfraredHeader = FormatPGMHeader(header, cInfraredWidth, cInfraredHeight, 65535);
+    m_cbDepthHeader = FormatPGMHeader(header, cDepthWidth, cDepthHeight, 65535);
+#ifdef COLOR_BMP
+    m_cbColorHeader = FormatBMPHeader(header, cColorWidth, cColorHeight, sizeof(RGBTRIPLE)* 8);
+#else
+    m_cbColorHeader = FormatPPMHeader(header, cColorWidth, cColorHeight, 255);
+#endif
+
+    // The frame slots are allocated by CreateFrameSlots once the threads which use them are placed
     for (int i = 0; i < BufferSize; ++i)
     {
-        // create heap storage for infrared pixel data in UINT16 format
-        m_pInfraredUINT16[i] = new UINT16[cInfraredWidth * cInfraredHeight];
-
-        // create heap storage for depth pixel data in UINT16 format
-        m_pDepthUINT16[i] = new UINT16[cDepthWidth * cDepthHeight];
-
-        // create heap storage for color pixel data in RGB format
-        m_pColorRGB[i] = new RGBTRIPLE[cColorWidth * cColorHeight];
-    }
-    
-    // create heap storage for file lists
-    m_vInfraredList.reserve(1800);
-    m_vDepthList.reserve(1800);
-    m_vColorList.reserve(1800);
+        m_pInfraredSlot[i] = NULL;
+        m_pInfraredUINT16[i] = NULL;
+        m_pDepthSlot[i] = NULL;
+        m_pDepthUINT16[i] = NULL;
+        m_pColorSlot[i] = NULL;
+        m_pColorRGB[i] = NULL;
+
+        m_bInfraredSlotBusy[i] = false;
+        m_bDepthSlotBusy[i] = false;
+        m_bColorSlotBusy[i] = false;
+        m_pSlotSession[RecordStream_Infrared][i] = NULL;
+        m_pSlotSession[RecordStream_Depth][i] = NULL;
+        m_pSlotSession[RecordStream_Color][i] = NULL;
+    }
+    m_nPendingFrames = 0;
+
+    // create heap storage for frames which cannot be recorded because the writer still holds their slot
+    m_pInfraredSpare = new UINT16[cInfraredWidth * cInfraredHeight];
+    m_pDepthSpare = new UINT16[cDepthWidth * cDepthHeight];
+    m_pColorSpare = new RGBTRIPLE[cColorWidth * cColorHeight];
+    m_cShotMessage[0] = L'\0';
+
+    // the writer backend may be changed for each record session
+    m_pFrameWriter = FrameWriter::Create(m_nWriterMode);
+    m_szStreamTo[0] = L'\0';
+    m_szNextStreamTo[0] = L'\0';
+    m_bWriterChange = false;
+    m_bEncoderChange = false;
+    m_bDrainReported = false;
+
+    // all streams are recorded at full rate unless the settings say otherwise
+    m_nDecimation[RecordStream_Infrared] = 1;
+    m_nDecimation[RecordStream_Depth] = 1;
+    m_nDecimation[RecordStream_Color] = 1;
+    SetFullGeometry(cInfraredWidth, cInfraredHeight, &m_geometry[RecordStream_Infrared]);
+    SetFullGeometry(cDepthWidth, cDepthHeight, &m_geometry[RecordStream_Depth]);
+    SetFullGeometry(cColorWidth, cColorHeight, &m_geometry[RecordStream_Color]);
+    ZeroMemory(m_packing, sizeof(m_packing));
+    m_colorEncoding.nCodec = ColorCodec_None;
+    m_colorEncoding.nQuality = 0;
+    m_bDedup[0] = m_bDedup[1] = m_bDedup[2] = false;
+    ZeroMemory(m_dedupThreshold, sizeof(m_dedupThreshold));
 }
 
 
@@ -156,25 +244,105 @@ CKinectV2Recorder::~CKinectV2Recorder()
         m_pColorRGBX = NULL;
     }
 
+    {
+        std::lock_guard<std::mutex> lock(m_mShotMutex);
+        m_bStopThread = true;
+    }
+    m_cvShot.notify_one();
+    if (m_tSaveThread.joinable()) m_tSaveThread.join();
+    if (m_tShotThread.joinable()) m_tShotThread.join();
+
+    // The color encoders finish the frames they hold before the slots go away
+    if (m_pColorEncoders)
+    {
+        delete m_pColorEncoders;
+        m_pColorEncoders = NULL;
+    }
+
+    // The shot thread has saved all queued sets before it stopped
+    if (m_pShotSet)
+    {
+        m_vFreeShotSets.push_back(m_pShotSet);
+        m_pShotSet = NULL;
+    }
+    for (size_t i = 0; i < m_vFreeShotSets.size(); ++i)
+    {
+        delete[] m_vFreeShotSets[i]->pInfrared;
+        delete[] m_vFreeShotSets[i]->pDepth;
+        delete[] m_vFreeShotSets[i]->pColor;
+        delete m_vFreeShotSets[i];
+    }
+    m_vFreeShotSets.clear();
+
+    // The staging writer migrates the frames it holds, which are counted in their sessions
+    if (m_pFrameWriter)
+    {
+        delete m_pFrameWriter;
+        m_pFrameWriter = NULL;
+        m_pStagingWriter = NULL;
+    }
+
+    // Sessions whose report did not reach the window any more
+    for (size_t i = 0; i < m_dRecordSessions.size(); ++i)
+    {
+        CloseRecordFiles(m_dRecordSessions[i]);
+        delete m_dRecordSessions[i];
+    }
+    m_dRecordSessions.clear();
+    m_pRecordSession = NULL;
+
+    // Slots of a stream without a slab were allocated one by one
     for (int i = 0; i < BufferSize; ++i)
     {
-        if (m_pInfraredUINT16[i])
+        if (!m_frameSlabs[RecordStream_Infrared].GetSlot(0))
         {
-            delete[] m_pInfraredUINT16[i];
-            m_pInfraredUINT16[i] = NULL;
+            FreeFrameSlot(m_pInfraredSlot[i]);
         }
+        m_pInfraredSlot[i] = NULL;
+        m_pInfraredUINT16[i] = NULL;
 
-        if (m_pDepthUINT16[i])
+        if (!m_frameSlabs[RecordStream_Depth].GetSlot(0))
         {
-            delete[] m_pDepthUINT16[i];
-            m_pDepthUINT16[i] = NULL;
+            FreeFrameSlot(m_pDepthSlot[i]);
         }
+        m_pDepthSlot[i] = NULL;
+        m_pDepthUINT16[i] = NULL;
 
-        if (m_pColorRGB[i])
+        if (!m_frameSlabs[RecordStream_Color].GetSlot(0))
         {
-            delete[] m_pColorRGB[i];
-            m_pColorRGB[i] = NULL;
+            FreeFrameSlot(m_pColorSlot[i]);
         }
+        m_pColorSlot[i] = NULL;
+        m_pColorRGB[i] = NULL;
+    }
+    for (int nStream = 0; nStream < 3; ++nStream)
+    {
+        m_frameSlabs[nStream].Destroy();
+    }
+
+    if (m_pInfraredSpare)
+    {
+        delete[] m_pInfraredSpare;
+        m_pInfraredSpare = NULL;
+    }
+
+    if (m_pDepthSpare)
+    {
+        delete[] m_pDepthSpare;
+        m_pDepthSpare = NULL;
+    }
+
+    if (m_pColorSpare)
+    {
+        delete[] m_pColorSpare;
+        m_pColorSpare = NULL;
+    }
+
+    // Readers which still map the live frames see that they are not published any more
+    if (m_pPublisher)
+    {
+        delete m_pPublisher;
+        m_pPublisher = NULL;
     }
 
     // clean up Direct2D
@@ -196,9 +364,6 @@ CKinectV2Recorder::~CKinectV2Recorder()
     }
 
     SafeRelease(m_pKinectSensor);
-
-    m_bStopThread = true;
-    if (m_tSaveThread.joinable()) m_tSaveThread.join();
 }
 
 /// <summary>
@@ -263,6 +428,30 @@ int CKinectV2Recorder::Run(HINSTANCE hInstance, int nCmdShow)
 void CKinectV2Recorder::StartMultithreading()
 {
     m_tSaveThread = std::thread(&CKinectV2Recorder::SaveRecordImages, this);
+    m_tShotThread = std::thread(&CKinectV2Recorder::SaveShotImages, this);
+
+    // Other pipeline threads place themselves as they start, these are placed right away so that
+    // the placement reported at startup is complete
+    PlaceThread(PipelineThread_Save, m_tSaveThread.native_handle());
+    PlaceThread(PipelineThread_Shot, m_tShotThread.native_handle());
+
+    // The placement is shown if the settings place anything, and always if it failed
+    bool bFailed = false;
+    for (int i = 0; i < PipelineThread_Count; ++i)
+    {
+        ThreadPlacementReport report;
+        GetThreadPlacementReport(static_cast<PipelineThread>(i), &report);
+        bFailed = bFailed || FAILED(report.hr);
+    }
+
+    if (m_bThreadsPlaced || bFailed)
+    {
+        WCHAR szPlacement[512];
+        WCHAR szStatusMessage[512];
+        FormatThreadPlacement(szPlacement, _countof(szPlacement));
+        StringCchPrintf(szStatusMessage, _countof(szStatusMessage), bFailed ? L"Thread placement failed: %s" : L"Threads: %s", szPlacement);
+        SetStatusMessage(szStatusMessage, 10000, true);
+    }
 }
 
 /// <summary>
@@ -654,22 +843,41 @@ void CKinectV2Recorder::ProcessUI(WPARAM wParam, LPARAM)
     {
         if (m_bRecord)
         {
-#ifdef VERBOSE
-            CheckImages();
-#endif
             ResetRecordParameters();
         }
-        else
+        else if (!m_bClosing)
         {
+            LoadRecordSettings();
+            if (m_pStagingWriter)
+            {
+                m_pStagingWriter->SetBackground(true);
+            }
             m_bRecord = true;
             SendDlgItemMessage(m_hWnd, IDC_BUTTON_RECORD, BM_SETIMAGE, (WPARAM)IMAGE_ICON, (LPARAM)m_hStop);
         }
     }
 
     // If it is a shot control and a button clicked event, save the camera images
+    // (a burst in progress is cancelled instead)
     if (IDC_BUTTON_SHOT == LOWORD(wParam) && BN_CLICKED == HIWORD(wParam))
     {
-        m_bShot = true;
+        if (m_bShot && m_nBurstCount > 1)
+        {
+            m_bShot = false;
+            m_bShotReady = false;
+            WCHAR szStatusMessage[128];
+            StringCchPrintf(szStatusMessage, _countof(szStatusMessage), L"Burst cancelled   [%d of %d shots, %d skipped]", m_nBurstTaken, m_nBurstCount, m_nBurstSkipped);
+            SetStatusMessage(szStatusMessage, 3000, true);
+        }
+        else
+        {
+            LoadShotSettings();
+            m_nBurstTaken = 0;
+            m_nBurstSkipped = 0;
+            m_nNextShotTime = 0;
+            m_vShotReference.clear();
+            m_bShot = true;
+        }
     }
 }
 
@@ -754,13 +962,54 @@ LRESULT CALLBACK CKinectV2Recorder::DlgProc(HWND hWnd, UINT message, WPARAM wPar
         // Get and initialize the default Kinect sensor
         InitializeDefaultSensor();
 
+        LoadLiveSettings();
+
+        LoadThreadSettings();
+
         StartMultithreading();
+
+        CreateFrameSlots();
     }
     break;
 
     // If the titlebar X is clicked, destroy app
     case WM_CLOSE:
-        DestroyWindow(hWnd);
+        if (m_bRecord)
+        {
+            ResetRecordParameters();
+        }
+
+        // Queued and staged frames would be lost, so keep running until they are written
+        WCHAR szBackgroundStatus[256];
+        if (FormatBackgroundStatus(szBackgroundStatus, _countof(szBackgroundStatus)))
+        {
+            m_bClosing = true;
+            SetStatusMessage(szBackgroundStatus, 1000, true);
+            SetTimer(hWnd, cMigrationTimerId, 500, NULL);
+        }
+        else
+        {
+            DestroyWindow(hWnd);
+        }
+        break;
+
+    // Check the migration while closing
+    case WM_TIMER:
+        if (cMigrationTimerId == wParam && m_bClosing)
+        {
+            WCHAR szBackgroundStatus[256];
+            if (FormatBackgroundStatus(szBackgroundStatus, _countof(szBackgroundStatus)))
+            {
+                WCHAR szStatusMessage[320];
+                StringCchPrintf(szStatusMessage, _countof(szStatusMessage), L" Closing after migration...    %s", szBackgroundStatus);
+                SetStatusMessage(szStatusMessage, 1000, true);
+            }
+            else
+            {
+                KillTimer(hWnd, cMigrationTimerId);
+                DestroyWindow(hWnd);
+            }
+        }
         break;
 
     case WM_DESTROY:
@@ -768,6 +1017,62 @@ LRESULT CALLBACK CKinectV2Recorder::DlgProc(HWND hWnd, UINT message, WPARAM wPar
         PostQuitMessage(0);
         break;
 
+    // A stopped record session has been written completely by the save thread
+    case WM_SESSIONDONE:
+    {
+        RecordSession* pSession = reinterpret_cast<RecordSession*>(lParam);
+        {
+            std::lock_guard<std::mutex> lock(m_mQueueMutex);
+            m_dRecordSessions.erase(std::remove(m_dRecordSessions.begin(), m_dRecordSessions.end(), pSession), m_dRecordSessions.end());
+        }
+
+        UINT32 nMissing = 0;
+        for (int i = 0; i < 3; ++i)
+        {
+            nMissing += pSession->analyzer[i].GetMissingCount();
+        }
+
+        WCHAR szStatusMessage[2 * MAX_PATH];
+        StringCchPrintf(szStatusMessage, _countof(szStatusMessage), L" Session %s done: %u frame sets, %u frames missing (sensor), %d frames dropped (writer busy), %d frames failed to write, drained in %0.1f s",
+            pSession->szSaveFolder, static_cast<UINT>(pSession->vList[RecordStream_Infrared].size()), nMissing, pSession->nDroppedFrames.load(), pSession->nFailedFrames.load(),
+            (pSession->nDoneTime - pSession->nStopTime) / 1000.);
+        SetStatusMessage(szStatusMessage, 5000, true);
+#ifdef VERBOSE
+        if (!pSession->bSynchronized)
+        {
+            MessageBox(NULL,
+                L"Frame dropping occured...\n",
+                L"No Good",
+                MB_OK | MB_ICONERROR
+                );
+        }
+#endif
+        delete pSession;
+    }
+    break;
+
+    // The previous sessions have been written, so the writer or the color encoders can be replaced
+    case WM_WRITERDRAINED:
+        ReplaceWriter();
+        break;
+
+    // A shot has been saved by the shot thread
+    case WM_SHOTSAVED:
+    {
+        std::lock_guard<std::mutex> lock(m_mShotMutex);
+        if (m_nBurstCount > 1)
+        {
+            WCHAR szStatusMessage[3 * MAX_PATH];
+            StringCchPrintfW(szStatusMessage, _countof(szStatusMessage), L"%s   [burst %d of %d, %d skipped]", m_cShotMessage, m_nBurstTaken, m_nBurstCount, m_nBurstSkipped);
+            SetStatusMessage(szStatusMessage, 3000, true);
+        }
+        else
+        {
+            SetStatusMessage(m_cShotMessage, 3000, true);
+        }
+    }
+    break;
+
     // Handle button press
     case WM_COMMAND:
         ProcessUI(wParam, lParam);
@@ -865,34 +1170,81 @@ void CKinectV2Recorder::ProcessInfrared(INT64 nTime, const UINT16* pBuffer, int
             }
         }
 
-        WCHAR szStatusMessage[128];
+        WCHAR szStatusMessage[512];
         StringCchPrintf(szStatusMessage, _countof(szStatusMessage), L" Save Folder: %s    FPS(Infrared, Depth, Color) = (%0.2f,  %0.2f,  %0.2f)", m_cSaveFolder, m_fInfraredFPS, m_fDepthFPS, m_fColorFPS);
 
-        if (SetStatusMessage(szStatusMessage, 1000, false))
+        if (m_pRecordSession)
+        {
+            UINT32 nMissing = 0;
+            for (int i = 0; i < 3; ++i)
+            {
+                nMissing += m_pRecordSession->analyzer[i].GetMissingCount();
+            }
+            if (nMissing)
+            {
+                WCHAR szMissing[64];
+                StringCchPrintf(szMissing, _countof(szMissing), L"    Missing frames: %u", nMissing);
+                StringCchCat(szStatusMessage, _countof(szStatusMessage), szMissing);
+            }
+        }
+
+        WCHAR szBackgroundStatus[256];
+        if (FormatBackgroundStatus(szBackgroundStatus, _countof(szBackgroundStatus)))
+        {
+            StringCchCat(szStatusMessage, _countof(szStatusMessage), L"    ");
+            StringCchCat(szStatusMessage, _countof(szStatusMessage), szBackgroundStatus);
+        }
+
+        WCHAR szStreamStatus[256];
+        if (FormatStreamStatus(szStreamStatus, _countof(szStreamStatus)))
+        {
+            StringCchCat(szStatusMessage, _countof(szStatusMessage), L"    ");
+            StringCchCat(szStatusMessage, _countof(szStatusMessage), szStreamStatus);
+        }
+
+        if (!m_bClosing && SetStatusMessage(szStatusMessage, 1000, false))
         {
             m_nInfraredLastCounter = qpcNow.QuadPart;
             m_nInfraredFramesSinceUpdate = 0;
             m_fInfraredFPS = fps;
-#ifdef VERBOSE
-            if (m_bRecord && m_fInfraredFPS < 29.5)
-            {
-                ResetRecordParameters();
-                MessageBox(NULL,
-                    L"Infrared frame dropping occured...\n",
-                    L"No Good",
-                    MB_OK | MB_ICONERROR
-                    );
-                return;
-            }
-#endif
         }
     }
 
     if (m_pInfraredRGBX && pBuffer && (nWidth == cInfraredWidth) && (nHeight == cInfraredHeight))
     {
+        if (m_bRecord && !m_pRecordSession && !m_bWriterChange && !m_bEncoderChange)
+        {
+            if (FAILED(StartRecordSession()))
+            {
+                m_bRecord = false;
+                SendDlgItemMessage(m_hWnd, IDC_BUTTON_RECORD, BM_SETIMAGE, (WPARAM)IMAGE_ICON, (LPARAM)m_hRecord);
+                return;
+            }
+            m_nStartTime = nTime;
+        }
+
         INT64 index = m_nInfraredIndex % BufferSize;
+
+        // A slot is not overwritten before the writer has released it. Otherwise the frame
+        // goes to the spare buffer and is dropped from the record.
+        // A mapped record file takes the frame straight into its preallocated space instead.
+        // Frames which are neither recorded nor taken for a shot are only converted for display.
+        // A region of interest is cropped in a pass of its own, while the shots keep the whole
+        // frame in the spare buffer.
+        // A published frame which is converted anyway is copied to the live frames, otherwise
+        // it is converted straight into them.
+        bool bRecordFrame = IsFrameRecorded(RecordStream_Infrared, nTime);
+        bool bShotDue = m_bShot && !m_bShotReady && GetTickCount64() >= m_nNextShotTime;
+        bool bSlotBusy = m_bInfraredSlotBusy[index];
+        bool bRegion = bRecordFrame && !IsFullGeometry(m_pRecordSession->geometry[RecordStream_Infrared], cInfraredWidth, cInfraredHeight);
+        bool bConvert = (bRecordFrame && !bRegion) || bShotDue;
+        BYTE* pMapped = (bRecordFrame && m_pRecordSession->pRecordFile[RecordStream_Infrared]) ? m_pRecordSession->pRecordFile[RecordStream_Infrared]->AcquireFrame() : NULL;
+        BYTE* pLive = (!bConvert && m_pPublisher) ? m_pPublisher->AcquireFrame(RecordStream_Infrared) : NULL;
         RGBQUAD* pRGBX = m_pInfraredRGBX;
-        UINT16* pUINT16 = m_pInfraredUINT16[index];
+        const UINT16* pSensor = pBuffer;
+        UINT16* pRecordFrame = pMapped ? reinterpret_cast<UINT16*>(pMapped) : bSlotBusy ? m_pInfraredSpare : bRecordFrame ? reinterpret_cast<UINT16*>(m_pInfraredSlot[index] + m_pRecordSession->cbHeader[RecordStream_Infrared]) : m_pInfraredUINT16[index];
+        UINT16* pInfraredFrame = pLive ? reinterpret_cast<UINT16*>(pLive) : bRegion ? m_pInfraredSpare : pRecordFrame;
+        UINT16* pUINT16 = (bConvert || pLive) ? pInfraredFrame : NULL;
         pBuffer += cInfraredWidth - 1;
 
         for (int i = 0; i < cInfraredHeight; ++i)
@@ -921,47 +1273,102 @@ void CKinectV2Recorder::ProcessInfrared(INT64 nTime, const UINT16* pBuffer, int
                 pRGBX->rgbBlue = intensity;
 
                 // convert UINT16 to Big-Endian format
-                (*pUINT16) = ((*pBuffer) >> 8) | ((*pBuffer) << 8);
+                if (pUINT16)
+                {
+                    (*pUINT16) = ((*pBuffer) >> 8) | ((*pBuffer) << 8);
+                    ++pUINT16;
+                }
 
                 --pBuffer;
                 ++pRGBX;
-                ++pUINT16;
             }
             pBuffer += (cInfraredWidth << 1);
         }
 
+        // A frame which is dropped from the record is not cropped
+        if (bRegion && pRecordFrame != m_pInfraredSpare)
+        {
+            CropInfrared(pSensor, cInfraredWidth, m_pRecordSession->geometry[RecordStream_Infrared], pRecordFrame);
+        }
+
+        if (pLive)
+        {
+            m_pPublisher->CommitFrame(RecordStream_Infrared, nTime);
+        }
+        else if (bConvert && m_pPublisher)
+        {
+            m_pPublisher->Publish(RecordStream_Infrared, reinterpret_cast<BYTE*>(pInfraredFrame), nTime);
+        }
+
         // Draw the data with Direct2D
         m_pDrawInfrared->Draw(reinterpret_cast<BYTE*>(m_pInfraredRGBX), cInfraredWidth * cInfraredHeight * sizeof(RGBQUAD));
 
-        if (m_bRecord)
+        if (m_pRecordSession && m_pRecordSession->nDecimation[RecordStream_Infrared])
         {
-            if (!m_nStartTime)
+            // Frames lost before they reached us show up as gaps in the relative time
+            m_pRecordSession->analyzer[RecordStream_Infrared].AddFrame(nTime - m_nStartTime);
+#ifdef VERBOSE
+            if (m_pRecordSession->analyzer[RecordStream_Infrared].GetMissingCount() > 0)
             {
-                if (IsDirectoryExists(m_cSaveFolder))
-                {
-                    MessageBox(NULL,
-                        L"The related folder is not emtpy!\n",
-                        L"Frames already existed",
-                        MB_OK | MB_ICONERROR
-                        );
-                    m_bRecord = false;
-                    SendDlgItemMessage(m_hWnd, IDC_BUTTON_RECORD, BM_SETIMAGE, (WPARAM)IMAGE_ICON, (LPARAM)m_hRecord);
-                    return;
-                }
-                m_nStartTime = nTime;
+                ResetRecordParameters();
+                MessageBox(NULL,
+                    L"Infrared frame dropping occured...\n",
+                    L"No Good",
+                    MB_OK | MB_ICONERROR
+                    );
+                return;
+            }
+#endif
+
+            if (!bRecordFrame)
+            {
+                // The frame set is skipped by the decimation of the stream
+            }
+            else if (m_pRecordSession->pRecordFile[RecordStream_Infrared])
+            {
+                RecordMappedFrame(m_pRecordSession, RecordStream_Infrared, pMapped, nTime);
+            }
+            else if (bSlotBusy)
+            {
+                ++m_pRecordSession->nDroppedFrames;
             }
+            else
+            {
+                // Write out the bitmap to disk (enqeue)
+                m_bInfraredSlotBusy[index] = true;
+                ++m_nPendingFrames;
+                ++m_pRecordSession->nPendingFrames;
 
-            // Write out the bitmap to disk (enqeue)
-            m_qInfraredTimeQueue.push(nTime - m_nStartTime);
-            m_qInfraredFrameQueue.push(m_pInfraredUINT16[index]);
+                std::lock_guard<std::mutex> lock(m_mQueueMutex);
+                m_pSlotSession[RecordStream_Infrared][index] = m_pRecordSession;
+                m_pRecordSession->qTimeQueue[RecordStream_Infrared].push(nTime - m_nStartTime);
+                m_pRecordSession->qFrameQueue[RecordStream_Infrared].push(static_cast<int>(index));
 
-            ++m_nInfraredIndex;
+                ++m_nInfraredIndex;
+            }
         }
 
-        if (m_bShot)
+        // Copy the frame for the shot when it is due, unless all shot sets are still being saved
+        if (bShotDue && AcquireShotSet())
         {
-            m_nInfraredShotTime = nTime;
-            m_bShotReady = true;
+            double fSharpness = 0.0;
+            double fMotion = 0.0;
+            if (m_fMinSharpness > 0.0 || m_fMaxMotion > 0.0)
+            {
+                MeasureShotQuality(pInfraredFrame, &fSharpness, &fMotion);
+            }
+
+            // Skip blurred or moving frame sets, the reference of the motion is the previous frame
+            if ((m_fMinSharpness > 0.0 && fSharpness < m_fMinSharpness) || (m_fMaxMotion > 0.0 && fMotion > m_fMaxMotion))
+            {
+                ++m_nBurstSkipped;
+            }
+            else
+            {
+                memcpy(m_pShotSet->pInfrared, pInfraredFrame, cInfraredWidth * cInfraredHeight * sizeof(UINT16));
+                m_nInfraredShotTime = nTime;
+                m_bShotReady = true;
+            }
         }
     }
 }
@@ -1002,18 +1409,6 @@ void CKinectV2Recorder::ProcessDepth(INT64 nTime, const UINT16* pBuffer, int nWi
             m_nDepthLastCounter = qpcNow.QuadPart;
             m_nDepthFramesSinceUpdate = 0;
             m_fDepthFPS = fps;
-#ifdef VERBOSE
-            if (m_bRecord && m_fDepthFPS < 29.5)
-            {
-                ResetRecordParameters();
-                MessageBox(NULL,
-                    L"Depth frame dropping occured...\n",
-                    L"No Good",
-                    MB_OK | MB_ICONERROR
-                    );
-                return;
-            }
-#endif
         }
     }
 
@@ -1021,8 +1416,20 @@ void CKinectV2Recorder::ProcessDepth(INT64 nTime, const UINT16* pBuffer, int nWi
     if (m_pDepthRGBX && pBuffer && (nWidth == cDepthWidth) && (nHeight == cDepthHeight))
     {
         INT64 index = m_nDepthIndex % BufferSize;
+
+        // A slot is not overwritten before the writer has released it. Published frames are
+        // converted as the infrared ones.
+        bool bRecordFrame = IsFrameRecorded(RecordStream_Depth, nTime);
+        bool bSlotBusy = m_bDepthSlotBusy[index];
+        bool bRegion = bRecordFrame && !IsFullGeometry(m_pRecordSession->geometry[RecordStream_Depth], cDepthWidth, cDepthHeight);
+        bool bConvert = (bRecordFrame && !bRegion) || m_bShotReady;
+        BYTE* pMapped = (bRecordFrame && m_pRecordSession->pRecordFile[RecordStream_Depth]) ? m_pRecordSession->pRecordFile[RecordStream_Depth]->AcquireFrame() : NULL;
+        BYTE* pLive = (!bConvert && m_pPublisher) ? m_pPublisher->AcquireFrame(RecordStream_Depth) : NULL;
         RGBQUAD* pRGBX = m_pDepthRGBX;
-        UINT16* pUINT16 = m_pDepthUINT16[index];
+        const UINT16* pSensor = pBuffer;
+        UINT16* pRecordFrame = pMapped ? reinterpret_cast<UINT16*>(pMapped) : bSlotBusy ? m_pDepthSpare : bRecordFrame ? reinterpret_cast<UINT16*>(m_pDepthSlot[index] + m_pRecordSession->cbHeader[RecordStream_Depth]) : m_pDepthUINT16[index];
+        UINT16* pDepthFrame = pLive ? reinterpret_cast<UINT16*>(pLive) : bRegion ? m_pDepthSpare : pRecordFrame;
+        UINT16* pUINT16 = (bConvert || pLive) ? pDepthFrame : NULL;
         pBuffer += cDepthWidth - 1;
 
         for (int i = 0; i < cDepthHeight; ++i)
@@ -1054,29 +1461,84 @@ void CKinectV2Recorder::ProcessDepth(INT64 nTime, const UINT16* pBuffer, int nWi
                 }
 
                 // convert UINT16 to Big-Endian format
-                (*pUINT16) = ((depth) >> 8) | ((depth) << 8);
+                if (pUINT16)
+                {
+                    (*pUINT16) = ((depth) >> 8) | ((depth) << 8);
+                    ++pUINT16;
+                }
 
                 --pBuffer;
                 ++pRGBX;
-                ++pUINT16;
             }
             pBuffer += (cDepthWidth << 1);
         }
 
+        // A frame which is dropped from the record is not cropped
+        if (bRegion && pRecordFrame != m_pDepthSpare)
+        {
+            CropDepth(pSensor, cDepthWidth, m_pRecordSession->geometry[RecordStream_Depth], nMinDepth, nMaxDepth, pRecordFrame);
+        }
+
+        if (pLive)
+        {
+            m_pPublisher->CommitFrame(RecordStream_Depth, nTime);
+        }
+        else if (bConvert && m_pPublisher)
+        {
+            m_pPublisher->Publish(RecordStream_Depth, reinterpret_cast<BYTE*>(pDepthFrame), nTime);
+        }
+
         // Draw the data with Direct2D
         m_pDrawDepth->Draw(reinterpret_cast<BYTE*>(m_pDepthRGBX), cDepthWidth * cDepthHeight * sizeof(RGBQUAD));
 
-        if (m_bRecord && m_nStartTime)
+        if (m_pRecordSession && m_pRecordSession->nDecimation[RecordStream_Depth])
         {
-            // Write out the bitmap to disk (enqeue)
-            m_qDepthTimeQueue.push(nTime - m_nStartTime);
-            m_qDepthFrameQueue.push(m_pDepthUINT16[index]);
+            // Frames lost before they reached us show up as gaps in the relative time
+            m_pRecordSession->analyzer[RecordStream_Depth].AddFrame(nTime - m_nStartTime);
+#ifdef VERBOSE
+            if (m_pRecordSession->analyzer[RecordStream_Depth].GetMissingCount() > 0)
+            {
+                ResetRecordParameters();
+                MessageBox(NULL,
+                    L"Depth frame dropping occured...\n",
+                    L"No Good",
+                    MB_OK | MB_ICONERROR
+                    );
+                return;
+            }
+#endif
+
+            if (!bRecordFrame)
+            {
+                // The frame set is skipped by the decimation of the stream
+            }
+            else if (m_pRecordSession->pRecordFile[RecordStream_Depth])
+            {
+                RecordMappedFrame(m_pRecordSession, RecordStream_Depth, pMapped, nTime);
+            }
+            else if (bSlotBusy)
+            {
+                ++m_pRecordSession->nDroppedFrames;
+            }
+            else
+            {
+                // Write out the bitmap to disk (enqeue)
+                m_bDepthSlotBusy[index] = true;
+                ++m_nPendingFrames;
+                ++m_pRecordSession->nPendingFrames;
 
-            ++m_nDepthIndex;
+                std::lock_guard<std::mutex> lock(m_mQueueMutex);
+                m_pSlotSession[RecordStream_Depth][index] = m_pRecordSession;
+                m_pRecordSession->qTimeQueue[RecordStream_Depth].push(nTime - m_nStartTime);
+                m_pRecordSession->qFrameQueue[RecordStream_Depth].push(static_cast<int>(index));
+
+                ++m_nDepthIndex;
+            }
         }
 
         if (m_bShotReady)
         {
+            memcpy(m_pShotSet->pDepth, pDepthFrame, cDepthWidth * cDepthHeight * sizeof(UINT16));
             m_nDepthShotTime = nTime;
         }
     }
@@ -1116,18 +1578,6 @@ void CKinectV2Recorder::ProcessColor(INT64 nTime, RGBQUAD* pBuffer, int nWidth,
             m_nColorLastCounter = qpcNow.QuadPart;
             m_nColorFramesSinceUpdate = 0;
             m_fColorFPS = fps;
-#ifdef VERBOSE
-            if (m_bRecord && m_fColorFPS < 29.5)
-            {
-                ResetRecordParameters();
-                MessageBox(NULL,
-                    L"Color frame dropping occured...\n",
-                    L"No Good",
-                    MB_OK | MB_ICONERROR
-                    );
-                return;
-            }
-#endif
         }
     }
 
@@ -1135,18 +1585,35 @@ void CKinectV2Recorder::ProcessColor(INT64 nTime, RGBQUAD* pBuffer, int nWidth,
     if (pBuffer && (nWidth == cColorWidth) && (nHeight == cColorHeight))
     {
         INT64 index = m_nColorIndex % BufferSize;
+
+        // A slot is not overwritten before the writer has released it. Color frames which are
+        // neither recorded, taken for a shot nor published are only mirrored for display.
+        // A region of interest is cropped from the mirrored frame in a pass of its own.
+        bool bRecordFrame = IsFrameRecorded(RecordStream_Color, nTime);
+        bool bSlotBusy = m_bColorSlotBusy[index];
+        bool bRegion = bRecordFrame && !IsFullGeometry(m_pRecordSession->geometry[RecordStream_Color], cColorWidth, cColorHeight);
+        bool bConvert = (bRecordFrame && !bRegion) || m_bShotReady;
+        BYTE* pMapped = (bRecordFrame && m_pRecordSession->pRecordFile[RecordStream_Color]) ? m_pRecordSession->pRecordFile[RecordStream_Color]->AcquireFrame() : NULL;
+        BYTE* pLive = (!bConvert && m_pPublisher) ? m_pPublisher->AcquireFrame(RecordStream_Color) : NULL;
+        bool bPublish = bConvert && m_pPublisher;
+        bConvert |= (NULL != pLive);
         RGBQUAD* pRGBX = pBuffer;
-        RGBTRIPLE* pRGB = m_pColorRGB[index];
+        RGBTRIPLE* pRecordFrame = pMapped ? reinterpret_cast<RGBTRIPLE*>(pMapped) : bSlotBusy ? m_pColorSpare : bRecordFrame ? reinterpret_cast<RGBTRIPLE*>(m_pColorSlot[index] + m_pRecordSession->cbHeader[RecordStream_Color]) : m_pColorRGB[index];
+        RGBTRIPLE* pColorFrame = pLive ? reinterpret_cast<RGBTRIPLE*>(pLive) : bRegion ? m_pColorSpare : pRecordFrame;
+        RGBTRIPLE* pRGB = pColorFrame;
 
 #ifdef USE_IPP
         const IppiSize roiSize = { cColorWidth, cColorHeight };
         ippiMirror_8u_C4IR((Ipp8u*)pRGBX, cColorWidth * 4, roiSize, ippAxsVertical);
+        if (bConvert)
+        {
 #ifdef COLOR_BMP
-        ippiCopy_8u_AC4C3R((Ipp8u*)pBuffer, cColorWidth * 4, (Ipp8u*)pRGB, cColorWidth * 3, roiSize);  // BGRA to BGR
+            ippiCopy_8u_AC4C3R((Ipp8u*)pBuffer, cColorWidth * 4, (Ipp8u*)pRGB, cColorWidth * 3, roiSize);  // BGRA to BGR
 #else // COLOR_BMP
-        const int dstOrder[3] = {2, 1, 0};
-        ippiSwapChannels_8u_C4C3R((Ipp8u*)pRGBX, cColorWidth * 4, (Ipp8u*)pRGB, cColorWidth * 3, roiSize, dstOrder); // BGRA to RGB
+            const int dstOrder[3] = {2, 1, 0};
+            ippiSwapChannels_8u_C4C3R((Ipp8u*)pRGBX, cColorWidth * 4, (Ipp8u*)pRGB, cColorWidth * 3, roiSize, dstOrder); // BGRA to RGB
 #endif // COLOR_BMP
+        }
 #else // USE_IPP
         RGBQUAD* pBegin = pBuffer;
         RGBQUAD* pEnd = pBuffer + cColorWidth;
@@ -1160,7 +1627,7 @@ void CKinectV2Recorder::ProcessColor(INT64 nTime, RGBQUAD* pBuffer, int nWidth,
         // end pixel is start + width*height - 1
         const RGBQUAD* pBufferEnd = pBuffer + (nWidth * nHeight);
 
-        while (pRGBX < pBufferEnd)
+        while (bConvert && pRGBX < pBufferEnd)
         {
 #ifdef COLOR_BMP
             pRGB->rgbtRed = pRGBX->rgbRed;
@@ -1176,26 +1643,96 @@ void CKinectV2Recorder::ProcessColor(INT64 nTime, RGBQUAD* pBuffer, int nWidth,
         }
 #endif // USE_IPP
 
-        // Draw the data with Direct2D
-        m_pDrawColor->Draw(reinterpret_cast<BYTE*>(pBuffer), cColorWidth * cColorHeight * sizeof(RGBQUAD));
-
-        if (m_bRecord && m_nStartTime)
+        // A frame which is dropped from the record is not cropped
+        if (bRegion && pRecordFrame != m_pColorSpare)
         {
-            // Write out the bitmap to disk (enqeue)
-            m_qColorTimeQueue.push(nTime - m_nStartTime);
-            m_qColorFrameQueue.push(m_pColorRGB[index]);
-
-            ++m_nColorIndex;
+#ifdef COLOR_BMP
+            CropColor(pBuffer, cColorWidth, m_pRecordSession->geometry[RecordStream_Color], false, pRecordFrame);
+#else // COLOR_BMP
+            CropColor(pBuffer, cColorWidth, m_pRecordSession->geometry[RecordStream_Color], true, pRecordFrame);
+#endif // COLOR_BMP
         }
 
-        if (m_bShotReady)
+        if (pLive)
         {
-            m_nColorShotTime = nTime;
-            if (m_nInfraredShotTime == m_nDepthShotTime || abs(m_nColorShotTime - m_nDepthShotTime) < 100000)
-            {
-                SaveShotImages();
-                m_bShot = false;
-                m_bShotReady = false;
+            m_pPublisher->CommitFrame(RecordStream_Color, nTime);
+        }
+        else if (bPublish)
+        {
+            m_pPublisher->Publish(RecordStream_Color, reinterpret_cast<BYTE*>(pColorFrame), nTime);
+        }
+
+        // Draw the data with Direct2D
+        m_pDrawColor->Draw(reinterpret_cast<BYTE*>(pBuffer), cColorWidth * cColorHeight * sizeof(RGBQUAD));
+
+        if (m_pRecordSession && m_pRecordSession->nDecimation[RecordStream_Color])
+        {
+            // Frames lost before they reached us show up as gaps in the relative time
+            m_pRecordSession->analyzer[RecordStream_Color].AddFrame(nTime - m_nStartTime);
+#ifdef VERBOSE
+            if (m_pRecordSession->analyzer[RecordStream_Color].GetMissingCount() > 0)
+            {
+                ResetRecordParameters();
+                MessageBox(NULL,
+                    L"Color frame dropping occured...\n",
+                    L"No Good",
+                    MB_OK | MB_ICONERROR
+                    );
+                return;
+            }
+#endif
+
+            if (!bRecordFrame)
+            {
+                // The frame set is skipped by the decimation of the stream
+            }
+            else if (m_pRecordSession->pRecordFile[RecordStream_Color])
+            {
+                RecordMappedFrame(m_pRecordSession, RecordStream_Color, pMapped, nTime);
+            }
+            else if (bSlotBusy)
+            {
+                ++m_pRecordSession->nDroppedFrames;
+            }
+            else
+            {
+                // Write out the bitmap to disk (enqeue)
+                m_bColorSlotBusy[index] = true;
+                ++m_nPendingFrames;
+                ++m_pRecordSession->nPendingFrames;
+
+                std::lock_guard<std::mutex> lock(m_mQueueMutex);
+                m_pSlotSession[RecordStream_Color][index] = m_pRecordSession;
+                m_pRecordSession->qTimeQueue[RecordStream_Color].push(nTime - m_nStartTime);
+                m_pRecordSession->qFrameQueue[RecordStream_Color].push(static_cast<int>(index));
+
+                ++m_nColorIndex;
+            }
+        }
+
+        if (m_bShotReady)
+        {
+            m_nColorShotTime = nTime;
+            if (m_nInfraredShotTime == m_nDepthShotTime || abs(m_nColorShotTime - m_nDepthShotTime) < 100000)
+            {
+                // Hand the copied set over to the shot thread, so the capture loop goes on right away
+                memcpy(m_pShotSet->pColor, pColorFrame, cColorWidth * cColorHeight * sizeof(RGBTRIPLE));
+
+                // Sequence numbers keep the names of the shots taken in the same second unique
+                WCHAR szTime[32];
+                GetTimeFormatEx(NULL, 0, NULL, L"HH'-'mm'-'ss", szTime, _countof(szTime));
+                StringCchPrintfW(m_pShotSet->szName, _countof(m_pShotSet->szName), L"%s_%04u", szTime, ++m_nShotSequence);
+                {
+                    std::lock_guard<std::mutex> lock(m_mShotMutex);
+                    m_qShotSets.push(m_pShotSet);
+                    m_pShotSet = NULL;
+                }
+                m_cvShot.notify_one();
+
+                ++m_nBurstTaken;
+                m_bShot = (m_nBurstTaken < m_nBurstCount);
+                m_nNextShotTime = GetTickCount64() + m_nBurstInterval;
+                m_bShotReady = false;
             }
         }
     }
@@ -1403,200 +1940,592 @@ bool CKinectV2Recorder::IsDirectoryExists(WCHAR* szDirName) {
 /// </summary>
 void CKinectV2Recorder::SaveRecordImages()
 {
+    ULONG_PTR nContexts[3 * BufferSize];
+    HRESULT hrResults[3 * BufferSize];
+    DWORD dwWait = 0;
+
     while (!m_bStopThread)
     {
-        bool bInfraredWrite = !m_qInfraredFrameQueue.empty();
-        bool bDepthWrite = !m_qDepthFrameQueue.empty();
-        bool bColorWrite = !m_qColorFrameQueue.empty();
+        // The writer may be replaced between two record sessions
+        std::unique_lock<std::mutex> writerLock(m_mWriterMutex);
 
-        // Check if the necessary directories exist
-        if ((bInfraredWrite || bDepthWrite || bColorWrite))
+        // Release the slots of completed writes back to the capture side
+        int nCompleted = m_pFrameWriter->Poll(nContexts, hrResults, _countof(nContexts), dwWait);
+        for (int i = 0; i < nCompleted; ++i)
         {
-            if (!IsDirectoryExists(m_cModelFolder))
+            // The image of an encoded color frame goes back to the encoders along with its slot
+            if (m_pColorEncoders && RecordStream_Color == static_cast<RecordStream>(nContexts[i] >> 16))
             {
-                CreateDirectory(m_cModelFolder, NULL);
+                m_pColorEncoders->Release(nContexts[i]);
             }
-            if (!IsDirectoryExists(m_cSaveFolder))
+            ReleaseRecordImage(nContexts[i], hrResults[i]);
+        }
+
+        // Write the color images encoded so far, in the order of their frames
+        int nEncoded = 0;
+        if (m_pColorEncoders)
+        {
+            ColorEncodedFrame encodedFrames[BufferSize];
+            nEncoded = m_pColorEncoders->Collect(encodedFrames, _countof(encodedFrames));
+            for (int i = 0; i < nEncoded; ++i)
             {
-                CreateDirectory(m_cSaveFolder, NULL);
+                HRESULT hr = encodedFrames[i].hr;
+                if (SUCCEEDED(hr))
+                {
+                    if (m_pStagingWriter)
+                    {
+                        m_pStagingWriter->SetTally(&m_pSlotSession[RecordStream_Color][encodedFrames[i].nContext & 0xFFFF]->staging);
+                    }
+                    hr = m_pFrameWriter->Submit(encodedFrames[i].szFilePath, encodedFrames[i].pImage, encodedFrames[i].cbImage, encodedFrames[i].nContext);
+                }
+                if (FAILED(hr))
+                {
+                    m_pColorEncoders->Release(encodedFrames[i].nContext);
+                    ReleaseRecordImage(encodedFrames[i].nContext, hr);
+                }
             }
         }
 
-        if (bInfraredWrite)
+        // Keep up to m_nQueueDepth writes in flight, taking turns between the streams
+        bool bSubmitted = false;
+        while (m_pFrameWriter->GetPendingCount() < m_nQueueDepth)
         {
-            WCHAR szSavePath[MAX_PATH];
-            StringCchPrintfW(szSavePath, _countof(szSavePath), L"%s\\ir", m_cSaveFolder);
+            bool bInfraredWrite = SubmitRecordImage(RecordStream_Infrared);
+            bool bDepthWrite = (m_pFrameWriter->GetPendingCount() < m_nQueueDepth) && SubmitRecordImage(RecordStream_Depth);
+            bool bColorWrite = (m_pFrameWriter->GetPendingCount() < m_nQueueDepth) && SubmitRecordImage(RecordStream_Color);
 
-            if (!IsDirectoryExists(szSavePath))
+            if (!(bInfraredWrite || bDepthWrite || bColorWrite))
             {
-                CreateDirectory(szSavePath, NULL);
+                break;
             }
+            bSubmitted = true;
+        }
 
-            INT64 nTime = m_qInfraredTimeQueue.front();
-            StringCchPrintfW(szSavePath, _countof(szSavePath), L"%s\\%011.6f.pgm", szSavePath, nTime / 10000000.);
-
-            SaveToPGM(reinterpret_cast<BYTE*>(m_qInfraredFrameQueue.front()), cInfraredWidth, cInfraredHeight, sizeof(UINT16)* 8, 65535, szSavePath);
-           
-            m_vInfraredList.push_back(nTime);
+        // Report the stopped sessions which have been written completely
+        FinishRecordSessions();
 
-            m_qInfraredTimeQueue.pop();
-            m_qInfraredFrameQueue.pop();
+        // Report back once the writer or the color encoders can be replaced, which no new session
+        // waits for in the meantime. A staging writer migrates at full speed until then.
+        if ((m_bWriterChange || m_bEncoderChange) && !m_bDrainReported && 0 == m_nPendingFrames)
+        {
+            StagingStatus status = { 0 };
+            if (m_bWriterChange && m_pStagingWriter)
+            {
+                m_pStagingWriter->GetStagingStatus(&status);
+                if (status.nFrames > 0)
+                {
+                    m_pStagingWriter->SetBackground(false);
+                }
+            }
+            if (0 == status.nFrames)
+            {
+                m_bDrainReported = true;
+                PostMessage(m_hWnd, WM_WRITERDRAINED, 0, 0);
+            }
         }
 
-        if (bDepthWrite)
+        dwWait = 0;
+        if (!bSubmitted && !nCompleted && !nEncoded)
         {
-            WCHAR szSavePath[MAX_PATH];
-            StringCchPrintfW(szSavePath, _countof(szSavePath), L"%s\\depth", m_cSaveFolder);
-
-            if (!IsDirectoryExists(szSavePath))
+            if (m_pFrameWriter->GetPendingCount() > 0)
             {
-                CreateDirectory(szSavePath, NULL);
+                // Nothing new to write, so wait for the device on the next poll
+                dwWait = 1;
             }
+            else
+            {
+                writerLock.unlock();
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+    }
+}
 
-            INT64 nTime = m_qDepthTimeQueue.front();
-            StringCchPrintfW(szSavePath, _countof(szSavePath), L"%s\\%011.6f.pgm", szSavePath, nTime / 10000000.);
-
-            SaveToPGM(reinterpret_cast<BYTE*>(m_qDepthFrameQueue.front()), cDepthWidth, cDepthHeight, sizeof(UINT16)* 8, 65535, szSavePath);
+/// <summary>
+/// Submit the oldest queued frame of a stream to the writer
+/// </summary>
+/// <param name="nStream">stream of the frame</param>
+/// <returns>true if a frame was submitted</returns>
+bool CKinectV2Recorder::SubmitRecordImage(RecordStream nStream)
+{
+    const WCHAR* szStream = NULL;
+    const WCHAR* szExtension = NULL;
+    BYTE** ppSlots = NULL;
 
-            m_vDepthList.push_back(nTime);
+    switch (nStream)
+    {
+    case RecordStream_Infrared:
+        szStream = L"ir";
+        szExtension = L"pgm";
+        ppSlots = m_pInfraredSlot;
+        break;
+    case RecordStream_Depth:
+        szStream = L"depth";
+        szExtension = L"pgm";
+        ppSlots = m_pDepthSlot;
+        break;
+    case RecordStream_Color:
+        szStream = L"color";
+#ifdef COLOR_BMP
+        szExtension = L"bmp";
+#else
+        szExtension = L"ppm";
+#endif
+        ppSlots = m_pColorSlot;
+        break;
+    default:
+        return false;
+    }
 
-            m_qDepthTimeQueue.pop();
-            m_qDepthFrameQueue.pop();
+    // The oldest session goes first, so a stopped session drains before the next one is written
+    RecordSession* pSession = NULL;
+    int nSlot = 0;
+    INT64 nTime = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_mQueueMutex);
+        for (size_t i = 0; i < m_dRecordSessions.size() && !pSession; ++i)
+        {
+            if (!m_dRecordSessions[i]->qFrameQueue[nStream].empty())
+            {
+                pSession = m_dRecordSessions[i];
+            }
+        }
+        if (!pSession)
+        {
+            return false;
         }
 
-        if (bColorWrite)
+        // Color frames to encode stay queued while the encoders have two frames per thread at hand
+        if (RecordStream_Color == nStream && ColorCodec_None != pSession->colorEncoding.nCodec && m_pColorEncoders &&
+            m_pColorEncoders->GetPendingCount() >= 2 * static_cast<int>(m_pColorEncoders->GetThreadCount()))
         {
-            WCHAR szSavePath[MAX_PATH];
-            StringCchPrintfW(szSavePath, _countof(szSavePath), L"%s\\color", m_cSaveFolder);
+            return false;
+        }
 
-            if (!IsDirectoryExists(szSavePath))
-            {
-                CreateDirectory(szSavePath, NULL);
-            }
+        nSlot = pSession->qFrameQueue[nStream].front();
+        nTime = pSession->qTimeQueue[nStream].front();
+        pSession->qFrameQueue[nStream].pop();
+        pSession->qTimeQueue[nStream].pop();
+    }
+
+    // Pick the record root of the frame and check if the necessary directories exist (the
+    // receiver creates them for streamed frames)
+    WCHAR szSessionFolder[MAX_PATH];
+    pSession->stripeLayout.GetSessionFolder(pSession->stripeLayout.NextRoot(nStream), pSession->szSaveFolder, szSessionFolder, _countof(szSessionFolder));
+
+    WCHAR szStreamFolder[MAX_PATH];
+    StringCchPrintfW(szStreamFolder, _countof(szStreamFolder), L"%s\\%s", szSessionFolder, szStream);
+    if (!m_pNetworkWriter && !IsDirectoryExists(szStreamFolder))
+    {
+        CreateFolderTree(szStreamFolder);
+    }
+
+    // The slot may have held a frame of a session with another region, so its header is written
+    // here, while the capture thread leaves the busy slot alone
+    DWORD cbHeader = FormatRecordHeader(nStream, pSession->geometry[nStream], ppSlots[nSlot]);
+    DWORD cbFrame = cbHeader + pSession->cbFrame[nStream];
+
+    // A frame of a packed stream is first reduced to the values the packing keeps, so that its
+    // checksum is the one of the frame unpacked again. Delta coded frames are reduced as well.
+    const GrayPacking& packing = pSession->packing[nStream];
+    UINT16* pPixels = reinterpret_cast<UINT16*>(ppSlots[nSlot] + cbHeader);
+    UINT32 nPixels = pSession->cbFrame[nStream] / sizeof(UINT16);
+    if (packing.nBits)
+    {
+        QuantizeGray(pPixels, nPixels, packing);
+    }
+
+    // The checksum covers the pixel data only, so it stays the same in any container
+    UINT32 nChecksum = ComputeCrc32c(pPixels, cbFrame - cbHeader);
+
+    // A frame which repeats the previous frame that did not is written as a duplicate image
+    // referring to it, and indexed with the checksum of that frame, which is the one read back
+    FrameDeduplicator& dedup = pSession->dedup[nStream];
+    bool bDuplicate = dedup.Deduplicate(ppSlots[nSlot] + cbHeader, cbFrame - cbHeader, RecordStream_Color != nStream, nChecksum, nTime);
+    bool bDelta = !bDuplicate && (RecordStream_Depth == nStream) && pSession->nKeyframeInterval;
+    bool bEncode = !bDuplicate && (RecordStream_Color == nStream) && ColorCodec_None != pSession->colorEncoding.nCodec && m_pColorEncoders;
+    if (bDuplicate)
+    {
+        szExtension = FrameDedupExtension;
+        nChecksum = dedup.GetReferenceChecksum();
+        cbFrame = FormatDuplicateHeader(ppSlots[nSlot], GetGeometryWidth(pSession->geometry[nStream]), GetGeometryHeight(pSession->geometry[nStream]), dedup.GetReferenceTime());
+    }
+    else if (bDelta)
+    {
+        szExtension = DepthDeltaExtension;
+    }
+    else if (packing.nBits)
+    {
+        szExtension = GrayPackedExtension;
+    }
+    else if (bEncode)
+    {
+        szExtension = GetColorCodecExtension(pSession->colorEncoding.nCodec);
+    }
+
+    WCHAR szSavePath[MAX_PATH];
+    StringCchPrintfW(szSavePath, _countof(szSavePath), L"%s\\%011.6f.%s", szStreamFolder, nTime / 10000000., szExtension);
+
+    // The delta coder keeps a copy of the frame as the reference of the next one, so the image
+    // replaces the frame in its slot, which holds 256 bytes more than the largest frame. Frames
+    // are coded in the order they are submitted, which is the order of their files.
+    if (bDelta)
+    {
+        cbFrame = pSession->depthEncoder.Encode(pPixels, GetGeometryWidth(pSession->geometry[nStream]), GetGeometryHeight(pSession->geometry[nStream]), ppSlots[nSlot]);
+    }
+    else if (packing.nBits && !bDuplicate)
+    {
+        // The packed header is never longer than the PGM header, so the frame is packed in place
+        BYTE header[256];
+        DWORD cbPackedHeader = FormatPackedHeader(header, GetGeometryWidth(pSession->geometry[nStream]), GetGeometryHeight(pSession->geometry[nStream]), packing);
+        PackGray(pPixels, nPixels, packing, ppSlots[nSlot] + cbPackedHeader);
+        memcpy(ppSlots[nSlot], header, cbPackedHeader);
+        cbFrame = cbPackedHeader + GetPackedSize(nPixels, packing.nBits);
+    }
 
-            INT64 nTime = m_qColorTimeQueue.front();
+    // Color frames are encoded on the pool, which hands the images back in order to be written.
+    // The frame stays in its slot until its image is written.
+    ULONG_PTR nContext = (static_cast<ULONG_PTR>(nStream) << 16) | nSlot;
+    HRESULT hr = S_OK;
+    if (bEncode)
+    {
 #ifdef COLOR_BMP
-            StringCchPrintfW(szSavePath, _countof(szSavePath), L"%s\\%011.6f.bmp", szSavePath, nTime / 10000000.);
-            SaveToBMP(reinterpret_cast<BYTE*>(m_qColorFrameQueue.front()), cColorWidth, cColorHeight, sizeof(RGBTRIPLE)* 8, szSavePath);
+        const bool bRedFirst = false;
 #else
-            StringCchPrintfW(szSavePath, _countof(szSavePath), L"%s\\%011.6f.ppm", szSavePath, nTime / 10000000.);
-            SaveToPPM(reinterpret_cast<BYTE*>(m_qColorFrameQueue.front()), cColorWidth, cColorHeight, sizeof(RGBTRIPLE)* 8, 255, szSavePath);
+        const bool bRedFirst = true;
 #endif
-            m_vColorList.push_back(nTime);
-
-            m_qColorTimeQueue.pop();
-            m_qColorFrameQueue.pop();
+        hr = m_pColorEncoders->Submit(szSavePath, pSession->colorEncoding, reinterpret_cast<const RGBTRIPLE*>(ppSlots[nSlot] + cbHeader),
+            GetGeometryWidth(pSession->geometry[nStream]), GetGeometryHeight(pSession->geometry[nStream]), bRedFirst, nContext);
+    }
+    else
+    {
+        if (m_pStagingWriter)
+        {
+            m_pStagingWriter->SetTally(&pSession->staging);
         }
+        hr = m_pFrameWriter->Submit(szSavePath, ppSlots[nSlot], cbFrame, nContext);
+    }
+    // A frame which could not be submitted is counted as failed and left out of the index. The
+    // delta coder and the deduplicator already took it as the reference, so the next depth
+    // frame is a keyframe and the next frame of the stream a new reference.
+    if (FAILED(hr))
+    {
+        if (bDelta)
+        {
+            pSession->depthEncoder.DropReference();
+        }
+        if (!bDuplicate)
+        {
+            dedup.DropReference();
+        }
+        ReleaseRecordImage(nContext, hr);
+        return true;
+    }
+
+    pSession->vList[nStream].push_back(nTime);
+    pSession->vChecksums[nStream].push_back(nChecksum);
+    return true;
+}
+
+/// <summary>
+/// Release the slot of a written frame back to the capture side
+/// </summary>
+/// <param name="nContext">stream and slot of the frame, as submitted to the writer</param>
+/// <param name="hr">result of the write</param>
+void CKinectV2Recorder::ReleaseRecordImage(ULONG_PTR nContext, HRESULT hr)
+{
+    int nSlot = static_cast<int>(nContext & 0xFFFF);
+    RecordStream nStream = static_cast<RecordStream>(nContext >> 16);
+    RecordSession* pSession = m_pSlotSession[nStream][nSlot];
+    switch (nStream)
+    {
+    case RecordStream_Infrared: m_bInfraredSlotBusy[nSlot] = false; break;
+    case RecordStream_Depth:    m_bDepthSlotBusy[nSlot] = false; break;
+    case RecordStream_Color:    m_bColorSlotBusy[nSlot] = false; break;
+    }
 
-        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    if (FAILED(hr))
+    {
+        ++pSession->nFailedFrames;
     }
+
+    --pSession->nPendingFrames;
+    --m_nPendingFrames;
 }
 
 /// <summary>
-/// Save shot images
+/// Save shot images, handed over by the capture loop, until the thread is stopped
 /// </summary>
 void CKinectV2Recorder::SaveShotImages()
 {
-    WCHAR* szPicturesFolder = NULL;
-    HRESULT hr = SHGetKnownFolderPath(FOLDERID_Pictures, 0, NULL, &szPicturesFolder);
-
-    if (SUCCEEDED(hr))
+    for (;;)
     {
-        WCHAR szCalibrationFolder[MAX_PATH];
-        WCHAR szInfraredFolder[MAX_PATH];
-        WCHAR szDepthFolder[MAX_PATH];
-        WCHAR szColorFolder[MAX_PATH];
-        WCHAR FileName[MAX_PATH];
-        StringCchPrintfW(szCalibrationFolder, _countof(szCalibrationFolder), L"%s\\calibration", szPicturesFolder);
-        if (!IsDirectoryExists(szCalibrationFolder))
+        ShotSet* pShotSet = NULL;
+        size_t nQueued = 0;
         {
-            CreateDirectory(szCalibrationFolder, NULL);
-        }
-        GetTimeFormatEx(NULL, 0, NULL, L"HH'-'mm'-'ss", FileName, _countof(FileName));
+            std::unique_lock<std::mutex> lock(m_mShotMutex);
+            while (m_qShotSets.empty() && !m_bStopThread)
+            {
+                m_cvShot.wait(lock);
+            }
 
-        // Save infrared image
-        StringCchPrintfW(szInfraredFolder, _countof(szInfraredFolder), L"%s\\ir", szCalibrationFolder);
-        if (!IsDirectoryExists(szInfraredFolder))
-        {
-            CreateDirectory(szInfraredFolder, NULL);
+            // Queued shots are still saved when the thread is stopped
+            if (m_qShotSets.empty())
+            {
+                break;
+            }
+            pShotSet = m_qShotSets.front();
+            m_qShotSets.pop();
+            nQueued = m_qShotSets.size();
         }
-        WCHAR szInfraredPath[MAX_PATH];
-        StringCchPrintfW(szInfraredPath, _countof(szInfraredPath), L"%s\\%s.pgm", szInfraredFolder, FileName);
-        SaveToPGM(reinterpret_cast<BYTE*>(m_pInfraredUINT16[0]), cInfraredWidth, cInfraredHeight, sizeof(UINT16)* 8, 65535, szInfraredPath);
 
-        // Save depth image
-        StringCchPrintfW(szDepthFolder, _countof(szDepthFolder), L"%s\\depth", szCalibrationFolder);
-        if (!IsDirectoryExists(szDepthFolder))
-        {
-            CreateDirectory(szDepthFolder, NULL);
-        }
-        WCHAR szDepthPath[MAX_PATH];
-        StringCchPrintfW(szDepthPath, _countof(szDepthPath), L"%s\\%s.pgm", szDepthFolder, FileName);
-        SaveToPGM(reinterpret_cast<BYTE*>(m_pDepthUINT16[0]), cDepthWidth, cDepthHeight, sizeof(UINT16)* 8, 65535, szDepthPath);
-    
-        // Save Color image
-        StringCchPrintfW(szColorFolder, _countof(szColorFolder), L"%s\\color", szCalibrationFolder);
-        if (!IsDirectoryExists(szColorFolder))
+        WCHAR* szPicturesFolder = NULL;
+        HRESULT hr = SHGetKnownFolderPath(FOLDERID_Pictures, 0, NULL, &szPicturesFolder);
+
+        if (SUCCEEDED(hr))
         {
-            CreateDirectory(szColorFolder, NULL);
-        }
-        WCHAR szColorPath[MAX_PATH];
-        StringCchPrintfW(szColorPath, _countof(szColorPath), L"%s\\%s.bmp", szColorFolder, FileName);
+            WCHAR szCalibrationFolder[MAX_PATH];
+            WCHAR szInfraredFolder[MAX_PATH];
+            WCHAR szDepthFolder[MAX_PATH];
+            WCHAR szColorFolder[MAX_PATH];
+            StringCchPrintfW(szCalibrationFolder, _countof(szCalibrationFolder), L"%s\\calibration", szPicturesFolder);
+            CoTaskMemFree(szPicturesFolder);
+            if (!IsDirectoryExists(szCalibrationFolder))
+            {
+                CreateDirectory(szCalibrationFolder, NULL);
+            }
+
+            // Save infrared image
+            StringCchPrintfW(szInfraredFolder, _countof(szInfraredFolder), L"%s\\ir", szCalibrationFolder);
+            if (!IsDirectoryExists(szInfraredFolder))
+            {
+                CreateDirectory(szInfraredFolder, NULL);
+            }
+            WCHAR szInfraredPath[MAX_PATH];
+            StringCchPrintfW(szInfraredPath, _countof(szInfraredPath), L"%s\\%s.pgm", szInfraredFolder, pShotSet->szName);
+            SaveToPGM(reinterpret_cast<BYTE*>(pShotSet->pInfrared), cInfraredWidth, cInfraredHeight, sizeof(UINT16)* 8, 65535, szInfraredPath);
+
+            // Save depth image
+            StringCchPrintfW(szDepthFolder, _countof(szDepthFolder), L"%s\\depth", szCalibrationFolder);
+            if (!IsDirectoryExists(szDepthFolder))
+            {
+                CreateDirectory(szDepthFolder, NULL);
+            }
+            WCHAR szDepthPath[MAX_PATH];
+            StringCchPrintfW(szDepthPath, _countof(szDepthPath), L"%s\\%s.pgm", szDepthFolder, pShotSet->szName);
+            SaveToPGM(reinterpret_cast<BYTE*>(pShotSet->pDepth), cDepthWidth, cDepthHeight, sizeof(UINT16)* 8, 65535, szDepthPath);
+
+            // Save Color image
+            StringCchPrintfW(szColorFolder, _countof(szColorFolder), L"%s\\color", szCalibrationFolder);
+            if (!IsDirectoryExists(szColorFolder))
+            {
+                CreateDirectory(szColorFolder, NULL);
+            }
+            WCHAR szColorPath[MAX_PATH];
+            StringCchPrintfW(szColorPath, _countof(szColorPath), L"%s\\%s.bmp", szColorFolder, pShotSet->szName);
 #ifndef COLOR_BMP
-        RGBTRIPLE* pBuffer = m_pColorRGB[0];
-        // end pixel is start + width*height - 1
-        const RGBTRIPLE* pBufferEnd = pBuffer + (cColorWidth * cColorHeight);
+            // The shot buffer is a copy, so it can be turned into BMP order in place
+            RGBTRIPLE* pBuffer = pShotSet->pColor;
+            // end pixel is start + width*height - 1
+            const RGBTRIPLE* pBufferEnd = pBuffer + (cColorWidth * cColorHeight);
+
+            while (pBuffer < pBufferEnd)
+            {
+                std::swap(pBuffer->rgbtRed, pBuffer->rgbtBlue);
+                ++pBuffer;
+            }
+#endif
+            SaveToBMP(reinterpret_cast<BYTE*>(pShotSet->pColor), cColorWidth, cColorHeight, sizeof(RGBTRIPLE)* 8, szColorPath);
+
+            // The status bar belongs to the UI thread
+            std::lock_guard<std::mutex> lock(m_mShotMutex);
+            if (nQueued > 0)
+            {
+                StringCchPrintfW(m_cShotMessage, _countof(m_cShotMessage), L"Take a shot   [%s\\xxx\\%s.xxx, %u queued]", szCalibrationFolder, pShotSet->szName, static_cast<UINT>(nQueued));
+            }
+            else
+            {
+                StringCchPrintfW(m_cShotMessage, _countof(m_cShotMessage), L"Take a shot   [%s\\xxx\\%s.xxx]", szCalibrationFolder, pShotSet->szName);
+            }
+            PostMessage(m_hWnd, WM_SHOTSAVED, 0, 0);
+        }
 
-        while (pBuffer < pBufferEnd)
+        std::lock_guard<std::mutex> lock(m_mShotMutex);
+        m_vFreeShotSets.push_back(pShotSet);
+    }
+}
+
+/// <summary>
+/// Get a shot set to fill, unless all of them are waiting to be saved
+/// </summary>
+/// <returns>true if m_pShotSet can be filled</returns>
+bool CKinectV2Recorder::AcquireShotSet()
+{
+    if (m_pShotSet)
+    {
+        return true;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mShotMutex);
+        if (!m_vFreeShotSets.empty())
         {
-            std::swap(pBuffer->rgbtRed, pBuffer->rgbtBlue);
-            ++pBuffer;
+            m_pShotSet = m_vFreeShotSets.back();
+            m_vFreeShotSets.pop_back();
+            return true;
         }
-#endif
-        SaveToBMP(reinterpret_cast<BYTE*>(m_pColorRGB[0]), cColorWidth, cColorHeight, sizeof(RGBTRIPLE)* 8, szColorPath);
+    }
 
-        WCHAR szStatusMessage[128];
-        StringCchPrintfW(szStatusMessage, _countof(szStatusMessage), L"Take a shot   [%s\\xxx\\%s.xxx]", szCalibrationFolder, FileName);
-        SetStatusMessage(szStatusMessage, 3000, true);
+    // Sets are allocated on demand, a single shot needs just one of them
+    if (m_nShotSets >= cMaxShotSets)
+    {
+        return false;
     }
+
+    m_pShotSet = new ShotSet;
+    m_pShotSet->pInfrared = new UINT16[cInfraredWidth * cInfraredHeight];
+    m_pShotSet->pDepth = new UINT16[cDepthWidth * cDepthHeight];
+    m_pShotSet->pColor = new RGBTRIPLE[cColorWidth * cColorHeight];
+    m_pShotSet->szName[0] = L'\0';
+    ++m_nShotSets;
+    return true;
 }
 
 /// <summary>
-/// Check if we have stored all the necessary images (no frame dropping)
+/// Measure the quality of an infrared frame for a shot
 /// </summary>
-void CKinectV2Recorder::CheckImages()
+/// <param name="pInfrared">infrared frame (Big-Endian)</param>
+/// <param name="pfSharpness">receives the mean gradient relative to the mean intensity</param>
+/// <param name="pfMotion">receives the mean difference to the previous frame relative to the mean intensity</param>
+void CKinectV2Recorder::MeasureShotQuality(const UINT16* pInfrared, double* pfSharpness, double* pfMotion)
 {
-    m_bRecord = false;
-    while (!m_qInfraredFrameQueue.empty() || !m_qDepthFrameQueue.empty() || !m_qColorFrameQueue.empty())
+    // Sample every cShotSampleStep-th pixel of every cShotSampleStep-th row, which is cheap enough for the capture loop
+    const int nSampleWidth = cInfraredWidth / cShotSampleStep;
+    const int nSampleHeight = cInfraredHeight / cShotSampleStep;
+    bool bReference = (m_vShotReference.size() == static_cast<size_t>(nSampleWidth * nSampleHeight));
+    if (!bReference)
     {
-        std::this_thread::sleep_for(std::chrono::microseconds(33));
+        m_vShotReference.resize(nSampleWidth * nSampleHeight);
     }
-    int nInfraredFrameNumber = m_vInfraredList.size();
-    int nDepthFrameNumber = m_vDepthList.size();
-    int nColorFrameNumber = m_vColorList.size();
 
-    if (!(nInfraredFrameNumber == nDepthFrameNumber && nDepthFrameNumber == nColorFrameNumber))
+    UINT64 nSum = 0;
+    UINT64 nGradient = 0;
+    UINT64 nDifference = 0;
+    UINT16* pReference = m_vShotReference.data();
+    for (int y = 0; y < nSampleHeight; ++y)
     {
-        MessageBox(NULL,
-            L"Frame dropping occured...\n",
-            L"No Good",
-            MB_OK | MB_ICONERROR
-            );
-        return;
+        const UINT16* pRow = pInfrared + (y * cShotSampleStep) * cInfraredWidth;
+        const UINT16* pNextRow = (y * cShotSampleStep + 1 < cInfraredHeight) ? pRow + cInfraredWidth : pRow;
+        for (int x = 0; x < nSampleWidth; ++x, ++pReference)
+        {
+            int i = x * cShotSampleStep;
+            int nValue = _byteswap_ushort(pRow[i]);
+            int nRight = _byteswap_ushort(pRow[min(i + 1, cInfraredWidth - 1)]);
+            int nBelow = _byteswap_ushort(pNextRow[i]);
+
+            nSum += nValue;
+            nGradient += abs(nRight - nValue) + abs(nBelow - nValue);
+            if (bReference)
+            {
+                nDifference += abs(nValue - static_cast<int>(*pReference));
+            }
+            *pReference = static_cast<UINT16>(nValue);
+        }
     }
 
-    for (int i = 0; i < nInfraredFrameNumber; ++i)
+    double fMean = max(1.0, static_cast<double>(nSum) / (nSampleWidth * nSampleHeight));
+    *pfSharpness = static_cast<double>(nGradient) / (nSampleWidth * nSampleHeight) / fMean;
+    *pfMotion = bReference ? static_cast<double>(nDifference) / (nSampleWidth * nSampleHeight) / fMean : 0.0;
+}
+
+/// <summary>
+/// Check if we have stored all the necessary images (no frame dropping)
+/// </summary>
+/// <param name="pSession">session which has been written completely</param>
+/// <returns>true if every frame set is complete and synchronized</returns>
+bool CKinectV2Recorder::CheckImages(const RecordSession* pSession)
+{
+    // Streams recorded at the same rate have the same frame sets: depth frames have the time of
+    // their infrared frame and color frames are within 10 ms of it. A stream decimated by a
+    // multiple of another one has to find each of its frames in the other one.
+    for (int a = 0; a < 3; ++a)
     {
-        if (m_vInfraredList[i] != m_vDepthList[i] || abs(m_vColorList[i] - m_vInfraredList[i]) > 100000)
+        for (int b = a + 1; b < 3; ++b)
         {
-            MessageBox(NULL,
-                L"Frame dropping occured...\n",
-                L"No Good",
-                MB_OK | MB_ICONERROR
-                );
-            return;
+            UINT nDecimationA = pSession->nDecimation[a];
+            UINT nDecimationB = pSession->nDecimation[b];
+            if (!nDecimationA || !nDecimationB || (max(nDecimationA, nDecimationB) % min(nDecimationA, nDecimationB)))
+            {
+                continue;
+            }
+
+            const std::vector<INT64>& vFine = pSession->vList[(nDecimationA <= nDecimationB) ? a : b];
+            const std::vector<INT64>& vCoarse = pSession->vList[(nDecimationA <= nDecimationB) ? b : a];
+            INT64 nTolerance = (RecordStream_Color == b) ? 100000 : 0;
+            if (nDecimationA == nDecimationB && vFine.size() != vCoarse.size())
+            {
+                return false;
+            }
+
+            size_t j = 0;
+            for (size_t i = 0; i < vCoarse.size(); ++i)
+            {
+                while (j < vFine.size() && vFine[j] < vCoarse[i] - nTolerance)
+                {
+                    ++j;
+                }
+                if (j == vFine.size() || abs(vFine[j] - vCoarse[i]) > nTolerance)
+                {
+                    return false;
+                }
+            }
         }
     }
+
+    return true;
+}
+
+/// <summary>
+/// Check whether a frame of the current session is recorded: its stream has to be on and
+/// its frame set has to be one of every Nth of the stream
+/// </summary>
+/// <param name="nStream">stream of the frame</param>
+/// <param name="nTime">timestamp of frame</param>
+/// <returns>true if the frame is recorded</returns>
+bool CKinectV2Recorder::IsFrameRecorded(RecordStream nStream, INT64 nTime) const
+{
+    if (!m_pRecordSession || !m_pRecordSession->nDecimation[nStream])
+    {
+        return false;
+    }
+
+    // Frame sets are counted from the record start, so the frames of all streams with the same
+    // (or a multiple) decimation come from the same frame sets. Color frames arrive a few ms
+    // after their infrared and depth frames.
+    INT64 nFrameSet = (nTime - m_nStartTime + FramePeriod / 2) / FramePeriod;
+    return 0 == nFrameSet % m_pRecordSession->nDecimation[nStream];
+}
+
+/// <summary>
+/// Format the image header of the recorded frames of a stream
+/// </summary>
+/// <param name="nStream">stream of the frames</param>
+/// <param name="geometry">recorded region of the stream</param>
+/// <param name="pDest">receives the header, room for 256 bytes</param>
+/// <returns>size (in bytes) of the header</returns>
+DWORD CKinectV2Recorder::FormatRecordHeader(RecordStream nStream, const RecordGeometry& geometry, BYTE* pDest) const
+{
+    LONG lWidth = static_cast<LONG>(GetGeometryWidth(geometry));
+    LONG lHeight = static_cast<LONG>(GetGeometryHeight(geometry));
+    if (RecordStream_Color != nStream)
+    {
+        return FormatPGMHeader(pDest, lWidth, lHeight, 65535);
+    }
+#ifdef COLOR_BMP
+    return FormatBMPHeader(pDest, lWidth, lHeight, sizeof(RGBTRIPLE)* 8);
+#else
+    return FormatPPMHeader(pDest, lWidth, lHeight, 255);
+#endif
 }
 
 /// <summary>
@@ -1605,18 +2534,1078 @@ void CKinectV2Recorder::CheckImages()
 void CKinectV2Recorder::ResetRecordParameters()
 {
     m_bRecord = false;
-    while (!m_qInfraredFrameQueue.empty() || !m_qDepthFrameQueue.empty() || !m_qColorFrameQueue.empty())
+
+    // The queued frames of the session are written in the background, so the next session
+    // can start right away
+    if (m_pRecordSession)
+    {
+        CloseRecordFiles(m_pRecordSession);
+        m_pRecordSession->nStopTime = GetTickCount64();
+
+        std::lock_guard<std::mutex> lock(m_mQueueMutex);
+        m_pRecordSession->bStopped = true;
+        m_pRecordSession = NULL;
+    }
+
+    // Nothing competes with the migration between two sessions
+    if (m_pStagingWriter)
     {
-        std::this_thread::sleep_for(std::chrono::microseconds(33));
+        m_pStagingWriter->SetBackground(false);
     }
+
     m_nInfraredIndex = 0;
     m_nDepthIndex = 0;
     m_nColorIndex = 0;
-    m_vInfraredList.resize(0);
-    m_vDepthList.resize(0);
-    m_vColorList.resize(0);
     m_nStartTime = 0;
     
 
     SendDlgItemMessage(m_hWnd, IDC_BUTTON_RECORD, BM_SETIMAGE, (WPARAM)IMAGE_ICON, (LPARAM)m_hRecord);
 }
+
+/// <summary>
+/// Start a record session in the current save folder
+/// </summary>
+/// <returns>indicates success or failure</returns>
+HRESULT CKinectV2Recorder::StartRecordSession()
+{
+    // The session must not exist on any of the record roots, nor be still draining
+    bool bSessionExists = false;
+    for (int i = 0; i < m_stripeLayout.GetRootCount(); ++i)
+    {
+        WCHAR szSessionFolder[MAX_PATH];
+        m_stripeLayout.GetSessionFolder(i, m_cSaveFolder, szSessionFolder, _countof(szSessionFolder));
+        bSessionExists |= IsDirectoryExists(szSessionFolder);
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mQueueMutex);
+        for (size_t i = 0; i < m_dRecordSessions.size(); ++i)
+        {
+            bSessionExists |= (0 == _wcsicmp(m_dRecordSessions[i]->szSaveFolder, m_cSaveFolder));
+        }
+    }
+
+    if (bSessionExists)
+    {
+        MessageBox(NULL,
+            L"The related folder is not emtpy!\n",
+            L"Frames already existed",
+            MB_OK | MB_ICONERROR
+            );
+        return E_FAIL;
+    }
+
+    // Each session keeps its own copy of the layout, as the roots may change for the next one
+    RecordSession* pSession = new RecordSession();
+    StringCchCopyW(pSession->szSaveFolder, _countof(pSession->szSaveFolder), m_cSaveFolder);
+    pSession->stripeLayout = m_stripeLayout;
+    pSession->stripeLayout.Reset();
+    for (int i = 0; i < 3; ++i)
+    {
+        pSession->nDecimation[i] = m_nDecimation[i];
+        pSession->geometry[i] = m_geometry[i];
+        pSession->vList[i].reserve(1800);
+        pSession->vChecksums[i].reserve(1800);
+    }
+
+    // Record files take the frames as they are converted, so only images are packed, delta coded,
+    // encoded or deduplicated. Delta coding finds a static depth frame by itself, as a single
+    // run of zero residuals, and needs every frame of its sequence, so it is not deduplicated.
+    if (WriterMode_Mapped != m_nWriterMode)
+    {
+        pSession->packing[RecordStream_Infrared] = m_packing[RecordStream_Infrared];
+        pSession->packing[RecordStream_Depth] = m_packing[RecordStream_Depth];
+        pSession->nKeyframeInterval = m_nKeyframeInterval;
+        pSession->depthEncoder.Reset(m_nKeyframeInterval);
+        pSession->colorEncoding = m_colorEncoding;
+        pSession->dedup[RecordStream_Infrared].Reset(m_dedupThreshold[RecordStream_Infrared], m_bDedup[RecordStream_Infrared]);
+        pSession->dedup[RecordStream_Depth].Reset(m_dedupThreshold[RecordStream_Depth], m_bDedup[RecordStream_Depth] && !m_nKeyframeInterval);
+        pSession->dedup[RecordStream_Color].Reset(m_dedupThreshold[RecordStream_Color], m_bDedup[RecordStream_Color]);
+    }
+
+    // The pixel data of a frame starts behind the image header, which is shorter for a smaller region
+    BYTE header[256];
+    pSession->cbHeader[RecordStream_Infrared] = FormatRecordHeader(RecordStream_Infrared, pSession->geometry[RecordStream_Infrared], header);
+    pSession->cbHeader[RecordStream_Depth] = FormatRecordHeader(RecordStream_Depth, pSession->geometry[RecordStream_Depth], header);
+    pSession->cbHeader[RecordStream_Color] = FormatRecordHeader(RecordStream_Color, pSession->geometry[RecordStream_Color], header);
+    pSession->cbFrame[RecordStream_Infrared] = GetGeometryWidth(pSession->geometry[RecordStream_Infrared]) * GetGeometryHeight(pSession->geometry[RecordStream_Infrared]) * sizeof(UINT16);
+    pSession->cbFrame[RecordStream_Depth] = GetGeometryWidth(pSession->geometry[RecordStream_Depth]) * GetGeometryHeight(pSession->geometry[RecordStream_Depth]) * sizeof(UINT16);
+    pSession->cbFrame[RecordStream_Color] = GetGeometryWidth(pSession->geometry[RecordStream_Color]) * GetGeometryHeight(pSession->geometry[RecordStream_Color]) * sizeof(RGBTRIPLE);
+
+    // Writers which create their files ahead get the folders of the session ready before its
+    // first frame
+    if (WriterMode_Mapped != m_nWriterMode)
+    {
+        const WCHAR* szStreams[] = { L"ir", L"depth", L"color" };
+        std::lock_guard<std::mutex> lock(m_mWriterMutex);
+        for (int i = 0; i < pSession->stripeLayout.GetRootCount(); ++i)
+        {
+            WCHAR szSessionFolder[MAX_PATH];
+            pSession->stripeLayout.GetSessionFolder(i, pSession->szSaveFolder, szSessionFolder, _countof(szSessionFolder));
+            for (int nStream = 0; nStream < 3; ++nStream)
+            {
+                if (pSession->nDecimation[nStream])
+                {
+                    WCHAR szStreamFolder[MAX_PATH];
+                    StringCchPrintfW(szStreamFolder, _countof(szStreamFolder), L"%s\\%s", szSessionFolder, szStreams[nStream]);
+                    m_pFrameWriter->Prepare(szStreamFolder, pSession->cbHeader[nStream] + pSession->cbFrame[nStream]);
+                }
+            }
+        }
+    }
+
+    // Let the tools find the frames on the other roots
+    if (pSession->stripeLayout.GetRootCount() > 1)
+    {
+        pSession->stripeLayout.WriteManifest(pSession->szSaveFolder);
+    }
+
+    if (WriterMode_Mapped == m_nWriterMode && FAILED(CreateRecordFiles(pSession)))
+    {
+        CloseRecordFiles(pSession);
+        delete pSession;
+        MessageBox(NULL,
+            L"The record files cannot be created!\n",
+            L"Record failed",
+            MB_OK | MB_ICONERROR
+            );
+        return E_FAIL;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mQueueMutex);
+    m_dRecordSessions.push_back(pSession);
+    m_pRecordSession = pSession;
+    return S_OK;
+}
+
+/// <summary>
+/// Report the stopped sessions which have been written completely (called by the save thread)
+/// </summary>
+void CKinectV2Recorder::FinishRecordSessions()
+{
+    std::vector<RecordSession*> vFinished;
+    {
+        std::lock_guard<std::mutex> lock(m_mQueueMutex);
+        for (size_t i = 0; i < m_dRecordSessions.size(); ++i)
+        {
+            RecordSession* pSession = m_dRecordSessions[i];
+            if (pSession->bStopped && !pSession->bDone && 0 == pSession->nPendingFrames && 0 == pSession->staging.nStaged)
+            {
+                pSession->bDone = true;
+                vFinished.push_back(pSession);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < vFinished.size(); ++i)
+    {
+        RecordSession* pSession = vFinished[i];
+        pSession->nFailedFrames += pSession->staging.nFailed;
+        pSession->nDoneTime = GetTickCount64();
+        pSession->bSynchronized = CheckImages(pSession);
+        if (FAILED(WriteSessionReport(pSession)))
+        {
+            ++pSession->nFailedFrames;
+        }
+
+        // The UI thread shows the report and deletes the session
+        PostMessage(m_hWnd, WM_SESSIONDONE, 0, reinterpret_cast<LPARAM>(pSession));
+    }
+}
+
+/// <summary>
+/// Write the index, the missing frames and the completion report of a session to its folder on the first record root
+/// </summary>
+/// <param name="pSession">session which has been written completely</param>
+/// <returns>indicates success or failure</returns>
+HRESULT CKinectV2Recorder::WriteSessionReport(const RecordSession* pSession)
+{
+    WCHAR szSessionFolder[MAX_PATH];
+    pSession->stripeLayout.GetSessionFolder(0, pSession->szSaveFolder, szSessionFolder, _countof(szSessionFolder));
+    if (!IsDirectoryExists(szSessionFolder) && FAILED(CreateFolderTree(szSessionFolder)))
+    {
+        return E_FAIL;
+    }
+
+    // Index: time of every recorded frame (relative to the record start, in seconds) and the
+    // CRC32C of its pixel data
+    WCHAR szIndexPath[MAX_PATH];
+    StringCchPrintfW(szIndexPath, _countof(szIndexPath), L"%s\\%s", szSessionFolder, SessionIndexName);
+    const char* szStreams[] = { "ir", "depth", "color" };
+    std::string sIndex("stream,index,time,crc32c\r\n");
+    for (int nStream = 0; nStream < 3; ++nStream)
+    {
+        for (size_t i = 0; i < pSession->vList[nStream].size(); ++i)
+        {
+            char szLine[64];
+            sprintf_s(szLine, "%s,%u,%011.6f,%08x\r\n", szStreams[nStream], static_cast<UINT>(i), pSession->vList[nStream][i] / 10000000., pSession->vChecksums[nStream][i]);
+            sIndex += szLine;
+        }
+    }
+
+    HANDLE hFile = CreateFileW(szIndexPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (INVALID_HANDLE_VALUE == hFile)
+    {
+        return E_ACCESSDENIED;
+    }
+
+    DWORD dwBytesWritten = 0;
+    BOOL bWritten = WriteFile(hFile, sIndex.data(), static_cast<DWORD>(sIndex.size()), &dwBytesWritten, NULL);
+    CloseHandle(hFile);
+    if (!bWritten)
+    {
+        return E_FAIL;
+    }
+
+    // Expected times of the frames which never arrived from the sensor
+    std::string sGaps("stream,time\r\n");
+    for (int nStream = 0; nStream < 3; ++nStream)
+    {
+        const std::vector<INT64>& vMissingTimes = pSession->analyzer[nStream].GetMissingTimes();
+        for (size_t i = 0; i < vMissingTimes.size(); ++i)
+        {
+            char szLine[64];
+            sprintf_s(szLine, "%s,%011.6f\r\n", szStreams[nStream], vMissingTimes[i] / 10000000.);
+            sGaps += szLine;
+        }
+    }
+
+    WCHAR szGapsPath[MAX_PATH];
+    StringCchPrintfW(szGapsPath, _countof(szGapsPath), L"%s\\%s", szSessionFolder, SessionGapsName);
+    hFile = CreateFileW(szGapsPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (INVALID_HANDLE_VALUE == hFile)
+    {
+        return E_ACCESSDENIED;
+    }
+
+    bWritten = WriteFile(hFile, sGaps.data(), static_cast<DWORD>(sGaps.size()), &dwBytesWritten, NULL);
+    CloseHandle(hFile);
+    if (!bWritten)
+    {
+        return E_FAIL;
+    }
+
+    // Report: frame counts, losses and how long the session took to drain after it was stopped
+    WCHAR szReportPath[MAX_PATH];
+    WCHAR szReport[MAX_PATH];
+    StringCchPrintfW(szReportPath, _countof(szReportPath), L"%s\\%s", szSessionFolder, SessionReportName);
+    GetFullPathNameW(szReportPath, _countof(szReport), szReport, NULL);
+
+    WCHAR szValue[64];
+    WritePrivateProfileStringW(L"Session", L"Folder", pSession->szSaveFolder, szReport);
+    StringCchPrintfW(szValue, _countof(szValue), L"%u", static_cast<UINT>(pSession->vList[RecordStream_Infrared].size()));
+    WritePrivateProfileStringW(L"Session", L"InfraredFrames", szValue, szReport);
+    StringCchPrintfW(szValue, _countof(szValue), L"%u", static_cast<UINT>(pSession->vList[RecordStream_Depth].size()));
+    WritePrivateProfileStringW(L"Session", L"DepthFrames", szValue, szReport);
+    StringCchPrintfW(szValue, _countof(szValue), L"%u", static_cast<UINT>(pSession->vList[RecordStream_Color].size()));
+    WritePrivateProfileStringW(L"Session", L"ColorFrames", szValue, szReport);
+    StringCchPrintfW(szValue, _countof(szValue), L"%d", pSession->nDroppedFrames.load());
+    WritePrivateProfileStringW(L"Session", L"DroppedFrames", szValue, szReport);
+    StringCchPrintfW(szValue, _countof(szValue), L"%d", pSession->nFailedFrames.load());
+    WritePrivateProfileStringW(L"Session", L"FailedFrames", szValue, szReport);
+    WritePrivateProfileStringW(L"Session", L"Synchronized", pSession->bSynchronized ? L"1" : L"0", szReport);
+    StringCchPrintfW(szValue, _countof(szValue), L"%llu", pSession->nDoneTime - pSession->nStopTime);
+    WritePrivateProfileStringW(L"Session", L"DrainMs", szValue, szReport);
+
+    // Timing of each stream as received from the sensor (unit: ms), with the non-empty bins of
+    // the interval histogram as "ms:count" pairs
+    const WCHAR* szSections[] = { L"Infrared", L"Depth", L"Color" };
+    for (int nStream = 0; nStream < 3; ++nStream)
+    {
+        FrameTimingStats stats;
+        pSession->analyzer[nStream].GetStats(&stats);
+        StringCchPrintfW(szValue, _countof(szValue), L"%u", pSession->nDecimation[nStream]);
+        WritePrivateProfileStringW(szSections[nStream], L"Decimation", szValue, szReport);
+        const RecordGeometry& geometry = pSession->geometry[nStream];
+        StringCchPrintfW(szValue, _countof(szValue), L"%u,%u,%u,%u", geometry.nX, geometry.nY, geometry.nWidth, geometry.nHeight);
+        WritePrivateProfileStringW(szSections[nStream], L"Roi", szValue, szReport);
+        StringCchPrintfW(szValue, _countof(szValue), L"%u", geometry.nBinning);
+        WritePrivateProfileStringW(szSections[nStream], L"Binning", szValue, szReport);
+        StringCchPrintfW(szValue, _countof(szValue), L"%u", GetGeometryWidth(geometry));
+        WritePrivateProfileStringW(szSections[nStream], L"Width", szValue, szReport);
+        StringCchPrintfW(szValue, _countof(szValue), L"%u", GetGeometryHeight(geometry));
+        WritePrivateProfileStringW(szSections[nStream], L"Height", szValue, szReport);
+        if (RecordStream_Color != nStream)
+        {
+            StringCchPrintfW(szValue, _countof(szValue), L"%u", pSession->packing[nStream].nBits ? pSession->packing[nStream].nBits : 16);
+            WritePrivateProfileStringW(szSections[nStream], L"Bits", szValue, szReport);
+            StringCchPrintfW(szValue, _countof(szValue), L"%u", pSession->packing[nStream].nShift);
+            WritePrivateProfileStringW(szSections[nStream], L"Shift", szValue, szReport);
+        }
+        if (RecordStream_Depth == nStream)
+        {
+            StringCchPrintfW(szValue, _countof(szValue), L"%u", pSession->nKeyframeInterval);
+            WritePrivateProfileStringW(szSections[nStream], L"KeyframeInterval", szValue, szReport);
+        }
+        if (RecordStream_Color == nStream)
+        {
+            WritePrivateProfileStringW(szSections[nStream], L"Codec", GetColorCodecName(pSession->colorEncoding.nCodec), szReport);
+            StringCchPrintfW(szValue, _countof(szValue), L"%u", pSession->colorEncoding.nQuality);
+            WritePrivateProfileStringW(szSections[nStream], L"Quality", szValue, szReport);
+        }
+        WritePrivateProfileStringW(szSections[nStream], L"Dedup", pSession->dedup[nStream].IsEnabled() ? L"1" : L"0", szReport);
+        StringCchPrintfW(szValue, _countof(szValue), L"%u", pSession->dedup[nStream].GetDuplicateCount());
+        WritePrivateProfileStringW(szSections[nStream], L"DuplicateFrames", szValue, szReport);
+        StringCchPrintfW(szValue, _countof(szValue), L"%u", stats.nGaps);
+        WritePrivateProfileStringW(szSections[nStream], L"Gaps", szValue, szReport);
+        StringCchPrintfW(szValue, _countof(szValue), L"%u", stats.nMissing);
+        WritePrivateProfileStringW(szSections[nStream], L"MissingFrames", szValue, szReport);
+        StringCchPrintfW(szValue, _countof(szValue), L"%0.3f", stats.fMeanInterval);
+        WritePrivateProfileStringW(szSections[nStream], L"MeanInterval", szValue, szReport);
+        StringCchPrintfW(szValue, _countof(szValue), L"%0.3f", stats.fJitter);
+        WritePrivateProfileStringW(szSections[nStream], L"Jitter", szValue, szReport);
+        StringCchPrintfW(szValue, _countof(szValue), L"%0.3f", stats.fMaxInterval);
+        WritePrivateProfileStringW(szSections[nStream], L"MaxInterval", szValue, szReport);
+
+        WCHAR szHistogram[FrameHistogramBins * 16] = L"";
+        const UINT32* pHistogram = pSession->analyzer[nStream].GetHistogram();
+        for (int i = 0; i < FrameHistogramBins; ++i)
+        {
+            if (pHistogram[i])
+            {
+                StringCchPrintfW(szValue, _countof(szValue), szHistogram[0] ? L" %d:%u" : L"%d:%u", i, pHistogram[i]);
+                StringCchCatW(szHistogram, _countof(szHistogram), szValue);
+            }
+        }
+        WritePrivateProfileStringW(szSections[nStream], L"Histogram", szHistogram, szReport);
+
+        // Where the frame slots of the stream live, as found in the working set now
+        FrameSlabStats slabStats;
+        WCHAR szPages[128];
+        m_frameSlabs[nStream].GetStats(&slabStats);
+        FormatSlabPages(slabStats, szPages, _countof(szPages));
+        if (FrameSlabAnyNode == slabStats.nNode)
+        {
+            StringCchCopyW(szValue, _countof(szValue), L"any");
+        }
+        else
+        {
+            StringCchPrintfW(szValue, _countof(szValue), L"%u", slabStats.nNode);
+        }
+        WritePrivateProfileStringW(szSections[nStream], L"SlotNode", szValue, szReport);
+        WritePrivateProfileStringW(szSections[nStream], L"SlotLargePages", slabStats.bLargePages ? L"1" : L"0", szReport);
+        WritePrivateProfileStringW(szSections[nStream], L"SlotPages", szPages, szReport);
+        StringCchPrintfW(szValue, _countof(szValue), L"%u", slabStats.nPagesNotResident);
+        WritePrivateProfileStringW(szSections[nStream], L"SlotPagesNotResident", szValue, szReport);
+    }
+
+    // Where the pipeline threads ran, for comparing the jitter of sessions
+    WriteThreadPlacement(szReport);
+
+    // Flush the cached profile to disk
+    if (!WritePrivateProfileStringW(NULL, NULL, NULL, szReport))
+    {
+        return E_FAIL;
+    }
+
+    // A streamed session is kept here as its report only, which completes the session on the
+    // receiver. The files are queued behind the frames, so the save thread does not wait for
+    // the receiver while it holds the writer.
+    if (m_pNetworkWriter)
+    {
+        std::vector<BYTE> vReport;
+        HRESULT hr = m_pNetworkWriter->Post(szIndexPath, reinterpret_cast<const BYTE*>(sIndex.data()), static_cast<DWORD>(sIndex.size()));
+        if (SUCCEEDED(hr))
+        {
+            hr = m_pNetworkWriter->Post(szGapsPath, reinterpret_cast<const BYTE*>(sGaps.data()), static_cast<DWORD>(sGaps.size()));
+        }
+        if (SUCCEEDED(hr))
+        {
+            hr = ReadImageFile(szReportPath, &vReport);
+        }
+        if (SUCCEEDED(hr))
+        {
+            hr = m_pNetworkWriter->Post(szReportPath, vReport.data(), static_cast<DWORD>(vReport.size()));
+        }
+        return hr;
+    }
+
+    return S_OK;
+}
+
+/// <summary>
+/// Load the settings of the next record session from KinectV2Recorder.ini in the working directory
+/// </summary>
+void CKinectV2Recorder::LoadRecordSettings()
+{
+    WCHAR szSettingsFile[MAX_PATH];
+    if (!GetFullPathNameW(L"KinectV2Recorder.ini", _countof(szSettingsFile), szSettingsFile, NULL))
+    {
+        return;
+    }
+
+    // Writer backend: "buffered" (default), "unbuffered", "overlapped", "mapped" or "network"
+    WCHAR szWriter[32];
+    GetPrivateProfileStringW(L"Record", L"Writer", L"buffered", szWriter, _countof(szWriter), szSettingsFile);
+    WriterMode nWriterMode = WriterMode_Buffered;
+    if (0 == _wcsicmp(szWriter, L"unbuffered"))
+    {
+        nWriterMode = WriterMode_Unbuffered;
+    }
+    else if (0 == _wcsicmp(szWriter, L"overlapped"))
+    {
+        nWriterMode = WriterMode_Overlapped;
+    }
+    else if (0 == _wcsicmp(szWriter, L"mapped"))
+    {
+        nWriterMode = WriterMode_Mapped;
+    }
+    else if (0 == _wcsicmp(szWriter, L"network"))
+    {
+        nWriterMode = WriterMode_Network;
+    }
+
+    // The network writer streams the frames to the receiver at StreamTo ("host:port"), with up to
+    // StreamWindowMB (default: 64) sent ahead of its acknowledgements. Without a receiver the
+    // frames are written locally.
+    WCHAR szStreamTo[256];
+    GetPrivateProfileStringW(L"Record", L"StreamTo", L"", szStreamTo, _countof(szStreamTo), szSettingsFile);
+    UINT nStreamWindowMB = GetPrivateProfileIntW(L"Record", L"StreamWindowMB", 64, szSettingsFile);
+    nStreamWindowMB = max(1u, min(4096u, nStreamWindowMB));
+    if (WriterMode_Network == nWriterMode && !szStreamTo[0])
+    {
+        nWriterMode = WriterMode_Buffered;
+    }
+
+    // Max number of frame writes in flight
+    m_nQueueDepth = GetPrivateProfileIntW(L"Record", L"QueueDepth", 16, szSettingsFile);
+    m_nQueueDepth = max(1, min(3 * BufferSize, m_nQueueDepth));
+
+    // Expected duration (in seconds) of a session, which is preallocated by the mapped writer
+    UINT nPreallocateSeconds = GetPrivateProfileIntW(L"Record", L"PreallocateSeconds", 60, szSettingsFile);
+    m_nPreallocateFrames = max(1u, min(3600u, nPreallocateSeconds)) * 30;
+
+    // Size (in MB) of the in-memory staging area, 0 writes straight to the save folder
+    UINT nStagingMB = GetPrivateProfileIntW(L"Record", L"StagingMB", 0, szSettingsFile);
+    nStagingMB = min(65536u, nStagingMB);
+    bool bStagingCompress = GetPrivateProfileIntW(L"Record", L"StagingCompress", 0, szSettingsFile) != 0;
+    if (WriterMode_Mapped == nWriterMode || WriterMode_Network == nWriterMode)
+    {
+        nStagingMB = 0;
+    }
+
+    // Compressed frames are migrated through the file cache: NTFS writes compressed files
+    // synchronously and through the cache anyway
+    bStagingCompress = bStagingCompress && nStagingMB;
+    if (bStagingCompress)
+    {
+        nWriterMode = WriterMode_Buffered;
+    }
+
+    // Streams to record separated by ',' (default: all), and for each of them every Nth frame set
+    // (Decimation) or the frame sets closest to a frame rate (Fps, overrides Decimation)
+    WCHAR szStreams[64];
+    GetPrivateProfileStringW(L"Record", L"Streams", L"ir,depth,color", szStreams, _countof(szStreams), szSettingsFile);
+    const WCHAR* szStreamNames[] = { L"ir", L"depth", L"color" };
+    const WCHAR* szDecimationKeys[] = { L"InfraredDecimation", L"DepthDecimation", L"ColorDecimation" };
+    const WCHAR* szFpsKeys[] = { L"InfraredFps", L"DepthFps", L"ColorFps" };
+    const WCHAR* szRoiKeys[] = { L"InfraredRoi", L"DepthRoi", L"ColorRoi" };
+    const WCHAR* szBinningKeys[] = { L"InfraredBinning", L"DepthBinning", L"ColorBinning" };
+    const UINT32 nFullWidths[] = { cInfraredWidth, cDepthWidth, cColorWidth };
+    const UINT32 nFullHeights[] = { cInfraredHeight, cDepthHeight, cColorHeight };
+    bool bStreamOn[3] = { false, false, false };
+    WCHAR* szContext = NULL;
+    for (WCHAR* szToken = wcstok_s(szStreams, L" ,;", &szContext); szToken; szToken = wcstok_s(NULL, L" ,;", &szContext))
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            bStreamOn[i] |= (0 == _wcsicmp(szToken, szStreamNames[i]));
+        }
+    }
+    for (int i = 0; i < 3; ++i)
+    {
+        UINT nDecimation = GetPrivateProfileIntW(L"Record", szDecimationKeys[i], 1, szSettingsFile);
+        UINT nFps = GetPrivateProfileIntW(L"Record", szFpsKeys[i], 0, szSettingsFile);
+        if (nFps)
+        {
+            nFps = min(30u, nFps);
+            nDecimation = (30 + nFps / 2) / nFps;
+        }
+        m_nDecimation[i] = bStreamOn[i] ? max(1u, min(300u, nDecimation)) : 0;
+
+        // Region of interest "x,y,width,height" of the mirrored frame (default: whole frame),
+        // and 2x2 binning of the region (Binning=2)
+        WCHAR szRoi[64];
+        GetPrivateProfileStringW(L"Record", szRoiKeys[i], L"", szRoi, _countof(szRoi), szSettingsFile);
+        UINT nBinning = GetPrivateProfileIntW(L"Record", szBinningKeys[i], 1, szSettingsFile);
+        ParseRecordGeometry(szRoi, nBinning, nFullWidths[i], nFullHeights[i], &m_geometry[i]);
+    }
+
+    // Depth and infrared images packed to 12 or 13 bits (Bits, default: 16 bits as PGM), after a
+    // right shift for infrared (Shift, so that bits + shift <= 16)
+    const WCHAR* szBitsKeys[] = { L"InfraredBits", L"DepthBits" };
+    const WCHAR* szShiftKeys[] = { L"InfraredShift", L"DepthShift" };
+    for (int i = 0; i < 2; ++i)
+    {
+        UINT nBits = GetPrivateProfileIntW(L"Record", szBitsKeys[i], 16, szSettingsFile);
+        UINT nShift = GetPrivateProfileIntW(L"Record", szShiftKeys[i], 0, szSettingsFile);
+        m_packing[i].nBits = (12 == nBits || 13 == nBits) ? nBits : 0;
+        m_packing[i].nShift = m_packing[i].nBits ? min(16 - nBits, nShift) : 0;
+    }
+
+    // Depth images delta coded over time with a keyframe every DepthKeyframeInterval frames
+    // (default: 0, not coded), which bounds the frames a reader decodes to seek
+    m_nKeyframeInterval = min(300u, GetPrivateProfileIntW(L"Record", L"DepthKeyframeInterval", 0, szSettingsFile));
+
+    // Color images encoded by ColorCodec: "none" (default, PPM/BMP), "qoi", "png" or "jpeg" at
+    // ColorQuality (1-100, default: 90), on ColorEncoderThreads threads (default: 4)
+    WCHAR szCodec[32];
+    GetPrivateProfileStringW(L"Record", L"ColorCodec", L"none", szCodec, _countof(szCodec), szSettingsFile);
+    m_colorEncoding.nCodec = ParseColorCodec(szCodec);
+    m_colorEncoding.nQuality = (ColorCodec_Jpeg == m_colorEncoding.nCodec) ? max(1u, min(100u, GetPrivateProfileIntW(L"Record", L"ColorQuality", 90, szSettingsFile))) : 0;
+    UINT nColorEncoderThreads = GetPrivateProfileIntW(L"Record", L"ColorEncoderThreads", 4, szSettingsFile);
+    nColorEncoderThreads = max(1u, min(static_cast<UINT>(ColorEncoderMaxThreads), nColorEncoderThreads));
+
+    // Streams whose static frames are deduplicated separated by ',' (default: none): a frame
+    // which repeats the previous frame that did not, with samples within DedupTolerance (depth:
+    // mm, infrared and color: levels, default: 0) but for DedupChangedPixels per 10000 (default:
+    // 0), is written as a reference to that frame
+    WCHAR szDedupStreams[64];
+    GetPrivateProfileStringW(L"Record", L"DedupStreams", L"", szDedupStreams, _countof(szDedupStreams), szSettingsFile);
+    const WCHAR* szToleranceKeys[] = { L"InfraredDedupTolerance", L"DepthDedupTolerance", L"ColorDedupTolerance" };
+    const UINT32 nMaxTolerances[] = { 65535, 65535, 255 };
+    UINT nChangedSamples = min(10000u, GetPrivateProfileIntW(L"Record", L"DedupChangedPixels", 0, szSettingsFile));
+    m_bDedup[0] = m_bDedup[1] = m_bDedup[2] = false;
+    szContext = NULL;
+    for (WCHAR* szToken = wcstok_s(szDedupStreams, L" ,;", &szContext); szToken; szToken = wcstok_s(NULL, L" ,;", &szContext))
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            m_bDedup[i] |= (0 == _wcsicmp(szToken, szStreamNames[i]));
+        }
+    }
+    for (int i = 0; i < 3; ++i)
+    {
+        m_dedupThreshold[i].nTolerance = min(nMaxTolerances[i], GetPrivateProfileIntW(L"Record", szToleranceKeys[i], 0, szSettingsFile));
+        m_dedupThreshold[i].nChangedSamples = nChangedSamples;
+    }
+
+    // Record roots separated by ';' (default: the working directory), frames are striped over them
+    // round-robin by "frame" (default) or by "stream". Streamed sessions go to the folder of the
+    // receiver, so their paths stay relative.
+    WCHAR szRoots[1024];
+    WCHAR szStripeBy[32];
+    GetPrivateProfileStringW(L"Record", L"Roots", L"", szRoots, _countof(szRoots), szSettingsFile);
+    if (WriterMode_Network == nWriterMode)
+    {
+        szRoots[0] = L'\0';
+    }
+    GetPrivateProfileStringW(L"Record", L"StripeBy", L"frame", szStripeBy, _countof(szStripeBy), szSettingsFile);
+    m_stripeLayout.SetRoots(szRoots, (0 == _wcsicmp(szStripeBy, L"stream")) ? StripeMode_Stream : StripeMode_Frame);
+
+    // The writer is replaced once the previous sessions have drained, so the zero-gap rollover
+    // needs the same writer settings. A staging writer finishes its migration first, a network
+    // writer waits for the receiver to acknowledge the frames in flight.
+    bool bStreamChanged = (WriterMode_Network == nWriterMode) && (0 != wcscmp(szStreamTo, m_szStreamTo) || nStreamWindowMB != m_nStreamWindowMB);
+    m_bWriterChange = nWriterMode != m_nWriterMode || nStagingMB != m_nStagingMB || bStagingCompress != m_bStagingCompress || bStreamChanged || !m_pFrameWriter;
+    m_nNextWriterMode = nWriterMode;
+    m_nNextStagingMB = nStagingMB;
+    m_bNextStagingCompress = bStagingCompress;
+    StringCchCopy(m_szNextStreamTo, _countof(m_szNextStreamTo), szStreamTo);
+    m_nNextStreamWindowMB = nStreamWindowMB;
+
+    // So are the color encoders, which are started by the first session encoding color images
+    m_bEncoderChange = ColorCodec_None != m_colorEncoding.nCodec && WriterMode_Mapped != nWriterMode && nColorEncoderThreads != m_nColorEncoderThreads;
+    m_nNextColorEncoderThreads = nColorEncoderThreads;
+
+    if (m_bWriterChange || m_bEncoderChange)
+    {
+        ReplaceWriter();
+    }
+}
+
+/// <summary>
+/// Replace the writer or the color encoders as requested by LoadRecordSettings if the previous
+/// sessions have been written, otherwise wait for the save thread to report them written
+/// </summary>
+void CKinectV2Recorder::ReplaceWriter()
+{
+    std::lock_guard<std::mutex> lock(m_mWriterMutex);
+    m_bDrainReported = false;
+
+    // The save thread reports again once the frames are written, the UI stays responsive meanwhile
+    StagingStatus status = { 0 };
+    if (m_bWriterChange && m_pStagingWriter)
+    {
+        m_pStagingWriter->GetStagingStatus(&status);
+    }
+    if (m_nPendingFrames > 0 || status.nFrames > 0)
+    {
+        SetStatusMessage(m_bWriterChange ? L" Writing the previous sessions before the writer changes..." : L" Writing the previous sessions before the color encoders change...", 1000, true);
+        return;
+    }
+
+    if (m_bWriterChange)
+    {
+        delete m_pFrameWriter;
+        m_pStagingWriter = NULL;
+        m_pNetworkWriter = NULL;
+        if (WriterMode_Network == m_nNextWriterMode)
+        {
+            m_pNetworkWriter = new NetworkFrameWriter(m_szNextStreamTo, UINT64(m_nNextStreamWindowMB) << 20);
+            m_pFrameWriter = m_pNetworkWriter;
+        }
+        else if (m_bNextStagingCompress)
+        {
+            m_pFrameWriter = new BufferedFrameWriter(true);
+        }
+        else
+        {
+            m_pFrameWriter = FrameWriter::Create(m_nNextWriterMode);
+        }
+        if (m_nNextStagingMB)
+        {
+            m_pStagingWriter = new StagingFrameWriter(m_pFrameWriter, UINT64(m_nNextStagingMB) << 20);
+            m_pFrameWriter = m_pStagingWriter;
+        }
+        m_nWriterMode = m_nNextWriterMode;
+        m_nStagingMB = m_nNextStagingMB;
+        m_bStagingCompress = m_bNextStagingCompress;
+        StringCchCopy(m_szStreamTo, _countof(m_szStreamTo), m_szNextStreamTo);
+        m_nStreamWindowMB = m_nNextStreamWindowMB;
+        m_bWriterChange = false;
+    }
+
+    if (m_bEncoderChange)
+    {
+        delete m_pColorEncoders;
+        m_pColorEncoders = new ColorEncoderPool(m_nNextColorEncoderThreads);
+        m_nColorEncoderThreads = m_nNextColorEncoderThreads;
+        m_bEncoderChange = false;
+    }
+}
+
+/// <summary>
+/// Load the settings of the next shot (or burst of shots)
+/// </summary>
+void CKinectV2Recorder::LoadShotSettings()
+{
+    m_nBurstCount = 1;
+    m_nBurstInterval = 0;
+    m_fMinSharpness = 0.0;
+    m_fMaxMotion = 0.0;
+
+    WCHAR szSettingsFile[MAX_PATH];
+    if (!GetFullPathNameW(L"KinectV2Recorder.ini", _countof(szSettingsFile), szSettingsFile, NULL))
+    {
+        return;
+    }
+
+    // Number of frame sets per press of the shot button and the interval (in ms) between them
+    m_nBurstCount = GetPrivateProfileIntW(L"Shot", L"BurstCount", 1, szSettingsFile);
+    m_nBurstCount = max(1, min(10000, m_nBurstCount));
+    m_nBurstInterval = GetPrivateProfileIntW(L"Shot", L"BurstIntervalMs", 500, szSettingsFile);
+    m_nBurstInterval = min(600000u, m_nBurstInterval);
+
+    // Quality thresholds on the infrared frame (0 = off), frame sets which miss them are skipped
+    WCHAR szValue[32];
+    GetPrivateProfileStringW(L"Shot", L"MinSharpness", L"0", szValue, _countof(szValue), szSettingsFile);
+    m_fMinSharpness = max(0.0, _wtof(szValue));
+    GetPrivateProfileStringW(L"Shot", L"MaxMotion", L"0", szValue, _countof(szValue), szSettingsFile);
+    m_fMaxMotion = max(0.0, _wtof(szValue));
+}
+
+/// <summary>
+/// Load the settings of the live frames and start publishing them
+/// </summary>
+void CKinectV2Recorder::LoadLiveSettings()
+{
+    WCHAR szSettingsFile[MAX_PATH];
+    if (!GetFullPathNameW(L"KinectV2Recorder.ini", _countof(szSettingsFile), szSettingsFile, NULL))
+    {
+        return;
+    }
+
+    // Frames published to shared memory for local readers (Publish=1, default: off) under Name,
+    // in Slots frame slots per stream (default: 4) for the streams separated by ','
+    if (!GetPrivateProfileIntW(L"Live", L"Publish", 0, szSettingsFile))
+    {
+        return;
+    }
+    WCHAR szName[MAX_PATH];
+    WCHAR szStreams[64];
+    GetPrivateProfileStringW(L"Live", L"Name", FramePublisherName, szName, _countof(szName), szSettingsFile);
+    GetPrivateProfileStringW(L"Live", L"Streams", L"ir,depth,color", szStreams, _countof(szStreams), szSettingsFile);
+    UINT nSlots = GetPrivateProfileIntW(L"Live", L"Slots", FramePublisherDefaultSlots, szSettingsFile);
+
+    // The frames are published as they are recorded: mirrored, Big-Endian depth and infrared,
+    // and RGB (BGR with COLOR_BMP) color
+#ifdef COLOR_BMP
+    const RecordPixelFormat nColorFormat = RecordPixelFormat_BGR24;
+#else // COLOR_BMP
+    const RecordPixelFormat nColorFormat = RecordPixelFormat_RGB24;
+#endif // COLOR_BMP
+    const FramePublisherFormat formats[FramePublisherStreams] =
+    {
+        { cInfraredWidth, cInfraredHeight, RecordPixelFormat_Gray16BE, cInfraredWidth * cInfraredHeight * sizeof(UINT16) },
+        { cDepthWidth, cDepthHeight, RecordPixelFormat_Gray16BE, cDepthWidth * cDepthHeight * sizeof(UINT16) },
+        { cColorWidth, cColorHeight, nColorFormat, cColorWidth * cColorHeight * sizeof(RGBTRIPLE) }
+    };
+    const WCHAR* szStreamNames[] = { L"ir", L"depth", L"color" };
+    FramePublisherFormat streams[FramePublisherStreams] = {};
+    WCHAR* szContext = NULL;
+    for (WCHAR* szToken = wcstok_s(szStreams, L" ,;", &szContext); szToken; szToken = wcstok_s(NULL, L" ,;", &szContext))
+    {
+        for (int i = 0; i < FramePublisherStreams; ++i)
+        {
+            if (0 == _wcsicmp(szToken, szStreamNames[i]))
+            {
+                streams[i] = formats[i];
+            }
+        }
+    }
+
+    m_pPublisher = new FramePublisher();
+    HRESULT hr = m_pPublisher->Create(szName, streams, nSlots);
+    if (FAILED(hr))
+    {
+        delete m_pPublisher;
+        m_pPublisher = NULL;
+
+        WCHAR szStatusMessage[MAX_PATH + 64];
+        StringCchPrintf(szStatusMessage, _countof(szStatusMessage), L"Failed to publish the live frames to %s (0x%08x).", szName, hr);
+        SetStatusMessage(szStatusMessage, 10000, true);
+    }
+}
+
+/// <summary>
+/// Load the placement of the pipeline threads and place the capture thread
+/// </summary>
+void CKinectV2Recorder::LoadThreadSettings()
+{
+    WCHAR szSettingsFile[MAX_PATH];
+    if (!GetFullPathNameW(L"KinectV2Recorder.ini", _countof(szSettingsFile), szSettingsFile, NULL))
+    {
+        return;
+    }
+
+    // Cores and priority of each pipeline thread, read once as the threads start. The capture
+    // thread is the main thread, which also draws the frames.
+    m_bThreadsPlaced = LoadThreadPlacement(szSettingsFile);
+    PlaceThread(PipelineThread_Capture);
+}
+
+/// <summary>
+/// Load the [Memory] settings and allocate the frame slots of each stream, on the node of the
+/// threads which fill and write them. The threads are placed first.
+/// </summary>
+void CKinectV2Recorder::CreateFrameSlots()
+{
+    WCHAR szSettingsFile[MAX_PATH];
+    if (!GetFullPathNameW(L"KinectV2Recorder.ini", _countof(szSettingsFile), szSettingsFile, NULL))
+    {
+        szSettingsFile[0] = L'\0';
+    }
+
+    // The capture thread fills the slots and the save thread hands them to the writer, so the
+    // slots go to the node of the capture thread, or of the save thread if the capture thread
+    // may run on any node. Without a placement both run anywhere and the slots stay unplaced.
+    ThreadPlacementReport captureReport;
+    ThreadPlacementReport saveReport;
+    GetThreadPlacementReport(PipelineThread_Capture, &captureReport);
+    GetThreadPlacementReport(PipelineThread_Save, &saveReport);
+    DWORD nNodes = GetNodeCount();
+    DWORD nThreadNode = GetAffinityNode(captureReport.nAffinity);
+    if (FrameSlabAnyNode == nThreadNode)
+    {
+        nThreadNode = GetAffinityNode(saveReport.nAffinity);
+    }
+    if (nNodes < 2)
+    {
+        nThreadNode = FrameSlabAnyNode;
+    }
+
+    // Slots on large pages (LargePages=1, default: on) where the account may lock pages in
+    // memory, and on the node of the threads (auto, default), no node (any) or a given node
+    bool bLargePages = 0 != GetPrivateProfileIntW(L"Memory", L"LargePages", 1, szSettingsFile);
+    const WCHAR* szNodeKeys[] = { L"InfraredNode", L"DepthNode", L"ColorNode" };
+    const DWORD cbFrames[] =
+    {
+        GetFrameSlotSize(256 + cInfraredWidth * cInfraredHeight * sizeof(UINT16)),
+        GetFrameSlotSize(256 + cDepthWidth * cDepthHeight * sizeof(UINT16)),
+        GetFrameSlotSize(256 + cColorWidth * cColorHeight * sizeof(RGBTRIPLE))
+    };
+    BYTE** ppStreamSlots[] = { m_pInfraredSlot, m_pDepthSlot, m_pColorSlot };
+    bool bAllocated = true;
+    for (int nStream = 0; nStream < 3; ++nStream)
+    {
+        WCHAR szNode[16];
+        GetPrivateProfileStringW(L"Memory", szNodeKeys[nStream], L"auto", szNode, _countof(szNode), szSettingsFile);
+        DWORD nNode = nThreadNode;
+        if (0 == _wcsicmp(szNode, L"any"))
+        {
+            nNode = FrameSlabAnyNode;
+        }
+        else if (0 != _wcsicmp(szNode, L"auto"))
+        {
+            nNode = min(static_cast<DWORD>(_wtoi(szNode)), nNodes - 1);
+        }
+
+        // A stream whose slab cannot be allocated in one piece gets its slots one by one, as
+        // they were allocated before the slabs
+        BYTE** ppSlots = ppStreamSlots[nStream];
+        if (SUCCEEDED(m_frameSlabs[nStream].Create(BufferSize, cbFrames[nStream], nNode, bLargePages)))
+        {
+            for (int i = 0; i < BufferSize; ++i)
+            {
+                ppSlots[i] = m_frameSlabs[nStream].GetSlot(i);
+            }
+        }
+        else
+        {
+            for (int i = 0; i < BufferSize; ++i)
+            {
+                ppSlots[i] = AllocateFrameSlot(cbFrames[nStream]);
+                bAllocated = bAllocated && (NULL != ppSlots[i]);
+            }
+        }
+    }
+
+    // Every frame passes through the slots, so without them the sensor is not read at all
+    if (!bAllocated)
+    {
+        SafeRelease(m_pInfraredFrameReader);
+        SafeRelease(m_pDepthFrameReader);
+        SafeRelease(m_pColorFrameReader);
+        SetStatusMessage(L"Failed to allocate the frame slots.", 10000, true);
+        return;
+    }
+
+    for (int i = 0; i < BufferSize; ++i)
+    {
+        // sector aligned storage for infrared pixel data in UINT16 format
+        FormatPGMHeader(m_pInfraredSlot[i], cInfraredWidth, cInfraredHeight, 65535);
+        m_pInfraredUINT16[i] = reinterpret_cast<UINT16*>(m_pInfraredSlot[i] + m_cbInfraredHeader);
+
+        // sector aligned storage for depth pixel data in UINT16 format
+        FormatPGMHeader(m_pDepthSlot[i], cDepthWidth, cDepthHeight, 65535);
+        m_pDepthUINT16[i] = reinterpret_cast<UINT16*>(m_pDepthSlot[i] + m_cbDepthHeader);
+
+        // sector aligned storage for color pixel data in RGB format
+#ifdef COLOR_BMP
+        FormatBMPHeader(m_pColorSlot[i], cColorWidth, cColorHeight, sizeof(RGBTRIPLE)* 8);
+#else
+        FormatPPMHeader(m_pColorSlot[i], cColorWidth, cColorHeight, 255);
+#endif
+        m_pColorRGB[i] = reinterpret_cast<RGBTRIPLE*>(m_pColorSlot[i] + m_cbColorHeader);
+    }
+}
+
+/// <summary>
+/// Create the record files of a mapped record session
+/// </summary>
+/// <param name="pSession">session to record</param>
+/// <returns>indicates success or failure</returns>
+HRESULT CKinectV2Recorder::CreateRecordFiles(RecordSession* pSession)
+{
+    // A record file cannot be split by frame, so each stream stays on one record root
+    WCHAR szSessionFolder[3][MAX_PATH];
+    for (int i = 0; i < 3; ++i)
+    {
+        if (!pSession->nDecimation[i])
+        {
+            continue;
+        }
+        pSession->stripeLayout.GetSessionFolder(pSession->stripeLayout.GetStreamRoot(i), pSession->szSaveFolder, szSessionFolder[i], _countof(szSessionFolder[i]));
+        if (!IsDirectoryExists(szSessionFolder[i]))
+        {
+            CreateFolderTree(szSessionFolder[i]);
+        }
+    }
+
+    // Decimated streams preallocate only the frames they record, streams which are off get no file
+    WCHAR szFilePath[MAX_PATH];
+    HRESULT hr = S_OK;
+    if (pSession->nDecimation[RecordStream_Infrared])
+    {
+        pSession->pRecordFile[RecordStream_Infrared] = new MappedRecordFile();
+        StringCchPrintfW(szFilePath, _countof(szFilePath), L"%s\\ir.kvr", szSessionFolder[RecordStream_Infrared]);
+        hr = pSession->pRecordFile[RecordStream_Infrared]->Create(szFilePath, RecordStream_Infrared, GetGeometryWidth(pSession->geometry[RecordStream_Infrared]), GetGeometryHeight(pSession->geometry[RecordStream_Infrared]), RecordPixelFormat_Gray16BE, pSession->cbFrame[RecordStream_Infrared],
+            max(1u, m_nPreallocateFrames / pSession->nDecimation[RecordStream_Infrared]), &pSession->geometry[RecordStream_Infrared]);
+    }
+
+    if (SUCCEEDED(hr) && pSession->nDecimation[RecordStream_Depth])
+    {
+        pSession->pRecordFile[RecordStream_Depth] = new MappedRecordFile();
+        StringCchPrintfW(szFilePath, _countof(szFilePath), L"%s\\depth.kvr", szSessionFolder[RecordStream_Depth]);
+        hr = pSession->pRecordFile[RecordStream_Depth]->Create(szFilePath, RecordStream_Depth, GetGeometryWidth(pSession->geometry[RecordStream_Depth]), GetGeometryHeight(pSession->geometry[RecordStream_Depth]), RecordPixelFormat_Gray16BE, pSession->cbFrame[RecordStream_Depth],
+            max(1u, m_nPreallocateFrames / pSession->nDecimation[RecordStream_Depth]), &pSession->geometry[RecordStream_Depth]);
+    }
+
+    if (SUCCEEDED(hr) && pSession->nDecimation[RecordStream_Color])
+    {
+        pSession->pRecordFile[RecordStream_Color] = new MappedRecordFile();
+        StringCchPrintfW(szFilePath, _countof(szFilePath), L"%s\\color.kvr", szSessionFolder[RecordStream_Color]);
+#ifdef COLOR_BMP
+        RecordPixelFormat nColorFormat = RecordPixelFormat_BGR24;
+#else
+        RecordPixelFormat nColorFormat = RecordPixelFormat_RGB24;
+#endif
+        hr = pSession->pRecordFile[RecordStream_Color]->Create(szFilePath, RecordStream_Color, GetGeometryWidth(pSession->geometry[RecordStream_Color]), GetGeometryHeight(pSession->geometry[RecordStream_Color]), nColorFormat, pSession->cbFrame[RecordStream_Color],
+            max(1u, m_nPreallocateFrames / pSession->nDecimation[RecordStream_Color]), &pSession->geometry[RecordStream_Color]);
+    }
+
+    return hr;
+}
+
+/// <summary>
+/// Close the record files of a mapped record session
+/// </summary>
+/// <param name="pSession">session which has been stopped</param>
+void CKinectV2Recorder::CloseRecordFiles(RecordSession* pSession)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        if (pSession->pRecordFile[i])
+        {
+            if (FAILED(pSession->pRecordFile[i]->Close()))
+            {
+                ++pSession->nFailedFrames;
+            }
+            delete pSession->pRecordFile[i];
+            pSession->pRecordFile[i] = NULL;
+        }
+    }
+}
+
+/// <summary>
+/// Commit a frame which has been converted into a mapped record file
+/// </summary>
+/// <param name="pSession">session being recorded</param>
+/// <param name="nStream">stream of the frame</param>
+/// <param name="pMapped">destination returned by AcquireFrame, NULL if there was none</param>
+/// <param name="nTime">timestamp of frame</param>
+void CKinectV2Recorder::RecordMappedFrame(RecordSession* pSession, RecordStream nStream, BYTE* pMapped, INT64 nTime)
+{
+    if (!pMapped)
+    {
+        // The file could not grow or be mapped, the frame went to the spare buffer
+        ++pSession->nFailedFrames;
+        return;
+    }
+
+    UINT32 nChecksum = pSession->pRecordFile[nStream]->CommitFrame(nTime - m_nStartTime);
+    pSession->vList[nStream].push_back(nTime - m_nStartTime);
+    pSession->vChecksums[nStream].push_back(nChecksum);
+}
+
+/// <summary>
+/// Format the progress of the stopped sessions which are still being written
+/// </summary>
+/// <param name="szStatus">receives the status</param>
+/// <param name="cchStatus">size (in characters) of szStatus</param>
+/// <returns>true if stopped sessions are still being written</returns>
+bool CKinectV2Recorder::FormatDrainStatus(WCHAR* szStatus, size_t cchStatus)
+{
+    int nSessions = 0;
+    int nFrames = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_mQueueMutex);
+        for (size_t i = 0; i < m_dRecordSessions.size(); ++i)
+        {
+            if (m_dRecordSessions[i]->bStopped)
+            {
+                ++nSessions;
+                nFrames += m_dRecordSessions[i]->nPendingFrames;
+            }
+        }
+    }
+
+    if (!nSessions)
+    {
+        return false;
+    }
+
+    StringCchPrintf(szStatus, cchStatus, L"Draining: %d frames of %d session%s", nFrames, nSessions, (nSessions > 1) ? L"s" : L"");
+    return true;
+}
+
+/// <summary>
+/// Format the work left in the background (draining sessions and staged frames) for the status bar
+/// </summary>
+/// <param name="szStatus">receives the status</param>
+/// <param name="cchStatus">size (in characters) of szStatus</param>
+/// <returns>true if frames are still to be written</returns>
+bool CKinectV2Recorder::FormatBackgroundStatus(WCHAR* szStatus, size_t cchStatus)
+{
+    WCHAR szDrainStatus[128];
+    WCHAR szStagingStatus[128];
+    bool bDraining = FormatDrainStatus(szDrainStatus, _countof(szDrainStatus));
+    bool bStaging = FormatStagingStatus(szStagingStatus, _countof(szStagingStatus));
+
+    szStatus[0] = L'\0';
+    if (bDraining)
+    {
+        StringCchCat(szStatus, cchStatus, szDrainStatus);
+    }
+    if (bStaging)
+    {
+        StringCchCat(szStatus, cchStatus, bDraining ? L"    " : L"");
+        StringCchCat(szStatus, cchStatus, szStagingStatus);
+    }
+    return bDraining || bStaging;
+}
+
+/// <summary>
+/// Format the occupancy of the staging area for the status bar
+/// </summary>
+/// <param name="szStatus">receives the status</param>
+/// <param name="cchStatus">size (in characters) of szStatus</param>
+/// <returns>true if staged frames are waiting for migration</returns>
+bool CKinectV2Recorder::FormatStagingStatus(WCHAR* szStatus, size_t cchStatus)
+{
+    if (!m_pStagingWriter)
+    {
+        return false;
+    }
+
+    StagingStatus status;
+    m_pStagingWriter->GetStagingStatus(&status);
+    if (!status.nFrames)
+    {
+        return false;
+    }
+
+    // Estimate the remaining time from the recent migration rate
+    int nPercent = static_cast<int>(100 * status.cbStaged / max(1ull, status.cbCapacity));
+    double fSeconds = (status.fMigrationRate > 0.0) ? status.cbStaged / status.fMigrationRate : 0.0;
+    StringCchPrintf(szStatus, cchStatus, L"Staging: %u frames, %llu MB (%d%%), ETA %0.0f s", status.nFrames, status.cbStaged >> 20, nPercent, fSeconds);
+    if (status.nFailed)
+    {
+        WCHAR szFailed[32];
+        StringCchPrintf(szFailed, _countof(szFailed), L", %u failed", status.nFailed);
+        StringCchCat(szStatus, cchStatus, szFailed);
+    }
+    return true;
+}
+
+/// <summary>
+/// Format the state of the connection to the receiver for the status bar
+/// </summary>
+/// <param name="szStatus">receives the status</param>
+/// <param name="cchStatus">size (in characters) of szStatus</param>
+/// <returns>true if the frames are streamed</returns>
+bool CKinectV2Recorder::FormatStreamStatus(WCHAR* szStatus, size_t cchStatus)
+{
+    if (!m_pNetworkWriter)
+    {
+        return false;
+    }
+
+    FrameStreamStatus status;
+    m_pNetworkWriter->GetStreamStatus(&status);
+    if (status.bConnected)
+    {
+        StringCchPrintf(szStatus, cchStatus, L"Streaming: %llu MB in flight, receiver backlog %llu MB, latency %0.0f ms", status.cbInFlight >> 20, status.cbBacklog >> 20, status.fMeanLatency * 1000.);
+    }
+    else
+    {
+        StringCchPrintf(szStatus, cchStatus, L"Streaming: not connected to %s", m_szStreamTo);
+    }
+    if (status.nFailed)
+    {
+        WCHAR szFailed[32];
+        StringCchPrintf(szFailed, _countof(szFailed), L", %u failed", status.nFailed);
+        StringCchCat(szStatus, cchStatus, szFailed);
+    }
+    return true;
+}
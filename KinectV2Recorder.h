@@ -10,9 +10,26 @@
 
 #include "resource.h"
 #include "ImageRenderer.h"
+#include "FrameWriter.h"
+#include "RecordFile.h"
+#include "Stripe.h"
+#include "FrameAnalyzer.h"
+#include "FrameRegion.h"
+#include "GrayPacking.h"
+#include "DepthDelta.h"
+#include "ColorEncoder.h"
+#include "FrameDedup.h"
+#include "FramePublisher.h"
+#include "FrameStream.h"
+#include "ThreadPlacement.h"
+#include "FrameSlab.h"
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <vector>
 #include <queue>
+#include <deque>
 #include <fstream>
 
 // InfraredSourceValueMaximum is the highest value that can be returned in the InfraredFrame.
@@ -45,6 +62,97 @@
 /// The BufferSize value specifies the size of buffer when writing image
 #define BufferSize 32
 
+/// The WM_SHOTSAVED message is posted by the shot thread when a shot has been saved
+#define WM_SHOTSAVED (WM_APP + 1)
+
+/// The WM_SESSIONDONE message is posted by the save thread when a stopped session has been written
+/// (lParam: RecordSession*)
+#define WM_SESSIONDONE (WM_APP + 2)
+
+/// The WM_WRITERDRAINED message is posted by the save thread when the previous sessions have been
+/// written, so that the writer or the color encoders can be replaced
+#define WM_WRITERDRAINED (WM_APP + 3)
+
+/// The SessionIndexName value specifies the frame index written to the session folder
+#define SessionIndexName L"index.csv"
+
+/// The SessionGapsName value specifies the list of missing frames written to the session folder
+#define SessionGapsName L"gaps.csv"
+
+/// The SessionReportName value specifies the completion report written to the session folder
+#define SessionReportName L"session.ini"
+
+/// Frame set of a calibration shot, filled by the capture loop and saved by the shot thread
+struct ShotSet
+{
+    UINT16*                 pInfrared;
+    UINT16*                 pDepth;
+    RGBTRIPLE*              pColor;
+    WCHAR                   szName[64];
+};
+
+/// Streams of a record session
+enum RecordStream
+{
+    RecordStream_Infrared = 0,
+    RecordStream_Depth,
+    RecordStream_Color
+};
+
+/// Queues, index and counters of a record session. A stopped session is written in the
+/// background while the next one records.
+struct RecordSession
+{
+    WCHAR                   szSaveFolder[MAX_PATH];
+    StripeLayout            stripeLayout;
+    std::queue<int>         qFrameQueue[3];         // slots of the queued frames of each stream
+    std::queue<INT64>       qTimeQueue[3];
+    std::vector<INT64>      vList[3];               // index: times of the written frames of each stream
+    std::vector<UINT32>     vChecksums[3];          // index: CRC32C of the pixel data of the written frames
+    FrameAnalyzer           analyzer[3];            // timing of the received frames of each stream
+    MappedRecordFile*       pRecordFile[3];         // record files of the mapped writer mode
+    UINT                    nDecimation[3];         // every Nth frame set of each stream is recorded, 0 = stream off
+    RecordGeometry          geometry[3];            // recorded region of each stream
+    DWORD                   cbHeader[3];            // size (in bytes) of the image header of each stream
+    DWORD                   cbFrame[3];             // size (in bytes) of the pixel data of each stream
+    GrayPacking             packing[3];             // packing of the depth and infrared images, none for color
+    UINT                    nKeyframeInterval;      // depth images are delta coded with a keyframe every N frames, 0 = off
+    DepthDeltaEncoder       depthEncoder;           // delta coder of the depth images, used by the save thread
+    ColorEncoding           colorEncoding;          // codec of the color images, ColorCodec_None for PPM/BMP
+    FrameDeduplicator       dedup[3];               // finds the frames repeating the previous one, used by the save thread
+    std::atomic<int>        nPendingFrames;
+    std::atomic<int>        nDroppedFrames;
+    std::atomic<int>        nFailedFrames;
+    StagingTally            staging;                // frames of the session waiting in the staging area
+    ULONGLONG               nStopTime;
+    ULONGLONG               nDoneTime;
+    bool                    bStopped;
+    bool                    bDone;
+    bool                    bSynchronized;
+
+    RecordSession() :
+        nKeyframeInterval(0),
+        nStopTime(0),
+        nDoneTime(0),
+        bStopped(false),
+        bDone(false),
+        bSynchronized(false)
+    {
+        szSaveFolder[0] = L'\0';
+        pRecordFile[0] = pRecordFile[1] = pRecordFile[2] = NULL;
+        nDecimation[0] = nDecimation[1] = nDecimation[2] = 1;
+        ZeroMemory(geometry, sizeof(geometry));
+        ZeroMemory(packing, sizeof(packing));
+        colorEncoding.nCodec = ColorCodec_None;
+        colorEncoding.nQuality = 0;
+        cbHeader[0] = cbHeader[1] = cbHeader[2] = 0;
+        cbFrame[0] = cbFrame[1] = cbFrame[2] = 0;
+        nPendingFrames = 0;
+        nDroppedFrames = 0;
+        nFailedFrames = 0;
+    }
+};
+
 class CKinectV2Recorder
 {
     static const int        cMinTimestampDifferenceForFrameReSync = 30; // The minimum timestamp difference between depth and color (in ms) at which they are considered un-synchronized.
@@ -54,6 +162,9 @@ class CKinectV2Recorder
     static const int        cDepthHeight = 424;
     static const int        cColorWidth = 1920;
     static const int        cColorHeight = 1080;
+    static const UINT_PTR   cMigrationTimerId = 1;
+    static const int        cMaxShotSets = 64;      // max number of shot sets held in memory
+    static const int        cShotSampleStep = 4;    // pixel step of the shot quality metrics
 public:
     /// <summary>
     /// Constructor
@@ -139,15 +250,31 @@ private:
     int                     m_nInfraredIndex;
     int                     m_nDepthIndex;
     int                     m_nColorIndex;
+    FrameSlab               m_frameSlabs[3];        // slots of each RecordStream, on the node of its threads
+    BYTE*                   m_pInfraredSlot[BufferSize];
+    BYTE*                   m_pDepthSlot[BufferSize];
+    BYTE*                   m_pColorSlot[BufferSize];
+    DWORD                   m_cbInfraredHeader;
+    DWORD                   m_cbDepthHeader;
+    DWORD                   m_cbColorHeader;
     UINT16*                 m_pInfraredUINT16[BufferSize];
     UINT16*                 m_pDepthUINT16[BufferSize];
     RGBTRIPLE*              m_pColorRGB[BufferSize];
-    std::queue<UINT16*>     m_qInfraredFrameQueue;
-    std::queue<UINT16*>     m_qDepthFrameQueue;
-    std::queue<RGBTRIPLE*>  m_qColorFrameQueue;
-    std::queue<INT64>       m_qInfraredTimeQueue;
-    std::queue<INT64>       m_qDepthTimeQueue;
-    std::queue<INT64>       m_qColorTimeQueue;
+    UINT16*                 m_pInfraredSpare;
+    UINT16*                 m_pDepthSpare;
+    RGBTRIPLE*              m_pColorSpare;
+    std::mutex              m_mQueueMutex;
+
+    // A slot is busy from being queued until the writer has completed it
+    std::atomic<bool>       m_bInfraredSlotBusy[BufferSize];
+    std::atomic<bool>       m_bDepthSlotBusy[BufferSize];
+    std::atomic<bool>       m_bColorSlotBusy[BufferSize];
+    std::atomic<int>        m_nPendingFrames;
+    RecordSession*          m_pSlotSession[3][BufferSize];
+
+    // Record sessions, the oldest first. Only the last one may be recording, the others drain.
+    RecordSession*          m_pRecordSession;
+    std::deque<RecordSession*> m_dRecordSessions;
 
     // Index
     UINT                    m_nModel2DIndex;
@@ -167,12 +294,65 @@ private:
 
     // Multithreading
     std::thread             m_tSaveThread;
+    std::thread             m_tShotThread;
     bool                    m_bStopThread;
 
-    // Check lists
-    std::vector<INT64>      m_vInfraredList;
-    std::vector<INT64>      m_vDepthList;
-    std::vector<INT64>      m_vColorList;
+    // Shot storage, filled by the capture loop and saved by the shot thread
+    ShotSet*                m_pShotSet;
+    std::queue<ShotSet*>    m_qShotSets;
+    std::vector<ShotSet*>   m_vFreeShotSets;
+    int                     m_nShotSets;
+    std::mutex              m_mShotMutex;
+    std::condition_variable m_cvShot;
+    WCHAR                   m_cShotMessage[2 * MAX_PATH];
+    UINT                    m_nShotSequence;
+
+    // Burst of shots
+    int                     m_nBurstCount;
+    int                     m_nBurstTaken;
+    int                     m_nBurstSkipped;
+    UINT                    m_nBurstInterval;
+    ULONGLONG               m_nNextShotTime;
+    double                  m_fMinSharpness;
+    double                  m_fMaxMotion;
+    std::vector<UINT16>     m_vShotReference;
+
+    // Writer backend
+    WriterMode              m_nWriterMode;
+    FrameWriter*            m_pFrameWriter;
+    int                     m_nQueueDepth;
+    UINT                    m_nPreallocateFrames;
+    UINT                    m_nDecimation[3];       // settings of the next session, see RecordSession
+    RecordGeometry          m_geometry[3];
+    GrayPacking             m_packing[3];
+    UINT                    m_nKeyframeInterval;
+    ColorEncoding           m_colorEncoding;
+    bool                    m_bDedup[3];
+    FrameDedupThreshold     m_dedupThreshold[3];
+    UINT                    m_nColorEncoderThreads;
+    ColorEncoderPool*       m_pColorEncoders;       // encoders of the color images, driven by the save thread
+    UINT                    m_nStagingMB;
+    bool                    m_bStagingCompress;
+    StagingFrameWriter*     m_pStagingWriter;
+    WCHAR                   m_szStreamTo[256];      // receiver of the network writer
+    UINT                    m_nStreamWindowMB;
+    NetworkFrameWriter*     m_pNetworkWriter;
+    std::atomic<bool>       m_bWriterChange;        // the writer is replaced before the next session starts
+    std::atomic<bool>       m_bEncoderChange;       // the color encoders are replaced before the next session starts
+    std::atomic<bool>       m_bDrainReported;       // WM_WRITERDRAINED is on its way to the UI thread
+    WriterMode              m_nNextWriterMode;      // settings of the replacement
+    UINT                    m_nNextStagingMB;
+    bool                    m_bNextStagingCompress;
+    WCHAR                   m_szNextStreamTo[256];
+    UINT                    m_nNextStreamWindowMB;
+    UINT                    m_nNextColorEncoderThreads;
+    bool                    m_bThreadsPlaced;       // the [Threads] settings place some thread
+    StripeLayout            m_stripeLayout;
+    std::mutex              m_mWriterMutex;
+    bool                    m_bClosing;
+
+    // Live frames for local readers
+    FramePublisher*         m_pPublisher;           // NULL if the frames are not published
 
     /// <summary>
     /// Main processing function
@@ -280,17 +460,170 @@ private:
     void                    SaveRecordImages();
 
     /// <summary>
-    /// Save shot images
+    /// Submit the oldest queued frame of a stream to the writer
+    /// </summary>
+    /// <param name="nStream">stream of the frame</param>
+    /// <returns>true if a frame was submitted</returns>
+    bool                    SubmitRecordImage(RecordStream nStream);
+
+    /// <summary>
+    /// Release the slot of a written frame back to the capture side
+    /// </summary>
+    /// <param name="nContext">stream and slot of the frame, as submitted to the writer</param>
+    /// <param name="hr">result of the write</param>
+    void                    ReleaseRecordImage(ULONG_PTR nContext, HRESULT hr);
+
+
+    /// <summary>
+    /// Save shot images, handed over by the capture loop, until the thread is stopped
     /// </summary>
     void                    SaveShotImages();
 
+    /// <summary>
+    /// Get a shot set to fill, unless all of them are waiting to be saved
+    /// </summary>
+    /// <returns>true if m_pShotSet can be filled</returns>
+    bool                    AcquireShotSet();
+
+    /// <summary>
+    /// Measure the quality of an infrared frame for a shot
+    /// </summary>
+    /// <param name="pInfrared">infrared frame (Big-Endian)</param>
+    /// <param name="pfSharpness">receives the mean gradient relative to the mean intensity</param>
+    /// <param name="pfMotion">receives the mean difference to the previous frame relative to the mean intensity</param>
+    void                    MeasureShotQuality(const UINT16* pInfrared, double* pfSharpness, double* pfMotion);
+
+    /// <summary>
+    /// Load the settings of the next shot (or burst of shots)
+    /// </summary>
+    void                    LoadShotSettings();
+
     /// <summary>
     /// Check if we have stored all the necessary images (no frame dropping)
     /// </summary>
-    void                    CheckImages();
+    /// <param name="pSession">session which has been written completely</param>
+    /// <returns>true if every frame set is complete and synchronized</returns>
+    bool                    CheckImages(const RecordSession* pSession);
+
+    /// <summary>
+    /// Check whether a frame of the current session is recorded: its stream has to be on and
+    /// its frame set has to be one of every Nth of the stream
+    /// </summary>
+    /// <param name="nStream">stream of the frame</param>
+    /// <param name="nTime">timestamp of frame</param>
+    /// <returns>true if the frame is recorded</returns>
+    bool                    IsFrameRecorded(RecordStream nStream, INT64 nTime) const;
+
+    /// <summary>
+    /// Format the image header of the recorded frames of a stream
+    /// </summary>
+    /// <param name="nStream">stream of the frames</param>
+    /// <param name="geometry">recorded region of the stream</param>
+    /// <param name="pDest">receives the header, room for 256 bytes</param>
+    /// <returns>size (in bytes) of the header</returns>
+    DWORD                   FormatRecordHeader(RecordStream nStream, const RecordGeometry& geometry, BYTE* pDest) const;
 
     /// <summary>
     /// Reset record parameters
     /// </summary>
     void                    ResetRecordParameters();
+
+    /// <summary>
+    /// Start a record session in the current save folder
+    /// </summary>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 StartRecordSession();
+
+    /// <summary>
+    /// Report the stopped sessions which have been written completely (called by the save thread)
+    /// </summary>
+    void                    FinishRecordSessions();
+
+    /// <summary>
+    /// Write the index, the missing frames and the completion report of a session to its folder on the first record root
+    /// </summary>
+    /// <param name="pSession">session which has been written completely</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 WriteSessionReport(const RecordSession* pSession);
+
+    /// <summary>
+    /// Load the settings of the next record session
+    /// </summary>
+    void                    LoadRecordSettings();
+
+    /// <summary>
+    /// Replace the writer or the color encoders as requested by LoadRecordSettings if the previous
+    /// sessions have been written, otherwise wait for the save thread to report them written
+    /// </summary>
+    void                    ReplaceWriter();
+
+    /// <summary>
+    /// Load the settings of the live frames and start publishing them
+    /// </summary>
+    void                    LoadLiveSettings();
+
+    /// <summary>
+    /// Load the placement of the pipeline threads and place the capture thread
+    /// </summary>
+    void                    LoadThreadSettings();
+
+    /// <summary>
+    /// Load the [Memory] settings and allocate the frame slots of each stream, on the node of the
+    /// threads which fill and write them. The threads are placed first.
+    /// </summary>
+    void                    CreateFrameSlots();
+
+    /// <summary>
+    /// Format the occupancy of the staging area for the status bar
+    /// </summary>
+    /// <param name="szStatus">receives the status</param>
+    /// <param name="cchStatus">size (in characters) of szStatus</param>
+    /// <returns>true if staged frames are waiting for migration</returns>
+    bool                    FormatStagingStatus(WCHAR* szStatus, size_t cchStatus);
+
+    /// <summary>
+    /// Format the state of the connection to the receiver for the status bar
+    /// </summary>
+    /// <param name="szStatus">receives the status</param>
+    /// <param name="cchStatus">size (in characters) of szStatus</param>
+    /// <returns>true if the frames are streamed</returns>
+    bool                    FormatStreamStatus(WCHAR* szStatus, size_t cchStatus);
+
+    /// <summary>
+    /// Format the progress of the stopped sessions which are still being written
+    /// </summary>
+    /// <param name="szStatus">receives the status</param>
+    /// <param name="cchStatus">size (in characters) of szStatus</param>
+    /// <returns>true if stopped sessions are still being written</returns>
+    bool                    FormatDrainStatus(WCHAR* szStatus, size_t cchStatus);
+
+    /// <summary>
+    /// Format the work left in the background (draining sessions and staged frames) for the status bar
+    /// </summary>
+    /// <param name="szStatus">receives the status</param>
+    /// <param name="cchStatus">size (in characters) of szStatus</param>
+    /// <returns>true if frames are still to be written</returns>
+    bool                    FormatBackgroundStatus(WCHAR* szStatus, size_t cchStatus);
+
+    /// <summary>
+    /// Create the record files of a mapped record session
+    /// </summary>
+    /// <param name="pSession">session to record</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 CreateRecordFiles(RecordSession* pSession);
+
+    /// <summary>
+    /// Close the record files of a mapped record session
+    /// </summary>
+    /// <param name="pSession">session which has been stopped</param>
+    void                    CloseRecordFiles(RecordSession* pSession);
+
+    /// <summary>
+    /// Commit a frame which has been converted into a mapped record file
+    /// </summary>
+    /// <param name="pSession">session being recorded</param>
+    /// <param name="nStream">stream of the frame</param>
+    /// <param name="pMapped">destination returned by AcquireFrame, NULL if there was none</param>
+    /// <param name="nTime">timestamp of frame</param>
+    void                    RecordMappedFrame(RecordSession* pSession, RecordStream nStream, BYTE* pMapped, INT64 nTime);
 };
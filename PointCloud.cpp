@@ -0,0 +1,430 @@
+// PointCloud.cpp
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Conversion of depth frames to point clouds through a precomputed table of pixel rays
+
+
+#include "stdafx.h"
+#include <strsafe.h>
+#include <stdio.h>
+#include <malloc.h>
+#include <emmintrin.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "PointCloud.h"
+#include "ReplayReader.h"
+#include "Stripe.h"
+
+/// <summary>
+/// Read the depth intrinsics from the [Depth] section of an ini file, with the keys named
+/// as the fields of CameraIntrinsics in the Kinect SDK (FocalLengthX, ..., RadialDistortionSixthOrder)
+/// </summary>
+/// <param name="szFilePath">ini file</param>
+/// <param name="pIntrinsics">receives the intrinsics</param>
+/// <returns>indicates success or failure</returns>
+HRESULT LoadDepthIntrinsics(LPCWSTR szFilePath, DepthIntrinsics* pIntrinsics)
+{
+    // The profile functions need a full path, otherwise the Windows folder is used
+    WCHAR szIni[MAX_PATH];
+    GetFullPathNameW(szFilePath, _countof(szIni), szIni, NULL);
+
+    const WCHAR* szKeys[] =
+    {
+        L"FocalLengthX", L"FocalLengthY", L"PrincipalPointX", L"PrincipalPointY",
+        L"RadialDistortionSecondOrder", L"RadialDistortionFourthOrder", L"RadialDistortionSixthOrder"
+    };
+    float* pValues[] =
+    {
+        &pIntrinsics->fFocalLengthX, &pIntrinsics->fFocalLengthY, &pIntrinsics->fPrincipalPointX, &pIntrinsics->fPrincipalPointY,
+        &pIntrinsics->fRadialDistortionSecondOrder, &pIntrinsics->fRadialDistortionFourthOrder, &pIntrinsics->fRadialDistortionSixthOrder
+    };
+
+    for (int i = 0; i < _countof(szKeys); ++i)
+    {
+        WCHAR szValue[64];
+        GetPrivateProfileStringW(L"Depth", szKeys[i], L"0", szValue, _countof(szValue), szIni);
+        *pValues[i] = static_cast<float>(_wtof(szValue));
+    }
+
+    if (pIntrinsics->fFocalLengthX <= 0.f || pIntrinsics->fFocalLengthY <= 0.f)
+    {
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+DepthRayTable::DepthRayTable() :
+    m_pRayX(NULL),
+    m_pRayY(NULL)
+{
+}
+
+/// <summary>
+/// Destructor
+/// </summary>
+DepthRayTable::~DepthRayTable()
+{
+    _aligned_free(m_pRayX);
+    _aligned_free(m_pRayY);
+}
+
+/// <summary>
+/// Compute the ray of every pixel of the depth geometry
+/// </summary>
+/// <param name="intrinsics">intrinsics of the depth camera</param>
+/// <returns>indicates success or failure</returns>
+HRESULT DepthRayTable::Build(const DepthIntrinsics& intrinsics)
+{
+    if (!m_pRayX)
+    {
+        m_pRayX = static_cast<float*>(_aligned_malloc(PointCloudWidth * PointCloudHeight * sizeof(float), 16));
+        m_pRayY = static_cast<float*>(_aligned_malloc(PointCloudWidth * PointCloudHeight * sizeof(float), 16));
+    }
+    if (!m_pRayX || !m_pRayY)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    const double k2 = intrinsics.fRadialDistortionSecondOrder;
+    const double k4 = intrinsics.fRadialDistortionFourthOrder;
+    const double k6 = intrinsics.fRadialDistortionSixthOrder;
+    for (int v = 0; v < PointCloudHeight; ++v)
+    {
+        for (int u = 0; u < PointCloudWidth; ++u)
+        {
+            // Invert the radial distortion by fixed point iteration, which converges within a
+            // few steps for the small distortion of the depth camera
+            double xd = (u - intrinsics.fPrincipalPointX) / intrinsics.fFocalLengthX;
+            double yd = (v - intrinsics.fPrincipalPointY) / intrinsics.fFocalLengthY;
+            double x = xd;
+            double y = yd;
+            for (int i = 0; i < 20; ++i)
+            {
+                double r2 = x * x + y * y;
+                double fFactor = 1. + r2 * (k2 + r2 * (k4 + r2 * k6));
+                x = xd / fFactor;
+                y = yd / fFactor;
+            }
+
+            m_pRayX[v * PointCloudWidth + u] = static_cast<float>(x);
+            m_pRayY[v * PointCloudWidth + u] = static_cast<float>(y);
+        }
+    }
+
+    return S_OK;
+}
+
+/// <summary>
+/// Convert a depth frame to the points of its valid (non-zero) pixels
+/// </summary>
+/// <param name="pDepth">depth frame in millimeters</param>
+/// <param name="pInfrared">infrared frame of the same time, NULL for points without intensity</param>
+/// <param name="bBigEndian">whether the frames are big-endian (as stored in PGM and record files)</param>
+/// <param name="pPoints">receives the points, room for PointCloudWidth * PointCloudHeight points</param>
+/// <returns>number of points</returns>
+UINT32 DepthRayTable::Convert(const UINT16* pDepth, const UINT16* pInfrared, bool bBigEndian, BYTE* pPoints) const
+{
+    const __m128 fMillimeter = _mm_set1_ps(0.001f);
+    const __m128i nZero = _mm_setzero_si128();
+    const UINT32 cbPoint = GetPointSize(NULL != pInfrared);
+
+    __m128 x[2];
+    __m128 y[2];
+    __m128 z[2];
+    __m128i nDepth;
+    const float* pX = reinterpret_cast<const float*>(x);
+    const float* pY = reinterpret_cast<const float*>(y);
+    const float* pZ = reinterpret_cast<const float*>(z);
+    const UINT16* pValid = reinterpret_cast<const UINT16*>(&nDepth);
+
+    BYTE* pPoint = pPoints;
+    for (UINT32 i = 0; i < PointCloudWidth * PointCloudHeight; i += 8)
+    {
+        nDepth = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pDepth + i));
+        if (bBigEndian)
+        {
+            nDepth = _mm_or_si128(_mm_slli_epi16(nDepth, 8), _mm_srli_epi16(nDepth, 8));
+        }
+
+        // Runs of invalid pixels (out of range or background) are skipped at once
+        if (0xFFFF == _mm_movemask_epi8(_mm_cmpeq_epi16(nDepth, nZero)))
+        {
+            continue;
+        }
+
+        // 8 pixels per step: depth to meters, then one multiply with the ray per coordinate
+        z[0] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(nDepth, nZero)), fMillimeter);
+        z[1] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(nDepth, nZero)), fMillimeter);
+        x[0] = _mm_mul_ps(_mm_load_ps(m_pRayX + i), z[0]);
+        x[1] = _mm_mul_ps(_mm_load_ps(m_pRayX + i + 4), z[1]);
+        y[0] = _mm_mul_ps(_mm_load_ps(m_pRayY + i), z[0]);
+        y[1] = _mm_mul_ps(_mm_load_ps(m_pRayY + i + 4), z[1]);
+
+        for (int k = 0; k < 8; ++k)
+        {
+            if (!pValid[k])
+            {
+                continue;
+            }
+
+            float fPoint[3] = { pX[k], pY[k], pZ[k] };
+            memcpy(pPoint, fPoint, sizeof(fPoint));
+            if (pInfrared)
+            {
+                UINT16 nIntensity = pInfrared[i + k];
+                if (bBigEndian)
+                {
+                    nIntensity = _byteswap_ushort(nIntensity);
+                }
+                memcpy(pPoint + sizeof(fPoint), &nIntensity, sizeof(nIntensity));
+            }
+            pPoint += cbPoint;
+        }
+    }
+
+    return static_cast<UINT32>((pPoint - pPoints) / cbPoint);
+}
+
+/// <summary>
+/// Write points to a binary PLY file
+/// </summary>
+/// <param name="szFilePath">full file path of the PLY file</param>
+/// <param name="pPoints">points as returned by DepthRayTable::Convert</param>
+/// <param name="nPoints">number of points</param>
+/// <param name="bInfrared">whether the points hold the infrared intensity</param>
+/// <returns>indicates success or failure</returns>
+HRESULT WritePointCloud(LPCWSTR szFilePath, const BYTE* pPoints, UINT32 nPoints, bool bInfrared)
+{
+    CHAR szHeader[256];
+    int cbHeader = sprintf_s(szHeader, "ply\nformat binary_little_endian 1.0\nelement vertex %u\nproperty float x\nproperty float y\nproperty float z\n%send_header\n",
+        nPoints, bInfrared ? "property ushort intensity\n" : "");
+
+    HANDLE hFile = CreateFileW(szFilePath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (INVALID_HANDLE_VALUE == hFile)
+    {
+        return E_ACCESSDENIED;
+    }
+
+    DWORD cbPoints = nPoints * DepthRayTable::GetPointSize(bInfrared);
+    DWORD dwBytesWritten = 0;
+    BOOL bWritten = WriteFile(hFile, szHeader, cbHeader, &dwBytesWritten, NULL) &&
+        WriteFile(hFile, pPoints, cbPoints, &dwBytesWritten, NULL) && dwBytesWritten == cbPoints;
+    CloseHandle(hFile);
+
+    return bWritten ? S_OK : E_FAIL;
+}
+
+namespace
+{
+    /// Depth (and infrared) frame waiting for conversion
+    struct PointCloudJob
+    {
+        std::vector<UINT16> vDepth;
+        std::vector<UINT16> vInfrared;
+        INT64               nTime;
+        bool                bBigEndian;
+    };
+
+    /// Export of a session, shared by the reading thread and the workers
+    struct PointCloudExport
+    {
+        DepthRayTable       rayTable;
+        std::wstring        sDestinationFolder;
+        bool                bInfrared;
+        std::deque<PointCloudJob*> qJobs;
+        std::vector<PointCloudJob*> vFreeJobs;
+        bool                bDone;
+        std::mutex          mMutex;
+        std::condition_variable cvJobs;
+        std::condition_variable cvFreeJobs;
+        std::atomic<ULONGLONG> nPoints;
+        std::atomic<ULONGLONG> cbWritten;
+        std::atomic<int>    nFailed;
+    };
+
+    /// <summary>
+    /// Convert and write queued frames until the reading thread is done
+    /// </summary>
+    /// <param name="pExport">export to work on</param>
+    void ExportPointClouds(PointCloudExport* pExport)
+    {
+        std::vector<BYTE> vPoints(PointCloudWidth * PointCloudHeight * DepthRayTable::GetPointSize(pExport->bInfrared));
+
+        for (;;)
+        {
+            PointCloudJob* pJob = NULL;
+            {
+                std::unique_lock<std::mutex> lock(pExport->mMutex);
+                while (pExport->qJobs.empty() && !pExport->bDone)
+                {
+                    pExport->cvJobs.wait(lock);
+                }
+                if (pExport->qJobs.empty())
+                {
+                    break;
+                }
+                pJob = pExport->qJobs.front();
+                pExport->qJobs.pop_front();
+            }
+
+            UINT32 nPoints = pExport->rayTable.Convert(pJob->vDepth.data(), pExport->bInfrared ? pJob->vInfrared.data() : NULL, pJob->bBigEndian, vPoints.data());
+
+            WCHAR szFilePath[MAX_PATH];
+            StringCchPrintfW(szFilePath, _countof(szFilePath), L"%s\\%011.6f.ply", pExport->sDestinationFolder.c_str(), pJob->nTime / 10000000.);
+            if (FAILED(WritePointCloud(szFilePath, vPoints.data(), nPoints, pExport->bInfrared)))
+            {
+                ++pExport->nFailed;
+            }
+            pExport->nPoints += nPoints;
+            pExport->cbWritten += nPoints * DepthRayTable::GetPointSize(pExport->bInfrared);
+
+            std::lock_guard<std::mutex> lock(pExport->mMutex);
+            pExport->vFreeJobs.push_back(pJob);
+            pExport->cvFreeJobs.notify_one();
+        }
+    }
+}
+
+/// <summary>
+/// Export the depth frames of a recorded session as point clouds
+/// </summary>
+/// <param name="argc">number of arguments</param>
+/// <param name="argv">session folder, destination folder, intrinsics file, (optional) number of workers and /ir</param>
+/// <returns>0 on success, otherwise failure</returns>
+int RunPointCloud(int argc, LPWSTR* argv)
+{
+    if (argc < 3)
+    {
+        wprintf(L"Usage: KinectV2Recorder /pointcloud <session> <destination> <intrinsics.ini> [workers] [/ir]\n");
+        return 1;
+    }
+
+    PointCloudExport pointCloudExport;
+    pointCloudExport.sDestinationFolder = argv[1];
+    pointCloudExport.bInfrared = false;
+    pointCloudExport.bDone = false;
+    pointCloudExport.nPoints = 0;
+    pointCloudExport.cbWritten = 0;
+    pointCloudExport.nFailed = 0;
+
+    int nWorkers = max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    for (int i = 3; i < argc; ++i)
+    {
+        if (0 == _wcsicmp(argv[i], L"/ir"))
+        {
+            pointCloudExport.bInfrared = true;
+        }
+        else
+        {
+            nWorkers = max(1, _wtoi(argv[i]));
+        }
+    }
+
+    DepthIntrinsics intrinsics;
+    if (FAILED(LoadDepthIntrinsics(argv[2], &intrinsics)) || FAILED(pointCloudExport.rayTable.Build(intrinsics)))
+    {
+        wprintf(L"No depth intrinsics in %s\n", argv[2]);
+        return 1;
+    }
+
+    ReplayReader reader;
+    DWORD dwStreams = ReplayStream_Depth | (pointCloudExport.bInfrared ? ReplayStream_Infrared : 0);
+    if (FAILED(reader.Open(argv[0], ReplayPrefetchDepth, dwStreams)) || dwStreams != reader.GetStreams() || FAILED(CreateFolderTree(argv[1])))
+    {
+        wprintf(L"Failed to open %s\n", argv[0]);
+        return 1;
+    }
+
+    // A few frames per worker are queued, which bounds the memory of the export
+    std::vector<PointCloudJob> vJobs(2 * nWorkers);
+    for (size_t i = 0; i < vJobs.size(); ++i)
+    {
+        vJobs[i].vDepth.resize(PointCloudWidth * PointCloudHeight);
+        vJobs[i].vInfrared.resize(PointCloudWidth * PointCloudHeight);
+        pointCloudExport.vFreeJobs.push_back(&vJobs[i]);
+    }
+
+    std::vector<std::thread> vWorkers;
+    for (int i = 0; i < nWorkers; ++i)
+    {
+        vWorkers.push_back(std::thread(ExportPointClouds, &pointCloudExport));
+    }
+
+    ULONGLONG nStart = GetTickCount64();
+    UINT32 nFrames = 0;
+    HRESULT hr = S_OK;
+    ReplayFrameSet frameSet;
+    while (S_OK == (hr = reader.Next(&frameSet)))
+    {
+        const ReplayFrame& depth = frameSet.frames[1];  // infrared, depth, color
+        const ReplayFrame& infrared = frameSet.frames[0];
+
+        // Frame sets of decimated streams or with a dropped frame lack some of the frames
+        if (!depth.pData || (pointCloudExport.bInfrared && !infrared.pData))
+        {
+            continue;
+        }
+        if (depth.nWidth != PointCloudWidth || depth.nHeight != PointCloudHeight || depth.cbData != PointCloudWidth * PointCloudHeight * sizeof(UINT16) ||
+            (pointCloudExport.bInfrared && infrared.cbData != depth.cbData))
+        {
+            hr = E_FAIL;
+            break;
+        }
+
+        PointCloudJob* pJob = NULL;
+        {
+            std::unique_lock<std::mutex> lock(pointCloudExport.mMutex);
+            while (pointCloudExport.vFreeJobs.empty())
+            {
+                pointCloudExport.cvFreeJobs.wait(lock);
+            }
+            pJob = pointCloudExport.vFreeJobs.back();
+            pointCloudExport.vFreeJobs.pop_back();
+        }
+
+        // The views of the reader are only valid until the next frame set
+        memcpy(pJob->vDepth.data(), depth.pData, depth.cbData);
+        if (pointCloudExport.bInfrared)
+        {
+            memcpy(pJob->vInfrared.data(), infrared.pData, infrared.cbData);
+        }
+        pJob->nTime = depth.nTime;
+        pJob->bBigEndian = (RecordPixelFormat_Gray16BE == depth.nPixelFormat);
+        ++nFrames;
+
+        std::lock_guard<std::mutex> lock(pointCloudExport.mMutex);
+        pointCloudExport.qJobs.push_back(pJob);
+        pointCloudExport.cvJobs.notify_one();
+    }
+    reader.Close();
+
+    {
+        std::lock_guard<std::mutex> lock(pointCloudExport.mMutex);
+        pointCloudExport.bDone = true;
+    }
+    pointCloudExport.cvJobs.notify_all();
+    for (size_t i = 0; i < vWorkers.size(); ++i)
+    {
+        vWorkers[i].join();
+    }
+
+    double fElapsed = max(1ull, GetTickCount64() - nStart) / 1000.;
+    wprintf(L"%u point clouds (%.0f points each, %.1f MB) in %.2f s with %d workers: %.1f fps\n", nFrames,
+        nFrames ? double(pointCloudExport.nPoints) / nFrames : 0., pointCloudExport.cbWritten / (1024. * 1024.), fElapsed, nWorkers, nFrames / fElapsed);
+
+    if (FAILED(hr) || pointCloudExport.nFailed > 0)
+    {
+        wprintf(L"Failed to export %d point clouds (0x%08x)\n", pointCloudExport.nFailed.load(), FAILED(hr) ? hr : S_OK);
+        return 1;
+    }
+    return 0;
+}
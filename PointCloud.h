@@ -0,0 +1,106 @@
+// PointCloud.h
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Conversion of depth frames to point clouds through a precomputed table of pixel rays
+
+
+#pragma once
+
+#include <windows.h>
+
+/// The PointCloudWidth and PointCloudHeight values specify the depth geometry of the table
+#define PointCloudWidth 512
+#define PointCloudHeight 424
+
+/// Intrinsics of the depth camera (in pixels) in the model of the Kinect SDK, which has
+/// radial distortion only
+struct DepthIntrinsics
+{
+    float                   fFocalLengthX;
+    float                   fFocalLengthY;
+    float                   fPrincipalPointX;
+    float                   fPrincipalPointY;
+    float                   fRadialDistortionSecondOrder;
+    float                   fRadialDistortionFourthOrder;
+    float                   fRadialDistortionSixthOrder;
+};
+
+/// <summary>
+/// Read the depth intrinsics from the [Depth] section of an ini file, with the keys named
+/// as the fields of CameraIntrinsics in the Kinect SDK (FocalLengthX, ..., RadialDistortionSixthOrder)
+/// </summary>
+/// <param name="szFilePath">ini file</param>
+/// <param name="pIntrinsics">receives the intrinsics</param>
+/// <returns>indicates success or failure</returns>
+HRESULT LoadDepthIntrinsics(LPCWSTR szFilePath, DepthIntrinsics* pIntrinsics);
+
+/// Turns depth frames into points (x, y, z in meters, optionally followed by the infrared
+/// intensity) with one multiply per coordinate. The ray of each pixel, undistorted and
+/// divided by the focal length, is computed once when the table is built.
+class DepthRayTable
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    DepthRayTable();
+
+    /// <summary>
+    /// Destructor
+    /// </summary>
+    ~DepthRayTable();
+
+    /// <summary>
+    /// Compute the ray of every pixel of the depth geometry
+    /// </summary>
+    /// <param name="intrinsics">intrinsics of the depth camera</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 Build(const DepthIntrinsics& intrinsics);
+
+    /// <summary>
+    /// Get the size of a point
+    /// </summary>
+    /// <param name="bInfrared">whether the points hold the infrared intensity</param>
+    /// <returns>size (in bytes) of a point: 3 floats, plus a UINT16 with infrared</returns>
+    static UINT32           GetPointSize(bool bInfrared) { return 3 * sizeof(float) + (bInfrared ? sizeof(UINT16) : 0); }
+
+    /// <summary>
+    /// Convert a depth frame to the points of its valid (non-zero) pixels
+    /// </summary>
+    /// <param name="pDepth">depth frame in millimeters</param>
+    /// <param name="pInfrared">infrared frame of the same time, NULL for points without intensity</param>
+    /// <param name="bBigEndian">whether the frames are big-endian (as stored in PGM and record files)</param>
+    /// <param name="pPoints">receives the points, room for PointCloudWidth * PointCloudHeight points</param>
+    /// <returns>number of points</returns>
+    UINT32                  Convert(const UINT16* pDepth, const UINT16* pInfrared, bool bBigEndian, BYTE* pPoints) const;
+
+    /// <summary>
+    /// Get the rays of the pixels, row by row
+    /// </summary>
+    /// <returns>x (or y) of the ray of each pixel at a depth of 1, NULL before the table is built</returns>
+    const float*            GetRayX() const { return m_pRayX; }
+    const float*            GetRayY() const { return m_pRayY; }
+
+private:
+    float*                  m_pRayX;
+    float*                  m_pRayY;
+};
+
+/// <summary>
+/// Write points to a binary PLY file
+/// </summary>
+/// <param name="szFilePath">full file path of the PLY file</param>
+/// <param name="pPoints">points as returned by DepthRayTable::Convert</param>
+/// <param name="nPoints">number of points</param>
+/// <param name="bInfrared">whether the points hold the infrared intensity</param>
+/// <returns>indicates success or failure</returns>
+HRESULT WritePointCloud(LPCWSTR szFilePath, const BYTE* pPoints, UINT32 nPoints, bool bInfrared);
+
+/// <summary>
+/// Export the depth frames of a recorded session as point clouds
+/// </summary>
+/// <param name="argc">number of arguments</param>
+/// <param name="argv">session folder, destination folder, intrinsics file, (optional) number of workers and /ir</param>
+/// <returns>0 on success, otherwise failure</returns>
+int RunPointCloud(int argc, LPWSTR* argv);
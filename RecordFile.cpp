@@ -0,0 +1,417 @@
+// RecordFile.cpp
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Record files: one preallocated file per stream holding fixed size frame records
+
+
+#include "stdafx.h"
+#include <string.h>
+#include "RecordFile.h"
+#include "Crc32c.h"
+#include "ThreadPlacement.h"
+
+/// <summary>
+/// Constructor
+/// </summary>
+MappedRecordFile::MappedRecordFile() :
+    m_hFile(INVALID_HANDLE_VALUE),
+    m_hMapping(NULL),
+    m_pView(NULL),
+    m_nViewOffset(0),
+    m_cbView(0),
+    m_nMappingCapacity(0),
+    m_nCapacity(0),
+    m_nCommitted(0),
+    m_nGrowFrames(0),
+    m_bStop(false)
+{
+    ZeroMemory(&m_header, sizeof(m_header));
+}
+
+/// <summary>
+/// Destructor, closes the file
+/// </summary>
+MappedRecordFile::~MappedRecordFile()
+{
+    Close();
+}
+
+/// <summary>
+/// Create and preallocate a record file
+/// </summary>
+/// <param name="lpszFilePath">full file path of the record file</param>
+/// <param name="nStream">stream of the frames</param>
+/// <param name="nWidth">width (in pixels) of a frame</param>
+/// <param name="nHeight">height (in pixels) of a frame</param>
+/// <param name="nPixelFormat">pixel format of a frame</param>
+/// <param name="cbFrame">size (in bytes) of the pixel data of a frame</param>
+/// <param name="nPreallocateFrames">number of frames to preallocate</param>
+/// <param name="pGeometry">recorded region of the sensor frame, NULL if unknown</param>
+/// <returns>indicates success or failure</returns>
+HRESULT MappedRecordFile::Create(LPCWSTR lpszFilePath, UINT32 nStream, UINT32 nWidth, UINT32 nHeight, RecordPixelFormat nPixelFormat, UINT32 cbFrame, UINT32 nPreallocateFrames, const RecordGeometry* pGeometry)
+{
+    Close();
+
+    ZeroMemory(&m_header, sizeof(m_header));
+    memcpy(m_header.szMagic, "KV2REC", 6);
+    m_header.nVersion = RecordFileVersion;
+    m_header.nStream = nStream;
+    m_header.nWidth = nWidth;
+    m_header.nHeight = nHeight;
+    m_header.nPixelFormat = nPixelFormat;
+    m_header.cbFrame = cbFrame;
+    m_header.cbRecord = GetRecordSize(cbFrame);
+    m_header.nFrames = 0;
+    if (pGeometry)
+    {
+        m_header.geometry = *pGeometry;
+    }
+
+    m_hFile = CreateFileW(lpszFilePath, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (INVALID_HANDLE_VALUE == m_hFile)
+    {
+        return E_ACCESSDENIED;
+    }
+
+    // Write the header of an empty file first, so an interrupted record is still readable
+    BYTE header[RecordFileHeaderSize] = { 0 };
+    memcpy(header, &m_header, sizeof(m_header));
+    DWORD dwBytesWritten = 0;
+    if (!WriteFile(m_hFile, header, sizeof(header), &dwBytesWritten, NULL))
+    {
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+        return E_FAIL;
+    }
+
+    m_nCapacity = 0;
+    m_nCommitted = 0;
+    m_nGrowFrames = max(1u, nPreallocateFrames);
+    HRESULT hr = Resize(m_nGrowFrames);
+    if (SUCCEEDED(hr))
+    {
+        hr = MapWindow(0);
+    }
+
+    if (FAILED(hr))
+    {
+        Unmap();
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+        return hr;
+    }
+
+    m_bStop = false;
+    m_tPreparer = std::thread(&MappedRecordFile::PrepareFrames, this);
+    return hr;
+}
+
+/// <summary>
+/// Get the destination of the pixel data of the next frame
+/// </summary>
+/// <returns>pointer into the mapped file, NULL on failure</returns>
+BYTE* MappedRecordFile::AcquireFrame()
+{
+    if (INVALID_HANDLE_VALUE == m_hFile)
+    {
+        return NULL;
+    }
+
+    UINT32 nFrame = m_header.nFrames;
+
+    // The preparer grows the file ahead of the frames, growing here only catches up with it
+    if (nFrame >= m_nCapacity)
+    {
+        std::lock_guard<std::mutex> lock(m_mMutex);
+        if (nFrame >= m_nCapacity && FAILED(Resize(m_nCapacity + m_nGrowFrames)))
+        {
+            return NULL;
+        }
+    }
+
+    ULONGLONG nOffset = RecordFileHeaderSize + ULONGLONG(nFrame) * m_header.cbRecord;
+    if (!m_pView || nOffset < m_nViewOffset || nOffset + m_header.cbRecord > m_nViewOffset + m_cbView)
+    {
+        if (FAILED(MapWindow(nFrame)))
+        {
+            return NULL;
+        }
+    }
+
+    return m_pView + (nOffset - m_nViewOffset) + sizeof(RecordFrameHeader);
+}
+
+/// <summary>
+/// Complete the frame returned by AcquireFrame
+/// </summary>
+/// <param name="nTime">time of the frame relative to the record start</param>
+/// <returns>CRC32C of the pixel data of the frame</returns>
+UINT32 MappedRecordFile::CommitFrame(INT64 nTime)
+{
+    if (!m_pView)
+    {
+        return 0;
+    }
+
+    ULONGLONG nOffset = RecordFileHeaderSize + ULONGLONG(m_header.nFrames) * m_header.cbRecord;
+    RecordFrameHeader* pFrameHeader = reinterpret_cast<RecordFrameHeader*>(m_pView + (nOffset - m_nViewOffset));
+    ZeroMemory(pFrameHeader, sizeof(RecordFrameHeader));
+    pFrameHeader->nTime = nTime;
+    pFrameHeader->nIndex = m_header.nFrames;
+    pFrameHeader->cbData = m_header.cbFrame;
+    pFrameHeader->nChecksum = ComputeCrc32c(pFrameHeader + 1, m_header.cbFrame);
+
+    ++m_header.nFrames;
+    m_nCommitted = m_header.nFrames;
+    m_cvCommitted.notify_one();
+    return pFrameHeader->nChecksum;
+}
+
+/// <summary>
+/// Unmap the file, store the number of frames and cut off the unused preallocation
+/// </summary>
+/// <returns>indicates success or failure</returns>
+HRESULT MappedRecordFile::Close()
+{
+    if (INVALID_HANDLE_VALUE == m_hFile)
+    {
+        return S_OK;
+    }
+
+    StopPreparer();
+    Unmap();
+    HRESULT hr = Resize(m_header.nFrames);
+
+    BYTE header[RecordFileHeaderSize] = { 0 };
+    memcpy(header, &m_header, sizeof(m_header));
+    LARGE_INTEGER nBegin = { 0 };
+    DWORD dwBytesWritten = 0;
+    if (!SetFilePointerEx(m_hFile, nBegin, NULL, FILE_BEGIN) || !WriteFile(m_hFile, header, sizeof(header), &dwBytesWritten, NULL))
+    {
+        hr = E_FAIL;
+    }
+
+    CloseHandle(m_hFile);
+    m_hFile = INVALID_HANDLE_VALUE;
+    m_nCapacity = 0;
+    return hr;
+}
+
+/// <summary>
+/// Set the size of the file to hold the given number of frames
+/// </summary>
+/// <param name="nFrames">number of frames</param>
+/// <returns>indicates success or failure</returns>
+HRESULT MappedRecordFile::Resize(UINT32 nFrames)
+{
+    // A file can grow while it is mapped, but not shrink below a mapped view
+    if (nFrames < m_nCapacity)
+    {
+        Unmap();
+    }
+
+    LARGE_INTEGER cbFile;
+    cbFile.QuadPart = RecordFileHeaderSize + LONGLONG(nFrames) * m_header.cbRecord;
+
+    // Reserve the clusters in one go, which keeps the file contiguous
+    FILE_ALLOCATION_INFO allocationInfo;
+    allocationInfo.AllocationSize = cbFile;
+    SetFileInformationByHandle(m_hFile, FileAllocationInfo, &allocationInfo, sizeof(allocationInfo));
+
+    FILE_END_OF_FILE_INFO eofInfo;
+    eofInfo.EndOfFile = cbFile;
+    if (!SetFileInformationByHandle(m_hFile, FileEndOfFileInfo, &eofInfo, sizeof(eofInfo)))
+    {
+        return E_FAIL;
+    }
+
+    // The new space is left beyond the valid data of the file: its pages fault in as zeros
+    // without reading the disk, where valid but unwritten clusters would be read first
+
+    m_nCapacity = nFrames;
+    return S_OK;
+}
+
+/// <summary>
+/// Map the window which starts with the given frame
+/// </summary>
+/// <param name="nFrame">index of the frame</param>
+/// <returns>indicates success or failure</returns>
+HRESULT MappedRecordFile::MapWindow(UINT32 nFrame)
+{
+    static DWORD dwGranularity = 0;
+    if (!dwGranularity)
+    {
+        SYSTEM_INFO systemInfo;
+        GetSystemInfo(&systemInfo);
+        dwGranularity = systemInfo.dwAllocationGranularity;
+    }
+
+    if (m_pView)
+    {
+        UnmapViewOfFile(m_pView);
+        m_pView = NULL;
+    }
+
+    // A mapping covers the file as it was when created, so the grown file needs a new one
+    UINT32 nCapacity = m_nCapacity;
+    UINT32 nEndFrame = min(nFrame + RecordFileWindowFrames, nCapacity);
+    if (m_hMapping && nEndFrame > m_nMappingCapacity)
+    {
+        CloseHandle(m_hMapping);
+        m_hMapping = NULL;
+    }
+
+    if (!m_hMapping)
+    {
+        m_hMapping = CreateFileMappingW(m_hFile, NULL, PAGE_READWRITE, 0, 0, NULL);
+        if (!m_hMapping)
+        {
+            return E_FAIL;
+        }
+        m_nMappingCapacity = nCapacity;
+    }
+
+    // Views have to start at a multiple of the allocation granularity
+    ULONGLONG nStart = RecordFileHeaderSize + ULONGLONG(nFrame) * m_header.cbRecord;
+    ULONGLONG nEnd = RecordFileHeaderSize + ULONGLONG(nEndFrame) * m_header.cbRecord;
+    m_nViewOffset = nStart - nStart % dwGranularity;
+    m_cbView = nEnd - m_nViewOffset;
+
+    m_pView = reinterpret_cast<BYTE*>(MapViewOfFile(m_hMapping, FILE_MAP_WRITE, DWORD(m_nViewOffset >> 32), DWORD(m_nViewOffset), SIZE_T(m_cbView)));
+    return m_pView ? S_OK : E_FAIL;
+}
+
+/// <summary>
+/// Unmap the current window and close the mapping
+/// </summary>
+void MappedRecordFile::Unmap()
+{
+    if (m_pView)
+    {
+        UnmapViewOfFile(m_pView);
+        m_pView = NULL;
+    }
+
+    if (m_hMapping)
+    {
+        CloseHandle(m_hMapping);
+        m_hMapping = NULL;
+    }
+
+    m_nViewOffset = 0;
+    m_cbView = 0;
+    m_nMappingCapacity = 0;
+}
+
+/// <summary>
+/// Keep the file grown and the records behind the last committed one faulted in, until
+/// the file is closed
+/// </summary>
+void MappedRecordFile::PrepareFrames()
+{
+    // The preparer serves the thread which writes the frames, growing the file and taking
+    // the page faults of the records before it reaches them
+    HRESULT hrPlaced = PlaceThread(PipelineThread_Save);
+
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+
+    HANDLE hMapping = NULL;
+    UINT32 nMappingCapacity = 0;
+    UINT32 nPrepared = 0;
+    std::unique_lock<std::mutex> lock(m_mMutex);
+    while (!m_bStop)
+    {
+        // Grow by another preallocation if the record outlasts the expected duration, while
+        // the frames are still a few windows away from the end of the file
+        UINT32 nCommitted = m_nCommitted;
+        if (nCommitted + RecordFilePrepareFrames >= m_nCapacity && FAILED(Resize(m_nCapacity + m_nGrowFrames)))
+        {
+            // The writing thread fails on its own when it reaches the end of the file
+            m_cvCommitted.wait_for(lock, std::chrono::milliseconds(RecordFilePrepareMsec));
+            continue;
+        }
+
+        UINT32 nCapacity = m_nCapacity;
+        UINT32 nBegin = max(nPrepared, nCommitted);
+        UINT32 nEnd = min(nCommitted + RecordFilePrepareFrames, nCapacity);
+        if (nBegin >= nEnd)
+        {
+            m_cvCommitted.wait_for(lock, std::chrono::milliseconds(RecordFilePrepareMsec));
+            continue;
+        }
+        lock.unlock();
+
+        // The preparer maps the file on its own, the pages are shared with the writing thread
+        if (hMapping && nEnd > nMappingCapacity)
+        {
+            CloseHandle(hMapping);
+            hMapping = NULL;
+        }
+        if (!hMapping)
+        {
+            hMapping = CreateFileMappingW(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+            nMappingCapacity = nCapacity;
+        }
+
+        ULONGLONG nStart = RecordFileHeaderSize + ULONGLONG(nBegin) * m_header.cbRecord;
+        ULONGLONG nStop = RecordFileHeaderSize + ULONGLONG(nEnd) * m_header.cbRecord;
+        ULONGLONG nViewOffset = nStart - nStart % systemInfo.dwAllocationGranularity;
+        const BYTE* pView = NULL;
+        if (hMapping)
+        {
+            pView = reinterpret_cast<const BYTE*>(MapViewOfFile(hMapping, FILE_MAP_READ, DWORD(nViewOffset >> 32), DWORD(nViewOffset), SIZE_T(nStop - nViewOffset)));
+        }
+        if (pView)
+        {
+            // Reading a page beyond the valid data yields zeros without any disk I/O, and the
+            // page stays in memory for the writing thread after the view is gone
+            volatile const BYTE* pPage = pView + (nStart - nViewOffset);
+            BYTE nTouched = 0;
+            for (ULONGLONG i = 0; i < nStop - nStart; i += systemInfo.dwPageSize)
+            {
+                nTouched |= pPage[i];
+            }
+            UNREFERENCED_PARAMETER(nTouched);
+            UnmapViewOfFile(pView);
+        }
+
+        lock.lock();
+        if (pView)
+        {
+            nPrepared = nEnd;
+        }
+        else
+        {
+            m_cvCommitted.wait_for(lock, std::chrono::milliseconds(RecordFilePrepareMsec));
+        }
+    }
+    lock.unlock();
+
+    if (hMapping)
+    {
+        CloseHandle(hMapping);
+    }
+
+    UnplaceThread(PipelineThread_Save, hrPlaced);
+}
+
+/// <summary>
+/// Stop the preparer and wait for it
+/// </summary>
+void MappedRecordFile::StopPreparer()
+{
+    if (!m_tPreparer.joinable())
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mMutex);
+        m_bStop = true;
+    }
+    m_cvCommitted.notify_one();
+    m_tPreparer.join();
+}
@@ -0,0 +1,197 @@
+// RecordFile.h
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Record files: one preallocated file per stream holding fixed size frame records
+
+
+#pragma once
+
+#include <windows.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+/// The RecordFileHeaderSize value specifies the size of the file header. The frame records
+/// start behind it, so they stay page aligned.
+#define RecordFileHeaderSize 4096
+
+/// The RecordFileVersion value specifies the version of the record files written. Frame
+/// headers of version 2 and later hold the CRC32C of the pixel data, file headers of version 3
+/// and later the region of the sensor frame which is recorded.
+#define RecordFileVersion 3
+
+/// The RecordFileWindowFrames value specifies the number of frame records mapped at once
+#define RecordFileWindowFrames 16
+
+/// The RecordFilePrepareFrames value specifies the number of frame records ahead of the last
+/// committed one which are kept allocated and faulted in, off the capturing thread
+#define RecordFilePrepareFrames (2 * RecordFileWindowFrames)
+
+/// The RecordFilePrepareMsec value specifies the time after which the preparer looks for
+/// committed frames again if it was not woken
+#define RecordFilePrepareMsec 100
+
+/// Pixel formats of the frame data in a record file
+enum RecordPixelFormat
+{
+    RecordPixelFormat_Gray16BE = 0,     // UINT16, big-endian (as in PGM)
+    RecordPixelFormat_RGB24,            // RGBTRIPLE, red first (as in PPM)
+    RecordPixelFormat_BGR24,            // RGBTRIPLE, blue first (as in BMP)
+    RecordPixelFormat_Gray16Packed,     // UINT16 packed to 12 or 13 bits (packed images only, see GrayPacking)
+    RecordPixelFormat_Gray16Delta,      // UINT16 delta coded over time (delta coded images only, see DepthDelta)
+    RecordPixelFormat_ColorEncoded,     // RGBTRIPLE encoded as QOI, PNG or JPEG (encoded images only, see ColorEncoder)
+    RecordPixelFormat_Duplicate         // no data, repeats an earlier frame (duplicate images only, see FrameDedup)
+};
+
+/// Region of the sensor frame which is recorded: a rectangle (in pixels of the mirrored frame,
+/// as it is displayed and saved) which is downscaled by nBinning x nBinning averaging
+struct RecordGeometry
+{
+    UINT32                  nX;
+    UINT32                  nY;
+    UINT32                  nWidth;             // multiple of 4 * nBinning
+    UINT32                  nHeight;            // multiple of nBinning
+    UINT32                  nBinning;           // 1 or 2
+};
+
+/// Header at the start of a record file
+struct RecordFileHeader
+{
+    CHAR                    szMagic[8];         // "KV2REC"
+    UINT32                  nVersion;
+    UINT32                  nStream;            // RecordStream
+    UINT32                  nWidth;
+    UINT32                  nHeight;
+    UINT32                  nPixelFormat;       // RecordPixelFormat
+    UINT32                  cbFrame;            // size (in bytes) of the pixel data of a frame
+    UINT32                  cbRecord;           // size (in bytes) of a frame record, page aligned
+    UINT32                  nFrames;            // number of frame records
+    RecordGeometry          geometry;           // region of the sensor frame (version 3 and later, zero if unknown)
+};
+
+/// Header in front of the pixel data of each frame record
+struct RecordFrameHeader
+{
+    INT64                   nTime;              // time relative to the record start (unit: 100 ns)
+    UINT32                  nIndex;             // index of the frame in the stream
+    UINT32                  cbData;             // size (in bytes) of the pixel data
+    UINT32                  nChecksum;          // CRC32C of the pixel data (version 2 and later)
+    UINT32                  nReserved[3];
+};
+
+/// <summary>
+/// Get the size of a frame record holding the given pixel data
+/// </summary>
+/// <param name="cbFrame">size (in bytes) of the pixel data</param>
+/// <returns>size (in bytes) of the record, page aligned</returns>
+inline UINT32 GetRecordSize(UINT32 cbFrame)
+{
+    return (sizeof(RecordFrameHeader) + cbFrame + 4095) & ~4095u;
+}
+
+/// A record file which is preallocated for the expected duration and written through
+/// mapped windows, so that the frames are converted straight into the file. A preparer
+/// thread grows the file ahead of the frames and faults in the records about to be written.
+class MappedRecordFile
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    MappedRecordFile();
+
+    /// <summary>
+    /// Destructor, closes the file
+    /// </summary>
+    ~MappedRecordFile();
+
+    /// <summary>
+    /// Create and preallocate a record file
+    /// </summary>
+    /// <param name="lpszFilePath">full file path of the record file</param>
+    /// <param name="nStream">stream of the frames</param>
+    /// <param name="nWidth">width (in pixels) of a frame</param>
+    /// <param name="nHeight">height (in pixels) of a frame</param>
+    /// <param name="nPixelFormat">pixel format of a frame</param>
+    /// <param name="cbFrame">size (in bytes) of the pixel data of a frame</param>
+    /// <param name="nPreallocateFrames">number of frames to preallocate</param>
+    /// <param name="pGeometry">recorded region of the sensor frame, NULL if unknown</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 Create(LPCWSTR lpszFilePath, UINT32 nStream, UINT32 nWidth, UINT32 nHeight, RecordPixelFormat nPixelFormat, UINT32 cbFrame, UINT32 nPreallocateFrames, const RecordGeometry* pGeometry = NULL);
+
+    /// <summary>
+    /// Get the destination of the pixel data of the next frame
+    /// </summary>
+    /// <returns>pointer into the mapped file, NULL on failure</returns>
+    BYTE*                   AcquireFrame();
+
+    /// <summary>
+    /// Complete the frame returned by AcquireFrame
+    /// </summary>
+    /// <param name="nTime">time of the frame relative to the record start</param>
+    /// <returns>CRC32C of the pixel data of the frame</returns>
+    UINT32                  CommitFrame(INT64 nTime);
+
+    /// <summary>
+    /// Unmap the file, store the number of frames and cut off the unused preallocation
+    /// </summary>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 Close();
+
+    /// <summary>
+    /// Get the number of committed frames
+    /// </summary>
+    /// <returns>number of frames</returns>
+    UINT32                  GetFrameCount() const { return m_header.nFrames; }
+
+private:
+    HANDLE                  m_hFile;
+    HANDLE                  m_hMapping;
+    BYTE*                   m_pView;
+    ULONGLONG               m_nViewOffset;
+    ULONGLONG               m_cbView;
+    UINT32                  m_nMappingCapacity;
+    std::atomic<UINT32>     m_nCapacity;
+    std::atomic<UINT32>     m_nCommitted;
+    UINT32                  m_nGrowFrames;
+    RecordFileHeader        m_header;
+
+    // Preparer
+    bool                    m_bStop;
+    std::mutex              m_mMutex;
+    std::condition_variable m_cvCommitted;
+    std::thread             m_tPreparer;
+
+    /// <summary>
+    /// Set the size of the file to hold the given number of frames. Growing keeps the file
+    /// mapped, shrinking unmaps it first.
+    /// </summary>
+    /// <param name="nFrames">number of frames</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 Resize(UINT32 nFrames);
+
+    /// <summary>
+    /// Keep the file grown and the records behind the last committed one faulted in, until
+    /// the file is closed
+    /// </summary>
+    void                    PrepareFrames();
+
+    /// <summary>
+    /// Stop the preparer and wait for it
+    /// </summary>
+    void                    StopPreparer();
+
+    /// <summary>
+    /// Map the window which starts with the given frame
+    /// </summary>
+    /// <param name="nFrame">index of the frame</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 MapWindow(UINT32 nFrame);
+
+    /// <summary>
+    /// Unmap the current window and close the mapping
+    /// </summary>
+    void                    Unmap();
+};
@@ -0,0 +1,506 @@
+// Registration.cpp
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Registration between the depth and color frames through a precomputed lookup table
+
+
+#include "stdafx.h"
+#include <strsafe.h>
+#include <stdio.h>
+#include <malloc.h>
+#include <emmintrin.h>
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "Registration.h"
+#include "FrameWriter.h"
+#include "ReplayReader.h"
+#include "Stripe.h"
+
+namespace
+{
+    /// <summary>
+    /// Read a list of numbers from an ini file
+    /// </summary>
+    /// <param name="szIni">full path of the ini file</param>
+    /// <param name="szSection">section of the key</param>
+    /// <param name="szKey">key of the list</param>
+    /// <param name="pValues">receives the numbers</param>
+    /// <param name="nValues">number of values expected</param>
+    /// <returns>true if all values were read</returns>
+    bool ReadProfileNumbers(LPCWSTR szIni, LPCWSTR szSection, LPCWSTR szKey, float* pValues, int nValues)
+    {
+        WCHAR szValue[256];
+        GetPrivateProfileStringW(szSection, szKey, L"", szValue, _countof(szValue), szIni);
+
+        // Values are separated by spaces or commas
+        WCHAR* szContext = NULL;
+        WCHAR* szToken = wcstok_s(szValue, L" ,\t", &szContext);
+        int n = 0;
+        for (; szToken && n < nValues; ++n)
+        {
+            pValues[n] = static_cast<float>(_wtof(szToken));
+            szToken = wcstok_s(NULL, L" ,\t", &szContext);
+        }
+
+        return n == nValues;
+    }
+}
+
+/// <summary>
+/// Read a calibration file: the depth intrinsics as for LoadDepthIntrinsics, the [Color]
+/// section with the same keys (without distortion), and the [DepthToColor] section with
+/// Rotation (9 values, row by row) and Translation (3 values in meters)
+/// </summary>
+/// <param name="szFilePath">ini file</param>
+/// <param name="pDepth">receives the depth intrinsics</param>
+/// <param name="pColor">receives the color intrinsics</param>
+/// <param name="pExtrinsics">receives the pose of the color camera</param>
+/// <returns>indicates success or failure</returns>
+HRESULT LoadRegistrationCalibration(LPCWSTR szFilePath, DepthIntrinsics* pDepth, ColorIntrinsics* pColor, DepthToColorExtrinsics* pExtrinsics)
+{
+    HRESULT hr = LoadDepthIntrinsics(szFilePath, pDepth);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    WCHAR szIni[MAX_PATH];
+    GetFullPathNameW(szFilePath, _countof(szIni), szIni, NULL);
+
+    const WCHAR* szKeys[] = { L"FocalLengthX", L"FocalLengthY", L"PrincipalPointX", L"PrincipalPointY" };
+    float* pValues[] = { &pColor->fFocalLengthX, &pColor->fFocalLengthY, &pColor->fPrincipalPointX, &pColor->fPrincipalPointY };
+    for (int i = 0; i < _countof(szKeys); ++i)
+    {
+        WCHAR szValue[64];
+        GetPrivateProfileStringW(L"Color", szKeys[i], L"0", szValue, _countof(szValue), szIni);
+        *pValues[i] = static_cast<float>(_wtof(szValue));
+    }
+
+    if (pColor->fFocalLengthX <= 0.f || pColor->fFocalLengthY <= 0.f ||
+        !ReadProfileNumbers(szIni, L"DepthToColor", L"Rotation", pExtrinsics->fRotation, 9) ||
+        !ReadProfileNumbers(szIni, L"DepthToColor", L"Translation", pExtrinsics->fTranslation, 3))
+    {
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+DepthColorRegistration::DepthColorRegistration() :
+    m_pNumeratorX(NULL),
+    m_pNumeratorY(NULL),
+    m_pDenominator(NULL),
+    m_fOffsetX(0.f),
+    m_fOffsetY(0.f),
+    m_fOffsetZ(0.f)
+{
+}
+
+/// <summary>
+/// Destructor
+/// </summary>
+DepthColorRegistration::~DepthColorRegistration()
+{
+    _aligned_free(m_pNumeratorX);
+    _aligned_free(m_pNumeratorY);
+    _aligned_free(m_pDenominator);
+}
+
+/// <summary>
+/// Compute the tables of the mapping
+/// </summary>
+/// <param name="depth">intrinsics of the depth camera</param>
+/// <param name="color">intrinsics of the color camera</param>
+/// <param name="extrinsics">pose of the color camera</param>
+/// <returns>indicates success or failure</returns>
+HRESULT DepthColorRegistration::Build(const DepthIntrinsics& depth, const ColorIntrinsics& color, const DepthToColorExtrinsics& extrinsics)
+{
+    DepthRayTable rayTable;
+    HRESULT hr = rayTable.Build(depth);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    if (!m_pNumeratorX)
+    {
+        m_pNumeratorX = static_cast<float*>(_aligned_malloc(PointCloudWidth * PointCloudHeight * sizeof(float), 16));
+        m_pNumeratorY = static_cast<float*>(_aligned_malloc(PointCloudWidth * PointCloudHeight * sizeof(float), 16));
+        m_pDenominator = static_cast<float*>(_aligned_malloc(PointCloudWidth * PointCloudHeight * sizeof(float), 16));
+    }
+    if (!m_pNumeratorX || !m_pNumeratorY || !m_pDenominator)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    // A depth pixel with depth z (in mm) is at p = z / 1000 * ray in the depth camera and at
+    // R * p + t in the color camera, which projects to
+    //   x = (fx * (R * p + t).x + cx * (R * p + t).z) / (R * p + t).z
+    // so the color pixel is (z * a + b) / (z * c + d) with a and c per pixel, b and d constant
+    const float* R = extrinsics.fRotation;
+    const float* t = extrinsics.fTranslation;
+    const float* pRayX = rayTable.GetRayX();
+    const float* pRayY = rayTable.GetRayY();
+    for (int i = 0; i < PointCloudWidth * PointCloudHeight; ++i)
+    {
+        double x = 0.001 * (R[0] * pRayX[i] + R[1] * pRayY[i] + R[2]);
+        double y = 0.001 * (R[3] * pRayX[i] + R[4] * pRayY[i] + R[5]);
+        double z = 0.001 * (R[6] * pRayX[i] + R[7] * pRayY[i] + R[8]);
+        m_pNumeratorX[i] = static_cast<float>(color.fFocalLengthX * x + color.fPrincipalPointX * z);
+        m_pNumeratorY[i] = static_cast<float>(color.fFocalLengthY * y + color.fPrincipalPointY * z);
+        m_pDenominator[i] = static_cast<float>(z);
+    }
+    m_fOffsetX = color.fFocalLengthX * t[0] + color.fPrincipalPointX * t[2];
+    m_fOffsetY = color.fFocalLengthY * t[1] + color.fPrincipalPointY * t[2];
+    m_fOffsetZ = t[2];
+
+    return S_OK;
+}
+
+/// <summary>
+/// Map the pixels of a depth frame to the color grid
+/// </summary>
+/// <param name="pDepth">depth frame in millimeters</param>
+/// <param name="bBigEndian">whether the frame is big-endian (as stored in PGM and record files)</param>
+/// <param name="pColorIndex">receives the index of the color pixel of each depth pixel, -1 for
+/// invalid depth or outside of the color frame; room for PointCloudWidth * PointCloudHeight</param>
+void DepthColorRegistration::Map(const UINT16* pDepth, bool bBigEndian, INT32* pColorIndex) const
+{
+    const __m128i nZero = _mm_setzero_si128();
+    const __m128i nInvalid = _mm_set1_epi32(-1);
+    const __m128i nWidth = _mm_set1_epi32(RegistrationColorWidth);
+    const __m128i nHeight = _mm_set1_epi32(RegistrationColorHeight);
+    const __m128 fOffsetX = _mm_set1_ps(m_fOffsetX);
+    const __m128 fOffsetY = _mm_set1_ps(m_fOffsetY);
+    const __m128 fOffsetZ = _mm_set1_ps(m_fOffsetZ);
+
+    for (UINT32 i = 0; i < PointCloudWidth * PointCloudHeight; i += 8)
+    {
+        __m128i nDepth = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pDepth + i));
+        if (bBigEndian)
+        {
+            nDepth = _mm_or_si128(_mm_slli_epi16(nDepth, 8), _mm_srli_epi16(nDepth, 8));
+        }
+
+        for (int h = 0; h < 2; ++h)
+        {
+            __m128i nDepth32 = h ? _mm_unpackhi_epi16(nDepth, nZero) : _mm_unpacklo_epi16(nDepth, nZero);
+            __m128 z = _mm_cvtepi32_ps(nDepth32);
+            __m128 fScale = _mm_div_ps(_mm_set1_ps(1.f), _mm_add_ps(_mm_mul_ps(z, _mm_load_ps(m_pDenominator + i + 4 * h)), fOffsetZ));
+            __m128i x = _mm_cvtps_epi32(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(z, _mm_load_ps(m_pNumeratorX + i + 4 * h)), fOffsetX), fScale));
+            __m128i y = _mm_cvtps_epi32(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(z, _mm_load_ps(m_pNumeratorY + i + 4 * h)), fOffsetY), fScale));
+
+            // Valid depth inside the color frame; a division by zero converts to INT_MIN and fails
+            __m128i bValid = _mm_andnot_si128(_mm_cmpeq_epi32(nDepth32, nZero), _mm_cmpgt_epi32(x, nInvalid));
+            bValid = _mm_and_si128(bValid, _mm_cmplt_epi32(x, nWidth));
+            bValid = _mm_and_si128(bValid, _mm_cmpgt_epi32(y, nInvalid));
+            bValid = _mm_and_si128(bValid, _mm_cmplt_epi32(y, nHeight));
+
+            // y * 1920 + x without the SSE4.1 multiply: 1920 = 2048 - 128
+            __m128i nIndex = _mm_add_epi32(_mm_sub_epi32(_mm_slli_epi32(y, 11), _mm_slli_epi32(y, 7)), x);
+            nIndex = _mm_or_si128(_mm_and_si128(bValid, nIndex), _mm_andnot_si128(bValid, nInvalid));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(pColorIndex + i + 4 * h), nIndex);
+        }
+    }
+}
+
+/// <summary>
+/// Sample the color of each depth pixel
+/// </summary>
+/// <param name="pColorIndex">mapping returned by Map</param>
+/// <param name="pColor">color frame (3 bytes per pixel, any channel order)</param>
+/// <param name="pRegistered">receives a PointCloudWidth x PointCloudHeight color frame in the
+/// channel order of pColor, black where there is no color</param>
+void DepthColorRegistration::RegisterColor(const INT32* pColorIndex, const BYTE* pColor, BYTE* pRegistered)
+{
+    for (int i = 0; i < PointCloudWidth * PointCloudHeight; ++i, pRegistered += 3)
+    {
+        if (pColorIndex[i] < 0)
+        {
+            pRegistered[0] = pRegistered[1] = pRegistered[2] = 0;
+            continue;
+        }
+
+        const BYTE* pPixel = pColor + 3 * pColorIndex[i];
+        pRegistered[0] = pPixel[0];
+        pRegistered[1] = pPixel[1];
+        pRegistered[2] = pPixel[2];
+    }
+}
+
+/// <summary>
+/// Spread the depth of each depth pixel over the color grid
+/// </summary>
+/// <param name="pColorIndex">mapping returned by Map</param>
+/// <param name="pDepth">depth frame that was mapped</param>
+/// <param name="bBigEndian">whether the frames are big-endian</param>
+/// <param name="pRegistered">receives a RegistrationColorWidth x RegistrationColorHeight depth frame
+/// in the byte order of pDepth, with the nearest depth where pixels overlap and 0 where there is none</param>
+void DepthColorRegistration::RegisterDepth(const INT32* pColorIndex, const UINT16* pDepth, bool bBigEndian, UINT16* pRegistered)
+{
+    memset(pRegistered, 0, RegistrationColorWidth * RegistrationColorHeight * sizeof(UINT16));
+
+    // A depth pixel covers about 3 x 3 color pixels (the focal length of the color camera is
+    // about 3 times the one of the depth camera), so each depth is spread over its neighbors
+    for (int i = 0; i < PointCloudWidth * PointCloudHeight; ++i)
+    {
+        if (pColorIndex[i] < 0)
+        {
+            continue;
+        }
+
+        int x = pColorIndex[i] % RegistrationColorWidth;
+        int y = pColorIndex[i] / RegistrationColorWidth;
+        UINT16 nDepth = bBigEndian ? _byteswap_ushort(pDepth[i]) : pDepth[i];
+        for (int v = max(0, y - 1); v <= min(RegistrationColorHeight - 1, y + 1); ++v)
+        {
+            UINT16* pRow = pRegistered + v * RegistrationColorWidth;
+            for (int u = max(0, x - 1); u <= min(RegistrationColorWidth - 1, x + 1); ++u)
+            {
+                UINT16 nCurrent = bBigEndian ? _byteswap_ushort(pRow[u]) : pRow[u];
+                if (0 == nCurrent || nDepth < nCurrent)
+                {
+                    pRow[u] = pDepth[i];
+                }
+            }
+        }
+    }
+}
+
+namespace
+{
+    /// Depth (and color) frame waiting for registration
+    struct RegistrationJob
+    {
+        std::vector<UINT16> vDepth;
+        std::vector<BYTE>   vColor;
+        INT64               nTime;
+        bool                bBigEndian;
+        RecordPixelFormat   nColorFormat;
+    };
+
+    /// Export of a session, shared by the reading thread and the workers
+    struct RegistrationExport
+    {
+        DepthColorRegistration registration;
+        std::wstring        sDestinationFolder;
+        bool                bColor;             // color for depth, otherwise depth for color
+        std::deque<RegistrationJob*> qJobs;
+        std::vector<RegistrationJob*> vFreeJobs;
+        bool                bDone;
+        std::mutex          mMutex;
+        std::condition_variable cvJobs;
+        std::condition_variable cvFreeJobs;
+        std::atomic<ULONGLONG> cbWritten;
+        std::atomic<int>    nFailed;
+    };
+
+    /// <summary>
+    /// Register and write queued frames until the reading thread is done
+    /// </summary>
+    /// <param name="pExport">export to work on</param>
+    void ExportRegisteredFrames(RegistrationExport* pExport)
+    {
+        std::vector<INT32> vColorIndex(PointCloudWidth * PointCloudHeight);
+        std::vector<BYTE> vFrame(1024 + RegistrationColorWidth * RegistrationColorHeight * sizeof(UINT16));
+        FrameWriter* pWriter = FrameWriter::Create(WriterMode_Buffered);
+
+        for (;;)
+        {
+            RegistrationJob* pJob = NULL;
+            {
+                std::unique_lock<std::mutex> lock(pExport->mMutex);
+                while (pExport->qJobs.empty() && !pExport->bDone)
+                {
+                    pExport->cvJobs.wait(lock);
+                }
+                if (pExport->qJobs.empty())
+                {
+                    break;
+                }
+                pJob = pExport->qJobs.front();
+                pExport->qJobs.pop_front();
+            }
+
+            // Registered frames are written with the same headers as the recorded ones
+            pExport->registration.Map(pJob->vDepth.data(), pJob->bBigEndian, vColorIndex.data());
+            const WCHAR* szExtension = L"pgm";
+            DWORD cbHeader = 0;
+            DWORD cbPixels = 0;
+            if (pExport->bColor)
+            {
+                if (RecordPixelFormat_RGB24 == pJob->nColorFormat)
+                {
+                    cbHeader = FormatPPMHeader(vFrame.data(), PointCloudWidth, PointCloudHeight, 255);
+                    szExtension = L"ppm";
+                }
+                else
+                {
+                    cbHeader = FormatBMPHeader(vFrame.data(), PointCloudWidth, PointCloudHeight, sizeof(RGBTRIPLE) * 8);
+                    szExtension = L"bmp";
+                }
+                cbPixels = PointCloudWidth * PointCloudHeight * sizeof(RGBTRIPLE);
+                DepthColorRegistration::RegisterColor(vColorIndex.data(), pJob->vColor.data(), vFrame.data() + cbHeader);
+            }
+            else
+            {
+                cbHeader = FormatPGMHeader(vFrame.data(), RegistrationColorWidth, RegistrationColorHeight, 65535);
+                cbPixels = RegistrationColorWidth * RegistrationColorHeight * sizeof(UINT16);
+                DepthColorRegistration::RegisterDepth(vColorIndex.data(), pJob->vDepth.data(), pJob->bBigEndian, reinterpret_cast<UINT16*>(vFrame.data() + cbHeader));
+            }
+
+            WCHAR szFilePath[MAX_PATH];
+            StringCchPrintfW(szFilePath, _countof(szFilePath), L"%s\\%011.6f.%s", pExport->sDestinationFolder.c_str(), pJob->nTime / 10000000., szExtension);
+            if (FAILED(pWriter->Write(szFilePath, vFrame.data(), cbHeader + cbPixels)))
+            {
+                ++pExport->nFailed;
+            }
+            pExport->cbWritten += cbHeader + cbPixels;
+
+            std::lock_guard<std::mutex> lock(pExport->mMutex);
+            pExport->vFreeJobs.push_back(pJob);
+            pExport->cvFreeJobs.notify_one();
+        }
+
+        delete pWriter;
+    }
+}
+
+/// <summary>
+/// Export the registered frames of a recorded session
+/// </summary>
+/// <param name="argc">number of arguments</param>
+/// <param name="argv">session folder, destination folder, calibration file, color or depth and (optional) number of workers</param>
+/// <returns>0 on success, otherwise failure</returns>
+int RunRegistration(int argc, LPWSTR* argv)
+{
+    if (argc < 4 || (0 != _wcsicmp(argv[3], L"color") && 0 != _wcsicmp(argv[3], L"depth")))
+    {
+        wprintf(L"Usage: KinectV2Recorder /register <session> <destination> <calibration.ini> <color|depth> [workers]\n");
+        return 1;
+    }
+
+    RegistrationExport registrationExport;
+    registrationExport.sDestinationFolder = argv[1];
+    registrationExport.bColor = (0 == _wcsicmp(argv[3], L"color"));
+    registrationExport.bDone = false;
+    registrationExport.cbWritten = 0;
+    registrationExport.nFailed = 0;
+    int nWorkers = (argc >= 5) ? max(1, _wtoi(argv[4])) : max(1, static_cast<int>(std::thread::hardware_concurrency()));
+
+    DepthIntrinsics depth;
+    ColorIntrinsics color;
+    DepthToColorExtrinsics extrinsics;
+    if (FAILED(LoadRegistrationCalibration(argv[2], &depth, &color, &extrinsics)) || FAILED(registrationExport.registration.Build(depth, color, extrinsics)))
+    {
+        wprintf(L"No calibration in %s\n", argv[2]);
+        return 1;
+    }
+
+    // Depth for color needs the depth frames only
+    ReplayReader reader;
+    DWORD dwStreams = ReplayStream_Depth | (registrationExport.bColor ? ReplayStream_Color : 0);
+    if (FAILED(reader.Open(argv[0], ReplayPrefetchDepth, dwStreams)) || dwStreams != reader.GetStreams() || FAILED(CreateFolderTree(argv[1])))
+    {
+        wprintf(L"Failed to open %s\n", argv[0]);
+        return 1;
+    }
+
+    // A few frames per worker are queued, which bounds the memory of the export
+    std::vector<RegistrationJob> vJobs(2 * nWorkers);
+    for (size_t i = 0; i < vJobs.size(); ++i)
+    {
+        vJobs[i].vDepth.resize(PointCloudWidth * PointCloudHeight);
+        if (registrationExport.bColor)
+        {
+            vJobs[i].vColor.resize(RegistrationColorWidth * RegistrationColorHeight * sizeof(RGBTRIPLE));
+        }
+        registrationExport.vFreeJobs.push_back(&vJobs[i]);
+    }
+
+    std::vector<std::thread> vWorkers;
+    for (int i = 0; i < nWorkers; ++i)
+    {
+        vWorkers.push_back(std::thread(ExportRegisteredFrames, &registrationExport));
+    }
+
+    ULONGLONG nStart = GetTickCount64();
+    UINT32 nFrames = 0;
+    HRESULT hr = S_OK;
+    ReplayFrameSet frameSet;
+    while (S_OK == (hr = reader.Next(&frameSet)))
+    {
+        const ReplayFrame& depthFrame = frameSet.frames[1];     // infrared, depth, color
+        const ReplayFrame& colorFrame = frameSet.frames[2];
+
+        // Frame sets of decimated streams or with a dropped frame lack some of the frames
+        if (!depthFrame.pData || (registrationExport.bColor && !colorFrame.pData))
+        {
+            continue;
+        }
+        if (depthFrame.nWidth != PointCloudWidth || depthFrame.nHeight != PointCloudHeight || depthFrame.cbData != PointCloudWidth * PointCloudHeight * sizeof(UINT16) ||
+            (registrationExport.bColor && (colorFrame.nWidth != RegistrationColorWidth || colorFrame.nHeight != RegistrationColorHeight ||
+            colorFrame.cbData != RegistrationColorWidth * RegistrationColorHeight * sizeof(RGBTRIPLE))))
+        {
+            hr = E_FAIL;
+            break;
+        }
+
+        RegistrationJob* pJob = NULL;
+        {
+            std::unique_lock<std::mutex> lock(registrationExport.mMutex);
+            while (registrationExport.vFreeJobs.empty())
+            {
+                registrationExport.cvFreeJobs.wait(lock);
+            }
+            pJob = registrationExport.vFreeJobs.back();
+            registrationExport.vFreeJobs.pop_back();
+        }
+
+        // The views of the reader are only valid until the next frame set
+        memcpy(pJob->vDepth.data(), depthFrame.pData, depthFrame.cbData);
+        if (registrationExport.bColor)
+        {
+            memcpy(pJob->vColor.data(), colorFrame.pData, colorFrame.cbData);
+            pJob->nColorFormat = colorFrame.nPixelFormat;
+        }
+        pJob->nTime = depthFrame.nTime;
+        pJob->bBigEndian = (RecordPixelFormat_Gray16BE == depthFrame.nPixelFormat);
+        ++nFrames;
+
+        std::lock_guard<std::mutex> lock(registrationExport.mMutex);
+        registrationExport.qJobs.push_back(pJob);
+        registrationExport.cvJobs.notify_one();
+    }
+    reader.Close();
+
+    {
+        std::lock_guard<std::mutex> lock(registrationExport.mMutex);
+        registrationExport.bDone = true;
+    }
+    registrationExport.cvJobs.notify_all();
+    for (size_t i = 0; i < vWorkers.size(); ++i)
+    {
+        vWorkers[i].join();
+    }
+
+    double fElapsed = max(1ull, GetTickCount64() - nStart) / 1000.;
+    wprintf(L"%u registered %s frames (%.1f MB) in %.2f s with %d workers: %.1f fps\n", nFrames, registrationExport.bColor ? L"color" : L"depth",
+        registrationExport.cbWritten / (1024. * 1024.), fElapsed, nWorkers, nFrames / fElapsed);
+
+    if (FAILED(hr) || registrationExport.nFailed > 0)
+    {
+        wprintf(L"Failed to register %d frames (0x%08x)\n", registrationExport.nFailed.load(), FAILED(hr) ? hr : S_OK);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,115 @@
+// Registration.h
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Registration between the depth and color frames through a precomputed lookup table
+
+
+#pragma once
+
+#include <windows.h>
+#include "PointCloud.h"
+
+/// The RegistrationColorWidth and RegistrationColorHeight values specify the color geometry
+#define RegistrationColorWidth 1920
+#define RegistrationColorHeight 1080
+
+/// Intrinsics of the color camera (in pixels). The color lens has negligible distortion.
+struct ColorIntrinsics
+{
+    float                   fFocalLengthX;
+    float                   fFocalLengthY;
+    float                   fPrincipalPointX;
+    float                   fPrincipalPointY;
+};
+
+/// Pose of the color camera relative to the depth camera: a point p of the depth camera is
+/// at R * p + t in the color camera
+struct DepthToColorExtrinsics
+{
+    float                   fRotation[9];       // R, row by row
+    float                   fTranslation[3];    // t in meters
+};
+
+/// <summary>
+/// Read a calibration file: the depth intrinsics as for LoadDepthIntrinsics, the [Color]
+/// section with the same keys (without distortion), and the [DepthToColor] section with
+/// Rotation (9 values, row by row) and Translation (3 values in meters)
+/// </summary>
+/// <param name="szFilePath">ini file</param>
+/// <param name="pDepth">receives the depth intrinsics</param>
+/// <param name="pColor">receives the color intrinsics</param>
+/// <param name="pExtrinsics">receives the pose of the color camera</param>
+/// <returns>indicates success or failure</returns>
+HRESULT LoadRegistrationCalibration(LPCWSTR szFilePath, DepthIntrinsics* pDepth, ColorIntrinsics* pColor, DepthToColorExtrinsics* pExtrinsics);
+
+/// Maps depth frames to the color grid. Everything but the depth of a pixel is folded into
+/// three tables when the registration is built, so the color pixel of a depth pixel with
+/// depth z is (z * a + b) / (z * c + d), with a and c from the tables. As with the coordinate
+/// mapper of the Kinect SDK, occluded color is not detected.
+class DepthColorRegistration
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    DepthColorRegistration();
+
+    /// <summary>
+    /// Destructor
+    /// </summary>
+    ~DepthColorRegistration();
+
+    /// <summary>
+    /// Compute the tables of the mapping
+    /// </summary>
+    /// <param name="depth">intrinsics of the depth camera</param>
+    /// <param name="color">intrinsics of the color camera</param>
+    /// <param name="extrinsics">pose of the color camera</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 Build(const DepthIntrinsics& depth, const ColorIntrinsics& color, const DepthToColorExtrinsics& extrinsics);
+
+    /// <summary>
+    /// Map the pixels of a depth frame to the color grid
+    /// </summary>
+    /// <param name="pDepth">depth frame in millimeters</param>
+    /// <param name="bBigEndian">whether the frame is big-endian (as stored in PGM and record files)</param>
+    /// <param name="pColorIndex">receives the index of the color pixel of each depth pixel, -1 for
+    /// invalid depth or outside of the color frame; room for PointCloudWidth * PointCloudHeight</param>
+    void                    Map(const UINT16* pDepth, bool bBigEndian, INT32* pColorIndex) const;
+
+    /// <summary>
+    /// Sample the color of each depth pixel
+    /// </summary>
+    /// <param name="pColorIndex">mapping returned by Map</param>
+    /// <param name="pColor">color frame (3 bytes per pixel, any channel order)</param>
+    /// <param name="pRegistered">receives a PointCloudWidth x PointCloudHeight color frame in the
+    /// channel order of pColor, black where there is no color</param>
+    static void             RegisterColor(const INT32* pColorIndex, const BYTE* pColor, BYTE* pRegistered);
+
+    /// <summary>
+    /// Spread the depth of each depth pixel over the color grid
+    /// </summary>
+    /// <param name="pColorIndex">mapping returned by Map</param>
+    /// <param name="pDepth">depth frame that was mapped</param>
+    /// <param name="bBigEndian">whether the frames are big-endian</param>
+    /// <param name="pRegistered">receives a RegistrationColorWidth x RegistrationColorHeight depth frame
+    /// in the byte order of pDepth, with the nearest depth where pixels overlap and 0 where there is none</param>
+    static void             RegisterDepth(const INT32* pColorIndex, const UINT16* pDepth, bool bBigEndian, UINT16* pRegistered);
+
+private:
+    float*                  m_pNumeratorX;      // a of x
+    float*                  m_pNumeratorY;      // a of y
+    float*                  m_pDenominator;     // c
+    float                   m_fOffsetX;         // b of x
+    float                   m_fOffsetY;         // b of y
+    float                   m_fOffsetZ;         // d
+};
+
+/// <summary>
+/// Export the registered frames of a recorded session
+/// </summary>
+/// <param name="argc">number of arguments</param>
+/// <param name="argv">session folder, destination folder, calibration file, color or depth and (optional) number of workers</param>
+/// <returns>0 on success, otherwise failure</returns>
+int RunRegistration(int argc, LPWSTR* argv);
@@ -0,0 +1,889 @@
+// ReplayReader.cpp
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Replay of recorded sessions: synchronized frame sets read ahead on a background thread
+
+
+#include "stdafx.h"
+#include <strsafe.h>
+#include <stdlib.h>
+#include "ReplayReader.h"
+#include "FrameAnalyzer.h"
+#include "Stripe.h"
+
+/// <summary>
+/// Read the next decimal number of a PGM/PPM header
+/// </summary>
+/// <param name="ppHeader">position in the header, moved behind the number</param>
+/// <param name="pEnd">end of the file</param>
+/// <returns>number, 0 if there is none</returns>
+static UINT32 ReadHeaderNumber(const BYTE** ppHeader, const BYTE* pEnd)
+{
+    const BYTE* p = *ppHeader;
+    while (p < pEnd && (' ' == *p || '\t' == *p || '\r' == *p || '\n' == *p))
+    {
+        ++p;
+    }
+
+    UINT32 nValue = 0;
+    while (p < pEnd && *p >= '0' && *p <= '9')
+    {
+        nValue = nValue * 10 + (*p - '0');
+        ++p;
+    }
+
+    *ppHeader = p;
+    return nValue;
+}
+
+/// <summary>
+/// Parse the header of an image file as written by the recorder. Packed, delta coded, encoded
+/// and duplicate images are reported as they are stored, the reader unpacks and expands them.
+/// </summary>
+/// <param name="pFile">start of the file, at least the whole header</param>
+/// <param name="cbFile">size (in bytes) of pFile</param>
+/// <param name="pFrame">receives the start of the pixel data, size and format</param>
+/// <returns>indicates success or failure</returns>
+HRESULT ParseImageHeader(const BYTE* pFile, size_t cbFile, ReplayFrame* pFrame)
+{
+    const BYTE* pEnd = pFile + cbFile;
+    UINT32 cbPixel = 0;
+    pFrame->packing.nBits = 0;
+    pFrame->packing.nShift = 0;
+    pFrame->delta.nSequence = 0;
+    pFrame->delta.nKeyDistance = 0;
+    pFrame->nCodec = ColorCodec_None;
+    pFrame->nReferenceTime = 0;
+
+    HRESULT hr = S_OK;
+    if (cbFile > 2 && 'P' == pFile[0] && ('5' == pFile[1] || '6' == pFile[1]))
+    {
+        // PGM (P5) or PPM (P6): magic, width, height and max value, then a single white space
+        const BYTE* p = pFile + 2;
+        pFrame->nWidth = ReadHeaderNumber(&p, pEnd);
+        pFrame->nHeight = ReadHeaderNumber(&p, pEnd);
+        UINT32 nMaxValue = ReadHeaderNumber(&p, pEnd);
+        ++p;
+
+        if ('5' == pFile[1])
+        {
+            pFrame->nPixelFormat = RecordPixelFormat_Gray16BE;
+            cbPixel = (nMaxValue > 255) ? 2 : 1;
+        }
+        else
+        {
+            pFrame->nPixelFormat = RecordPixelFormat_RGB24;
+            cbPixel = 3;
+        }
+        pFrame->pData = p;
+    }
+    else if (cbFile > 2 && 'K' == pFile[0] && 'P' == pFile[1])
+    {
+        // Packed image: magic, width, height, bits and shift, then a single white space
+        const BYTE* p = pFile + 2;
+        pFrame->nWidth = ReadHeaderNumber(&p, pEnd);
+        pFrame->nHeight = ReadHeaderNumber(&p, pEnd);
+        pFrame->packing.nBits = ReadHeaderNumber(&p, pEnd);
+        pFrame->packing.nShift = ReadHeaderNumber(&p, pEnd);
+        ++p;
+
+        if ((12 != pFrame->packing.nBits && 13 != pFrame->packing.nBits) || pFrame->packing.nBits + pFrame->packing.nShift > 16)
+        {
+            return E_FAIL;
+        }
+        pFrame->nPixelFormat = RecordPixelFormat_Gray16Packed;
+        pFrame->pData = p;
+        pFrame->cbData = GetPackedSize(pFrame->nWidth * pFrame->nHeight, pFrame->packing.nBits);
+        return (pFrame->cbData && pFrame->pData <= pEnd) ? S_OK : E_FAIL;
+    }
+    else if (cbFile > 2 && 'K' == pFile[0] && 'D' == pFile[1])
+    {
+        // Delta coded image: magic, width, height, sequence, key distance and size of the data,
+        // then a single white space
+        const BYTE* p = pFile + 2;
+        pFrame->nWidth = ReadHeaderNumber(&p, pEnd);
+        pFrame->nHeight = ReadHeaderNumber(&p, pEnd);
+        pFrame->delta.nSequence = ReadHeaderNumber(&p, pEnd);
+        pFrame->delta.nKeyDistance = ReadHeaderNumber(&p, pEnd);
+        pFrame->cbData = ReadHeaderNumber(&p, pEnd);
+        ++p;
+
+        pFrame->nPixelFormat = RecordPixelFormat_Gray16Delta;
+        pFrame->pData = p;
+        return (pFrame->nWidth && pFrame->nHeight && pFrame->cbData && pFrame->pData <= pEnd) ? S_OK : E_FAIL;
+    }
+    else if (cbFile > 2 && 'K' == pFile[0] && 'S' == pFile[1])
+    {
+        // Duplicate image: magic, width, height and the time of the repeated frame in seconds,
+        // read as the time of a file name, then a single white space and no data
+        const BYTE* p = pFile + 2;
+        pFrame->nWidth = ReadHeaderNumber(&p, pEnd);
+        pFrame->nHeight = ReadHeaderNumber(&p, pEnd);
+        while (p < pEnd && (' ' == *p || '\t' == *p || '\r' == *p || '\n' == *p))
+        {
+            ++p;
+        }
+        CHAR szTime[32];
+        size_t cchTime = 0;
+        while (p < pEnd && cchTime + 1 < _countof(szTime) && (('0' <= *p && *p <= '9') || '.' == *p))
+        {
+            szTime[cchTime++] = static_cast<CHAR>(*p++);
+        }
+        szTime[cchTime] = '\0';
+        ++p;
+
+        pFrame->nPixelFormat = RecordPixelFormat_Duplicate;
+        pFrame->nReferenceTime = static_cast<INT64>(strtod(szTime, NULL) * 10000000. + 0.5);
+        pFrame->pData = p;
+        pFrame->cbData = 0;
+        return (pFrame->nWidth && pFrame->nHeight && cchTime && pFrame->pData <= pEnd) ? S_OK : E_FAIL;
+    }
+    else if (cbFile > sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) && 'B' == pFile[0] && 'M' == pFile[1])
+    {
+        const BITMAPFILEHEADER* pFileHeader = reinterpret_cast<const BITMAPFILEHEADER*>(pFile);
+        const BITMAPINFOHEADER* pInfoHeader = reinterpret_cast<const BITMAPINFOHEADER*>(pFile + sizeof(BITMAPFILEHEADER));
+        pFrame->nWidth = pInfoHeader->biWidth;
+        pFrame->nHeight = abs(pInfoHeader->biHeight);
+        pFrame->nPixelFormat = RecordPixelFormat_BGR24;
+        pFrame->pData = pFile + pFileHeader->bfOffBits;
+        cbPixel = pInfoHeader->biBitCount / 8;
+    }
+    else if (S_FALSE != (hr = ParseColorImageHeader(pFile, cbFile, &pFrame->nCodec, &pFrame->nWidth, &pFrame->nHeight)))
+    {
+        // Encoded color image: the whole file is its data, of which pFile may hold the start only
+        pFrame->nPixelFormat = RecordPixelFormat_ColorEncoded;
+        pFrame->pData = pFile;
+        pFrame->cbData = static_cast<UINT32>(cbFile);
+        return (SUCCEEDED(hr) && pFrame->nWidth && pFrame->nHeight) ? S_OK : E_FAIL;
+    }
+    else
+    {
+        return E_FAIL;
+    }
+
+    pFrame->cbData = pFrame->nWidth * pFrame->nHeight * cbPixel;
+    if (!pFrame->cbData || pFrame->pData > pEnd)
+    {
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+/// <summary>
+/// Locate the pixel data of an image file as written by the recorder
+/// </summary>
+/// <param name="pFile">contents of the file</param>
+/// <param name="cbFile">size (in bytes) of the file</param>
+/// <param name="pFrame">receives the pixel data, size and format</param>
+/// <returns>indicates success or failure</returns>
+static HRESULT ParseImage(const BYTE* pFile, size_t cbFile, ReplayFrame* pFrame)
+{
+    if (FAILED(ParseImageHeader(pFile, cbFile, pFrame)) || pFrame->pData + pFrame->cbData > pFile + cbFile)
+    {
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+/// <summary>
+/// Read a whole image file
+/// </summary>
+/// <param name="szFilePath">path of the file</param>
+/// <param name="pvBuffer">receives the contents, keeps its capacity</param>
+/// <returns>S_OK, E_ACCESSDENIED if the file cannot be opened, otherwise failure</returns>
+HRESULT ReadImageFile(LPCWSTR szFilePath, std::vector<BYTE>* pvBuffer)
+{
+    HANDLE hFile = CreateFileW(szFilePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (INVALID_HANDLE_VALUE == hFile)
+    {
+        return E_ACCESSDENIED;
+    }
+
+    LARGE_INTEGER cbFile = { 0 };
+    DWORD dwBytesRead = 0;
+    BOOL bRead = GetFileSizeEx(hFile, &cbFile) && cbFile.QuadPart > 0 && cbFile.QuadPart < MAXDWORD;
+    if (bRead)
+    {
+        pvBuffer->resize(static_cast<size_t>(cbFile.QuadPart));
+        bRead = ReadFile(hFile, pvBuffer->data(), cbFile.LowPart, &dwBytesRead, NULL) && dwBytesRead == cbFile.LowPart;
+    }
+    CloseHandle(hFile);
+
+    return bRead ? S_OK : E_FAIL;
+}
+
+/// <summary>
+/// Decode a delta coded image of a stream. Unless the decoder holds the frame before it, as
+/// after a seek, the images from its keyframe on are read and decoded first.
+/// </summary>
+/// <param name="vFiles">image files of the stream</param>
+/// <param name="nIndex">index of the image in vFiles</param>
+/// <param name="frame">the parsed image</param>
+/// <param name="pDecoder">decoder of the stream</param>
+/// <param name="pvBuffer">buffer for the images before it</param>
+/// <param name="pDest">receives the frame in big-endian (as in PGM)</param>
+/// <returns>indicates success or failure</returns>
+HRESULT DecodeDeltaImage(const std::vector<std::wstring>& vFiles, UINT32 nIndex, const ReplayFrame& frame, DepthDeltaDecoder* pDecoder, std::vector<BYTE>* pvBuffer, UINT16* pDest)
+{
+    // The keyframe is key distance images back, unless images of the sequence failed to write,
+    // in which case the decoder finds the sequence broken
+    if (!pDecoder->HasReference(frame.delta, frame.nWidth, frame.nHeight))
+    {
+        if (frame.delta.nKeyDistance > nIndex)
+        {
+            return E_FAIL;
+        }
+
+        for (UINT32 k = nIndex - frame.delta.nKeyDistance; k < nIndex; ++k)
+        {
+            ReplayFrame reference;
+            if (FAILED(ReadImageFile(vFiles[k].c_str(), pvBuffer)) || FAILED(ParseImage(pvBuffer->data(), pvBuffer->size(), &reference)) ||
+                RecordPixelFormat_Gray16Delta != reference.nPixelFormat || reference.nWidth != frame.nWidth || reference.nHeight != frame.nHeight ||
+                FAILED(pDecoder->Decode(reference.pData, reference.cbData, reference.nWidth, reference.nHeight, reference.delta, pDest)))
+            {
+                return E_FAIL;
+            }
+        }
+    }
+
+    return pDecoder->Decode(frame.pData, frame.cbData, frame.nWidth, frame.nHeight, frame.delta, pDest);
+}
+
+/// <summary>
+/// Read the image a duplicate image of a stream repeats, the last image before it which is no
+/// duplicate
+/// </summary>
+/// <param name="vFiles">image files of the stream</param>
+/// <param name="nIndex">index of the duplicate image in vFiles</param>
+/// <param name="frame">the parsed duplicate image</param>
+/// <param name="pvBuffer">receives the repeated image</param>
+/// <param name="pReference">receives the parsed repeated image, of any format but delta coded</param>
+/// <returns>indicates success or failure</returns>
+HRESULT ReadDuplicateImage(const std::vector<std::wstring>& vFiles, UINT32 nIndex, const ReplayFrame& frame, std::vector<BYTE>* pvBuffer, ReplayFrame* pReference)
+{
+    // The duplicates in between are skipped by their name. If the repeated image failed to
+    // write, the image found has another time and the frame is lost.
+    const size_t cchExtension = wcslen(FrameDedupExtension);
+    UINT32 k = nIndex;
+    while (k > 0)
+    {
+        const std::wstring& sFilePath = vFiles[--k];
+        if (sFilePath.size() <= cchExtension || 0 != _wcsicmp(sFilePath.c_str() + sFilePath.size() - cchExtension, FrameDedupExtension))
+        {
+            break;
+        }
+    }
+    if (k == nIndex || GetImageFileTime(vFiles[k]) != frame.nReferenceTime)
+    {
+        return E_FAIL;
+    }
+
+    if (FAILED(ReadImageFile(vFiles[k].c_str(), pvBuffer)) || FAILED(ParseImage(pvBuffer->data(), pvBuffer->size(), pReference)) ||
+        RecordPixelFormat_Duplicate == pReference->nPixelFormat || RecordPixelFormat_Gray16Delta == pReference->nPixelFormat ||
+        pReference->nWidth != frame.nWidth || pReference->nHeight != frame.nHeight)
+    {
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+/// <summary>
+/// Get the time of an image file from its name, which is the time in seconds
+/// </summary>
+/// <param name="sFilePath">path of the file</param>
+/// <returns>time relative to the record start (unit: 100 ns)</returns>
+INT64 GetImageFileTime(const std::wstring& sFilePath)
+{
+    size_t nName = sFilePath.find_last_of(L'\\');
+    const WCHAR* szName = sFilePath.c_str() + ((std::wstring::npos == nName) ? 0 : nName + 1);
+    return static_cast<INT64>(wcstod(szName, NULL) * 10000000. + 0.5);
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+ReplayReader::ReplayReader() :
+    m_nLayout(ReplayLayout_Images),
+    m_dwStreams(ReplayStream_All),
+    m_nFrames(0),
+    m_dwGranularity(0),
+    m_nProduced(0),
+    m_nConsumed(0),
+    m_nReleased(0),
+    m_bStop(false)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        m_hRecordFile[i] = INVALID_HANDLE_VALUE;
+        m_hMapping[i] = NULL;
+        m_nStreamFrames[i] = 0;
+    }
+    ZeroMemory(m_header, sizeof(m_header));
+
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+    m_dwGranularity = systemInfo.dwAllocationGranularity;
+}
+
+/// <summary>
+/// Destructor, closes the session
+/// </summary>
+ReplayReader::~ReplayReader()
+{
+    Close();
+}
+
+/// <summary>
+/// Open a recorded session and start reading ahead
+/// </summary>
+/// <param name="szSessionFolder">folder of the session on any of its record roots</param>
+/// <param name="nPrefetchDepth">number of frame sets to read ahead</param>
+/// <param name="dwStreams">ReplayStreams to read, the others are skipped</param>
+/// <returns>indicates success or failure</returns>
+HRESULT ReplayReader::Open(LPCWSTR szSessionFolder, UINT32 nPrefetchDepth, DWORD dwStreams)
+{
+    Close();
+
+    m_dwStreams = dwStreams & ReplayStream_All;
+    if (!m_dwStreams)
+    {
+        return E_INVALIDARG;
+    }
+
+    std::vector<std::wstring> vSessionFolders;
+    StripeLayout::ReadManifest(szSessionFolder, &vSessionFolders);
+
+    // Streams which were off have neither frames nor a record file. The report is written to
+    // the session folder on the first root, sessions without it have all streams on.
+    WCHAR szReport[MAX_PATH];
+    GetFullPathNameW((vSessionFolders[0] + L"\\session.ini").c_str(), _countof(szReport), szReport, NULL);
+    const WCHAR* szSections[] = { L"Infrared", L"Depth", L"Color" };
+    for (int i = 0; i < 3; ++i)
+    {
+        if (0 == GetPrivateProfileIntW(szSections[i], L"Decimation", 1, szReport))
+        {
+            m_dwStreams &= ~(1 << i);
+        }
+    }
+    if (!m_dwStreams)
+    {
+        return E_FAIL;
+    }
+
+    // A session of the mapped writer mode has one record file per stream, otherwise the
+    // frames are single images
+    HRESULT hr = OpenRecordFiles(vSessionFolders);
+    if (FAILED(hr))
+    {
+        Close();
+        return hr;
+    }
+
+    const WCHAR* szStreams[] = { L"ir", L"depth", L"color" };
+    m_nLayout = (S_OK == hr) ? ReplayLayout_RecordFiles : ReplayLayout_Images;
+    std::vector<INT64> vTimes[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        if (!(m_dwStreams & (1 << i)))
+        {
+            continue;
+        }
+
+        if (ReplayLayout_Images == m_nLayout)
+        {
+            StripeLayout::ListFrames(szSessionFolder, szStreams[i], &m_vFiles[i]);
+        }
+        if (FAILED(ReadFrameTimes(i, &vTimes[i])))
+        {
+            Close();
+            return E_FAIL;
+        }
+        m_nStreamFrames[i] = static_cast<UINT32>(vTimes[i].size());
+    }
+
+    AlignFrameSets(vTimes);
+    if (!m_nFrames)
+    {
+        Close();
+        return E_FAIL;
+    }
+
+    m_vSlots.resize(max(1u, nPrefetchDepth));
+    for (size_t i = 0; i < m_vSlots.size(); ++i)
+    {
+        ZeroMemory(m_vSlots[i].pView, sizeof(m_vSlots[i].pView));
+    }
+
+    m_nProduced = 0;
+    m_nConsumed = 0;
+    m_nReleased = 0;
+    m_bStop = false;
+    m_tPrefetcher = std::thread(&ReplayReader::PrefetchFrameSets, this);
+    return S_OK;
+}
+
+/// <summary>
+/// Continue at another frame set, the views of the previous one become invalid. Delta coded
+/// frames are decoded from their keyframe on, so a seek costs up to a keyframe interval.
+/// </summary>
+/// <param name="nIndex">index of the frame set which Next returns next</param>
+/// <returns>indicates success or failure</returns>
+HRESULT ReplayReader::Seek(UINT32 nIndex)
+{
+    if (nIndex >= m_nFrames)
+    {
+        return E_INVALIDARG;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mMutex);
+        m_bStop = true;
+    }
+    m_cvReleased.notify_one();
+    if (m_tPrefetcher.joinable())
+    {
+        m_tPrefetcher.join();
+    }
+
+    for (size_t i = 0; i < m_vSlots.size(); ++i)
+    {
+        UnmapRecords(&m_vSlots[i]);
+    }
+
+    // The read ahead starts over at the frame set, the decoders keep their previous frame in
+    // case it is the one before
+    m_nProduced = nIndex;
+    m_nConsumed = nIndex;
+    m_nReleased = nIndex;
+    m_bStop = false;
+    m_tPrefetcher = std::thread(&ReplayReader::PrefetchFrameSets, this);
+    return S_OK;
+}
+
+/// <summary>
+/// Stop reading ahead and close the session
+/// </summary>
+void ReplayReader::Close()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mMutex);
+        m_bStop = true;
+    }
+    m_cvReleased.notify_one();
+    if (m_tPrefetcher.joinable())
+    {
+        m_tPrefetcher.join();
+    }
+
+    for (size_t i = 0; i < m_vSlots.size(); ++i)
+    {
+        UnmapRecords(&m_vSlots[i]);
+    }
+    m_vSlots.clear();
+
+    for (int i = 0; i < 3; ++i)
+    {
+        if (m_hMapping[i])
+        {
+            CloseHandle(m_hMapping[i]);
+            m_hMapping[i] = NULL;
+        }
+        if (INVALID_HANDLE_VALUE != m_hRecordFile[i])
+        {
+            CloseHandle(m_hRecordFile[i]);
+            m_hRecordFile[i] = INVALID_HANDLE_VALUE;
+        }
+        m_vFiles[i].clear();
+        m_vFrameSets[i].clear();
+        m_nStreamFrames[i] = 0;
+        m_decoder[i].Reset();
+    }
+
+    m_nFrames = 0;
+}
+
+/// <summary>
+/// Get the next frame set, the views of the previous one become invalid
+/// </summary>
+/// <param name="pFrameSet">receives the views of the frames</param>
+/// <returns>S_OK, S_FALSE after the last frame set, otherwise failure</returns>
+HRESULT ReplayReader::Next(ReplayFrameSet* pFrameSet)
+{
+    std::unique_lock<std::mutex> lock(m_mMutex);
+
+    // Hand the slot of the previous frame set back to the prefetcher
+    if (m_nReleased < m_nConsumed)
+    {
+        m_nReleased = m_nConsumed;
+        m_cvReleased.notify_one();
+    }
+
+    if (m_nConsumed >= m_nFrames)
+    {
+        return S_FALSE;
+    }
+
+    while (m_nProduced <= m_nConsumed && !m_bStop)
+    {
+        m_cvProduced.wait(lock);
+    }
+    if (m_nProduced <= m_nConsumed)
+    {
+        return E_ABORT;
+    }
+
+    ReplaySlot& slot = m_vSlots[m_nConsumed % m_vSlots.size()];
+    ++m_nConsumed;
+    if (FAILED(slot.hr))
+    {
+        return slot.hr;
+    }
+
+    *pFrameSet = slot.frameSet;
+    return S_OK;
+}
+
+/// <summary>
+/// Open the record files of a session
+/// </summary>
+/// <param name="vSessionFolders">folders of the session on all of its roots</param>
+/// <returns>S_OK, S_FALSE if the session has no record files, otherwise failure</returns>
+HRESULT ReplayReader::OpenRecordFiles(const std::vector<std::wstring>& vSessionFolders)
+{
+    const WCHAR* szRecordFiles[] = { L"ir.kvr", L"depth.kvr", L"color.kvr" };
+    bool bFound = false;
+    for (int i = 0; i < 3; ++i)
+    {
+        if (!(m_dwStreams & (1 << i)))
+        {
+            continue;
+        }
+
+        // Each stream of a record session stays on one root, which may be any of them
+        for (size_t r = 0; r < vSessionFolders.size() && INVALID_HANDLE_VALUE == m_hRecordFile[i]; ++r)
+        {
+            WCHAR szFilePath[MAX_PATH];
+            StringCchPrintfW(szFilePath, _countof(szFilePath), L"%s\\%s", vSessionFolders[r].c_str(), szRecordFiles[i]);
+            m_hRecordFile[i] = CreateFileW(szFilePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        }
+
+        if (INVALID_HANDLE_VALUE == m_hRecordFile[i])
+        {
+            return bFound ? E_FAIL : S_FALSE;
+        }
+        bFound = true;
+
+        DWORD dwBytesRead = 0;
+        if (!ReadFile(m_hRecordFile[i], &m_header[i], sizeof(m_header[i]), &dwBytesRead, NULL) ||
+            dwBytesRead != sizeof(m_header[i]) || 0 != memcmp(m_header[i].szMagic, "KV2REC", 6) ||
+            m_header[i].cbRecord < sizeof(RecordFrameHeader))
+        {
+            return E_FAIL;
+        }
+
+        m_hMapping[i] = CreateFileMappingW(m_hRecordFile[i], NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!m_hMapping[i])
+        {
+            return E_FAIL;
+        }
+    }
+
+    return S_OK;
+}
+
+/// <summary>
+/// Read the times of the frames of a stream, from the names of the image files or the
+/// headers of the records
+/// </summary>
+/// <param name="nStream">stream, indexed as RecordStream</param>
+/// <param name="pvTimes">receives the time of each frame</param>
+/// <returns>indicates success or failure</returns>
+HRESULT ReplayReader::ReadFrameTimes(int nStream, std::vector<INT64>* pvTimes)
+{
+    if (ReplayLayout_Images == m_nLayout)
+    {
+        pvTimes->resize(m_vFiles[nStream].size());
+        for (size_t n = 0; n < m_vFiles[nStream].size(); ++n)
+        {
+            (*pvTimes)[n] = GetImageFileTime(m_vFiles[nStream][n]);
+        }
+        return S_OK;
+    }
+
+    // Only the frame header of each record is read
+    pvTimes->resize(m_header[nStream].nFrames);
+    for (UINT32 n = 0; n < m_header[nStream].nFrames; ++n)
+    {
+        ULONGLONG nOffset = RecordFileHeaderSize + ULONGLONG(n) * m_header[nStream].cbRecord;
+        OVERLAPPED overlapped = { 0 };
+        overlapped.Offset = DWORD(nOffset);
+        overlapped.OffsetHigh = DWORD(nOffset >> 32);
+
+        RecordFrameHeader frameHeader;
+        DWORD dwBytesRead = 0;
+        if (!ReadFile(m_hRecordFile[nStream], &frameHeader, sizeof(frameHeader), &dwBytesRead, &overlapped) || dwBytesRead != sizeof(frameHeader))
+        {
+            return E_FAIL;
+        }
+        (*pvTimes)[n] = frameHeader.nTime;
+    }
+    return S_OK;
+}
+
+/// <summary>
+/// Assign the frames of the streams to frame sets by their time
+/// </summary>
+/// <param name="vTimes">time of each frame of each stream</param>
+void ReplayReader::AlignFrameSets(const std::vector<INT64> vTimes[3])
+{
+    // Frame sets are counted in frame periods from the record start, as the recorder decimates
+    // them. Color frames arrive a few ms after their infrared and depth frames.
+    size_t nNext[3] = { 0, 0, 0 };
+    for (;;)
+    {
+        // The next frame set is the earliest one which any stream still has a frame of
+        INT64 nFrameSet = 0;
+        bool bFound = false;
+        for (int i = 0; i < 3; ++i)
+        {
+            if (nNext[i] < vTimes[i].size())
+            {
+                INT64 nStreamFrameSet = (vTimes[i][nNext[i]] + FramePeriod / 2) / FramePeriod;
+                if (!bFound || nStreamFrameSet < nFrameSet)
+                {
+                    nFrameSet = nStreamFrameSet;
+                    bFound = true;
+                }
+            }
+        }
+        if (!bFound)
+        {
+            break;
+        }
+
+        for (int i = 0; i < 3; ++i)
+        {
+            bool bFrame = nNext[i] < vTimes[i].size() && (vTimes[i][nNext[i]] + FramePeriod / 2) / FramePeriod == nFrameSet;
+            m_vFrameSets[i].push_back(bFrame ? static_cast<UINT32>(nNext[i]++) : ReplayNoFrame);
+        }
+    }
+
+    m_nFrames = static_cast<UINT32>(m_vFrameSets[0].size());
+}
+
+/// <summary>
+/// Read the frame sets ahead of the consumer until all are read or the session is closed
+/// </summary>
+void ReplayReader::PrefetchFrameSets()
+{
+    // Encoded color images are decoded on this thread, which holds the coder
+    ColorCoder coder;
+    for (UINT32 nIndex = m_nProduced; nIndex < m_nFrames; ++nIndex)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mMutex);
+            while (nIndex - m_nReleased >= m_vSlots.size() && !m_bStop)
+            {
+                m_cvReleased.wait(lock);
+            }
+            if (m_bStop)
+            {
+                break;
+            }
+        }
+
+        // The slot is neither held by the consumer nor visible to it until it is produced
+        ReplaySlot* pSlot = &m_vSlots[nIndex % m_vSlots.size()];
+        UnmapRecords(pSlot);
+        pSlot->frameSet.nIndex = nIndex;
+        pSlot->hr = (ReplayLayout_RecordFiles == m_nLayout) ? MapRecords(nIndex, pSlot) : ReadImages(nIndex, pSlot, &coder);
+
+        std::lock_guard<std::mutex> lock(m_mMutex);
+        m_nProduced = nIndex + 1;
+        m_cvProduced.notify_one();
+    }
+
+    std::lock_guard<std::mutex> lock(m_mMutex);
+    m_bStop = true;
+    m_cvProduced.notify_one();
+}
+
+/// <summary>
+/// Read the image files of a frame set into a slot
+/// </summary>
+/// <param name="nIndex">index of the frame set</param>
+/// <param name="pSlot">slot to fill</param>
+/// <param name="pCoder">coder of the read ahead thread for encoded color images</param>
+/// <returns>indicates success or failure</returns>
+HRESULT ReplayReader::ReadImages(UINT32 nIndex, ReplaySlot* pSlot, ColorCoder* pCoder)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        UINT32 nFrame = m_vFrameSets[i][nIndex];
+        if (!(m_dwStreams & (1 << i)) || ReplayNoFrame == nFrame)
+        {
+            ZeroMemory(&pSlot->frameSet.frames[i], sizeof(ReplayFrame));
+            continue;
+        }
+
+        // The buffers of a slot keep their capacity, so only the first frame sets allocate
+        const std::wstring& sFilePath = m_vFiles[i][nFrame];
+        HRESULT hr = ReadImageFile(sFilePath.c_str(), &pSlot->vBuffer[i]);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        ReplayFrame& frame = pSlot->frameSet.frames[i];
+        if (FAILED(ParseImage(pSlot->vBuffer[i].data(), pSlot->vBuffer[i].size(), &frame)))
+        {
+            return E_FAIL;
+        }
+
+        // A duplicate image is replaced by the image it repeats, which is then unpacked or
+        // decoded as if it had been read itself
+        if (RecordPixelFormat_Duplicate == frame.nPixelFormat)
+        {
+            ReplayFrame duplicate = frame;
+            if (FAILED(ReadDuplicateImage(m_vFiles[i], nFrame, duplicate, &pSlot->vBuffer[i], &frame)))
+            {
+                return E_FAIL;
+            }
+        }
+
+        // Packed frames are unpacked here, on the read ahead thread, so they look as recorded
+        if (RecordPixelFormat_Gray16Packed == frame.nPixelFormat)
+        {
+            UINT32 nPixels = frame.nWidth * frame.nHeight;
+            pSlot->vUnpacked[i].resize(nPixels);
+            UnpackGray(frame.pData, nPixels, frame.packing, pSlot->vUnpacked[i].data());
+            frame.pData = reinterpret_cast<const BYTE*>(pSlot->vUnpacked[i].data());
+            frame.cbData = nPixels * sizeof(UINT16);
+            frame.nPixelFormat = RecordPixelFormat_Gray16BE;
+            frame.packing.nBits = 0;
+            frame.packing.nShift = 0;
+        }
+
+        // So are delta coded frames, in order on this thread, which holds their decoders
+        if (RecordPixelFormat_Gray16Delta == frame.nPixelFormat)
+        {
+            UINT32 nPixels = frame.nWidth * frame.nHeight;
+            pSlot->vUnpacked[i].resize(nPixels);
+            if (FAILED(DecodeDeltaImage(m_vFiles[i], nFrame, frame, &m_decoder[i], &m_vReference, pSlot->vUnpacked[i].data())))
+            {
+                return E_FAIL;
+            }
+            frame.pData = reinterpret_cast<const BYTE*>(pSlot->vUnpacked[i].data());
+            frame.cbData = nPixels * sizeof(UINT16);
+            frame.nPixelFormat = RecordPixelFormat_Gray16BE;
+            frame.delta.nSequence = 0;
+            frame.delta.nKeyDistance = 0;
+        }
+
+        // And encoded color images, in the channel order of the images the recorder writes
+        if (RecordPixelFormat_ColorEncoded == frame.nPixelFormat)
+        {
+            UINT32 nPixels = frame.nWidth * frame.nHeight;
+            pSlot->vDecoded.resize(nPixels);
+#ifdef COLOR_BMP
+            const bool bRedFirst = false;
+            frame.nPixelFormat = RecordPixelFormat_BGR24;
+#else
+            const bool bRedFirst = true;
+            frame.nPixelFormat = RecordPixelFormat_RGB24;
+#endif
+            if (FAILED(pCoder->Decode(frame.nCodec, frame.pData, frame.cbData, frame.nWidth, frame.nHeight, bRedFirst, pSlot->vDecoded.data())))
+            {
+                return E_FAIL;
+            }
+            frame.pData = reinterpret_cast<const BYTE*>(pSlot->vDecoded.data());
+            frame.cbData = nPixels * sizeof(RGBTRIPLE);
+            frame.nCodec = ColorCodec_None;
+        }
+
+        // Image files are named by their time in seconds, duplicates keep their own
+        frame.nTime = GetImageFileTime(sFilePath);
+    }
+
+    return S_OK;
+}
+
+/// <summary>
+/// Map the records of a frame set into a slot and touch their pages
+/// </summary>
+/// <param name="nIndex">index of the frame set</param>
+/// <param name="pSlot">slot to fill</param>
+/// <returns>indicates success or failure</returns>
+HRESULT ReplayReader::MapRecords(UINT32 nIndex, ReplaySlot* pSlot)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        UINT32 nFrame = m_vFrameSets[i][nIndex];
+        if (!(m_dwStreams & (1 << i)) || ReplayNoFrame == nFrame)
+        {
+            ZeroMemory(&pSlot->frameSet.frames[i], sizeof(ReplayFrame));
+            continue;
+        }
+
+        // Views have to start at a multiple of the allocation granularity
+        ULONGLONG nOffset = RecordFileHeaderSize + ULONGLONG(nFrame) * m_header[i].cbRecord;
+        ULONGLONG nViewOffset = nOffset - nOffset % m_dwGranularity;
+        SIZE_T cbView = static_cast<SIZE_T>(nOffset - nViewOffset + m_header[i].cbRecord);
+
+        pSlot->pView[i] = MapViewOfFile(m_hMapping[i], FILE_MAP_READ, DWORD(nViewOffset >> 32), DWORD(nViewOffset), cbView);
+        if (!pSlot->pView[i])
+        {
+            return E_FAIL;
+        }
+
+        const BYTE* pRecord = reinterpret_cast<const BYTE*>(pSlot->pView[i]) + (nOffset - nViewOffset);
+        const RecordFrameHeader* pFrameHeader = reinterpret_cast<const RecordFrameHeader*>(pRecord);
+        if (pFrameHeader->cbData > m_header[i].cbRecord - sizeof(RecordFrameHeader))
+        {
+            return E_FAIL;
+        }
+
+        ReplayFrame& frame = pSlot->frameSet.frames[i];
+        frame.pData = pRecord + sizeof(RecordFrameHeader);
+        frame.cbData = pFrameHeader->cbData;
+        frame.nWidth = m_header[i].nWidth;
+        frame.nHeight = m_header[i].nHeight;
+        frame.nPixelFormat = static_cast<RecordPixelFormat>(m_header[i].nPixelFormat);
+        frame.packing.nBits = 0;
+        frame.packing.nShift = 0;
+        frame.delta.nSequence = 0;
+        frame.delta.nKeyDistance = 0;
+        frame.nCodec = ColorCodec_None;
+        frame.nReferenceTime = 0;
+        frame.nTime = pFrameHeader->nTime;
+
+        // Fault the pages in here, so the consumer does not wait for the disk
+        volatile BYTE nTouch = 0;
+        for (UINT32 cb = 0; cb < frame.cbData; cb += 4096)
+        {
+            nTouch ^= frame.pData[cb];
+        }
+    }
+
+    return S_OK;
+}
+
+/// <summary>
+/// Unmap the records held by a slot
+/// </summary>
+/// <param name="pSlot">slot to release</param>
+void ReplayReader::UnmapRecords(ReplaySlot* pSlot)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        if (pSlot->pView[i])
+        {
+            UnmapViewOfFile(pSlot->pView[i]);
+            pSlot->pView[i] = NULL;
+        }
+    }
+}
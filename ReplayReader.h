@@ -0,0 +1,273 @@
+// ReplayReader.h
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Replay of recorded sessions: synchronized frame sets read ahead on a background thread
+
+
+#pragma once
+
+#include <windows.h>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "RecordFile.h"
+#include "GrayPacking.h"
+#include "DepthDelta.h"
+#include "ColorEncoder.h"
+#include "FrameDedup.h"
+
+/// The ReplayPrefetchDepth value specifies the default number of frame sets read ahead
+#define ReplayPrefetchDepth 8
+
+/// The ReplayNoFrame value specifies the frame index of a stream without a frame in a frame set
+#define ReplayNoFrame MAXDWORD
+
+/// Layouts of a recorded session
+enum ReplayLayout
+{
+    ReplayLayout_Images = 0,    // one image file per frame, possibly striped over several roots
+    ReplayLayout_RecordFiles    // one .kvr record file per stream (mapped writer mode)
+};
+
+/// Streams to read from a session, combined by OR
+enum ReplayStreams
+{
+    ReplayStream_Infrared = 0x1,
+    ReplayStream_Depth = 0x2,
+    ReplayStream_Color = 0x4,
+    ReplayStream_All = 0x7
+};
+
+/// View of a frame, valid until the next frame set is requested
+struct ReplayFrame
+{
+    const BYTE*             pData;              // pixel data, in the layout of the recorded file
+    UINT32                  cbData;             // size (in bytes) of the pixel data
+    UINT32                  nWidth;
+    UINT32                  nHeight;
+    RecordPixelFormat       nPixelFormat;
+    GrayPacking             packing;            // packing of RecordPixelFormat_Gray16Packed
+    DepthDeltaFrame         delta;              // position of RecordPixelFormat_Gray16Delta in its sequence
+    ColorCodec              nCodec;             // codec of RecordPixelFormat_ColorEncoded
+    INT64                   nReferenceTime;     // time of the frame which RecordPixelFormat_Duplicate repeats
+    INT64                   nTime;              // time relative to the record start (unit: 100 ns)
+};
+
+/// Synchronized infrared, depth and color frames of a session. A decimated stream has a frame
+/// in every Nth frame set only, and a dropped frame leaves its frame set without it.
+struct ReplayFrameSet
+{
+    UINT32                  nIndex;             // index of the frame set in the session
+    ReplayFrame             frames[3];          // indexed by RecordStream, empty (pData NULL) for streams not read or without a frame
+};
+
+/// <summary>
+/// Parse the header of an image file as written by the recorder. Packed, delta coded, encoded
+/// and duplicate images are reported as they are stored, the reader unpacks and expands them.
+/// </summary>
+/// <param name="pFile">start of the file, at least the whole header</param>
+/// <param name="cbFile">size (in bytes) of pFile</param>
+/// <param name="pFrame">receives the start of the pixel data, size and format</param>
+/// <returns>indicates success or failure</returns>
+HRESULT ParseImageHeader(const BYTE* pFile, size_t cbFile, ReplayFrame* pFrame);
+
+/// <summary>
+/// Read a whole image file
+/// </summary>
+/// <param name="szFilePath">path of the file</param>
+/// <param name="pvBuffer">receives the contents, keeps its capacity</param>
+/// <returns>S_OK, E_ACCESSDENIED if the file cannot be opened, otherwise failure</returns>
+HRESULT ReadImageFile(LPCWSTR szFilePath, std::vector<BYTE>* pvBuffer);
+
+/// <summary>
+/// Decode a delta coded image of a stream. Unless the decoder holds the frame before it, as
+/// after a seek, the images from its keyframe on are read and decoded first.
+/// </summary>
+/// <param name="vFiles">image files of the stream</param>
+/// <param name="nIndex">index of the image in vFiles</param>
+/// <param name="frame">the parsed image</param>
+/// <param name="pDecoder">decoder of the stream</param>
+/// <param name="pvBuffer">buffer for the images before it</param>
+/// <param name="pDest">receives the frame in big-endian (as in PGM)</param>
+/// <returns>indicates success or failure</returns>
+HRESULT DecodeDeltaImage(const std::vector<std::wstring>& vFiles, UINT32 nIndex, const ReplayFrame& frame, DepthDeltaDecoder* pDecoder, std::vector<BYTE>* pvBuffer, UINT16* pDest);
+
+/// <summary>
+/// Read the image a duplicate image of a stream repeats, the last image before it which is no
+/// duplicate
+/// </summary>
+/// <param name="vFiles">image files of the stream</param>
+/// <param name="nIndex">index of the duplicate image in vFiles</param>
+/// <param name="frame">the parsed duplicate image</param>
+/// <param name="pvBuffer">receives the repeated image</param>
+/// <param name="pReference">receives the parsed repeated image, of any format but delta coded</param>
+/// <returns>indicates success or failure</returns>
+HRESULT ReadDuplicateImage(const std::vector<std::wstring>& vFiles, UINT32 nIndex, const ReplayFrame& frame, std::vector<BYTE>* pvBuffer, ReplayFrame* pReference);
+
+/// <summary>
+/// Get the time of an image file from its name, which is the time in seconds
+/// </summary>
+/// <param name="sFilePath">path of the file</param>
+/// <returns>time relative to the record start (unit: 100 ns)</returns>
+INT64 GetImageFileTime(const std::wstring& sFilePath);
+
+/// Iterates the frame sets of a recorded session in order. A background thread reads the
+/// image files (or maps and touches the records of the record files) ahead of the consumer,
+/// which gets views of the frames without another copy. The frames of the streams are aligned
+/// by their frame set, counted in frame periods from the record start, so that decimated
+/// streams and dropped frames keep the others in step. Streams which were off are not read.
+class ReplayReader
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    ReplayReader();
+
+    /// <summary>
+    /// Destructor, closes the session
+    /// </summary>
+    ~ReplayReader();
+
+    /// <summary>
+    /// Open a recorded session and start reading ahead
+    /// </summary>
+    /// <param name="szSessionFolder">folder of the session on any of its record roots</param>
+    /// <param name="nPrefetchDepth">number of frame sets to read ahead</param>
+    /// <param name="dwStreams">ReplayStreams to read, the others are skipped</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 Open(LPCWSTR szSessionFolder, UINT32 nPrefetchDepth = ReplayPrefetchDepth, DWORD dwStreams = ReplayStream_All);
+
+    /// <summary>
+    /// Stop reading ahead and close the session
+    /// </summary>
+    void                    Close();
+
+    /// <summary>
+    /// Get the next frame set, the views of the previous one become invalid
+    /// </summary>
+    /// <param name="pFrameSet">receives the views of the frames</param>
+    /// <returns>S_OK, S_FALSE after the last frame set, otherwise failure</returns>
+    HRESULT                 Next(ReplayFrameSet* pFrameSet);
+
+    /// <summary>
+    /// Continue at another frame set, the views of the previous one become invalid. Delta coded
+    /// frames are decoded from their keyframe on, so a seek costs up to a keyframe interval.
+    /// </summary>
+    /// <param name="nIndex">index of the frame set which Next returns next</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 Seek(UINT32 nIndex);
+
+    /// <summary>
+    /// Get the number of frame sets which hold a frame of any stream read
+    /// </summary>
+    /// <returns>number of frame sets</returns>
+    UINT32                  GetFrameCount() const { return m_nFrames; }
+
+    /// <summary>
+    /// Get the number of frames of a stream
+    /// </summary>
+    /// <param name="nStream">stream, indexed as RecordStream</param>
+    /// <returns>number of frames, 0 for streams not read</returns>
+    UINT32                  GetStreamFrameCount(int nStream) const { return m_nStreamFrames[nStream]; }
+
+    /// <summary>
+    /// Get the streams which are read, those requested which were recorded
+    /// </summary>
+    /// <returns>ReplayStreams</returns>
+    DWORD                   GetStreams() const { return m_dwStreams; }
+
+    /// <summary>
+    /// Get the layout of the session
+    /// </summary>
+    /// <returns>layout</returns>
+    ReplayLayout            GetLayout() const { return m_nLayout; }
+
+private:
+    /// A frame set read ahead
+    struct ReplaySlot
+    {
+        std::vector<BYTE>   vBuffer[3];         // image files, or the images duplicate images repeat
+        std::vector<UINT16> vUnpacked[3];       // frames of packed and delta coded images
+        std::vector<RGBTRIPLE> vDecoded;        // frame of an encoded color image
+        void*               pView[3];           // mapped records
+        ReplayFrameSet      frameSet;
+        HRESULT             hr;
+    };
+
+    ReplayLayout            m_nLayout;
+    DWORD                   m_dwStreams;
+    UINT32                  m_nFrames;
+    UINT32                  m_nStreamFrames[3];
+    std::vector<UINT32>     m_vFrameSets[3];    // frame of each stream in each frame set, ReplayNoFrame if none
+    std::vector<std::wstring> m_vFiles[3];
+    HANDLE                  m_hRecordFile[3];
+    HANDLE                  m_hMapping[3];
+    RecordFileHeader        m_header[3];
+    DWORD                   m_dwGranularity;
+    DepthDeltaDecoder       m_decoder[3];       // used by the read ahead thread only
+    std::vector<BYTE>       m_vReference;       // images read to decode a delta coded frame after a seek
+
+    std::vector<ReplaySlot> m_vSlots;
+    UINT32                  m_nProduced;
+    UINT32                  m_nConsumed;
+    UINT32                  m_nReleased;
+    bool                    m_bStop;
+    std::mutex              m_mMutex;
+    std::condition_variable m_cvProduced;
+    std::condition_variable m_cvReleased;
+    std::thread             m_tPrefetcher;
+
+    /// <summary>
+    /// Open the record files of a session
+    /// </summary>
+    /// <param name="vSessionFolders">folders of the session on all of its roots</param>
+    /// <returns>S_OK, S_FALSE if the session has no record files, otherwise failure</returns>
+    HRESULT                 OpenRecordFiles(const std::vector<std::wstring>& vSessionFolders);
+
+    /// <summary>
+    /// Read the times of the frames of a stream, from the names of the image files or the
+    /// headers of the records
+    /// </summary>
+    /// <param name="nStream">stream, indexed as RecordStream</param>
+    /// <param name="pvTimes">receives the time of each frame</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 ReadFrameTimes(int nStream, std::vector<INT64>* pvTimes);
+
+    /// <summary>
+    /// Assign the frames of the streams to frame sets by their time
+    /// </summary>
+    /// <param name="vTimes">time of each frame of each stream</param>
+    void                    AlignFrameSets(const std::vector<INT64> vTimes[3]);
+
+    /// <summary>
+    /// Read the frame sets ahead of the consumer until all are read or the session is closed
+    /// </summary>
+    void                    PrefetchFrameSets();
+
+    /// <summary>
+    /// Read the image files of a frame set into a slot
+    /// </summary>
+    /// <param name="nIndex">index of the frame set</param>
+    /// <param name="pSlot">slot to fill</param>
+    /// <param name="pCoder">coder of the read ahead thread for encoded color images</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 ReadImages(UINT32 nIndex, ReplaySlot* pSlot, ColorCoder* pCoder);
+
+    /// <summary>
+    /// Map the records of a frame set into a slot and touch their pages
+    /// </summary>
+    /// <param name="nIndex">index of the frame set</param>
+    /// <param name="pSlot">slot to fill</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 MapRecords(UINT32 nIndex, ReplaySlot* pSlot);
+
+    /// <summary>
+    /// Unmap the records held by a slot
+    /// </summary>
+    /// <param name="pSlot">slot to release</param>
+    void                    UnmapRecords(ReplaySlot* pSlot);
+};
@@ -0,0 +1,275 @@
+// Stripe.cpp
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Striping of record sessions across several record roots (e.g. one per drive)
+
+
+#include "stdafx.h"
+#include <wctype.h>
+#include <strsafe.h>
+#include <algorithm>
+#include <utility>
+#include "Stripe.h"
+
+/// <summary>
+/// Create a folder and all of its missing parent folders
+/// </summary>
+/// <param name="szFolder">folder to create</param>
+/// <returns>indicates success or failure</returns>
+HRESULT CreateFolderTree(LPCWSTR szFolder)
+{
+    WCHAR szPath[MAX_PATH];
+    if (FAILED(StringCchCopyW(szPath, _countof(szPath), szFolder)))
+    {
+        return E_INVALIDARG;
+    }
+
+    // Create each parent on the way, skipping the drive or share prefix which already exists
+    for (WCHAR* p = szPath; *p; ++p)
+    {
+        if ((L'\\' == *p || L'/' == *p) && p > szPath && L':' != p[-1] && L'\\' != p[-1])
+        {
+            WCHAR c = *p;
+            *p = L'\0';
+            CreateDirectoryW(szPath, NULL);
+            *p = c;
+        }
+    }
+
+    if (!CreateDirectoryW(szPath, NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+    {
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+StripeLayout::StripeLayout() :
+    m_nMode(StripeMode_Frame)
+{
+    Reset();
+}
+
+/// <summary>
+/// Set the record roots
+/// </summary>
+/// <param name="szRoots">root folders separated by ';', empty for the working directory</param>
+/// <param name="nMode">way to distribute the frames</param>
+void StripeLayout::SetRoots(LPCWSTR szRoots, StripeMode nMode)
+{
+    m_vRoots.clear();
+    m_nMode = nMode;
+
+    std::wstring sRoots(szRoots ? szRoots : L"");
+    size_t nBegin = 0;
+    while (nBegin <= sRoots.size())
+    {
+        size_t nEnd = sRoots.find(L';', nBegin);
+        if (std::wstring::npos == nEnd)
+        {
+            nEnd = sRoots.size();
+        }
+
+        // Trim blanks and trailing separators
+        std::wstring sRoot = sRoots.substr(nBegin, nEnd - nBegin);
+        sRoot.erase(0, sRoot.find_first_not_of(L" \t"));
+        sRoot.erase(sRoot.find_last_not_of(L" \t\\/") + 1);
+        if (!sRoot.empty())
+        {
+            m_vRoots.push_back(sRoot);
+        }
+
+        nBegin = nEnd + 1;
+    }
+
+    Reset();
+}
+
+/// <summary>
+/// Restart the distribution for a new session
+/// </summary>
+void StripeLayout::Reset()
+{
+    for (int i = 0; i < _countof(m_nNextRoot); ++i)
+    {
+        m_nNextRoot[i] = 0;
+    }
+}
+
+/// <summary>
+/// Get the root of the next frame of a stream
+/// </summary>
+/// <param name="nStream">stream of the frame</param>
+/// <returns>index of the root</returns>
+int StripeLayout::NextRoot(int nStream)
+{
+    if (StripeMode_Stream == m_nMode || nStream < 0 || nStream >= _countof(m_nNextRoot))
+    {
+        return GetStreamRoot(max(0, nStream));
+    }
+
+    int nRoot = m_nNextRoot[nStream];
+    m_nNextRoot[nStream] = (nRoot + 1) % GetRootCount();
+    return nRoot;
+}
+
+/// <summary>
+/// Get the folder of a session on a root
+/// </summary>
+/// <param name="nRoot">index of the root</param>
+/// <param name="szSaveFolder">session folder relative to the root</param>
+/// <param name="szSessionFolder">receives the session folder</param>
+/// <param name="cchSessionFolder">size (in characters) of szSessionFolder</param>
+void StripeLayout::GetSessionFolder(int nRoot, LPCWSTR szSaveFolder, WCHAR* szSessionFolder, size_t cchSessionFolder) const
+{
+    if (m_vRoots.empty())
+    {
+        StringCchCopyW(szSessionFolder, cchSessionFolder, szSaveFolder);
+    }
+    else
+    {
+        StringCchPrintfW(szSessionFolder, cchSessionFolder, L"%s\\%s", m_vRoots[nRoot % m_vRoots.size()].c_str(), szSaveFolder);
+    }
+}
+
+/// <summary>
+/// Write the manifest of a session to its folder on every root
+/// </summary>
+/// <param name="szSaveFolder">session folder relative to the roots</param>
+/// <returns>indicates success or failure</returns>
+HRESULT StripeLayout::WriteManifest(LPCWSTR szSaveFolder) const
+{
+    if (m_vRoots.empty())
+    {
+        return S_OK;
+    }
+
+    HRESULT hr = S_OK;
+    WCHAR szValue[MAX_PATH];
+    WCHAR szKey[32];
+
+    for (int i = 0; i < GetRootCount(); ++i)
+    {
+        WCHAR szSessionFolder[MAX_PATH];
+        WCHAR szManifest[MAX_PATH];
+        GetSessionFolder(i, szSaveFolder, szSessionFolder, _countof(szSessionFolder));
+        if (FAILED(CreateFolderTree(szSessionFolder)))
+        {
+            hr = E_FAIL;
+            continue;
+        }
+
+        // The profile functions need a full path, otherwise the Windows folder is used
+        WCHAR szManifestPath[MAX_PATH];
+        StringCchPrintfW(szManifestPath, _countof(szManifestPath), L"%s\\%s", szSessionFolder, StripeManifestName);
+        GetFullPathNameW(szManifestPath, _countof(szManifest), szManifest, NULL);
+
+        WritePrivateProfileStringW(L"Stripe", L"Mode", (StripeMode_Stream == m_nMode) ? L"stream" : L"frame", szManifest);
+        WritePrivateProfileStringW(L"Stripe", L"Folder", szSaveFolder, szManifest);
+        StringCchPrintfW(szValue, _countof(szValue), L"%d", GetRootCount());
+        WritePrivateProfileStringW(L"Stripe", L"Roots", szValue, szManifest);
+        for (int r = 0; r < GetRootCount(); ++r)
+        {
+            StringCchPrintfW(szKey, _countof(szKey), L"Root%d", r);
+            GetFullPathNameW(m_vRoots[r].c_str(), _countof(szValue), szValue, NULL);
+            WritePrivateProfileStringW(L"Stripe", szKey, szValue, szManifest);
+        }
+
+        // Flush the cached profile to disk
+        if (!WritePrivateProfileStringW(NULL, NULL, NULL, szManifest))
+        {
+            hr = E_FAIL;
+        }
+    }
+
+    return hr;
+}
+
+/// <summary>
+/// Get the folders of a session on all roots from its manifest
+/// </summary>
+/// <param name="szSessionFolder">folder of the session on any of its roots</param>
+/// <param name="pvSessionFolders">receives the session folders, just szSessionFolder if there is no manifest</param>
+void StripeLayout::ReadManifest(LPCWSTR szSessionFolder, std::vector<std::wstring>* pvSessionFolders)
+{
+    pvSessionFolders->clear();
+
+    WCHAR szManifestPath[MAX_PATH];
+    WCHAR szManifest[MAX_PATH];
+    StringCchPrintfW(szManifestPath, _countof(szManifestPath), L"%s\\%s", szSessionFolder, StripeManifestName);
+    GetFullPathNameW(szManifestPath, _countof(szManifest), szManifest, NULL);
+
+    WCHAR szFolder[MAX_PATH];
+    int nRoots = GetPrivateProfileIntW(L"Stripe", L"Roots", 0, szManifest);
+    GetPrivateProfileStringW(L"Stripe", L"Folder", L"", szFolder, _countof(szFolder), szManifest);
+    for (int r = 0; r < nRoots && szFolder[0]; ++r)
+    {
+        WCHAR szKey[32];
+        WCHAR szRoot[MAX_PATH];
+        WCHAR szPath[MAX_PATH];
+        StringCchPrintfW(szKey, _countof(szKey), L"Root%d", r);
+        GetPrivateProfileStringW(L"Stripe", szKey, L"", szRoot, _countof(szRoot), szManifest);
+        if (szRoot[0])
+        {
+            StringCchPrintfW(szPath, _countof(szPath), L"%s\\%s", szRoot, szFolder);
+            pvSessionFolders->push_back(szPath);
+        }
+    }
+
+    if (pvSessionFolders->empty())
+    {
+        pvSessionFolders->push_back(szSessionFolder);
+    }
+}
+
+/// <summary>
+/// List the frame files of a stream of a session across all of its roots, in time order
+/// </summary>
+/// <param name="szSessionFolder">folder of the session on any of its roots</param>
+/// <param name="szStream">stream folder name ("ir", "depth" or "color")</param>
+/// <param name="pvFiles">receives the full paths of the frame files</param>
+void StripeLayout::ListFrames(LPCWSTR szSessionFolder, LPCWSTR szStream, std::vector<std::wstring>* pvFiles)
+{
+    pvFiles->clear();
+
+    std::vector<std::wstring> vSessionFolders;
+    ReadManifest(szSessionFolder, &vSessionFolders);
+
+    // Frame files are named by their fixed width time stamp, so the name order is the time order.
+    // Other files, such as the files the overlapped writer creates ahead (~<process>_<n>.tmp)
+    // and leaves behind when the recorder is killed, are skipped.
+    std::vector<std::pair<std::wstring, std::wstring> > vFrames;
+    for (size_t i = 0; i < vSessionFolders.size(); ++i)
+    {
+        WCHAR szPattern[MAX_PATH];
+        StringCchPrintfW(szPattern, _countof(szPattern), L"%s\\%s\\*", vSessionFolders[i].c_str(), szStream);
+
+        WIN32_FIND_DATAW findData;
+        HANDLE hFind = FindFirstFileW(szPattern, &findData);
+        if (INVALID_HANDLE_VALUE == hFind)
+        {
+            continue;
+        }
+
+        do
+        {
+            if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && iswdigit(findData.cFileName[0]))
+            {
+                std::wstring sPath = vSessionFolders[i] + L"\\" + szStream + L"\\" + findData.cFileName;
+                vFrames.push_back(std::make_pair(std::wstring(findData.cFileName), sPath));
+            }
+        } while (FindNextFileW(hFind, &findData));
+        FindClose(hFind);
+    }
+
+    std::sort(vFrames.begin(), vFrames.end());
+    pvFiles->reserve(vFrames.size());
+    for (size_t i = 0; i < vFrames.size(); ++i)
+    {
+        pvFiles->push_back(vFrames[i].second);
+    }
+}
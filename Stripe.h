@@ -0,0 +1,108 @@
+// Stripe.h
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Striping of record sessions across several record roots (e.g. one per drive)
+
+
+#pragma once
+
+#include <windows.h>
+#include <vector>
+#include <string>
+
+/// The StripeManifestName value specifies the manifest stored in the session folder of each root
+#define StripeManifestName L"stripe.ini"
+
+/// Ways to distribute the frames of a session over the record roots
+enum StripeMode
+{
+    StripeMode_Frame = 0,   // frames of each stream go round-robin over the roots
+    StripeMode_Stream       // each stream stays on one root
+};
+
+/// <summary>
+/// Create a folder and all of its missing parent folders
+/// </summary>
+/// <param name="szFolder">folder to create</param>
+/// <returns>indicates success or failure</returns>
+HRESULT CreateFolderTree(LPCWSTR szFolder);
+
+/// Record roots of a session and the way frames are distributed over them. Without roots,
+/// sessions are saved relative to the working directory as before.
+class StripeLayout
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    StripeLayout();
+
+    /// <summary>
+    /// Set the record roots
+    /// </summary>
+    /// <param name="szRoots">root folders separated by ';', empty for the working directory</param>
+    /// <param name="nMode">way to distribute the frames</param>
+    void                    SetRoots(LPCWSTR szRoots, StripeMode nMode);
+
+    /// <summary>
+    /// Get the number of record roots
+    /// </summary>
+    /// <returns>number of roots, at least 1</returns>
+    int                     GetRootCount() const { return max(1, static_cast<int>(m_vRoots.size())); }
+
+    /// <summary>
+    /// Restart the distribution for a new session
+    /// </summary>
+    void                    Reset();
+
+    /// <summary>
+    /// Get the root of the next frame of a stream
+    /// </summary>
+    /// <param name="nStream">stream of the frame</param>
+    /// <returns>index of the root</returns>
+    int                     NextRoot(int nStream);
+
+    /// <summary>
+    /// Get the root which holds a whole stream (for containers which cannot be split by frame)
+    /// </summary>
+    /// <param name="nStream">stream</param>
+    /// <returns>index of the root</returns>
+    int                     GetStreamRoot(int nStream) const { return nStream % GetRootCount(); }
+
+    /// <summary>
+    /// Get the folder of a session on a root
+    /// </summary>
+    /// <param name="nRoot">index of the root</param>
+    /// <param name="szSaveFolder">session folder relative to the root</param>
+    /// <param name="szSessionFolder">receives the session folder</param>
+    /// <param name="cchSessionFolder">size (in characters) of szSessionFolder</param>
+    void                    GetSessionFolder(int nRoot, LPCWSTR szSaveFolder, WCHAR* szSessionFolder, size_t cchSessionFolder) const;
+
+    /// <summary>
+    /// Write the manifest of a session to its folder on every root
+    /// </summary>
+    /// <param name="szSaveFolder">session folder relative to the roots</param>
+    /// <returns>indicates success or failure</returns>
+    HRESULT                 WriteManifest(LPCWSTR szSaveFolder) const;
+
+    /// <summary>
+    /// Get the folders of a session on all roots from its manifest
+    /// </summary>
+    /// <param name="szSessionFolder">folder of the session on any of its roots</param>
+    /// <param name="pvSessionFolders">receives the session folders, just szSessionFolder if there is no manifest</param>
+    static void             ReadManifest(LPCWSTR szSessionFolder, std::vector<std::wstring>* pvSessionFolders);
+
+    /// <summary>
+    /// List the frame files of a stream of a session across all of its roots, in time order
+    /// </summary>
+    /// <param name="szSessionFolder">folder of the session on any of its roots</param>
+    /// <param name="szStream">stream folder name ("ir", "depth" or "color")</param>
+    /// <param name="pvFiles">receives the full paths of the frame files</param>
+    static void             ListFrames(LPCWSTR szSessionFolder, LPCWSTR szStream, std::vector<std::wstring>* pvFiles);
+
+private:
+    std::vector<std::wstring> m_vRoots;
+    StripeMode              m_nMode;
+    int                     m_nNextRoot[3];
+};
@@ -0,0 +1,387 @@
+// ThreadPlacement.cpp
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Names, cores and priorities of the threads of the record pipeline
+
+
+#include "stdafx.h"
+#include <strsafe.h>
+#include <stdlib.h>
+#include <mutex>
+#include "ThreadPlacement.h"
+
+/// Names of the kinds of pipeline threads, as shown by debuggers and profilers
+static const WCHAR* s_szThreadNames[PipelineThread_Count] = { L"capture", L"save", L"shot", L"encoder", L"migrator", L"network" };
+
+/// Prefixes of the settings of each kind
+static const WCHAR* s_szSettingNames[PipelineThread_Count] = { L"Capture", L"Save", L"Shot", L"Encoder", L"Migrator", L"Network" };
+
+/// Thread priorities by their names in the settings
+static const struct
+{
+    LPCWSTR                 szName;
+    int                     nPriority;
+} s_priorities[] =
+{
+    { L"idle", THREAD_PRIORITY_IDLE },
+    { L"lowest", THREAD_PRIORITY_LOWEST },
+    { L"below", THREAD_PRIORITY_BELOW_NORMAL },
+    { L"normal", THREAD_PRIORITY_NORMAL },
+    { L"above", THREAD_PRIORITY_ABOVE_NORMAL },
+    { L"highest", THREAD_PRIORITY_HIGHEST },
+    { L"critical", THREAD_PRIORITY_TIME_CRITICAL }
+};
+
+/// SetThreadDescription needs Windows 10 (1607), so it is looked up
+typedef HRESULT (WINAPI *SetThreadDescriptionProc)(HANDLE hThread, PCWSTR lpThreadDescription);
+static const SetThreadDescriptionProc s_pSetThreadDescription =
+    reinterpret_cast<SetThreadDescriptionProc>(GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "SetThreadDescription"));
+
+static ThreadPlacement s_placements[PipelineThread_Count];
+static DWORD_PTR s_nIsolated = 0;                   // cores kept to the threads which were given them
+static ThreadPlacementReport s_reports[PipelineThread_Count];
+static UINT32 s_nFailed[PipelineThread_Count];      // threads of each kind which could not be placed and have not exited
+static std::mutex s_mReportMutex;
+
+/// <summary>
+/// Load the placement of the pipeline threads from the [Threads] section of the settings and
+/// set the priority class of the process. Threads are placed as they start, so this comes first.
+/// </summary>
+/// <param name="szSettingsFile">full path of the settings file</param>
+/// <returns>true if any thread or the process is placed other than by default</returns>
+bool LoadThreadPlacement(LPCWSTR szSettingsFile)
+{
+    bool bPlaced = false;
+    WCHAR szValue[256];
+
+    // Priority class of the process: "normal" (default), "above" or "high"
+    GetPrivateProfileStringW(L"Threads", L"PriorityClass", L"normal", szValue, _countof(szValue), szSettingsFile);
+    if (0 == _wcsicmp(szValue, L"above"))
+    {
+        bPlaced = SetPriorityClass(GetCurrentProcess(), ABOVE_NORMAL_PRIORITY_CLASS) != FALSE;
+    }
+    else if (0 == _wcsicmp(szValue, L"high"))
+    {
+        bPlaced = SetPriorityClass(GetCurrentProcess(), HIGH_PRIORITY_CLASS) != FALSE;
+    }
+
+    // Cores and priority of each kind of thread, e.g. CaptureCores=2 and CapturePriority=highest
+    DWORD_PTR nProcessAffinity = 0;
+    DWORD_PTR nSystemAffinity = 0;
+    GetProcessAffinityMask(GetCurrentProcess(), &nProcessAffinity, &nSystemAffinity);
+    s_nIsolated = 0;
+    for (int i = 0; i < PipelineThread_Count; ++i)
+    {
+        WCHAR szKey[32];
+        DWORD_PTR nAffinity = 0;
+        StringCchPrintfW(szKey, _countof(szKey), L"%sCores", s_szSettingNames[i]);
+        GetPrivateProfileStringW(L"Threads", szKey, L"", szValue, _countof(szValue), szSettingsFile);
+        s_placements[i].nAffinity = ParseCoreList(szValue, &nAffinity) ? (nAffinity & nProcessAffinity) : 0;
+        s_nIsolated |= s_placements[i].nAffinity;
+
+        StringCchPrintfW(szKey, _countof(szKey), L"%sPriority", s_szSettingNames[i]);
+        GetPrivateProfileStringW(L"Threads", szKey, L"normal", szValue, _countof(szValue), szSettingsFile);
+        s_placements[i].nPriority = THREAD_PRIORITY_NORMAL;
+        for (int p = 0; p < _countof(s_priorities); ++p)
+        {
+            if (0 == _wcsicmp(szValue, s_priorities[p].szName))
+            {
+                s_placements[i].nPriority = s_priorities[p].nPriority;
+            }
+        }
+
+        bPlaced = bPlaced || s_placements[i].nAffinity || THREAD_PRIORITY_NORMAL != s_placements[i].nPriority;
+    }
+
+    // With Isolate=1 the threads without cores of their own stay off the cores given to others
+    if (!GetPrivateProfileIntW(L"Threads", L"Isolate", 0, szSettingsFile))
+    {
+        s_nIsolated = 0;
+    }
+
+    return bPlaced;
+}
+
+/// <summary>
+/// Name and place a pipeline thread of a kind, and report its placement
+/// </summary>
+/// <param name="nThread">kind of the thread</param>
+/// <param name="hThread">the thread, by default the calling one</param>
+/// <returns>indicates success or failure, handed to UnplaceThread when the thread exits</returns>
+HRESULT PlaceThread(PipelineThread nThread, HANDLE hThread)
+{
+    DWORD_PTR nProcessAffinity = 0;
+    DWORD_PTR nSystemAffinity = 0;
+    GetProcessAffinityMask(GetCurrentProcess(), &nProcessAffinity, &nSystemAffinity);
+
+    // Threads without cores of their own stay off the isolated cores (any core if that leaves none)
+    ThreadPlacement placement = s_placements[nThread];
+    if (!placement.nAffinity && s_nIsolated)
+    {
+        placement.nAffinity = nProcessAffinity & ~s_nIsolated;
+    }
+
+    DWORD_PTR nAffinity = 0;
+    HRESULT hr = ApplyThreadPlacement(hThread, placement, &nAffinity);
+
+    std::lock_guard<std::mutex> lock(s_mReportMutex);
+    ThreadPlacementReport& report = s_reports[nThread];
+    ++report.nThreads;
+    if (s_pSetThreadDescription)
+    {
+        WCHAR szName[32];
+        StringCchPrintfW(szName, _countof(szName), (report.nThreads > 1) ? L"%s %u" : L"%s", s_szThreadNames[nThread], report.nThreads);
+        s_pSetThreadDescription(hThread, szName);
+    }
+    report.nAffinity = nAffinity;
+    report.nPriority = GetThreadPriority(hThread);
+    if (FAILED(hr))
+    {
+        ++s_nFailed[nThread];
+        if (SUCCEEDED(report.hr))
+        {
+            report.hr = hr;
+        }
+    }
+    return hr;
+}
+
+/// <summary>
+/// Take a thread which exits off the report of its kind
+/// </summary>
+/// <param name="nThread">kind of the thread</param>
+/// <param name="hrPlaced">result of PlaceThread for the thread</param>
+void UnplaceThread(PipelineThread nThread, HRESULT hrPlaced)
+{
+    // Helpers which come and go, such as the encoders of a replaced pool, leave the count and
+    // their failure with them
+    std::lock_guard<std::mutex> lock(s_mReportMutex);
+    ThreadPlacementReport& report = s_reports[nThread];
+    if (report.nThreads)
+    {
+        --report.nThreads;
+    }
+    if (FAILED(hrPlaced) && s_nFailed[nThread] && 0 == --s_nFailed[nThread])
+    {
+        report.hr = S_OK;
+    }
+}
+
+/// <summary>
+/// Set the cores and priority of a thread
+/// </summary>
+/// <param name="hThread">the thread</param>
+/// <param name="placement">placement of the thread</param>
+/// <param name="pnAffinity">receives the cores the thread runs on</param>
+/// <returns>indicates success or failure</returns>
+HRESULT ApplyThreadPlacement(HANDLE hThread, const ThreadPlacement& placement, DWORD_PTR* pnAffinity)
+{
+    DWORD_PTR nProcessAffinity = 0;
+    DWORD_PTR nSystemAffinity = 0;
+    GetProcessAffinityMask(GetCurrentProcess(), &nProcessAffinity, &nSystemAffinity);
+
+    // A thread without cores runs on any core of the process
+    HRESULT hr = S_OK;
+    DWORD_PTR nAffinity = placement.nAffinity ? (placement.nAffinity & nProcessAffinity) : nProcessAffinity;
+    *pnAffinity = nProcessAffinity;
+    if (!nAffinity)
+    {
+        hr = E_INVALIDARG;
+    }
+    else if (SetThreadAffinityMask(hThread, nAffinity))
+    {
+        *pnAffinity = nAffinity;
+    }
+    else
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    if (!SetThreadPriority(hThread, placement.nPriority) && SUCCEEDED(hr))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    return hr;
+}
+
+/// <summary>
+/// Get the effective placement of the pipeline threads of a kind
+/// </summary>
+/// <param name="nThread">kind of the threads</param>
+/// <param name="pReport">receives the placement, zero if no thread of the kind was placed</param>
+void GetThreadPlacementReport(PipelineThread nThread, ThreadPlacementReport* pReport)
+{
+    std::lock_guard<std::mutex> lock(s_mReportMutex);
+    *pReport = s_reports[nThread];
+}
+
+/// <summary>
+/// Format the effective placement of the pipeline threads on one line
+/// </summary>
+/// <param name="szPlacement">receives the placement</param>
+/// <param name="cchPlacement">size (in characters) of szPlacement</param>
+void FormatThreadPlacement(WCHAR* szPlacement, size_t cchPlacement)
+{
+    szPlacement[0] = L'\0';
+    for (int i = 0; i < PipelineThread_Count; ++i)
+    {
+        ThreadPlacementReport report;
+        GetThreadPlacementReport(static_cast<PipelineThread>(i), &report);
+        if (!report.nThreads)
+        {
+            continue;
+        }
+
+        WCHAR szCores[128];
+        WCHAR szThread[192];
+        FormatCoreList(report.nAffinity, szCores, _countof(szCores));
+        StringCchPrintfW(szThread, _countof(szThread), L"%s%s on %s (%s%s)", szPlacement[0] ? L"; " : L"", s_szThreadNames[i], szCores,
+            GetThreadPriorityName(report.nPriority), FAILED(report.hr) ? L", failed" : L"");
+        StringCchCatW(szPlacement, cchPlacement, szThread);
+    }
+}
+
+/// <summary>
+/// Write the effective placement of the pipeline threads to the [Threads] section of a report
+/// </summary>
+/// <param name="szReport">full path of the report</param>
+void WriteThreadPlacement(LPCWSTR szReport)
+{
+    DWORD dwPriorityClass = GetPriorityClass(GetCurrentProcess());
+    WritePrivateProfileStringW(L"Threads", L"PriorityClass", (HIGH_PRIORITY_CLASS == dwPriorityClass) ? L"high" : (ABOVE_NORMAL_PRIORITY_CLASS == dwPriorityClass) ? L"above" : L"normal", szReport);
+
+    for (int i = 0; i < PipelineThread_Count; ++i)
+    {
+        ThreadPlacementReport report;
+        GetThreadPlacementReport(static_cast<PipelineThread>(i), &report);
+        if (!report.nThreads)
+        {
+            continue;
+        }
+
+        WCHAR szKey[32];
+        WCHAR szValue[128];
+        StringCchPrintfW(szKey, _countof(szKey), L"%sThreads", s_szSettingNames[i]);
+        StringCchPrintfW(szValue, _countof(szValue), L"%u", report.nThreads);
+        WritePrivateProfileStringW(L"Threads", szKey, szValue, szReport);
+        StringCchPrintfW(szKey, _countof(szKey), L"%sCores", s_szSettingNames[i]);
+        FormatCoreList(report.nAffinity, szValue, _countof(szValue));
+        WritePrivateProfileStringW(L"Threads", szKey, szValue, szReport);
+        StringCchPrintfW(szKey, _countof(szKey), L"%sPriority", s_szSettingNames[i]);
+        WritePrivateProfileStringW(L"Threads", szKey, GetThreadPriorityName(report.nPriority), szReport);
+        if (FAILED(report.hr))
+        {
+            StringCchPrintfW(szKey, _countof(szKey), L"%sError", s_szSettingNames[i]);
+            StringCchPrintfW(szValue, _countof(szValue), L"0x%08x", report.hr);
+            WritePrivateProfileStringW(L"Threads", szKey, szValue, szReport);
+        }
+    }
+}
+
+/// <summary>
+/// Parse a list of cores such as "0,2-3"
+/// </summary>
+/// <param name="szCores">cores separated by ',', ranges as first-last</param>
+/// <param name="pnAffinity">receives the cores as an affinity mask</param>
+/// <returns>true if the list is valid</returns>
+bool ParseCoreList(LPCWSTR szCores, DWORD_PTR* pnAffinity)
+{
+    // An affinity mask covers the cores of one processor group
+    const long nCores = sizeof(DWORD_PTR) * 8;
+    DWORD_PTR nAffinity = 0;
+    LPCWSTR p = szCores;
+    while (*p)
+    {
+        WCHAR* pEnd = NULL;
+        long nFirst = wcstol(p, &pEnd, 10);
+        long nLast = nFirst;
+        if (pEnd == p)
+        {
+            return false;
+        }
+        p = pEnd;
+        if (L'-' == *p)
+        {
+            ++p;
+            nLast = wcstol(p, &pEnd, 10);
+            if (pEnd == p)
+            {
+                return false;
+            }
+            p = pEnd;
+        }
+        if (nFirst < 0 || nLast < nFirst || nLast >= nCores)
+        {
+            return false;
+        }
+        for (long i = nFirst; i <= nLast; ++i)
+        {
+            nAffinity |= static_cast<DWORD_PTR>(1) << i;
+        }
+
+        while (L' ' == *p)
+        {
+            ++p;
+        }
+        if (L',' == *p)
+        {
+            ++p;
+        }
+        else if (*p)
+        {
+            return false;
+        }
+    }
+
+    *pnAffinity = nAffinity;
+    return 0 != nAffinity;
+}
+
+/// <summary>
+/// Format an affinity mask as a list of cores such as "0,2-3"
+/// </summary>
+/// <param name="nAffinity">affinity mask</param>
+/// <param name="szCores">receives the list</param>
+/// <param name="cchCores">size (in characters) of szCores</param>
+void FormatCoreList(DWORD_PTR nAffinity, WCHAR* szCores, size_t cchCores)
+{
+    const int nCores = sizeof(DWORD_PTR) * 8;
+    szCores[0] = L'\0';
+    for (int i = 0; i < nCores; ++i)
+    {
+        if (!((nAffinity >> i) & 1))
+        {
+            continue;
+        }
+
+        int nLast = i;
+        while (nLast + 1 < nCores && ((nAffinity >> (nLast + 1)) & 1))
+        {
+            ++nLast;
+        }
+
+        WCHAR szRange[16];
+        StringCchPrintfW(szRange, _countof(szRange), (nLast > i) ? L"%s%d-%d" : L"%s%d", szCores[0] ? L"," : L"", i, nLast);
+        StringCchCatW(szCores, cchCores, szRange);
+        i = nLast;
+    }
+}
+
+/// <summary>
+/// Get the name of a thread priority as used by the settings
+/// </summary>
+/// <param name="nPriority">THREAD_PRIORITY_*</param>
+/// <returns>name of the priority, "normal" for other values</returns>
+LPCWSTR GetThreadPriorityName(int nPriority)
+{
+    for (int p = 0; p < _countof(s_priorities); ++p)
+    {
+        if (nPriority == s_priorities[p].nPriority)
+        {
+            return s_priorities[p].szName;
+        }
+    }
+    return L"normal";
+}
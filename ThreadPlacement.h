@@ -0,0 +1,113 @@
+// ThreadPlacement.h
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Names, cores and priorities of the threads of the record pipeline
+
+
+#pragma once
+
+#include <windows.h>
+
+/// Threads of the recorder which are placed by the [Threads] settings
+enum PipelineThread
+{
+    PipelineThread_Capture = 0,     // main thread: reads, converts and draws the frames
+    PipelineThread_Save,            // prepares the recorded frames and hands them to the writer
+    PipelineThread_Shot,            // saves the frame sets of shots
+    PipelineThread_Encoder,         // color encoders
+    PipelineThread_Migrator,        // migrates staged frames to the save folder
+    PipelineThread_Network,         // sends streamed frames and receives their acknowledgements
+    PipelineThread_Count
+};
+
+/// Placement of a thread
+struct ThreadPlacement
+{
+    DWORD_PTR               nAffinity;          // cores (logical processors) the thread runs on, 0 for any
+    int                     nPriority;          // THREAD_PRIORITY_*
+};
+
+/// Effective placement of the threads of a kind
+struct ThreadPlacementReport
+{
+    UINT32                  nThreads;           // threads placed which have not exited
+    DWORD_PTR               nAffinity;          // cores the last one runs on
+    int                     nPriority;          // priority of the last one
+    HRESULT                 hr;                 // first failure to place one of them, S_OK once those have exited
+};
+
+/// <summary>
+/// Load the placement of the pipeline threads from the [Threads] section of the settings and
+/// set the priority class of the process. Threads are placed as they start, so this comes first.
+/// </summary>
+/// <param name="szSettingsFile">full path of the settings file</param>
+/// <returns>true if any thread or the process is placed other than by default</returns>
+bool LoadThreadPlacement(LPCWSTR szSettingsFile);
+
+/// <summary>
+/// Name and place a pipeline thread of a kind, and report its placement
+/// </summary>
+/// <param name="nThread">kind of the thread</param>
+/// <param name="hThread">the thread, by default the calling one</param>
+/// <returns>indicates success or failure, handed to UnplaceThread when the thread exits</returns>
+HRESULT PlaceThread(PipelineThread nThread, HANDLE hThread = GetCurrentThread());
+
+/// <summary>
+/// Take a thread which exits off the report of its kind
+/// </summary>
+/// <param name="nThread">kind of the thread</param>
+/// <param name="hrPlaced">result of PlaceThread for the thread</param>
+void UnplaceThread(PipelineThread nThread, HRESULT hrPlaced);
+
+/// <summary>
+/// Set the cores and priority of a thread
+/// </summary>
+/// <param name="hThread">the thread</param>
+/// <param name="placement">placement of the thread</param>
+/// <param name="pnAffinity">receives the cores the thread runs on</param>
+/// <returns>indicates success or failure</returns>
+HRESULT ApplyThreadPlacement(HANDLE hThread, const ThreadPlacement& placement, DWORD_PTR* pnAffinity);
+
+/// <summary>
+/// Get the effective placement of the pipeline threads of a kind
+/// </summary>
+/// <param name="nThread">kind of the threads</param>
+/// <param name="pReport">receives the placement, zero if no thread of the kind was placed</param>
+void GetThreadPlacementReport(PipelineThread nThread, ThreadPlacementReport* pReport);
+
+/// <summary>
+/// Format the effective placement of the pipeline threads on one line
+/// </summary>
+/// <param name="szPlacement">receives the placement</param>
+/// <param name="cchPlacement">size (in characters) of szPlacement</param>
+void FormatThreadPlacement(WCHAR* szPlacement, size_t cchPlacement);
+
+/// <summary>
+/// Write the effective placement of the pipeline threads to the [Threads] section of a report
+/// </summary>
+/// <param name="szReport">full path of the report</param>
+void WriteThreadPlacement(LPCWSTR szReport);
+
+/// <summary>
+/// Parse a list of cores such as "0,2-3"
+/// </summary>
+/// <param name="szCores">cores separated by ',', ranges as first-last</param>
+/// <param name="pnAffinity">receives the cores as an affinity mask</param>
+/// <returns>true if the list is valid</returns>
+bool ParseCoreList(LPCWSTR szCores, DWORD_PTR* pnAffinity);
+
+/// <summary>
+/// Format an affinity mask as a list of cores such as "0,2-3"
+/// </summary>
+/// <param name="nAffinity">affinity mask</param>
+/// <param name="szCores">receives the list</param>
+/// <param name="cchCores">size (in characters) of szCores</param>
+void FormatCoreList(DWORD_PTR nAffinity, WCHAR* szCores, size_t cchCores);
+
+/// <summary>
+/// Get the name of a thread priority as used by the settings
+/// </summary>
+/// <param name="nPriority">THREAD_PRIORITY_*</param>
+/// <returns>name of the priority, "normal" for other values</returns>
+LPCWSTR GetThreadPriorityName(int nPriority);
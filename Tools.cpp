@@ -0,0 +1,126 @@
+// Tools.cpp
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Command line tools which run instead of the recorder UI
+
+
+#include "stdafx.h"
+#include <stdio.h>
+#include "Tools.h"
+#include "Benchmark.h"
+#include "Converter.h"
+#include "FrameStream.h"
+#include "PointCloud.h"
+#include "Registration.h"
+#include "Verifier.h"
+
+/// <summary>
+/// Attach the standard output to the console of the parent process (or a new console)
+/// </summary>
+void OpenConsole()
+{
+    if (!AttachConsole(ATTACH_PARENT_PROCESS))
+    {
+        AllocConsole();
+    }
+
+    FILE* pFile = NULL;
+    freopen_s(&pFile, "CONOUT$", "w", stdout);
+    freopen_s(&pFile, "CONOUT$", "w", stderr);
+    wprintf(L"\n");
+}
+
+/// <summary>
+/// Print the usage of the command line tools
+/// </summary>
+static void PrintUsage()
+{
+    wprintf(L"Usage:\n");
+    wprintf(L"  KinectV2Recorder /benchmark writer <folder> [frames]\n");
+    wprintf(L"  KinectV2Recorder /benchmark load <folder> [seconds] [queue depth]\n");
+    wprintf(L"  KinectV2Recorder /benchmark stripe <folder;folder;...> [frames] [queue depth]\n");
+    wprintf(L"  KinectV2Recorder /benchmark replay <folder> [frames] [prefetch depth]\n");
+    wprintf(L"  KinectV2Recorder /benchmark checksum <folder> [frames]\n");
+    wprintf(L"  KinectV2Recorder /benchmark pointcloud [frames]\n");
+    wprintf(L"  KinectV2Recorder /benchmark registration [frames]\n");
+    wprintf(L"  KinectV2Recorder /benchmark pack [frames]\n");
+    wprintf(L"  KinectV2Recorder /benchmark delta <session> [keyframe interval] [frames]\n");
+    wprintf(L"  KinectV2Recorder /benchmark color <session> [threads] [frames] [quality]\n");
+    wprintf(L"  KinectV2Recorder /benchmark dedup [frames]\n");
+    wprintf(L"  KinectV2Recorder /benchmark publish [frames] [readers]\n");
+    wprintf(L"  KinectV2Recorder /benchmark stream <folder> [seconds] [queue depth] [port]\n");
+    wprintf(L"  KinectV2Recorder /benchmark threads [seconds] [load threads] [core]\n");
+    wprintf(L"  KinectV2Recorder /benchmark slab [frames]\n");
+    wprintf(L"  KinectV2Recorder /convert <source> <destination> <images|kvr> [workers] [/compress]\n");
+    wprintf(L"  KinectV2Recorder /verify <session> [workers] [/checksums] [/report <folder>]\n");
+    wprintf(L"  KinectV2Recorder /pointcloud <session> <destination> <intrinsics.ini> [workers] [/ir]\n");
+    wprintf(L"  KinectV2Recorder /register <session> <destination> <calibration.ini> <color|depth> [workers]\n");
+    wprintf(L"  KinectV2Recorder /receive <folder> [port] [buffered|unbuffered|overlapped]\n");
+}
+
+/// <summary>
+/// Run the command line tool named by the command line, if any
+/// </summary>
+/// <param name="lpCmdLine">command line arguments</param>
+/// <param name="pnExitCode">exit code of the tool</param>
+/// <returns>true if a tool was run, false if the recorder should be started</returns>
+bool RunTool(LPWSTR lpCmdLine, int* pnExitCode)
+{
+    if (!lpCmdLine || !lpCmdLine[0])
+    {
+        return false;
+    }
+
+    int argc = 0;
+    LPWSTR* argv = CommandLineToArgvW(lpCmdLine, &argc);
+    if (!argv)
+    {
+        return false;
+    }
+
+    bool bTool = true;
+    if (argc >= 2 && 0 == _wcsicmp(argv[0], L"/benchmark"))
+    {
+        OpenConsole();
+        *pnExitCode = RunBenchmark(argc - 1, argv + 1);
+    }
+    else if (argc >= 1 && 0 == _wcsicmp(argv[0], L"/convert"))
+    {
+        OpenConsole();
+        *pnExitCode = RunConvert(argc - 1, argv + 1);
+    }
+    else if (argc >= 1 && 0 == _wcsicmp(argv[0], L"/verify"))
+    {
+        OpenConsole();
+        *pnExitCode = RunVerify(argc - 1, argv + 1);
+    }
+    else if (argc >= 1 && 0 == _wcsicmp(argv[0], L"/pointcloud"))
+    {
+        OpenConsole();
+        *pnExitCode = RunPointCloud(argc - 1, argv + 1);
+    }
+    else if (argc >= 1 && 0 == _wcsicmp(argv[0], L"/register"))
+    {
+        OpenConsole();
+        *pnExitCode = RunRegistration(argc - 1, argv + 1);
+    }
+    else if (argc >= 1 && 0 == _wcsicmp(argv[0], L"/receive"))
+    {
+        OpenConsole();
+        *pnExitCode = RunReceive(argc - 1, argv + 1);
+    }
+    else if (argc >= 1 && (0 == _wcsicmp(argv[0], L"/?") || 0 == _wcsicmp(argv[0], L"/help")))
+    {
+        OpenConsole();
+        PrintUsage();
+        *pnExitCode = 0;
+    }
+    else
+    {
+        bTool = false;
+    }
+
+    LocalFree(argv);
+    return bTool;
+}
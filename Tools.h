@@ -0,0 +1,23 @@
+// Tools.h
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Command line tools which run instead of the recorder UI
+
+
+#pragma once
+
+#include <windows.h>
+
+/// <summary>
+/// Run the command line tool named by the command line, if any
+/// </summary>
+/// <param name="lpCmdLine">command line arguments</param>
+/// <param name="pnExitCode">exit code of the tool</param>
+/// <returns>true if a tool was run, false if the recorder should be started</returns>
+bool RunTool(LPWSTR lpCmdLine, int* pnExitCode);
+
+/// <summary>
+/// Attach the standard output to the console of the parent process (or a new console)
+/// </summary>
+void OpenConsole();
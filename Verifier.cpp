@@ -0,0 +1,814 @@
+// Verifier.cpp
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Offline integrity verification of recorded sessions
+
+
+#include "stdafx.h"
+#include <strsafe.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include "Verifier.h"
+#include "Crc32c.h"
+#include "FrameAnalyzer.h"
+#include "RecordFile.h"
+#include "ReplayReader.h"
+#include "Stripe.h"
+
+namespace
+{
+    const UINT32 cStreamWidths[3] = { 512, 512, 1920 };
+    const UINT32 cStreamHeights[3] = { 424, 424, 1080 };
+    const WCHAR* cStreamNames[3] = { L"ir", L"depth", L"color" };
+    const WCHAR* cRecordFileNames[3] = { L"ir.kvr", L"depth.kvr", L"color.kvr" };
+
+    // Same tolerance between the color and the infrared frame of a set as CheckImages (10 ms)
+    const INT64 cColorOffsetTolerance = 100000;
+
+    // Number of frames a worker verifies at once
+    const UINT32 cChunkFrames = 256;
+
+    // Size (in bytes) which holds the header of every image format, including the segments of a
+    // JPEG in front of its frame header
+    const DWORD cImageHeaderSize = 4096;
+
+    /// Problems found with a frame
+    enum VerifyError
+    {
+        VerifyError_Open = 0x01,        // the frame cannot be opened or read
+        VerifyError_Header = 0x02,      // the header is invalid or does not match the stream
+        VerifyError_Size = 0x04,        // the file or record is shorter or longer than its header says
+        VerifyError_Order = 0x08,       // the time is not later than the time of the previous frame
+        VerifyError_Sync = 0x10,        // the time does not match the infrared frame of the set
+        VerifyError_Checksum = 0x20     // the pixel data differs from the recorded checksum
+    };
+    const int cErrorKinds = 6;
+    const WCHAR* cErrorNames[cErrorKinds] = { L"open", L"header", L"size", L"order", L"sync", L"checksum" };
+
+    /// Result of the verification of a frame
+    struct VerifyFrame
+    {
+        INT64               nTime;
+        UINT32              nChecksum;          // CRC32C of the pixel data
+        UINT32              nRecordedChecksum;  // CRC32C stored by the recorder, if any
+        UINT32              nErrors;            // VerifyError flags
+        bool                bRecordedChecksum;
+    };
+
+    /// A session being verified, shared by the workers
+    struct VerifySession
+    {
+        ReplayLayout        nLayout;
+        bool                bChecksums;
+        std::vector<std::wstring> vFiles[3];    // image files
+        std::wstring        sRecordFiles[3];    // record files
+        RecordFileHeader    header[3];
+        UINT                nDecimation[3];     // every how many frame sets each stream was recorded, 0 if off
+        UINT32              nWidth[3];          // size (in pixels) of the recorded frames of each stream
+        UINT32              nHeight[3];
+        bool                bLossy[3];          // the recorded checksums are the ones before a lossy codec
+        std::wstring        sFileProblem[3];    // problem of a whole stream, empty if none
+        std::vector<VerifyFrame> vFrames[3];
+        std::vector<std::pair<int, UINT32> > vChunks;   // stream and first frame of each chunk
+        std::atomic<size_t> nNextChunk;
+        std::atomic<ULONGLONG> cbRead;
+    };
+
+    /// <summary>
+    /// Check whether the format of a frame matches its stream
+    /// </summary>
+    /// <param name="pSession">session of the frame</param>
+    /// <param name="nStream">stream of the frame</param>
+    /// <param name="nWidth">width (in pixels) of the frame</param>
+    /// <param name="nHeight">height (in pixels) of the frame</param>
+    /// <param name="nPixelFormat">pixel format of the frame</param>
+    /// <param name="cbData">size (in bytes) of the pixel data</param>
+    /// <returns>true if the format is one the recorder writes for the stream</returns>
+    bool IsStreamFormat(const VerifySession* pSession, int nStream, UINT32 nWidth, UINT32 nHeight, RecordPixelFormat nPixelFormat, UINT32 cbData)
+    {
+        // The size of packed, delta coded and encoded pixel data follows from their header, a
+        // duplicate has none and fits any stream
+        bool bPacked = (RecordPixelFormat_Gray16Packed == nPixelFormat) || (RecordPixelFormat_Gray16Delta == nPixelFormat);
+        bool bGray = bPacked || (RecordPixelFormat_Gray16BE == nPixelFormat);
+        bool bEncoded = (RecordPixelFormat_ColorEncoded == nPixelFormat);
+        bool bDuplicate = (RecordPixelFormat_Duplicate == nPixelFormat);
+        UINT32 cbPixel = bGray ? sizeof(UINT16) : sizeof(RGBTRIPLE);
+        return nWidth == pSession->nWidth[nStream] && nHeight == pSession->nHeight[nStream] &&
+            (bDuplicate || bGray == (2 != nStream)) && (bPacked || bEncoded || bDuplicate || cbData == nWidth * nHeight * cbPixel);
+    }
+
+    /// <summary>
+    /// Verify an image file
+    /// </summary>
+    /// <param name="pSession">session of the frame</param>
+    /// <param name="nStream">stream of the frame</param>
+    /// <param name="nIndex">index of the frame in the stream</param>
+    /// <param name="pvBuffer">buffer of the worker</param>
+    /// <param name="pvUnpacked">buffer of the worker for packed and delta coded frames</param>
+    /// <param name="pDecoder">decoder of the worker for delta coded frames of the stream</param>
+    /// <param name="pvReference">buffer of the worker for the images a delta coded or duplicate frame refers to</param>
+    /// <param name="pCoder">coder of the worker for encoded color images</param>
+    /// <param name="pvDecoded">buffer of the worker for encoded color frames</param>
+    void VerifyImage(VerifySession* pSession, int nStream, UINT32 nIndex, std::vector<BYTE>* pvBuffer, std::vector<UINT16>* pvUnpacked,
+        DepthDeltaDecoder* pDecoder, std::vector<BYTE>* pvReference, ColorCoder* pCoder, std::vector<RGBTRIPLE>* pvDecoded)
+    {
+        const std::wstring& sFilePath = pSession->vFiles[nStream][nIndex];
+        VerifyFrame& result = pSession->vFrames[nStream][nIndex];
+
+        // Image files are named by their time in seconds
+        size_t nName = sFilePath.find_last_of(L'\\');
+        result.nTime = static_cast<INT64>(wcstod(sFilePath.c_str() + ((std::wstring::npos == nName) ? 0 : nName + 1), NULL) * 10000000. + 0.5);
+
+        HANDLE hFile = CreateFileW(sFilePath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (INVALID_HANDLE_VALUE == hFile)
+        {
+            result.nErrors |= VerifyError_Open;
+            return;
+        }
+
+        // Without checksums only the header is read
+        LARGE_INTEGER cbFile = { 0 };
+        DWORD dwBytesRead = 0;
+        BOOL bRead = GetFileSizeEx(hFile, &cbFile) && cbFile.QuadPart < MAXDWORD;
+        if (bRead)
+        {
+            DWORD cbRead = pSession->bChecksums ? cbFile.LowPart : min(cbFile.LowPart, cImageHeaderSize);
+            pvBuffer->resize(max(1ul, cbRead));
+            bRead = ReadFile(hFile, pvBuffer->data(), cbRead, &dwBytesRead, NULL) && dwBytesRead == cbRead;
+        }
+        CloseHandle(hFile);
+        if (!bRead)
+        {
+            result.nErrors |= VerifyError_Open;
+            return;
+        }
+        pSession->cbRead += dwBytesRead;
+
+        ReplayFrame frame;
+        if (FAILED(ParseImageHeader(pvBuffer->data(), dwBytesRead, &frame)) ||
+            !IsStreamFormat(pSession, nStream, frame.nWidth, frame.nHeight, frame.nPixelFormat, frame.cbData))
+        {
+            result.nErrors |= VerifyError_Header;
+            return;
+        }
+
+        // The size of an encoded image shows when it is decoded
+        UINT32 cbHeader = static_cast<UINT32>(frame.pData - pvBuffer->data());
+        if (RecordPixelFormat_ColorEncoded != frame.nPixelFormat && cbHeader + frame.cbData != cbFile.QuadPart)
+        {
+            result.nErrors |= VerifyError_Size;
+            return;
+        }
+
+        // The checksum of a duplicate frame is the one of the frame it repeats, which is read
+        // and checked in its place
+        if (pSession->bChecksums && RecordPixelFormat_Duplicate == frame.nPixelFormat)
+        {
+            ReplayFrame duplicate = frame;
+            if (FAILED(ReadDuplicateImage(pSession->vFiles[nStream], nIndex, duplicate, pvReference, &frame)))
+            {
+                result.nErrors |= VerifyError_Checksum;
+                return;
+            }
+            pSession->cbRead += pvReference->size();
+        }
+
+        // The checksum of a packed frame is the one of the frame unpacked
+        if (pSession->bChecksums && RecordPixelFormat_Gray16Packed == frame.nPixelFormat)
+        {
+            pvUnpacked->resize(frame.nWidth * frame.nHeight);
+            UnpackGray(frame.pData, frame.nWidth * frame.nHeight, frame.packing, pvUnpacked->data());
+            result.nChecksum = ComputeCrc32c(pvUnpacked->data(), pvUnpacked->size() * sizeof(UINT16));
+        }
+        else if (pSession->bChecksums && RecordPixelFormat_Gray16Delta == frame.nPixelFormat)
+        {
+            // So is the one of a delta coded frame. The frames of a chunk are decoded in order,
+            // only its first one is decoded from its keyframe on.
+            pvUnpacked->resize(frame.nWidth * frame.nHeight);
+            if (FAILED(DecodeDeltaImage(pSession->vFiles[nStream], nIndex, frame, pDecoder, pvReference, pvUnpacked->data())))
+            {
+                result.nErrors |= VerifyError_Checksum;
+                return;
+            }
+            result.nChecksum = ComputeCrc32c(pvUnpacked->data(), pvUnpacked->size() * sizeof(UINT16));
+        }
+        else if (pSession->bChecksums && RecordPixelFormat_ColorEncoded == frame.nPixelFormat)
+        {
+            // And the one of an encoded frame, in the channel order the recorder held it in
+#ifdef COLOR_BMP
+            const bool bRedFirst = false;
+#else
+            const bool bRedFirst = true;
+#endif
+            pvDecoded->resize(frame.nWidth * frame.nHeight);
+            if (FAILED(pCoder->Decode(frame.nCodec, frame.pData, frame.cbData, frame.nWidth, frame.nHeight, bRedFirst, pvDecoded->data())))
+            {
+                result.nErrors |= VerifyError_Checksum;
+                return;
+            }
+            result.nChecksum = ComputeCrc32c(pvDecoded->data(), pvDecoded->size() * sizeof(RGBTRIPLE));
+        }
+        else if (pSession->bChecksums)
+        {
+            result.nChecksum = ComputeCrc32c(frame.pData, frame.cbData);
+        }
+    }
+
+    /// <summary>
+    /// Verify a frame record of a record file
+    /// </summary>
+    /// <param name="pSession">session of the frame</param>
+    /// <param name="hFile">record file of the stream, opened by the worker</param>
+    /// <param name="nStream">stream of the frame</param>
+    /// <param name="nIndex">index of the frame in the stream</param>
+    /// <param name="pvBuffer">buffer of the worker</param>
+    void VerifyRecord(VerifySession* pSession, HANDLE hFile, int nStream, UINT32 nIndex, std::vector<BYTE>* pvBuffer)
+    {
+        const RecordFileHeader& header = pSession->header[nStream];
+        VerifyFrame& result = pSession->vFrames[nStream][nIndex];
+
+        // Without checksums only the frame header is read
+        DWORD cbRead = sizeof(RecordFrameHeader) + (pSession->bChecksums ? header.cbFrame : 0);
+        ULONGLONG nOffset = RecordFileHeaderSize + ULONGLONG(nIndex) * header.cbRecord;
+        OVERLAPPED overlapped = { 0 };
+        overlapped.Offset = DWORD(nOffset);
+        overlapped.OffsetHigh = DWORD(nOffset >> 32);
+
+        pvBuffer->resize(cbRead);
+        DWORD dwBytesRead = 0;
+        if (!ReadFile(hFile, pvBuffer->data(), cbRead, &dwBytesRead, &overlapped))
+        {
+            result.nErrors |= VerifyError_Open;
+            return;
+        }
+        pSession->cbRead += dwBytesRead;
+        if (dwBytesRead != cbRead)
+        {
+            result.nErrors |= VerifyError_Size;
+            return;
+        }
+
+        const RecordFrameHeader* pFrameHeader = reinterpret_cast<const RecordFrameHeader*>(pvBuffer->data());
+        result.nTime = pFrameHeader->nTime;
+        if (pFrameHeader->nIndex != nIndex || pFrameHeader->cbData != header.cbFrame)
+        {
+            result.nErrors |= VerifyError_Header;
+            return;
+        }
+
+        if (pSession->bChecksums)
+        {
+            result.nChecksum = ComputeCrc32c(pvBuffer->data() + sizeof(RecordFrameHeader), header.cbFrame);
+            result.nRecordedChecksum = pFrameHeader->nChecksum;
+            result.bRecordedChecksum = (header.nVersion >= 2);
+        }
+    }
+
+    /// <summary>
+    /// Verify the chunks of a session until none is left
+    /// </summary>
+    /// <param name="pSession">session to work on</param>
+    void VerifyChunks(VerifySession* pSession)
+    {
+        std::vector<BYTE> vBuffer;
+        std::vector<UINT16> vUnpacked;
+        std::vector<BYTE> vReference;
+        std::vector<RGBTRIPLE> vDecoded;
+        DepthDeltaDecoder decoders[3];
+        ColorCoder coder;
+        HANDLE hRecordFiles[3] = { INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE };
+
+        for (size_t c = pSession->nNextChunk++; c < pSession->vChunks.size(); c = pSession->nNextChunk++)
+        {
+            int nStream = pSession->vChunks[c].first;
+            UINT32 nBegin = pSession->vChunks[c].second;
+            UINT32 nEnd = min(nBegin + cChunkFrames, static_cast<UINT32>(pSession->vFrames[nStream].size()));
+
+            // Each worker reads the record files through its own handles
+            if (ReplayLayout_RecordFiles == pSession->nLayout && INVALID_HANDLE_VALUE == hRecordFiles[nStream])
+            {
+                hRecordFiles[nStream] = CreateFileW(pSession->sRecordFiles[nStream].c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            }
+
+            for (UINT32 i = nBegin; i < nEnd; ++i)
+            {
+                if (ReplayLayout_Images == pSession->nLayout)
+                {
+                    VerifyImage(pSession, nStream, i, &vBuffer, &vUnpacked, &decoders[nStream], &vReference, &coder, &vDecoded);
+                }
+                else if (INVALID_HANDLE_VALUE != hRecordFiles[nStream])
+                {
+                    VerifyRecord(pSession, hRecordFiles[nStream], nStream, i, &vBuffer);
+                }
+                else
+                {
+                    pSession->vFrames[nStream][i].nErrors |= VerifyError_Open;
+                }
+            }
+        }
+
+        for (int i = 0; i < 3; ++i)
+        {
+            if (INVALID_HANDLE_VALUE != hRecordFiles[i])
+            {
+                CloseHandle(hRecordFiles[i]);
+            }
+        }
+    }
+
+    /// <summary>
+    /// Open the record files of a session and check their file headers
+    /// </summary>
+    /// <param name="szSessionFolder">folder of the session on any of its record roots</param>
+    /// <param name="pSession">receives the record files, their headers and the frames to verify</param>
+    /// <returns>true if the session has record files</returns>
+    bool FindRecordFiles(LPCWSTR szSessionFolder, VerifySession* pSession)
+    {
+        std::vector<std::wstring> vSessionFolders;
+        StripeLayout::ReadManifest(szSessionFolder, &vSessionFolders);
+
+        bool bFound = false;
+        for (int s = 0; s < 3; ++s)
+        {
+            // Each stream of a record session stays on one root, which may be any of them
+            HANDLE hFile = INVALID_HANDLE_VALUE;
+            for (size_t r = 0; r < vSessionFolders.size() && INVALID_HANDLE_VALUE == hFile; ++r)
+            {
+                pSession->sRecordFiles[s] = vSessionFolders[r] + L"\\" + cRecordFileNames[s];
+                hFile = CreateFileW(pSession->sRecordFiles[s].c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            }
+            if (INVALID_HANDLE_VALUE == hFile)
+            {
+                pSession->sFileProblem[s] = L"missing";
+                continue;
+            }
+            bFound = true;
+
+            RecordFileHeader& header = pSession->header[s];
+            LARGE_INTEGER cbFile = { 0 };
+            DWORD dwBytesRead = 0;
+            BOOL bRead = GetFileSizeEx(hFile, &cbFile) && ReadFile(hFile, &header, sizeof(header), &dwBytesRead, NULL) && dwBytesRead == sizeof(header);
+            CloseHandle(hFile);
+
+            if (!bRead || 0 != memcmp(header.szMagic, "KV2REC", 6) || header.nStream != static_cast<UINT32>(s) ||
+                !IsStreamFormat(pSession, s, header.nWidth, header.nHeight, static_cast<RecordPixelFormat>(header.nPixelFormat), header.cbFrame) ||
+                header.cbRecord != GetRecordSize(header.cbFrame))
+            {
+                pSession->sFileProblem[s] = L"header";
+                continue;
+            }
+
+            // Frames beyond the end of a cut off file are reported at once instead of by frame
+            ULONGLONG nFrames = (max(RecordFileHeaderSize, cbFile.QuadPart) - RecordFileHeaderSize) / header.cbRecord;
+            if (ULONGLONG(RecordFileHeaderSize) + ULONGLONG(header.nFrames) * header.cbRecord != ULONGLONG(cbFile.QuadPart))
+            {
+                pSession->sFileProblem[s] = L"size";
+            }
+            pSession->vFrames[s].resize(static_cast<size_t>(min(nFrames, ULONGLONG(header.nFrames))));
+        }
+
+        return bFound;
+    }
+
+    /// <summary>
+    /// Read the streams, their decimation, the size of their frames and their codec from the
+    /// report the recorder wrote with the session. Sessions recorded before streams could be
+    /// selected or cropped have all streams at full rate and size.
+    /// </summary>
+    /// <param name="szSessionFolder">folder of the session on any of its record roots</param>
+    /// <param name="pSession">receives the decimation, frame size and codec of each stream</param>
+    void LoadSessionStreams(LPCWSTR szSessionFolder, VerifySession* pSession)
+    {
+        // The report is written to the session folder on the first root
+        std::vector<std::wstring> vSessionFolders;
+        StripeLayout::ReadManifest(szSessionFolder, &vSessionFolders);
+        WCHAR szReport[MAX_PATH];
+        GetFullPathNameW((vSessionFolders[0] + L"\\session.ini").c_str(), _countof(szReport), szReport, NULL);
+
+        const WCHAR* szSections[] = { L"Infrared", L"Depth", L"Color" };
+        for (int s = 0; s < 3; ++s)
+        {
+            pSession->nDecimation[s] = GetPrivateProfileIntW(szSections[s], L"Decimation", 1, szReport);
+            pSession->nWidth[s] = GetPrivateProfileIntW(szSections[s], L"Width", cStreamWidths[s], szReport);
+            pSession->nHeight[s] = GetPrivateProfileIntW(szSections[s], L"Height", cStreamHeights[s], szReport);
+
+            WCHAR szCodec[32];
+            GetPrivateProfileStringW(szSections[s], L"Codec", L"none", szCodec, _countof(szCodec), szReport);
+            pSession->bLossy[s] = (ColorCodec_Jpeg == ParseColorCodec(szCodec));
+        }
+    }
+
+    /// <summary>
+    /// Take the checksums of the frames from the index the recorder wrote with the session
+    /// </summary>
+    /// <param name="szSessionFolder">folder of the session on any of its record roots</param>
+    /// <param name="pSession">verified session, whose frames receive the checksums of the same time</param>
+    /// <returns>true if the index holds checksums</returns>
+    bool LoadIndexChecksums(LPCWSTR szSessionFolder, VerifySession* pSession)
+    {
+        // The index is written to the session folder on the first root
+        std::vector<std::wstring> vSessionFolders;
+        StripeLayout::ReadManifest(szSessionFolder, &vSessionFolders);
+        std::wstring sIndexPath = vSessionFolders[0] + L"\\index.csv";
+
+        FILE* pFile = NULL;
+        if (0 != _wfopen_s(&pFile, sIndexPath.c_str(), L"r"))
+        {
+            return false;
+        }
+
+        // Frames which failed to write are in the index but not on disk, so the frames are
+        // matched by time rather than by index
+        const CHAR* szStreams[] = { "ir", "depth", "color" };
+        size_t nNext[3] = { 0 };
+        bool bFound = false;
+        CHAR szLine[128];
+        CHAR szStream[16];
+        UINT nIndex = 0;
+        double fTime = 0.;
+        UINT nChecksum = 0;
+        while (fgets(szLine, sizeof(szLine), pFile))
+        {
+            if (4 != sscanf_s(szLine, "%15[^,],%u,%lf,%x", szStream, static_cast<unsigned>(_countof(szStream)), &nIndex, &fTime, &nChecksum))
+            {
+                continue;
+            }
+            for (int s = 0; s < 3; ++s)
+            {
+                if (0 != strcmp(szStream, szStreams[s]))
+                {
+                    continue;
+                }
+
+                // Both the index and the frames are in time order
+                INT64 nTime = static_cast<INT64>(fTime * 10000000. + 0.5);
+                std::vector<VerifyFrame>& vFrames = pSession->vFrames[s];
+                while (nNext[s] < vFrames.size() && vFrames[nNext[s]].nTime < nTime)
+                {
+                    ++nNext[s];
+                }
+                if (nNext[s] < vFrames.size() && vFrames[nNext[s]].nTime == nTime)
+                {
+                    vFrames[nNext[s]].nRecordedChecksum = nChecksum;
+                    vFrames[nNext[s]].bRecordedChecksum = true;
+                    bFound = true;
+                }
+            }
+        }
+
+        fclose(pFile);
+        return bFound;
+    }
+
+    /// <summary>
+    /// Compare the checksums of the frames with the ones stored by the recorder
+    /// </summary>
+    /// <param name="pSession">verified session</param>
+    /// <returns>true if the recorder stored checksums</returns>
+    bool CompareRecordedChecksums(VerifySession* pSession)
+    {
+        bool bFound = false;
+        for (int s = 0; s < 3; ++s)
+        {
+            // A lossy codec changes the frame, which still has to decode
+            if (pSession->bLossy[s])
+            {
+                continue;
+            }
+
+            for (size_t i = 0; i < pSession->vFrames[s].size(); ++i)
+            {
+                VerifyFrame& frame = pSession->vFrames[s][i];
+                if (frame.bRecordedChecksum && !(frame.nErrors & (VerifyError_Open | VerifyError_Header | VerifyError_Size)))
+                {
+                    bFound = true;
+                    if (frame.nChecksum != frame.nRecordedChecksum)
+                    {
+                        frame.nErrors |= VerifyError_Checksum;
+                    }
+                }
+            }
+        }
+        return bFound;
+    }
+
+    /// <summary>
+    /// Record the checksums of a session, or compare them with the recorded ones
+    /// </summary>
+    /// <param name="pSession">verified session</param>
+    /// <param name="szChecksumsPath">full file path of the checksum list</param>
+    /// <returns>true if the checksums were compared, false if they were recorded</returns>
+    bool CompareChecksums(VerifySession* pSession, LPCWSTR szChecksumsPath)
+    {
+        FILE* pFile = NULL;
+        if (0 == _wfopen_s(&pFile, szChecksumsPath, L"r"))
+        {
+            CHAR szLine[128];
+            CHAR szStream[16];
+            UINT nIndex = 0;
+            UINT nChecksum = 0;
+            while (fgets(szLine, sizeof(szLine), pFile))
+            {
+                if (3 != sscanf_s(szLine, "%15[^,],%u,%x", szStream, static_cast<unsigned>(_countof(szStream)), &nIndex, &nChecksum))
+                {
+                    continue;
+                }
+                for (int s = 0; s < 3; ++s)
+                {
+                    WCHAR szName[16];
+                    StringCchPrintfW(szName, _countof(szName), L"%S", szStream);
+                    if (0 == wcscmp(szName, cStreamNames[s]) && nIndex < pSession->vFrames[s].size() &&
+                        !(pSession->vFrames[s][nIndex].nErrors & (VerifyError_Open | VerifyError_Header | VerifyError_Size)) &&
+                        pSession->vFrames[s][nIndex].nChecksum != nChecksum)
+                    {
+                        pSession->vFrames[s][nIndex].nErrors |= VerifyError_Checksum;
+                    }
+                }
+            }
+            fclose(pFile);
+            return true;
+        }
+
+        HANDLE hFile = CreateFileW(szChecksumsPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (INVALID_HANDLE_VALUE == hFile)
+        {
+            return false;
+        }
+
+        const CHAR* szStreams[] = { "ir", "depth", "color" };
+        std::string sChecksums = "stream,index,checksum\r\n";
+        for (int s = 0; s < 3; ++s)
+        {
+            for (size_t i = 0; i < pSession->vFrames[s].size(); ++i)
+            {
+                CHAR szLine[128];
+                sprintf_s(szLine, "%s,%u,%08x\r\n", szStreams[s], static_cast<UINT>(i), pSession->vFrames[s][i].nChecksum);
+                sChecksums += szLine;
+            }
+        }
+
+        DWORD dwBytesWritten = 0;
+        WriteFile(hFile, sChecksums.data(), static_cast<DWORD>(sChecksums.size()), &dwBytesWritten, NULL);
+        CloseHandle(hFile);
+        return false;
+    }
+}
+
+/// <summary>
+/// Verify the frames of a recorded session on disk
+/// </summary>
+/// <param name="argc">number of arguments</param>
+/// <param name="argv">session folder, (optional) number of workers, /checksums and /report with its folder</param>
+/// <returns>0 if the session passed, otherwise failure</returns>
+int RunVerify(int argc, LPWSTR* argv)
+{
+    if (argc < 1)
+    {
+        wprintf(L"Usage: KinectV2Recorder /verify <session> [workers] [/checksums] [/report <folder>]\n");
+        return 1;
+    }
+
+    LPCWSTR szSessionFolder = argv[0];
+    LPCWSTR szReportFolder = argv[0];
+    int nWorkers = max(1, static_cast<int>(std::thread::hardware_concurrency()));
+
+    VerifySession session;
+    session.bChecksums = false;
+    session.nNextChunk = 0;
+    session.cbRead = 0;
+    ZeroMemory(session.header, sizeof(session.header));
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (0 == _wcsicmp(argv[i], L"/checksums"))
+        {
+            session.bChecksums = true;
+        }
+        else if (0 == _wcsicmp(argv[i], L"/report") && i + 1 < argc)
+        {
+            szReportFolder = argv[++i];
+        }
+        else
+        {
+            nWorkers = max(1, _wtoi(argv[i]));
+        }
+    }
+
+    ULONGLONG nStart = GetTickCount64();
+
+    // The frames are checked against the streams and the region the session was recorded with
+    LoadSessionStreams(szSessionFolder, &session);
+
+    // A session of the mapped writer mode has one record file per stream, otherwise the
+    // frames are single images gathered from all roots
+    if (FindRecordFiles(szSessionFolder, &session))
+    {
+        session.nLayout = ReplayLayout_RecordFiles;
+    }
+    else
+    {
+        session.nLayout = ReplayLayout_Images;
+        for (int s = 0; s < 3; ++s)
+        {
+            session.sFileProblem[s].clear();
+            StripeLayout::ListFrames(szSessionFolder, cStreamNames[s], &session.vFiles[s]);
+            session.vFrames[s].resize(session.vFiles[s].size());
+        }
+    }
+
+    // Streams which were off have no frames, and streams recorded at a lower rate are only
+    // compared with the streams of the same rate
+    int nReference = 0;
+    while (nReference < 2 && !session.nDecimation[nReference])
+    {
+        ++nReference;
+    }
+    for (int s = 0; s < 3; ++s)
+    {
+        if (!session.nDecimation[s] && session.vFrames[s].empty())
+        {
+            session.sFileProblem[s].clear();
+        }
+    }
+
+    size_t nTotalFrames = 0;
+    for (int s = 0; s < 3; ++s)
+    {
+        for (size_t i = 0; i < session.vFrames[s].size(); i += cChunkFrames)
+        {
+            session.vChunks.push_back(std::make_pair(s, static_cast<UINT32>(i)));
+        }
+        ZeroMemory(session.vFrames[s].data(), session.vFrames[s].size() * sizeof(VerifyFrame));
+        nTotalFrames += session.vFrames[s].size();
+    }
+
+    if (!nTotalFrames)
+    {
+        wprintf(L"No frames in %s\n", szSessionFolder);
+        return 1;
+    }
+
+    // Frames are independent of each other, so the workers verify chunks of any stream
+    std::vector<std::thread> vWorkers;
+    for (int i = 0; i < min(nWorkers, static_cast<int>(session.vChunks.size())); ++i)
+    {
+        vWorkers.push_back(std::thread(VerifyChunks, &session));
+    }
+    for (size_t i = 0; i < vWorkers.size(); ++i)
+    {
+        vWorkers[i].join();
+    }
+
+    // The checks across frames run on the results in order
+    size_t nFrameSets = session.vFrames[nReference].size();
+    for (int s = 0; s < 3; ++s)
+    {
+        if (session.nDecimation[s] == session.nDecimation[nReference])
+        {
+            nFrameSets = min(nFrameSets, session.vFrames[s].size());
+        }
+    }
+    UINT32 nMissing[3] = { 0 };
+    for (int s = 0; s < 3; ++s)
+    {
+        std::vector<VerifyFrame>& vFrames = session.vFrames[s];
+        FrameAnalyzer analyzer(FramePeriod * max(1u, session.nDecimation[s]));
+        for (size_t i = 0; i < vFrames.size(); ++i)
+        {
+            if (i > 0 && vFrames[i].nTime <= vFrames[i - 1].nTime)
+            {
+                vFrames[i].nErrors |= VerifyError_Order;
+            }
+            analyzer.AddFrame(vFrames[i].nTime);
+        }
+        nMissing[s] = analyzer.GetMissingCount();
+    }
+    for (int s = nReference + 1; s < 3; ++s)
+    {
+        if (session.nDecimation[s] != session.nDecimation[nReference])
+        {
+            continue;
+        }
+
+        // Depth frames have the time of their infrared frame, color frames are a few ms later
+        INT64 nTolerance = (2 == s) ? cColorOffsetTolerance : 0;
+        for (size_t i = 0; i < nFrameSets; ++i)
+        {
+            if (_abs64(session.vFrames[s][i].nTime - session.vFrames[nReference][i].nTime) > nTolerance)
+            {
+                session.vFrames[s][i].nErrors |= VerifyError_Sync;
+            }
+        }
+    }
+
+    // Reports go to the session folder unless it is read-only (e.g. an archive)
+    CreateFolderTree(szReportFolder);
+    WCHAR szPath[MAX_PATH];
+    WCHAR szReport[MAX_PATH];
+    LPCWSTR szChecksums = L"off";
+    if (session.bChecksums)
+    {
+        // Sessions recorded before the recorder stored checksums get a list of their own
+        if (ReplayLayout_Images == session.nLayout)
+        {
+            LoadIndexChecksums(szSessionFolder, &session);
+        }
+        if (CompareRecordedChecksums(&session))
+        {
+            szChecksums = L"recorder";
+        }
+        else
+        {
+            StringCchPrintfW(szPath, _countof(szPath), L"%s\\%s", szReportFolder, VerifyChecksumsName);
+            szChecksums = CompareChecksums(&session, szPath) ? L"compared" : L"recorded";
+        }
+    }
+
+    // Frame problems are listed one per line and error kind
+    const CHAR* szStreams[] = { "ir", "depth", "color" };
+    const CHAR* szErrors[cErrorKinds] = { "open", "header", "size", "order", "sync", "checksum" };
+    UINT32 nErrors[3][cErrorKinds] = { { 0 } };
+    std::string sProblems = "stream,index,time,problem\r\n";
+    UINT32 nProblems = 0;
+    for (int s = 0; s < 3; ++s)
+    {
+        for (size_t i = 0; i < session.vFrames[s].size(); ++i)
+        {
+            for (int e = 0; e < cErrorKinds; ++e)
+            {
+                if (session.vFrames[s][i].nErrors & (1 << e))
+                {
+                    CHAR szLine[128];
+                    sprintf_s(szLine, "%s,%u,%011.6f,%s\r\n", szStreams[s], static_cast<UINT>(i), session.vFrames[s][i].nTime / 10000000., szErrors[e]);
+                    sProblems += szLine;
+                    ++nErrors[s][e];
+                    ++nProblems;
+                }
+            }
+        }
+        if (!session.sFileProblem[s].empty() || (session.nDecimation[s] == session.nDecimation[nReference] && session.vFrames[s].size() != nFrameSets))
+        {
+            ++nProblems;
+        }
+    }
+
+    StringCchPrintfW(szPath, _countof(szPath), L"%s\\%s", szReportFolder, VerifyProblemsName);
+    HANDLE hFile = CreateFileW(szPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (INVALID_HANDLE_VALUE != hFile)
+    {
+        DWORD dwBytesWritten = 0;
+        WriteFile(hFile, sProblems.data(), static_cast<DWORD>(sProblems.size()), &dwBytesWritten, NULL);
+        CloseHandle(hFile);
+    }
+
+    double fElapsed = max(1ull, GetTickCount64() - nStart) / 1000.;
+    bool bPassed = (0 == nProblems);
+
+    // The profile functions need a full path, otherwise the Windows folder is used
+    WCHAR szValue[MAX_PATH];
+    StringCchPrintfW(szPath, _countof(szPath), L"%s\\%s", szReportFolder, VerifyReportName);
+    GetFullPathNameW(szPath, _countof(szReport), szReport, NULL);
+    GetFullPathNameW(szSessionFolder, _countof(szValue), szValue, NULL);
+    WritePrivateProfileStringW(L"Verify", L"Session", szValue, szReport);
+    WritePrivateProfileStringW(L"Verify", L"Layout", (ReplayLayout_Images == session.nLayout) ? L"images" : L"kvr", szReport);
+    WritePrivateProfileStringW(L"Verify", L"Result", bPassed ? L"passed" : L"failed", szReport);
+    StringCchPrintfW(szValue, _countof(szValue), L"%u", static_cast<UINT>(nFrameSets));
+    WritePrivateProfileStringW(L"Verify", L"FrameSets", szValue, szReport);
+    StringCchPrintfW(szValue, _countof(szValue), L"%u", nProblems);
+    WritePrivateProfileStringW(L"Verify", L"Problems", szValue, szReport);
+    WritePrivateProfileStringW(L"Verify", L"Checksums", szChecksums, szReport);
+    StringCchPrintfW(szValue, _countof(szValue), L"%.3f", fElapsed);
+    WritePrivateProfileStringW(L"Verify", L"Seconds", szValue, szReport);
+    for (int s = 0; s < 3; ++s)
+    {
+        StringCchPrintfW(szValue, _countof(szValue), L"%u", static_cast<UINT>(session.vFrames[s].size()));
+        WritePrivateProfileStringW(cStreamNames[s], L"Frames", szValue, szReport);
+        StringCchPrintfW(szValue, _countof(szValue), L"%u", session.nDecimation[s]);
+        WritePrivateProfileStringW(cStreamNames[s], L"Decimation", szValue, szReport);
+        StringCchPrintfW(szValue, _countof(szValue), L"%u", nMissing[s]);
+        WritePrivateProfileStringW(cStreamNames[s], L"Missing", szValue, szReport);
+        WritePrivateProfileStringW(cStreamNames[s], L"File", session.sFileProblem[s].empty() ? L"ok" : session.sFileProblem[s].c_str(), szReport);
+        for (int e = 0; e < cErrorKinds; ++e)
+        {
+            StringCchPrintfW(szValue, _countof(szValue), L"%u", nErrors[s][e]);
+            WritePrivateProfileStringW(cStreamNames[s], cErrorNames[e], szValue, szReport);
+        }
+    }
+    WritePrivateProfileStringW(NULL, NULL, NULL, szReport);
+
+    wprintf(L"%-6s %8s %8s %6s %6s %6s %6s %6s %6s %9s\n", L"stream", L"frames", L"missing", L"open", L"header", L"size", L"order", L"sync", L"check", L"file");
+    for (int s = 0; s < 3; ++s)
+    {
+        wprintf(L"%-6s %8u %8u %6u %6u %6u %6u %6u %6u %9s\n", cStreamNames[s], static_cast<UINT>(session.vFrames[s].size()), nMissing[s],
+            nErrors[s][0], nErrors[s][1], nErrors[s][2], nErrors[s][3], nErrors[s][4], nErrors[s][5],
+            session.sFileProblem[s].empty() ? L"ok" : session.sFileProblem[s].c_str());
+    }
+    wprintf(L"%s: %u problems, checksums %s, %u frames (%.1f MB) in %.2f s with %d workers\n", bPassed ? L"Passed" : L"Failed", nProblems, szChecksums,
+        static_cast<UINT>(nTotalFrames), session.cbRead / (1024. * 1024.), fElapsed, static_cast<int>(vWorkers.size()));
+    return bPassed ? 0 : 1;
+}
@@ -0,0 +1,29 @@
+// Verifier.h
+//
+// Author: Po-Chen Wu (pcwu0329@gmail.com)
+//
+// Offline integrity verification of recorded sessions
+
+
+#pragma once
+
+#include <windows.h>
+
+/// The VerifyReportName value specifies the summary of a verification
+#define VerifyReportName L"verify.ini"
+
+/// The VerifyProblemsName value specifies the list of frames which failed a verification
+#define VerifyProblemsName L"verify.csv"
+
+/// The VerifyChecksumsName value specifies the per frame checksums of a session without
+/// checksums from the recorder, recorded by the first verification with checksums and
+/// compared by the following ones
+#define VerifyChecksumsName L"checksums.csv"
+
+/// <summary>
+/// Verify the frames of a recorded session on disk
+/// </summary>
+/// <param name="argc">number of arguments</param>
+/// <param name="argv">session folder, (optional) number of workers, /checksums and /report with its folder</param>
+/// <returns>0 if the session passed, otherwise failure</returns>
+int RunVerify(int argc, LPWSTR* argv);